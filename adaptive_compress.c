@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <limits.h>
 /*
 #if defined(sun) || defined(__sun)
 #include <sys/byteorder.h>
@@ -40,11 +41,27 @@
 #include <pc_archive.h>
 #include "filters/analyzer/analyzer.h"
 
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
 static unsigned int lzma_count = 0;
 static unsigned int bzip2_count = 0;
 static unsigned int bsc_count = 0;
 static unsigned int ppmd_count = 0;
 static unsigned int lz4_count = 0;
+static unsigned int trial_count = 0;
+static unsigned int trial_wins[ADAPT_COMPRESS_LZ4 + 1];
+
+/*
+ * Trial compression picks the codec per chunk by compressing a few small samples
+ * of the chunk with every candidate codec instead of relying on the byte histogram.
+ */
+#define	TRIAL_NSAMPLES		4
+#define	TRIAL_SAMPLE_SZ		(32 * 1024)
+#define	TRIAL_SZ		(TRIAL_NSAMPLES * TRIAL_SAMPLE_SZ)
+#define	TRIAL_MIN_CHUNK		(4 * TRIAL_SZ)
+#define	TRIAL_MAX_CANDS		4
 
 extern int lzma_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *destlen, int level, uchar_t chdr, int btype, void *data);
@@ -82,7 +99,6 @@ extern int lz4_init(void **data, int *level, int nthreads, uint64_t chunksize,
 extern int lz4_deinit(void **data);
 
 extern int ppmd_alloc(void *data);
-extern void ppmd_free(void *data);
 extern int ppmd_state_init(void **data, int *level, int alloc);
 
 extern int lz4_buf_extra(uint64_t buflen);
@@ -95,6 +111,11 @@ struct adapt_data {
 	void *lz4_data;
 	int adapt_mode;
 	analyzer_ctx_t *actx;
+	int trial;
+	int trial_speed;
+	int nthreads;
+	uchar_t *trial_buf;
+	void *trial_lzma_data;
 };
 
 void
@@ -115,6 +136,14 @@ adapt_stats(int show)
 			log_msg(LOG_INFO, 0, "	PPMd chunk count: %u", ppmd_count);
 			log_msg(LOG_INFO, 0, "	LZMA chunk count: %u", lzma_count);
 			log_msg(LOG_INFO, 0, "	LZ4 chunk count: %u", lz4_count);
+			if (trial_count > 0) {
+				log_msg(LOG_INFO, 0, "	Trial selected chunk count: %u", trial_count);
+				log_msg(LOG_INFO, 0, "		BZIP2 wins: %u", trial_wins[ADAPT_COMPRESS_BZIP2]);
+				log_msg(LOG_INFO, 0, "		LIBBSC wins: %u", trial_wins[ADAPT_COMPRESS_BSC]);
+				log_msg(LOG_INFO, 0, "		PPMd wins: %u", trial_wins[ADAPT_COMPRESS_PPMD]);
+				log_msg(LOG_INFO, 0, "		LZMA wins: %u", trial_wins[ADAPT_COMPRESS_LZMA]);
+				log_msg(LOG_INFO, 0, "		LZ4 wins: %u", trial_wins[ADAPT_COMPRESS_LZ4]);
+			}
 		} else {
 			log_msg(LOG_INFO, 0, "\n");
 		}
@@ -124,6 +153,30 @@ adapt_stats(int show)
 	bsc_count = 0;
 	ppmd_count = 0;
 	lz4_count = 0;
+	trial_count = 0;
+	memset(trial_wins, 0, sizeof (trial_wins));
+}
+
+/*
+ * Trial compression is enabled by setting PCOMPRESS_ADAPT_TRIAL to the minimum
+ * compression speed in MB/s that a codec must reach on the samples to be chosen.
+ * Zero means only the compression ratio matters.
+ */
+static void
+adapt_trial_init(struct adapt_data *adat)
+{
+	char *val;
+
+	adat->trial = 0;
+	adat->trial_speed = 0;
+	adat->trial_buf = NULL;
+	adat->trial_lzma_data = NULL;
+	if ((val = getenv("PCOMPRESS_ADAPT_TRIAL")) != NULL) {
+		adat->trial = 1;
+		adat->trial_speed = atoi(val);
+		if (adat->trial_speed < 0)
+			adat->trial_speed = 0;
+	}
 }
 
 void
@@ -164,14 +217,18 @@ adapt_init(void **data, int *level, int nthreads, uint64_t chunksize,
 			rv = lz4_init(&(adat->lz4_data), &lv, nthreads, chunksize, file_version, op);
 		adat->lzma_data = NULL;
 		adat->bsc_data = NULL;
+		adapt_trial_init(adat);
 		*data = adat;
 		if (*level > 9) *level = 9;
 	}
+	adat->nthreads = nthreads;
 	lzma_count = 0;
 	bzip2_count = 0;
 	ppmd_count = 0;
 	bsc_count = 0;
 	lz4_count = 0;
+	trial_count = 0;
+	memset(trial_wins, 0, sizeof (trial_wins));
 	return (rv);
 }
 
@@ -206,14 +263,28 @@ adapt2_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		lv = 1;
 		if (rv == 0)
 			rv = lz4_init(&(adat->lz4_data), &lv, nthreads, chunksize, file_version, op);
+		adapt_trial_init(adat);
+
+		/*
+		 * LZMA sizes its dictionary to the input. The trial samples get an
+		 * encoder of their own so that the chunk encoder keeps its match
+		 * finder from one chunk to the next.
+		 */
+		lv = *level;
+		if (rv == 0 && adat->trial && op == COMPRESS)
+			rv = lzma_init(&(adat->trial_lzma_data), &lv, nthreads, chunksize,
+			    file_version, op);
 		*data = adat;
 		if (*level > 9) *level = 9;
 	}
+	adat->nthreads = nthreads;
 	lzma_count = 0;
 	bzip2_count = 0;
 	ppmd_count = 0;
 	bsc_count = 0;
 	lz4_count = 0;
+	trial_count = 0;
+	memset(trial_wins, 0, sizeof (trial_wins));
 	return (rv);
 }
 
@@ -227,8 +298,12 @@ adapt_deinit(void **data)
 		rv = ppmd_deinit(&(adat->ppmd_data));
 		if (adat->lzma_data)
 			rv += lzma_deinit(&(adat->lzma_data));
+		if (adat->trial_lzma_data)
+			rv += lzma_deinit(&(adat->trial_lzma_data));
 		if (adat->lz4_data)
 			rv += lz4_deinit(&(adat->lz4_data));
+		if (adat->trial_buf)
+			slab_free(NULL, adat->trial_buf);
 		slab_free(NULL, adat);
 		*data = NULL;
 	}
@@ -251,15 +326,155 @@ is_bsc_type(int btype)
 	    (mtype & TYPE_BINARY && stype == TYPE_MARKUP));
 }
 
+/*
+ * Compress the buffer with one of the codecs available in this adaptive mode.
+ * Trial samples use the separate trial LZMA encoder.
+ */
+static int
+adapt_compress_algo(struct adapt_data *adat, int algo, void *src, uint64_t srclen,
+	void *dst, uint64_t *dstlen, int level, uchar_t chdr, int btype, int trial)
+{
+	int rv;
+
+	switch (algo) {
+	case ADAPT_COMPRESS_LZ4:
+		return (lz4_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->lz4_data));
+	case ADAPT_COMPRESS_LZMA:
+		return (lzma_compress(src, srclen, dst, dstlen, level, chdr, btype,
+		    trial ? adat->trial_lzma_data : adat->lzma_data));
+	case ADAPT_COMPRESS_BZIP2:
+		return (bzip2_compress(src, srclen, dst, dstlen, level, chdr, btype, NULL));
+#ifdef ENABLE_PC_LIBBSC
+	case ADAPT_COMPRESS_BSC:
+		return (libbsc_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->bsc_data));
+#endif
+	case ADAPT_COMPRESS_PPMD:
+		/*
+		 * Model memory is allocated on first use and then kept for the
+		 * life of the thread. It is released in ppmd_deinit().
+		 */
+		rv = ppmd_alloc(adat->ppmd_data);
+		if (rv < 0)
+			return (rv);
+		return (ppmd_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->ppmd_data));
+	}
+	return (-1);
+}
+
+/*
+ * Compress samples taken from across the chunk with every candidate codec and
+ * return the codec giving the smallest output among those that reach the
+ * configured speed. If none is fast enough the fastest one is returned.
+ * Candidates are listed fastest first so that ties favor speed. The candidates
+ * are run in parallel only upto the per-chunk thread count this worker was
+ * given, so that the trial does not oversubscribe the CPUs, and never from
+ * within another parallel region.
+ */
+static int
+adapt_trial_select(struct adapt_data *adat, void *src, uint64_t srclen, int level,
+	uchar_t chdr, int btype)
+{
+	int cands[TRIAL_MAX_CANDS], ncands, i, best, fastest;
+	uint64_t csize[TRIAL_MAX_CANDS], stride;
+	double speed[TRIAL_MAX_CANDS];
+	uchar_t *sample;
+
+	ncands = 0;
+	cands[ncands++] = ADAPT_COMPRESS_LZ4;
+	if (adat->adapt_mode == 1) {
+		cands[ncands++] = ADAPT_COMPRESS_BZIP2;
+	} else {
+		cands[ncands++] = ADAPT_COMPRESS_LZMA;
+#ifdef ENABLE_PC_LIBBSC
+		if (adat->bsc_data)
+			cands[ncands++] = ADAPT_COMPRESS_BSC;
+#endif
+	}
+	cands[ncands++] = ADAPT_COMPRESS_PPMD;
+
+	/*
+	 * Room for the samples followed by an output buffer per candidate. The
+	 * output buffers are twice the sample size so that no codec overflows.
+	 */
+	if (adat->trial_buf == NULL) {
+		adat->trial_buf = (uchar_t *)slab_alloc(NULL,
+		    TRIAL_SZ + TRIAL_MAX_CANDS * TRIAL_SZ * 2);
+		if (adat->trial_buf == NULL)
+			return (-1);
+	}
+	sample = adat->trial_buf;
+	stride = srclen / TRIAL_NSAMPLES;
+	for (i = 0; i < TRIAL_NSAMPLES; i++) {
+		memcpy(sample + i * TRIAL_SAMPLE_SZ, (uchar_t *)src + i * stride,
+		    TRIAL_SAMPLE_SZ);
+	}
+
+#if defined(_OPENMP)
+	int nthr = ncands;
+
+	if (nthr > adat->nthreads)
+		nthr = adat->nthreads;
+	if (omp_in_parallel())
+		nthr = 1;
+#	pragma omp parallel for num_threads(nthr) if (nthr > 1)
+#endif
+	for (i = 0; i < ncands; i++) {
+		uchar_t *tdst = adat->trial_buf + TRIAL_SZ + i * TRIAL_SZ * 2;
+		uint64_t dlen = TRIAL_SZ * 2;
+		double strt, en;
+
+		strt = get_wtime_millis();
+		if (adapt_compress_algo(adat, cands[i], sample, TRIAL_SZ, tdst, &dlen,
+		    level, chdr, btype, 1) < 0) {
+			csize[i] = 0;
+			continue;
+		}
+		en = get_wtime_millis();
+		csize[i] = dlen;
+		if (en > strt)
+			speed[i] = get_mb_s(TRIAL_SZ, strt, en);
+		else
+			speed[i] = (double)INT_MAX;
+	}
+
+	best = -1;
+	fastest = -1;
+	for (i = 0; i < ncands; i++) {
+		if (csize[i] == 0)
+			continue;
+		if (fastest < 0 || speed[i] > speed[fastest])
+			fastest = i;
+		if (speed[i] < adat->trial_speed)
+			continue;
+		if (best < 0 || csize[i] < csize[best])
+			best = i;
+	}
+	if (best < 0)
+		best = fastest;
+	if (best < 0)
+		return (-1);
+	return (cands[best]);
+}
+
 int
 adapt_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data)
 {
 	struct adapt_data *adat = (struct adapt_data *)(data);
-	int rv = 0, bsc_type = 0;
+	int rv = 0, bsc_type = 0, algo;
 	int stype = PC_SUBTYPE(btype);
 	analyzer_ctx_t actx;
 
+	if (adat->trial && srclen >= TRIAL_MIN_CHUNK) {
+		adat->actx = NULL;
+		algo = adapt_trial_select(adat, src, srclen, level, chdr, btype);
+		if (algo > 0) {
+			trial_count++;
+			trial_wins[algo]++;
+			goto do_compress;
+		}
+	}
+
 	if (btype == TYPE_UNKNOWN || PC_TYPE(btype) & TYPE_TEXT ||
 	    stype == TYPE_ARCHIVE_TAR || stype == TYPE_PDF) {
 		if (adat->actx == NULL) {
@@ -288,51 +503,44 @@ adapt_compress(void *src, uint64_t srclen, void *dst,
 	bsc_type = is_bsc_type(btype);
 #endif
 	if (is_incompressible(btype) && !bsc_type) {
-		rv = lz4_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->lz4_data);
-		if (rv < 0)
-			return (rv);
-		rv = ADAPT_COMPRESS_LZ4;
-		lz4_count++;
+		algo = ADAPT_COMPRESS_LZ4;
 
 	} else if (adat->adapt_mode == 2 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type) {
-		rv = lzma_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->lzma_data);
-		if (rv < 0)
-			return (rv);
-		rv = ADAPT_COMPRESS_LZMA;
-		lzma_count++;
+		algo = ADAPT_COMPRESS_LZMA;
 
 	} else if (adat->adapt_mode == 1 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type) {
-		rv = bzip2_compress(src, srclen, dst, dstlen, level, chdr, btype, NULL);
-		if (rv < 0)
-			return (rv);
-		rv = ADAPT_COMPRESS_BZIP2;
-		bzip2_count++;
+		algo = ADAPT_COMPRESS_BZIP2;
+
+	} else if (adat->bsc_data && bsc_type) {
+		algo = ADAPT_COMPRESS_BSC;
 
 	} else {
-#ifdef ENABLE_PC_LIBBSC
-		if (adat->bsc_data && bsc_type) {
-			rv = libbsc_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->bsc_data);
-			if (rv < 0)
-				return (rv);
-			rv = ADAPT_COMPRESS_BSC;
-			bsc_count++;
-		} else {
-#endif
-			rv = ppmd_alloc(adat->ppmd_data);
-			if (rv < 0)
-				return (rv);
-			rv = ppmd_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->ppmd_data);
-			ppmd_free(adat->ppmd_data);
-			if (rv < 0)
-				return (rv);
-			rv = ADAPT_COMPRESS_PPMD;
-			ppmd_count++;
-#ifdef ENABLE_PC_LIBBSC
-		}
-#endif
+		algo = ADAPT_COMPRESS_PPMD;
 	}
 
-	return (rv);
+do_compress:
+	rv = adapt_compress_algo(adat, algo, src, srclen, dst, dstlen, level, chdr, btype, 0);
+	if (rv < 0)
+		return (rv);
+
+	switch (algo) {
+	case ADAPT_COMPRESS_LZ4:
+		lz4_count++;
+		break;
+	case ADAPT_COMPRESS_LZMA:
+		lzma_count++;
+		break;
+	case ADAPT_COMPRESS_BZIP2:
+		bzip2_count++;
+		break;
+	case ADAPT_COMPRESS_BSC:
+		bsc_count++;
+		break;
+	case ADAPT_COMPRESS_PPMD:
+		ppmd_count++;
+		break;
+	}
+	return (algo);
 }
 
 int
@@ -358,9 +566,7 @@ adapt_decompress(void *src, uint64_t srclen, void *dst,
 		rv = ppmd_alloc(adat->ppmd_data);
 		if (rv < 0)
 			return (rv);
-		rv = ppmd_decompress(src, srclen, dst, dstlen, level, chdr, btype, adat->ppmd_data);
-		ppmd_free(adat->ppmd_data);
-		return (rv);
+		return (ppmd_decompress(src, srclen, dst, dstlen, level, chdr, btype, adat->ppmd_data));
 
 	} else if (cmp_flags == ADAPT_COMPRESS_BSC) {
 #ifdef ENABLE_PC_LIBBSC
@@ -33,6 +33,12 @@
  *
  * There is no provision yet to reap buffers from high-usage slabs
  * and return them to the heap.
+ *
+ * The power of 2 slabs, which see the bulk of small and frequent requests
+ * from the codecs, are fronted by per-thread magazines. A thread takes and
+ * returns buffers from its own magazine without locking and only goes to the
+ * shared slab in batches. Since a freed buffer is normally reused by the same
+ * thread its pages also stay local to where that thread runs.
  */
 
 #include <sys/types.h>
@@ -70,6 +76,13 @@
 #define	HTABLE_SZ	8192
 #define	ONEM		(1UL * 1024UL * 1024UL)
 
+/*
+ * A magazine holds upto MAG_MAX_BUFS buffers per slab but not more than
+ * about MAG_MAX_BYTES in total, so large buffers are not hoarded by threads.
+ */
+#define	MAG_MAX_BUFS	32
+#define	MAG_MAX_BYTES	(2UL * ONEM)
+
 static const unsigned int bv[] = {
 	0xAAAAAAAA,
 	0xCCCCCCCC,
@@ -83,6 +96,7 @@ struct slabentry {
 	struct slabentry *next;
 	uint64_t sz;
 	uint64_t allocs, hits;
+	int magidx;	/* Magazine slot or -1 if not cached per-thread. */
 	pthread_mutex_t slab_lock;
 };
 struct bufentry {
@@ -91,12 +105,26 @@ struct bufentry {
 	struct bufentry *next;
 };
 
+struct magazine {
+	struct bufentry *avail[NUM_POW2];
+	uint32_t count[NUM_POW2];
+	uint64_t hits, misses;
+	int id;
+	struct magazine *next;
+};
+
 static struct slabentry slabheads[NUM_SLABS];
 static struct bufentry **htable;
 static pthread_mutex_t *hbucket_locks;
 static pthread_mutex_t htable_lock = PTHREAD_MUTEX_INITIALIZER;
 static int inited = 0, bypass = 0;
 
+static pthread_key_t mag_key;
+static struct magazine *mag_list;
+static pthread_mutex_t mag_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mag_count;
+static uint32_t mag_cap[NUM_POW2];
+
 static uint64_t total_allocs, oversize_allocs, hash_collisions, hash_entries;
 
 /*
@@ -117,6 +145,126 @@ hash6432shift(uint64_t key)
 	return (uint32_t) key;
 }
 
+/*
+ * Move n buffers from the head of a magazine slot back to the shared slab
+ * under a single lock acquisition.
+ */
+static void
+mag_return(struct magazine *mag, int i, uint32_t n)
+{
+	struct bufentry *first, *last;
+	struct slabentry *slab;
+	uint32_t j;
+
+	if (n == 0) return;
+	slab = &slabheads[i];
+	first = mag->avail[i];
+	last = first;
+	for (j = 1; j < n; j++)
+		last = last->next;
+	mag->avail[i] = last->next;
+	mag->count[i] -= n;
+
+	pthread_mutex_lock(&(slab->slab_lock));
+	last->next = slab->avail;
+	slab->avail = first;
+	pthread_mutex_unlock(&(slab->slab_lock));
+}
+
+/*
+ * Thread exit: hand the cached buffers back to the shared slabs. The magazine
+ * itself stays on mag_list for the statistics.
+ */
+static void
+mag_destroy(void *arg)
+{
+	struct magazine *mag = (struct magazine *)arg;
+	int i;
+
+	for (i = 0; i < NUM_POW2; i++)
+		mag_return(mag, i, mag->count[i]);
+}
+
+static struct magazine *
+get_magazine(void)
+{
+	struct magazine *mag;
+
+	mag = (struct magazine *)pthread_getspecific(mag_key);
+	if (mag == NULL) {
+		mag = (struct magazine *)calloc(1, sizeof (struct magazine));
+		if (!mag) return (NULL);
+		pthread_mutex_lock(&mag_list_lock);
+		mag->id = mag_count++;
+		mag->next = mag_list;
+		mag_list = mag;
+		pthread_mutex_unlock(&mag_list_lock);
+		pthread_setspecific(mag_key, mag);
+	}
+	return (mag);
+}
+
+/*
+ * Take a buffer from the thread's magazine. When empty refill half of it from
+ * the shared slab in one go, or allocate a new buffer if the slab is empty too.
+ */
+static struct bufentry *
+mag_get(struct magazine *mag, struct slabentry *slab)
+{
+	struct bufentry *buf;
+	uint32_t n, want;
+	int i = slab->magidx;
+
+	if (mag->avail[i] == NULL) {
+		mag->misses++;
+		want = mag_cap[i] / 2;
+		n = 0;
+		pthread_mutex_lock(&(slab->slab_lock));
+		while (slab->avail && n < want) {
+			buf = slab->avail;
+			slab->avail = buf->next;
+			buf->next = mag->avail[i];
+			mag->avail[i] = buf;
+			n++;
+		}
+		if (n == 0)
+			slab->allocs++;
+		else
+			slab->hits += n;
+		pthread_mutex_unlock(&(slab->slab_lock));
+		mag->count[i] = n;
+
+		if (n == 0) {
+			buf = (struct bufentry *)malloc(sizeof (struct bufentry));
+			buf->ptr = malloc(slab->sz);
+			buf->slab = slab;
+			return (buf);
+		}
+	} else {
+		mag->hits++;
+	}
+	buf = mag->avail[i];
+	mag->avail[i] = buf->next;
+	mag->count[i]--;
+	return (buf);
+}
+
+/*
+ * Put a freed buffer in the thread's magazine. Once over capacity half of
+ * it goes back to the shared slab.
+ */
+static void
+mag_put(struct magazine *mag, struct bufentry *buf)
+{
+	int i = buf->slab->magidx;
+
+	buf->next = mag->avail[i];
+	mag->avail[i] = buf;
+	mag->count[i]++;
+	if (mag->count[i] > mag_cap[i])
+		mag_return(mag, i, mag->count[i] / 2);
+}
+
 void
 slab_init()
 {
@@ -136,8 +284,12 @@ slab_init()
 		slabheads[i].sz = slab_sz;
 		slabheads[i].allocs = 0;
 		slabheads[i].hits = 0;
+		slabheads[i].magidx = i;
 		/* Speed up: Copy from already inited but not yet used lock object. */
 		slabheads[i].slab_lock = htable_lock;
+		mag_cap[i] = MAG_MAX_BYTES / slab_sz;
+		if (mag_cap[i] > MAG_MAX_BUFS) mag_cap[i] = MAG_MAX_BUFS;
+		if (mag_cap[i] < 2) mag_cap[i] = 2;
 		slab_sz *= 2;
 	}
 
@@ -149,6 +301,7 @@ slab_init()
 		slabheads[i].sz = slab_sz;
 		slabheads[i].allocs = 0;
 		slabheads[i].hits = 0;
+		slabheads[i].magidx = -1;
 		/* Speed up: Copy from already inited but not yet used lock object. */
 		slabheads[i].slab_lock = htable_lock;
 		slab_sz += ONEM;
@@ -160,6 +313,7 @@ slab_init()
 		slabheads[i].sz = 0;
 		slabheads[i].allocs = 0;
 		slabheads[i].hits = 0;
+		slabheads[i].magidx = -1;
 		/* Do not init locks here. They will be inited on demand. */
 	}
 	htable = (struct bufentry **)calloc(HTABLE_SZ, sizeof (struct bufentry *));
@@ -172,6 +326,9 @@ slab_init()
 	oversize_allocs = 0;
 	hash_collisions = 0;
 	hash_entries = 0;
+	mag_list = NULL;
+	mag_count = 0;
+	pthread_key_create(&mag_key, mag_destroy);
 	inited = 1;
 }
 
@@ -185,6 +342,31 @@ slab_cleanup(int quiet)
 	if (!inited) return;
 	if (bypass) return;
 
+	/*
+	 * All other threads are done by now. Flush every magazine including the
+	 * calling thread's so that the buffers are freed below.
+	 */
+	if (!quiet && mag_list) {
+		log_msg(LOG_INFO, 0, "Thread Magazine Stats\n");
+		log_msg(LOG_INFO, 0, "==================================================================\n");
+		log_msg(LOG_INFO, 0, " Thread              | Hits                | Misses              |\n");
+		log_msg(LOG_INFO, 0, "==================================================================\n");
+	}
+	while (mag_list) {
+		struct magazine *mag = mag_list;
+
+		if (!quiet && (mag->hits || mag->misses)) {
+			log_msg(LOG_INFO, 0, "%21d %21" PRIu64 " %21" PRIu64 "\n", mag->id,
+			    mag->hits, mag->misses);
+		}
+		mag_destroy(mag);
+		mag_list = mag->next;
+		free(mag);
+	}
+	pthread_setspecific(mag_key, NULL);
+	pthread_key_delete(mag_key);
+	if (!quiet) log_msg(LOG_INFO, 0, "\n");
+
 	if (!quiet) {
 		log_msg(LOG_INFO, 0, "Slab Allocation Stats\n");
 		log_msg(LOG_INFO, 0, "==================================================================\n");
@@ -357,6 +539,7 @@ slab_cache_add(uint64_t size)
 		pthread_mutex_init(&(slabheads[sindx].slab_lock), NULL);
 		pthread_mutex_lock(&(slabheads[sindx].slab_lock));
 		slabheads[sindx].sz = size;
+		slabheads[sindx].magidx = -1;
 		pthread_mutex_unlock(&(slabheads[sindx].slab_lock));
 	} else {
 		slab = (struct slabentry *)malloc(sizeof (struct slabentry));
@@ -365,6 +548,7 @@ slab_cache_add(uint64_t size)
 		slab->sz = size;
 		slab->allocs = 0;
 		slab->hits = 0;
+		slab->magidx = -1;
 		pthread_mutex_init(&(slab->slab_lock), NULL);
 
 		pthread_mutex_lock(&(slabheads[sindx].slab_lock));
@@ -417,8 +601,13 @@ slab_alloc(void *p, size_t size)
 		return (buf->ptr);
 	} else {
 		struct bufentry *buf;
+		struct magazine *mag;
 		uint32_t hindx;
 
+		if (slab->magidx >= 0 && (mag = get_magazine()) != NULL) {
+			buf = mag_get(mag, slab);
+			goto got_buf;
+		}
 		pthread_mutex_lock(&(slab->slab_lock));
 		if (slab->avail == NULL) {
 			slab->allocs++;
@@ -433,6 +622,7 @@ slab_alloc(void *p, size_t size)
 			pthread_mutex_unlock(&(slab->slab_lock));
 		}
 
+got_buf:
 		hindx = hash6432shift((unsigned long)(buf->ptr)) & (HTABLE_SZ - 1);
 		if (htable[hindx]) ATOMIC_ADD(hash_collisions, 1);
 		pthread_mutex_lock(&hbucket_locks[hindx]);
@@ -448,6 +638,7 @@ static void
 slab_free_real(void *p, void *address, int do_free)
 {
 	struct bufentry *buf, *pbuf;
+	struct magazine *mag;
 	int found = 0;
 	uint32_t hindx;
 
@@ -475,6 +666,8 @@ slab_free_real(void *p, void *address, int do_free)
 			if (buf->slab == NULL || do_free) {
 				free(buf->ptr);
 				free(buf);
+			} else if (buf->slab->magidx >= 0 && (mag = get_magazine()) != NULL) {
+				mag_put(mag, buf);
 			} else {
 				pthread_mutex_lock(&(buf->slab->slab_lock));
 				buf->next = buf->slab->avail;
@@ -108,6 +108,7 @@ add_filters_by_type(struct type_data *typetab, struct filter_flags *ff)
 		typetab[slot].filter_func = dispack_filter;
 		typetab[slot].filter_name = "Dispack";
 		typetab[slot].result_type = 0;
+		typetab[slot].mt_safe = 1;
 	}
 
 #ifdef _ENABLE_WAVPACK_
@@ -123,6 +124,7 @@ add_filters_by_type(struct type_data *typetab, struct filter_flags *ff)
 		typetab[slot].filter_func = wavpack_filter;
 		typetab[slot].filter_name = "WavPack";
 		typetab[slot].result_type = -1;
+		typetab[slot].mt_safe = 1;
 	}
 #endif
 }
@@ -176,6 +178,28 @@ copy_archive_data(struct archive *ar, uchar_t *out_buf)
 	return (tot);
 }
 
+/*
+ * Return the entry data to be decoded. It is either already in memory or is read
+ * from the archive being extracted into the scratch buffer.
+ */
+static uchar_t *
+filter_input(struct filter_info *fi, struct scratch_buffer *sdat, uint64_t len)
+{
+	if (fi->in_buf != NULL)
+		return (fi->in_buf);
+
+	ensure_buffer(sdat, len);
+	if (sdat->in_buff == NULL) {
+		log_msg(LOG_ERR, 1, "Out of memory.");
+		return (NULL);
+	}
+	if (copy_archive_data(fi->source_arc, sdat->in_buff) != len) {
+		log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		return (NULL);
+	}
+	return (sdat->in_buff);
+}
+
 #ifndef _MPLV2_LICENSE_
 int
 pjg_version_supported(char ver)
@@ -187,7 +211,7 @@ ssize_t
 packjpg_filter(struct filter_info *fi, void *filter_private)
 {
 	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
-	uchar_t *mapbuf, *out;
+	uchar_t *mapbuf, *out, *in_buff;
 	uint64_t len, in_size = 0, len1;
 
 	len = archive_entry_size(fi->entry);
@@ -216,28 +240,19 @@ packjpg_filter(struct filter_info *fi, void *filter_private)
 		}
 	} else {
 		/*
-		 * Allocate input buffer and read archive data stream for the entry
-		 * into this buffer.
+		 * Get the archive data stream for the entry into a buffer.
 		 */
-		ensure_buffer(sdat, len);
-		if (sdat->in_buff == NULL) {
-			log_msg(LOG_ERR, 1, "Out of memory.");
-			return (FILTER_RETURN_ERROR);
-		}
-
-		in_size = copy_archive_data(fi->source_arc, sdat->in_buff);
-		if (in_size != len) {
-			log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		in_buff = filter_input(fi, sdat, len);
+		if (in_buff == NULL)
 			return (FILTER_RETURN_ERROR);
-		}
 
 		/*
 		 * First 8 bytes in the data is the compressed size of the entry.
 		 * LibArchive always zero-pads entries to their original size so
 		 * we need to separately store the compressed size.
 		 */
-		in_size = LE64(U64_P(sdat->in_buff));
-		mapbuf = sdat->in_buff + 8;
+		in_size = LE64(U64_P(in_buff));
+		mapbuf = in_buff + 8;
 
 		/*
 		 * We are trying to decompress and this is not a packJPG file.
@@ -247,7 +262,7 @@ packjpg_filter(struct filter_info *fi, void *filter_private)
 		if (mapbuf[0] != 'J' || mapbuf[1] != 'S' || !pjg_version_supported(mapbuf[2])) {
 			uint8_t *out = malloc(len);
 
-			memcpy(out, sdat->in_buff, len);
+			memcpy(out, in_buff, len);
 			fi->fout->output_type = FILTER_OUTPUT_MEM;
 			fi->fout->out = out;
 			fi->fout->out_size = len;
@@ -286,7 +301,7 @@ packjpg_filter(struct filter_info *fi, void *filter_private)
 		 */
 		free(out);
 		out = malloc(len);
-		memcpy(out, sdat->in_buff, len);
+		memcpy(out, in_buff, len);
 
 		fi->fout->output_type = FILTER_OUTPUT_MEM;
 		fi->fout->out = out;
@@ -304,7 +319,7 @@ ssize_t
 packpnm_filter(struct filter_info *fi, void *filter_private)
 {
 	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
-	uchar_t *mapbuf, *out;
+	uchar_t *mapbuf, *out, *in_buff;
 	uint64_t len, in_size = 0, len1;
 
 	len = archive_entry_size(fi->entry);
@@ -328,28 +343,19 @@ packpnm_filter(struct filter_info *fi, void *filter_private)
 		}
 	} else {
 		/*
-		 * Allocate input buffer and read archive data stream for the entry
-		 * into this buffer.
+		 * Get the archive data stream for the entry into a buffer.
 		 */
-		ensure_buffer(sdat, len);
-		if (sdat->in_buff == NULL) {
-			log_msg(LOG_ERR, 1, "Out of memory.");
+		in_buff = filter_input(fi, sdat, len);
+		if (in_buff == NULL)
 			return (FILTER_RETURN_ERROR);
-		}
-
-		in_size = copy_archive_data(fi->source_arc, sdat->in_buff);
-		if (in_size != len) {
-			log_msg(LOG_ERR, 0, "Failed to read archive data.");
-			return (FILTER_RETURN_ERROR);
-		}
 
 		/*
 		 * First 8 bytes in the data is the compressed size of the entry.
 		 * LibArchive always zero-pads entries to their original size so
 		 * we need to separately store the compressed size.
 		 */
-		in_size = LE64(U64_P(sdat->in_buff));
-		mapbuf = sdat->in_buff + 8;
+		in_size = LE64(U64_P(in_buff));
+		mapbuf = in_buff + 8;
 
 		/*
 		 * We are trying to decompress and this is not a packPNM file.
@@ -358,7 +364,7 @@ packpnm_filter(struct filter_info *fi, void *filter_private)
 		if (identify_pnm_type(mapbuf, len - 8) != 2) {
 			uint8_t *out = malloc(len);
 
-			memcpy(out, sdat->in_buff, len);
+			memcpy(out, in_buff, len);
 			fi->fout->output_type = FILTER_OUTPUT_MEM;
 			fi->fout->out = out;
 			fi->fout->out_size = len;
@@ -397,7 +403,7 @@ packpnm_filter(struct filter_info *fi, void *filter_private)
 		 */
 		free(out);
 		out = malloc(len);
-		memcpy(out, sdat->in_buff, len);
+		memcpy(out, in_buff, len);
 
 		fi->fout->output_type = FILTER_OUTPUT_MEM;
 		fi->fout->out = out;
@@ -417,7 +423,7 @@ ssize_t
 wavpack_filter(struct filter_info *fi, void *filter_private)
 {
 	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
-	uchar_t *mapbuf, *out;
+	uchar_t *mapbuf, *out, *in_buff;
 	uint64_t len, in_size = 0, len1;
 
 	len = archive_entry_size(fi->entry);
@@ -443,28 +449,19 @@ wavpack_filter(struct filter_info *fi, void *filter_private)
 		char *wpkstr;
 
 		/*
-		 * Allocate input buffer and read archive data stream for the entry
-		 * into this buffer.
+		 * Get the archive data stream for the entry into a buffer.
 		 */
-		ensure_buffer(sdat, len);
-		if (sdat->in_buff == NULL) {
-			log_msg(LOG_ERR, 1, "Out of memory.");
-			return (FILTER_RETURN_ERROR);
-		}
-
-		in_size = copy_archive_data(fi->source_arc, sdat->in_buff);
-		if (in_size != len) {
-			log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		in_buff = filter_input(fi, sdat, len);
+		if (in_buff == NULL)
 			return (FILTER_RETURN_ERROR);
-		}
 
 		/*
 		 * First 8 bytes in the data is the compressed size of the entry.
 		 * LibArchive always zero-pads entries to their original size so
 		 * we need to separately store the compressed size.
 		 */
-		in_size = LE64(U64_P(sdat->in_buff));
-		mapbuf = sdat->in_buff + 8;
+		in_size = LE64(U64_P(in_buff));
+		mapbuf = in_buff + 8;
 
 		/*
 		 * We are trying to decompress and this is not a Wavpack file.
@@ -474,7 +471,7 @@ wavpack_filter(struct filter_info *fi, void *filter_private)
 		if (strncmp(wpkstr, "wvpk", 4) != 0) {
 			uint8_t *out = malloc(len);
 
-			memcpy(out, sdat->in_buff, len);
+			memcpy(out, in_buff, len);
 			fi->fout->output_type = FILTER_OUTPUT_MEM;
 			fi->fout->out = out;
 			fi->fout->out_size = len;
@@ -513,7 +510,7 @@ wavpack_filter(struct filter_info *fi, void *filter_private)
 		 */
 		free(out);
 		out = malloc(len);
-		memcpy(out, sdat->in_buff, len);
+		memcpy(out, in_buff, len);
 
 		fi->fout->output_type = FILTER_OUTPUT_MEM;
 		fi->fout->out = out;
@@ -532,7 +529,7 @@ ssize_t
 dispack_filter(struct filter_info *fi, void *filter_private)
 {
 	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
-	uchar_t *mapbuf, *out;
+	uchar_t *mapbuf, *out, *in_buff;
 	uint64_t len, in_size = 0, len1;
 
 	len = archive_entry_size(fi->entry);
@@ -553,21 +550,12 @@ dispack_filter(struct filter_info *fi, void *filter_private)
 		 */
 	} else {
 		/*
-		 * Allocate input buffer and read archive data stream for the entry
-		 * into this buffer.
+		 * Get the archive data stream for the entry into a buffer.
 		 */
-		ensure_buffer(sdat, len);
-		if (sdat->in_buff == NULL) {
-			log_msg(LOG_ERR, 1, "Out of memory.");
-			return (FILTER_RETURN_ERROR);
-		}
-
-		in_size = copy_archive_data(fi->source_arc, sdat->in_buff);
-		if (in_size != len) {
-			log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		in_buff = filter_input(fi, sdat, len);
+		if (in_buff == NULL)
 			return (FILTER_RETURN_ERROR);
-		}
-		mapbuf = sdat->in_buff;
+		mapbuf = in_buff;
 
 		/*
 		 * No check for supported EXE types needed here since supported
@@ -607,7 +595,7 @@ dispack_filter(struct filter_info *fi, void *filter_private)
 		 */
 		free(out);
 		out = malloc(len);
-		memcpy(out, sdat->in_buff, len);
+		memcpy(out, in_buff, len);
 
 		fi->fout->output_type = FILTER_OUTPUT_MEM;
 		fi->fout->out = out;
@@ -75,9 +75,14 @@ typedef struct _filter_output {
 	filter_std_hdr_t hdr;
 } filter_output_t;
 
+/*
+ * When decoding, the entry data is read from source_arc unless in_buf already
+ * holds it.
+ */
 struct filter_info {
 	struct archive *source_arc;
 	struct archive *target_arc;
+	uchar_t *in_buf;
 	struct archive_entry *entry;
 	int fd;
 	int compressing, block_size;
@@ -96,11 +101,16 @@ struct filter_flags {
 
 typedef ssize_t (*filter_func_ptr)(struct filter_info *fi, void *filter_private);
 
+/*
+ * Filters that can be run on several files concurrently set mt_safe. Others,
+ * like the packJPG and packPNM libraries, keep global state and are serialized.
+ */
 struct type_data {
 	void *filter_private;
 	filter_func_ptr filter_func;
 	char *filter_name;
 	int result_type;
+	int mt_safe;
 };
 
 void add_filters_by_type(struct type_data *typetab, struct filter_flags *ff);
@@ -77,6 +77,10 @@ AE_IFIFO   Named pipe (fifo)
 
 #define	ARC_ENTRY_OVRHEAD	1024
 #define	MMAP_SIZE		(1024 * 1024)
+#define	ARC_PREFETCH_SIZE	(8 * MMAP_SIZE)
+#define	ARC_FILTER_THREADS_MAX	32
+#define	ARC_EXTRACT_THREADS_MAX	32
+#define	ARC_EXTRACT_BUF_MAX	(8 * MMAP_SIZE)
 #define	SORT_BUF_SIZE		(65536)
 #define	NAMELEN			4
 #define	TEMP_MMAP_SIZE		(128 * 1024)
@@ -237,6 +241,7 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 		}
 	}
 
+	pctx->arc_data_pos += len - remaining;
 	return (len - remaining);
 }
 
@@ -282,12 +287,18 @@ extract_close_callback(struct archive *arc, void *ctx)
 {
 	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
 
+	/*
+	 * The lock orders this against archiver_write() handing over a buffer,
+	 * so that a writer is either released here or sees arc_closed.
+	 */
+	pthread_mutex_lock(&pctx->arc_mutex);
 	pctx->arc_closed = 1;
 	if (pctx->arc_buf) {
 		Sem_Post(&(pctx->write_sem));
 	} else {
 		pctx->arc_buf_size = 0;
 	}
+	pthread_mutex_unlock(&pctx->arc_mutex);
 	return (ARCHIVE_OK);
 }
 
@@ -331,6 +342,44 @@ extract_read_callback(struct archive *arc, void *ctx, const void **buf)
 		return (pctx->temp_mmap_len);
 	}
 
+	/*
+	 * Only the selected chunks come in when extracting some members. Each
+	 * is handed over with its data stream offset. Ones that are entirely
+	 * skipped over are released without being read.
+	 */
+	if (pctx->arc_selective) {
+		uint64_t end, len;
+
+		end = 0;
+		for (;;) {
+			if (pctx->arc_writing) {
+				end = pctx->arc_buf_off + pctx->arc_buf_size;
+				if (pctx->arc_data_pos < end)
+					break;
+				pctx->arc_writing = 0;
+				Sem_Post(&(pctx->write_sem));
+			}
+			Sem_Wait(&(pctx->read_sem));
+			if (pctx->arc_buf == NULL || pctx->arc_buf_size == 0) {
+				pctx->arc_buf_size = 0;
+				log_msg(LOG_ERR, 0, "End of file when extracting archive.");
+				archive_set_error(arc, ARCHIVE_EOF,
+				    "End of file when extracting archive.");
+				return (-1);
+			}
+			pctx->arc_writing = 1;
+		}
+		if (pctx->arc_data_pos < pctx->arc_buf_off) {
+			archive_set_error(arc, EIO,
+			    "Member data is not in the selected chunks.");
+			return (-1);
+		}
+		len = end - pctx->arc_data_pos;
+		*buf = pctx->arc_buf + (pctx->arc_data_pos - pctx->arc_buf_off);
+		pctx->arc_data_pos = end;
+		return (len);
+	}
+
 	if (!pctx->arc_writing) {
 		Sem_Wait(&(pctx->read_sem));
 	} else {
@@ -351,23 +400,52 @@ extract_read_callback(struct archive *arc, void *ctx, const void **buf)
 	return (pctx->arc_buf_size);
 }
 
+/*
+ * When listing with a metadata stream, or extracting some members using the
+ * catalog, unwanted file data is never decompressed. Data skips are satisfied
+ * without reading anything. Metadata must still be read and is left to the
+ * read callback.
+ */
+static int64_t
+extract_skip_callback(struct archive *arc, void *ctx, int64_t request)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
+
+	if (archive_request_is_metadata(arc))
+		return (0);
+	pctx->arc_data_pos += request;
+	return (request);
+}
+
 int64_t
 archiver_write(void *ctx, void *buf, uint64_t count)
 {
 	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
 
+	pthread_mutex_lock(&pctx->arc_mutex);
 	if (pctx->arc_closed) {
+		pthread_mutex_unlock(&pctx->arc_mutex);
+		/*
+		 * Once the extractor has seen the end of the archive, any remaining
+		 * chunks only hold the archive padding. An archive without member
+		 * data ends before the data stream is read at all. When extracting
+		 * some members the remaining chunks are not needed either.
+		 */
+		if (pctx->arc_selective || pctx->arc_eof)
+			return (count);
 		log_msg(LOG_WARN, 0, "Archive extractor closed unexpectedly");
 		return (0);
 	}
 
 	if (pctx->arc_buf != NULL) {
+		pthread_mutex_unlock(&pctx->arc_mutex);
 		log_msg(LOG_ERR, 0, "Incorrect sequencing of archiver_write() call.");
 		return (-1);
 	}
 
 	pctx->arc_buf = buf;
 	pctx->arc_buf_size = count;
+	pthread_mutex_unlock(&pctx->arc_mutex);
 	Sem_Post(&(pctx->read_sem));
 	Sem_Wait(&(pctx->write_sem));
 	pctx->arc_buf = NULL;
@@ -1020,17 +1098,27 @@ setup_extractor(pc_ctx_t *pctx)
 	return (0);
 }
 
+/*
+ * Serializes filters that are not mt_safe.
+ */
+static pthread_mutex_t filter_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * When decoding, in_buf can hold the entry data already read from the archive.
+ */
 static ssize_t
 process_by_filter(int fd, int *typ, struct archive *target_arc,
-    struct archive *source_arc, struct archive_entry *entry,
+    struct archive *source_arc, uchar_t *in_buf, struct archive_entry *entry,
     filter_output_t *fout, int cmp, int level)
 {
 	struct filter_info fi;
+	struct type_data *td;
 	int64_t wrtn;
 
 	fout->hdr_valid = 1;
 	fi.source_arc = source_arc;
 	fi.target_arc = target_arc;
+	fi.in_buf = in_buf;
 	fi.entry = entry;
 	fi.fd = fd;
 	fi.compressing = cmp;
@@ -1038,7 +1126,12 @@ process_by_filter(int fd, int *typ, struct archive *target_arc,
 	fi.type_ptr = typ;
 	fi.cmp_level = level;
 	fi.fout = fout;
-	wrtn = (*(typetab[(*typ >> 3)].filter_func))(&fi, typetab[(*typ >> 3)].filter_private);
+	td = &typetab[(*typ >> 3)];
+	if (!td->mt_safe)
+		pthread_mutex_lock(&filter_mutex);
+	wrtn = (*(td->filter_func))(&fi, td->filter_private);
+	if (!td->mt_safe)
+		pthread_mutex_unlock(&filter_mutex);
 	if (wrtn == FILTER_RETURN_ERROR) {
 		log_msg(LOG_ERR, 0, "Warning: Error invoking filter: %s (skipping)",
 		    typetab[(*typ >> 3)].filter_name);
@@ -1051,7 +1144,7 @@ process_by_filter(int fd, int *typ, struct archive *target_arc,
 }
 
 static int
-write_header(struct archive *arc, struct archive_entry *entry)
+write_header(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry)
 {
 	int rv;
 
@@ -1066,83 +1159,239 @@ write_header(struct archive *arc, struct archive_entry *entry)
 			    archive_entry_sourcepath(entry), archive_error_string(arc));
 		}
 	}
+
+	/*
+	 * With Metadata Streams the header went to the metadata stream, so the
+	 * member's data starts at the current data stream position.
+	 */
+	if (pctx->catalog) {
+		if (catalog_add(pctx->catalog, archive_entry_pathname(entry),
+		    pctx->arc_data_pos) != 0)
+			return (-1);
+	}
 	return (0);
 }
 
 /*
  * Routines to archive members and write the file data to the callback. Portions of
  * the following code is adapted from some of the Libarchive bsdtar code.
+ *
+ * Regular files are opened, have their type detected and are run through filters
+ * by a pool of filter threads working ahead of the archiver thread. Member number
+ * n is handed to filter thread n % nthreads and the archiver thread picks up the
+ * results in turn, so members are written to libarchive in the same order as the
+ * member list.
  */
+struct arc_member {
+	struct archive_entry *entry;
+	pc_ctx_t *pctx;
+	int fd, typ, ctype, set_ctype;
+	int filtered, rv, stop;
+	char *fname;
+	filter_output_t fout;
+	Sem_t start_sem, done_sem;
+	pthread_t thr;
+
+	/*
+	 * Incremental archiving state. The identity is taken when the member
+	 * is read from the list, before filters change the entry.
+	 */
+	manifest_ent_t *prev;
+	int unchanged, hashed;
+	uint64_t size, mtime_sec, dev, ino;
+	uint32_t mtime_nsec;
+	uchar_t hash[MANIFEST_HASH_BYTES];
+};
+
+static void
+filter_member_data(struct arc_member *m)
+{
+	pc_ctx_t *pctx = m->pctx;
+	struct archive_entry *entry = m->entry;
+	struct type_data *td;
+	const char *fpath;
+	uchar_t *mapbuf;
+	size_t sz, len;
+	int64_t rv;
+
+	m->fd = -1;
+	m->filtered = 0;
+	m->rv = 0;
+	m->set_ctype = (m->typ != TYPE_UNKNOWN);
+	m->ctype = m->typ;
+	if (m->unchanged || archive_entry_filetype(entry) != AE_IFREG ||
+	    archive_entry_size(entry) == 0)
+		return;
+
+	sz = archive_entry_size(entry);
+	fpath = archive_entry_sourcepath(entry);
+	m->fd = open(fpath, O_RDONLY);
+	if (m->fd == -1) {
+		log_msg(LOG_ERR, 1, "Failed to open %s.", fpath);
+		m->rv = -1;
+		return;
+	}
+
+	/*
+	 * A file that was only touched since the last incremental run has the
+	 * same content and is still stored as a reference. Only a file of the
+	 * same size can be one, others are digested as their data is archived.
+	 */
+	if (pctx->manifest && m->prev && m->prev->size == sz) {
+		if (manifest_hash_fd(m->fd, sz, m->hash) != 0) {
+			log_msg(LOG_ERR, 0, "Failed to digest %s.", fpath);
+			m->rv = -1;
+			return;
+		}
+		m->hashed = 1;
+		if (m->prev && m->prev->size == sz &&
+		    memcmp(m->prev->hash, m->hash, MANIFEST_HASH_BYTES) == 0) {
+			m->unchanged = 1;
+			close(m->fd);
+			m->fd = -1;
+			return;
+		}
+	}
+
+	/*
+	 * Type is detected from the first mmap-ed buffer if the extension did not
+	 * give it.
+	 */
+	if (m->typ == TYPE_UNKNOWN) {
+		len = sz < MMAP_SIZE ? sz : MMAP_SIZE;
+		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, m->fd, 0);
+		if (mapbuf == NULL) {
+			log_msg(LOG_ERR, 1, "Mmap failed for %s.", fpath);
+			m->rv = -1;
+			return;
+		}
+		m->ctype = detect_type_by_data(mapbuf, len);
+		m->set_ctype = 1;
+		munmap(mapbuf, len);
+	}
+
+	td = &typetab[(m->ctype >> 3)];
+	if (m->ctype == TYPE_UNKNOWN || td->filter_func == NULL) {
+#ifdef POSIX_FADV_WILLNEED
+		/*
+		 * Data will be copied as-is. Get the start of it read in while the
+		 * archiver thread is busy with earlier members.
+		 */
+		posix_fadvise(m->fd, 0, sz < ARC_PREFETCH_SIZE ? sz : ARC_PREFETCH_SIZE,
+		    POSIX_FADV_WILLNEED);
+#endif
+		return;
+	}
+
+	rv = process_by_filter(m->fd, &(m->ctype), NULL, NULL, NULL, entry,
+	    &(m->fout), 1, pctx->level);
+	if (rv != FILTER_RETURN_SKIP && rv != FILTER_RETURN_ERROR) {
+		if (m->fout.output_type == FILTER_OUTPUT_MEM) {
+			m->filtered = 1;
+			m->fname = td->filter_name;
+
+			/*
+			 * The filter has just read the whole file, digest it while
+			 * it is still cached.
+			 */
+			if (pctx->manifest && !m->hashed) {
+				if (manifest_hash_fd(m->fd, sz, m->hash) != 0) {
+					log_msg(LOG_ERR, 0, "Failed to digest %s.", fpath);
+					m->rv = -1;
+					return;
+				}
+				m->hashed = 1;
+			}
+		} else {
+			log_msg(LOG_WARN, 0, "Unsupported filter output for entry: %s.",
+			    archive_entry_pathname(entry));
+			m->rv = ARCHIVE_FATAL;
+		}
+	}
+}
+
+static void *
+filter_thread_func(void *dat)
+{
+	struct arc_member *m = (struct arc_member *)dat;
+
+	for (;;) {
+		Sem_Wait(&(m->start_sem));
+		if (m->stop)
+			break;
+		filter_member_data(m);
+		Sem_Post(&(m->done_sem));
+	}
+	return (NULL);
+}
+
+static void
+release_member(struct arc_member *m)
+{
+	if (m->filtered) {
+		free(m->fout.out);
+		m->filtered = 0;
+	}
+	if (m->fd != -1) {
+		close(m->fd);
+		m->fd = -1;
+	}
+	archive_entry_clear(m->entry);
+}
+
 static int
-copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ)
+copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry,
+    struct arc_member *m)
 {
 	size_t sz, offset, len;
-	ssize_t bytes_to_write;
+	ssize_t bytes_to_write, wrtn;
 	uchar_t *mapbuf;
-	int rv, fd, typ1;
+	int rv, hashing;
 	const char *fpath;
-	filter_output_t fout;
+	cksum_ctx_t cctx;
+
+	if (m->rv != 0)
+		return (m->rv);
+	if (m->set_ctype)
+		pctx->ctype = m->ctype;
+
+	if (m->filtered) {
+		archive_entry_xattr_add_entry(entry, FILTER_XATTR_ENTRY,
+					      m->fname, strlen(m->fname));
+		if (write_header(pctx, arc, entry) == -1)
+			return (-1);
+		if (m->fout.hdr_valid) {
+			wrtn = archive_write_data(arc, &(m->fout.hdr),
+						  sizeof (m->fout.hdr));
+			if (wrtn != sizeof (m->fout.hdr))
+				return (wrtn);
+		}
+		wrtn = archive_write_data(arc, m->fout.out, m->fout.out_size);
+		if (wrtn != m->fout.out_size)
+			return (ARCHIVE_FATAL);
+		else
+			return (ARCHIVE_OK);
+	}
+	if (write_header(pctx, arc, entry) == -1)
+		return (-1);
 
-	typ1 = typ;
 	offset = 0;
 	rv = 0;
 	sz = archive_entry_size(entry);
 	bytes_to_write = sz;
 	fpath = archive_entry_sourcepath(entry);
-	fd = open(fpath, O_RDONLY);
-	if (fd == -1) {
-		log_msg(LOG_ERR, 1, "Failed to open %s.", fpath);
-		return (-1);
-	}
 
-	if (typ != TYPE_UNKNOWN) {
-		if (typetab[(typ >> 3)].filter_func != NULL) {
-			int64_t rv;
-			char *fname = typetab[(typ >> 3)].filter_name;
-
-			pctx->ctype = typ;
-			rv = process_by_filter(fd, &(pctx->ctype), arc, NULL, entry,
-			    &fout, 1, pctx->level);
-			if (rv != FILTER_RETURN_SKIP &&
-			    rv != FILTER_RETURN_ERROR) {
-				if (fout.output_type == FILTER_OUTPUT_MEM) {
-					archive_entry_xattr_add_entry(entry, FILTER_XATTR_ENTRY,
-								      fname, strlen(fname));
-					if (write_header(arc, entry) == -1) {
-						close(fd);
-						return (-1);
-					}
-					if (fout.hdr_valid) {
-						rv = archive_write_data(arc, &(fout.hdr),
-									sizeof (fout.hdr));
-						if (rv != sizeof (fout.hdr))
-							return (rv);
-					}
-					rv = archive_write_data(arc, fout.out,
-								fout.out_size);
-					free(fout.out);
-					close(fd);
-					if (rv != fout.out_size)
-						return (ARCHIVE_FATAL);
-					else
-						return (ARCHIVE_OK);
-				} else {
-					log_msg(LOG_WARN, 0,
-						"Unsupported filter output for entry: %s.",
-						archive_entry_pathname(entry));
-					return (ARCHIVE_FATAL);
-				}
-			}
-			if (write_header(arc, entry) == -1) {
-				close(fd);
-				return (-1);
-			}
-		} else {
-			if (write_header(arc, entry) == -1) {
-				close(fd);
-				return (-1);
-			}
+	/*
+	 * For incremental archiving the manifest digest is computed from the
+	 * data as it is copied.
+	 */
+	hashing = 0;
+	if (pctx->manifest && !m->hashed) {
+		if (cksum_init(&cctx, MANIFEST_HASH) != 0) {
+			log_msg(LOG_ERR, 0, "Cannot initialize manifest digest.");
+			return (-1);
 		}
+		hashing = 1;
 	}
 
 	/*
@@ -1152,14 +1401,12 @@ copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry,
 	while (bytes_to_write > 0) {
 		uchar_t *src;
 		size_t wlen;
-		ssize_t wrtn;
 
 		if (bytes_to_write < MMAP_SIZE)
 			len = bytes_to_write;
 		else
 			len = MMAP_SIZE;
-do_map:
-		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, m->fd, offset);
 		if (mapbuf == NULL) {
 			/* Mmap failed; this is bad. */
 			log_msg(LOG_ERR, 1, "Mmap failed for %s.", fpath);
@@ -1169,71 +1416,8 @@ do_map:
 		offset += len;
 		src = mapbuf;
 		wlen = len;
-
-		if (typ == TYPE_UNKNOWN) {
-			pctx->ctype = detect_type_by_data(src, len);
-			typ = pctx->ctype;
-			if (typ != TYPE_UNKNOWN) {
-				if (typetab[(typ >> 3)].filter_func != NULL) {
-					int64_t rv;
-					char *fname = typetab[(typ >> 3)].filter_name;
-
-					munmap(mapbuf, len);
-					rv = process_by_filter(fd, &(pctx->ctype), arc, NULL, entry,
-					    &fout, 1, pctx->level);
-					if (rv != FILTER_RETURN_SKIP &&
-					    rv != FILTER_RETURN_ERROR) {
-						if (fout.output_type == FILTER_OUTPUT_MEM) {
-							archive_entry_xattr_add_entry(entry,
-										      FILTER_XATTR_ENTRY,
-										      fname, strlen(fname));
-							if (write_header(arc, entry) == -1) {
-								close(fd);
-								return (-1);
-							}
-							if (fout.hdr_valid) {
-								rv = archive_write_data(arc, &(fout.hdr),
-											sizeof (fout.hdr));
-								if (rv != sizeof (fout.hdr))
-									return (rv);
-							}
-							rv = archive_write_data(arc, fout.out,
-										fout.out_size);
-							free(fout.out);
-							close(fd);
-							if (rv != fout.out_size)
-								return (ARCHIVE_FATAL);
-							else
-								return (ARCHIVE_OK);
-						} else {
-							log_msg(LOG_WARN, 0,
-								"Unsupported filter output for entry: %s.",
-								archive_entry_pathname(entry));
-							return (ARCHIVE_FATAL);
-						}
-					}
-					if (write_header(arc, entry) == -1) {
-						close(fd);
-						return (-1);
-					}
-					lseek(fd, 0, SEEK_SET);
-					typ = TYPE_COMPRESSED;
-					offset = 0;
-					goto do_map;
-				} else {
-					if (write_header(arc, entry) == -1) {
-						close(fd);
-						return (-1);
-					}
-				}
-			} else {
-				if (write_header(arc, entry) == -1) {
-					close(fd);
-					return (-1);
-				}
-			}
-		}
-		typ = TYPE_COMPRESSED; // Need to avoid calling detect_type_by_data subsequently.
+		if (hashing)
+			cksum_update(&cctx, src, wlen);
 
 		/*
 		 * Write the entire mmap-ed buffer. Since we are writing to the compressor
@@ -1249,22 +1433,52 @@ do_map:
 		if (rv == -1) break;
 		munmap(mapbuf, len);
 	}
-	close(fd);
+	if (hashing) {
+		if (rv == 0) {
+			cksum_final(&cctx, m->hash);
+			m->hashed = 1;
+		}
+		cksum_cleanup(&cctx);
+	}
 
 	return (rv);
 }
 
+/*
+ * Store an unchanged member as a reference. It has no data and its size is
+ * kept in the reference marker.
+ */
+static int
+write_reference(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry,
+    struct arc_member *m)
+{
+	char sz[24];
+
+	snprintf(sz, sizeof (sz), "%" PRIu64, m->size);
+	archive_entry_xattr_add_entry(entry, MANIFEST_REF_XATTR, sz, strlen(sz));
+	archive_entry_set_size(entry, 0);
+	if (write_header(pctx, arc, entry) == -1)
+		return (-1);
+	pctx->manifest_refs++;
+	pctx->manifest_ref_bytes += m->size;
+	return (0);
+}
+
 static int
-write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ)
+write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry,
+    struct arc_member *m)
 {
+	if (m->unchanged && archive_entry_hardlink(entry) == NULL)
+		return (write_reference(pctx, arc, entry, m));
+
 	/*
 	 * If entry has data we postpone writing the header till we have
 	 * determined whether the entry type has an associated filter.
 	 */
 	if (archive_entry_size(entry) > 0) {
-		return (copy_file_data(pctx, arc, entry, typ));
+		return (copy_file_data(pctx, arc, entry, m));
 	} else {
-		if (write_header(arc, entry) == -1)
+		if (write_header(pctx, arc, entry) == -1)
 			return (-1);
 	}
 
@@ -1272,45 +1486,59 @@ write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, in
 }
 
 /*
- * Thread function. Archive members and write to pipe. The dispatcher thread
- * reads from the other end and compresses.
+ * Record the files of the previous manifest that are gone now, so that
+ * extracting the incremental archive over the earlier ones removes them.
  */
-static void *
-archiver_thread_func(void *dat) {
-	pc_ctx_t *pctx = (pc_ctx_t *)dat;
-	char fpath[PATH_MAX], *name, *bnchars = NULL; // Silence compiler
-	int warn, rbytes, fpathlen = 0; // Silence compiler
-	uint32_t ctr;
-	struct archive_entry *entry, *spare_entry, *ent;
-	struct archive *arc, *ard;
-	struct archive_entry_linkresolver *resolver;
-	int readdisk_flags;
+static int
+write_deletions(pc_ctx_t *pctx, struct archive *arc)
+{
+	struct archive_entry *entry;
+	manifest_ent_t *ment;
+	uint64_t i;
+	int rv;
 
-	warn = 1;
 	entry = archive_entry_new();
-	arc = (struct archive *)(pctx->archive_ctx);
-
-	if ((resolver = archive_entry_linkresolver_new()) != NULL) {
-		archive_entry_linkresolver_set_strategy(resolver, archive_format(arc));
-	} else {
-		log_msg(LOG_WARN, 0, "Cannot create link resolver, hardlinks will be duplicated.");
+	if (entry == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (-1);
 	}
+	rv = 0;
+	for (i = 0; i < pctx->manifest_prev->hsize && rv == 0; i++) {
+		for (ment = pctx->manifest_prev->htab[i]; ment != NULL; ment = ment->next) {
+			if (manifest_lookup(pctx->manifest, ment->name) != NULL)
+				continue;
+			archive_entry_clear(entry);
+			archive_entry_copy_pathname(entry, ment->name);
+			archive_entry_set_filetype(entry, AE_IFREG);
+			archive_entry_set_perm(entry, 0600);
+			archive_entry_set_size(entry, 0);
+			archive_entry_xattr_add_entry(entry, MANIFEST_DEL_XATTR, "d", 1);
+			if (write_header(pctx, arc, entry) == -1) {
+				rv = -1;
+				break;
+			}
+			archive_write_finish_entry(arc);
+		}
+	}
+	archive_entry_free(entry);
+	return (rv);
+}
 
-	ctr = 1;
-	readdisk_flags = ARCHIVE_READDISK_NO_TRAVERSE_MOUNTS;
-	readdisk_flags |= ARCHIVE_READDISK_HONOR_NODUMP;
-
-	ard = archive_read_disk_new();
-	archive_read_disk_set_behavior(ard, readdisk_flags);
-	archive_read_disk_set_standard_lookup(ard);
-	archive_read_disk_set_symlink_physical(ard);
+/*
+ * Read the next pathname from the member list and fill in its archive entry.
+ * Returns 0 at the end of the list.
+ */
+static int
+next_member(pc_ctx_t *pctx, struct archive *ard, struct arc_member *m, int *warn)
+{
+	char fpath[PATH_MAX], *name, *bnchars = NULL; // Silence compiler
+	int rbytes, fpathlen = 0; // Silence compiler
+	struct archive_entry *entry = m->entry;
 
 	/*
 	 * Read next path entry from list file. read_next_path() also handles sorted reading.
 	 */
 	while ((rbytes = read_next_path(pctx, fpath, &bnchars, &fpathlen)) != 0) {
-		int typ;
-
 		if (rbytes == -1) break;
 		archive_entry_copy_sourcepath(entry, fpath);
 		if (archive_read_disk_entry_from_file(ard, entry, -1, NULL) != ARCHIVE_OK) {
@@ -1320,20 +1548,18 @@ archiver_thread_func(void *dat) {
 			continue;
 		}
 
-		typ = TYPE_UNKNOWN;
-		if (archive_entry_filetype(entry) == AE_IFREG) {
-			if ((typ = detect_type_by_ext(fpath, fpathlen)) != TYPE_UNKNOWN)
-				pctx->ctype = typ;
-		}
+		m->typ = TYPE_UNKNOWN;
+		if (archive_entry_filetype(entry) == AE_IFREG)
+			m->typ = detect_type_by_ext(fpath, fpathlen);
 
 		/*
 		 * Strip leading '/' or '../' or '/../' from member name.
 		 */
 		name = fpath;
 		while (name[0] == '/' || name[0] == '\\') {
-			if (warn) {
+			if (*warn) {
 				log_msg(LOG_WARN, 0, "Converting absolute paths.");
-				warn = 0;
+				*warn = 0;
 			}
 			if (name[1] == '.' && name[2] == '.' && (name[3] == '/' || name[3] == '\\')) {
 				name += 3; /* /.. is removed here and / is removed next. */
@@ -1372,30 +1598,212 @@ archiver_thread_func(void *dat) {
 		} else {
 			archive_entry_set_size(entry, archive_entry_size(entry));
 		}
+
+		/*
+		 * For incremental archiving a file with the same identity as in
+		 * the previous manifest is not read at all.
+		 */
+		m->prev = NULL;
+		m->unchanged = 0;
+		m->hashed = 0;
+		if (pctx->manifest && archive_entry_filetype(entry) == AE_IFREG) {
+			m->size = archive_entry_size(entry);
+			m->mtime_sec = archive_entry_mtime(entry);
+			m->mtime_nsec = archive_entry_mtime_nsec(entry);
+			m->dev = archive_entry_dev(entry);
+			m->ino = archive_entry_ino64(entry);
+			m->prev = manifest_lookup(pctx->manifest_prev,
+			    archive_entry_pathname(entry));
+			if (m->prev && m->prev->size == m->size &&
+			    m->prev->mtime_sec == m->mtime_sec &&
+			    m->prev->mtime_nsec == m->mtime_nsec &&
+			    m->prev->dev == m->dev && m->prev->ino == m->ino) {
+				m->unchanged = 1;
+				memcpy(m->hash, m->prev->hash, MANIFEST_HASH_BYTES);
+			}
+		}
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Thread function. Archive members and write to pipe. The dispatcher thread
+ * reads from the other end and compresses.
+ */
+static void *
+archiver_thread_func(void *dat) {
+	pc_ctx_t *pctx = (pc_ctx_t *)dat;
+	int warn, i, cur, nmembers, nfilter, failed;
+	uint32_t ctr;
+	struct archive_entry *spare_entry, *ent;
+	struct archive *arc, *ard;
+	struct archive_entry_linkresolver *resolver;
+	struct arc_member *members, *m;
+	char *pending, *val;
+	int readdisk_flags;
+
+	warn = 1;
+	failed = 0;
+	arc = (struct archive *)(pctx->archive_ctx);
+
+	if ((resolver = archive_entry_linkresolver_new()) != NULL) {
+		archive_entry_linkresolver_set_strategy(resolver, archive_format(arc));
+	} else {
+		log_msg(LOG_WARN, 0, "Cannot create link resolver, hardlinks will be duplicated.");
+	}
+
+	ctr = 1;
+	readdisk_flags = ARCHIVE_READDISK_NO_TRAVERSE_MOUNTS;
+	readdisk_flags |= ARCHIVE_READDISK_HONOR_NODUMP;
+
+	ard = archive_read_disk_new();
+	archive_read_disk_set_behavior(ard, readdisk_flags);
+	archive_read_disk_set_standard_lookup(ard);
+	archive_read_disk_set_symlink_physical(ard);
+
+	/*
+	 * Start the filter threads. With no filter threads members are processed
+	 * inline using a single slot.
+	 */
+	nfilter = pctx->nthreads;
+	if ((val = getenv("PCOMPRESS_ARC_FILTER_THREADS")) != NULL)
+		nfilter = atoi(val);
+	if (nfilter < 0)
+		nfilter = 0;
+	if (nfilter > ARC_FILTER_THREADS_MAX)
+		nfilter = ARC_FILTER_THREADS_MAX;
+	nmembers = nfilter > 0 ? nfilter : 1;
+	members = (struct arc_member *)calloc(nmembers, sizeof (struct arc_member));
+	pending = (char *)calloc(nmembers, 1);
+	if (members == NULL || pending == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		nmembers = 0;
+		goto bail;
+	}
+	for (i = 0; i < nmembers; i++) {
+		m = &members[i];
+		m->pctx = pctx;
+		m->fd = -1;
+		m->entry = archive_entry_new();
+		Sem_Init(&(m->start_sem), 0, 0);
+		Sem_Init(&(m->done_sem), 0, 0);
+		if (nfilter > 0 && pthread_create(&(m->thr), NULL, filter_thread_func, m) != 0) {
+			log_msg(LOG_ERR, 1, "Error in thread creation: ");
+			archive_entry_free(m->entry);
+			Sem_Destroy(&(m->start_sem));
+			Sem_Destroy(&(m->done_sem));
+			nmembers = i;
+			goto bail;
+		}
+	}
+
+	/*
+	 * Prime all the slots then take each member in turn, writing it out and
+	 * refilling its slot with the next one from the list.
+	 */
+	for (i = 0; i < nmembers; i++) {
+		if (!next_member(pctx, ard, &members[i], &warn))
+			break;
+		if (nfilter > 0)
+			Sem_Post(&(members[i].start_sem));
+		pending[i] = 1;
+	}
+
+	cur = 0;
+	while (pending[cur]) {
+		m = &members[cur];
+		if (nfilter > 0)
+			Sem_Wait(&(m->done_sem));
+		else
+			filter_member_data(m);
+		pending[cur] = 0;
+
+		if (m->typ != TYPE_UNKNOWN)
+			pctx->ctype = m->typ;
 		log_msg(LOG_VERBOSE, 0, "%5d/%d %8" PRIu64 " %s", ctr, pctx->archive_members_count,
-		    archive_entry_size(entry), name);
+		    archive_entry_size(m->entry), archive_entry_pathname(m->entry));
 
-		archive_entry_linkify(resolver, &entry, &spare_entry);
-		ent = entry;
+		ent = m->entry;
+		spare_entry = NULL;
+		archive_entry_linkify(resolver, &ent, &spare_entry);
 		while (ent != NULL) {
-			if (write_entry(pctx, arc, ent, typ) != 0) {
+			if (write_entry(pctx, arc, ent, m) != 0) {
 				log_msg(LOG_WARN, 1, "Error archiving entry: %s\n%s",
-				    archive_entry_pathname(entry),
+				    archive_entry_pathname(m->entry),
 				    archive_error_string(ard));
-				goto done;
+				release_member(m);
+				goto bail;
 			}
 			ent = spare_entry;
 			spare_entry = NULL;
 		}
 		archive_write_finish_entry(arc);
-		archive_entry_clear(entry);
+
+		/*
+		 * The digest is normally complete now. Empty files and members
+		 * whose data was not written, like hard links, are digested here.
+		 */
+		if (pctx->manifest && archive_entry_filetype(m->entry) == AE_IFREG &&
+		    m->rv == 0) {
+			if (!m->unchanged && !m->hashed &&
+			    manifest_hash_fd(m->fd, m->size, m->hash) != 0) {
+				release_member(m);
+				goto bail;
+			}
+			if (manifest_add(pctx->manifest, archive_entry_pathname(m->entry),
+			    m->size, m->mtime_sec, m->mtime_nsec, m->dev, m->ino,
+			    m->hash) != 0) {
+				release_member(m);
+				goto bail;
+			}
+		}
+		release_member(m);
 		ctr++;
+
+		if (next_member(pctx, ard, m, &warn)) {
+			if (nfilter > 0)
+				Sem_Post(&(m->start_sem));
+			pending[cur] = 1;
+		}
+		cur = (cur + 1) % nmembers;
 	}
+	if (pctx->manifest && write_deletions(pctx, arc) != 0)
+		goto bail;
+	goto done;
 
+bail:
+	failed = 1;
 done:
+	for (i = 0; i < nmembers; i++) {
+		m = &members[i];
+		if (nfilter > 0) {
+			if (pending[i]) {
+				Sem_Wait(&(m->done_sem));
+				release_member(m);
+			}
+			m->stop = 1;
+			Sem_Post(&(m->start_sem));
+			pthread_join(m->thr, NULL);
+		}
+		archive_entry_free(m->entry);
+		Sem_Destroy(&(m->start_sem));
+		Sem_Destroy(&(m->done_sem));
+	}
+	free(members);
+	free(pending);
+
+	/*
+	 * An incomplete archive must not leave a manifest that claims files
+	 * were archived.
+	 */
+	if (failed && pctx->manifest) {
+		log_msg(LOG_WARN, 0, "Archiving failed, manifest not updated.");
+		manifest_destroy(pctx->manifest);
+		pctx->manifest = NULL;
+	}
 	if (pctx->temp_mmap_len > 0)
 		munmap(pctx->temp_mmap_buf, pctx->temp_mmap_len);
-	archive_entry_free(entry);
 	archive_entry_linkresolver_free(resolver);
 	archive_read_free(ard);
 	archive_write_free(arc);
@@ -1416,10 +1824,15 @@ start_archiver(pc_ctx_t *pctx) {
  * We have to use low-level APIs to extract entries to disk. Normally one would use
  * archive_read_extract2() but LibArchive has no option to set user-defined filter
  * routines, so we have to handle here.
+ *
+ * If buf is non-NULL it holds all of the entry's data read in by read_entry_data()
+ * and ar is not used. Otherwise the data is read from ar.
  */
+static pthread_mutex_t extract_err_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static int
 copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entry,
-    int typ, pc_ctx_t *pctx)
+    int typ, uchar_t *buf, pc_ctx_t *pctx)
 {
 	int64_t offset;
 	const void *buff;
@@ -1432,10 +1845,11 @@ copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entr
 		if (typetab[(typ >> 3)].filter_func != NULL) {
 			int64_t rv;
 
-			rv = process_by_filter(-1, &typ, aw, ar, entry, &fout, 0, 0);
+			rv = process_by_filter(-1, &typ, aw, ar, buf, entry, &fout, 0, 0);
 			if (rv == FILTER_RETURN_ERROR) {
-				archive_set_error(ar, archive_errno(aw),
-				    "%s", archive_error_string(aw));
+				if (ar != NULL)
+					archive_set_error(ar, archive_errno(aw),
+					    "%s", archive_error_string(aw));
 				return (ARCHIVE_FATAL);
 
 			} else if (rv == FILTER_RETURN_SOFT_ERROR ||
@@ -1449,12 +1863,14 @@ copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entr
 						" for entry: %s.",
 						archive_entry_pathname(entry));
 				}
+				pthread_mutex_lock(&extract_err_mutex);
 				pctx->errored_count++;
 				if (pctx->err_paths_fd) {
 					fprintf(pctx->err_paths_fd, "%s,%s\n",
 					    archive_entry_pathname(entry),
 					    typetab[(typ >> 3)].filter_name);
 				}
+				pthread_mutex_unlock(&extract_err_mutex);
 				ret = ARCHIVE_WARN;
 			}
 			if (fout.output_type == FILTER_OUTPUT_MEM) {
@@ -1473,6 +1889,21 @@ copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entr
 		}
 	}
 
+	if (buf != NULL) {
+		/*
+		 * Holes in sparse entries are zero-filled in the buffer and the
+		 * whole buffer is written as one block. The original hole layout is
+		 * not kept. With ARCHIVE_EXTRACT_SPARSE archive_write_disk skips
+		 * runs of zero bytes instead of writing them, so filesystem blocks
+		 * that are all zero become holes whether or not they were holes in
+		 * the archived file.
+		 */
+		r = (int)archive_write_data_block(aw, buf, archive_entry_size(entry), 0);
+		if (r < ARCHIVE_WARN)
+			r = ARCHIVE_WARN;
+		return (r);
+	}
+
 	for (;;) {
 		r = archive_read_data_block(ar, &buff, &size, &offset);
 		if (r == ARCHIVE_EOF)
@@ -1491,9 +1922,12 @@ copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entr
 	return (ret);
 }
 
+/*
+ * With buf set, a is NULL and errors are left in ad. See copy_data_out().
+ */
 static int
 archive_extract_entry(struct archive *a, struct archive_entry *entry,
-    struct archive *ad, int typ, pc_ctx_t *pctx)
+    struct archive *ad, int typ, uchar_t *buf, pc_ctx_t *pctx)
 {
 	int r, r2;
 	char *filter_name;
@@ -1514,16 +1948,17 @@ archive_extract_entry(struct archive *a, struct archive_entry *entry,
 		r = ARCHIVE_WARN;
 	if (r != ARCHIVE_OK) {
 		/* If _write_header failed, copy the error. */
-		archive_copy_error(a, ad);
+		if (a != NULL)
+			archive_copy_error(a, ad);
 	} else if (!archive_entry_size_is_set(entry) || archive_entry_size(entry) > 0) {
 		/* Otherwise, pour data into the entry. */
-		r = copy_data_out(a, ad, entry, typ, pctx);
+		r = copy_data_out(a, ad, entry, typ, buf, pctx);
 	}
 	r2 = archive_write_finish_entry(ad);
 	if (r2 < ARCHIVE_WARN)
 		r2 = ARCHIVE_WARN;
 	/* Use the first message. */
-	if (r2 != ARCHIVE_OK && r == ARCHIVE_OK)
+	if (r2 != ARCHIVE_OK && r == ARCHIVE_OK && a != NULL)
 		archive_copy_error(a, ad);
 	/* Use the worst error return. */
 	if (r2 < r)
@@ -1531,24 +1966,6 @@ archive_extract_entry(struct archive *a, struct archive_entry *entry,
 	return (r);
 }
 
-static int
-copy_data_skip(struct archive *ar, struct archive_entry *entry, int typ)
-{
-	int64_t offset;
-	const void *buff;
-	size_t size;
-	int r;
-
-	for (;;) {
-		r = archive_read_data_block(ar, &buff, &size, &offset);
-		if (r == ARCHIVE_EOF)
-			return (ARCHIVE_OK);
-		if (r != ARCHIVE_OK)
-			return (r);
-	}
-	return (ARCHIVE_OK);
-}
-
 static int
 archive_list_entry(struct archive *a, struct archive_entry *entry, int typ)
 {
@@ -1584,13 +2001,166 @@ archive_list_entry(struct archive *a, struct archive_entry *entry, int typ)
 		int64_t sz = archive_entry_size(entry);
 		printf("%12" PRId64 " %13s %s\n", sz, strtm, archive_entry_pathname(entry));
 		if (sz > 0)
-			return (copy_data_skip(a, entry, typ));
+			return (archive_read_data_skip(a));
 	} else {
 		printf("%12" PRId64 " %13s %s\n", 0LL, strtm, archive_entry_pathname(entry));
 	}
 	return (ARCHIVE_OK);
 }
 
+/*
+ * Deletion markers are applied with a plain unlink(), which does not get the
+ * checks that archive_write_disk does for ARCHIVE_EXTRACT_SECURE_NODOTDOT and
+ * ARCHIVE_EXTRACT_SECURE_SYMLINKS. Only accept relative paths without ".."
+ * components whose existing parent directories are not symlinks.
+ */
+static int
+deleted_member_safe(const char *name)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	char *comp, *slash;
+
+	if (name[0] == '/' || strlen(name) >= sizeof (path))
+		return (0);
+	strcpy(path, name);
+	comp = path;
+	while (1) {
+		slash = strchr(comp, '/');
+		if (strncmp(comp, "..", 2) == 0 && (comp[2] == '/' || comp[2] == '\0'))
+			return (0);
+		if (slash == NULL)
+			break;
+		*slash = '\0';
+		if (lstat(path, &sb) == -1) {
+			/*
+			 * Nothing below a missing directory can be removed.
+			 */
+			if (errno == ENOENT)
+				return (1);
+			return (0);
+		}
+		if (S_ISLNK(sb.st_mode))
+			return (0);
+		*slash = '/';
+		comp = slash + 1;
+	}
+	return (1);
+}
+
+/*
+ * Check a member against the pathnames given for extraction and note the
+ * ones that matched.
+ */
+static int
+member_selected(pc_ctx_t *pctx, const char *name)
+{
+	int i, sel;
+
+	sel = 0;
+	for (i = 0; i < pctx->nextract; i++) {
+		if (catalog_match(name, pctx->extract_paths[i])) {
+			pctx->extract_found[i] = 1;
+			sel = 1;
+		}
+	}
+	return (sel);
+}
+
+/*
+ * Regular files of up to ARC_EXTRACT_BUF_MAX bytes are read into memory by the
+ * extractor thread and handed to a pool of writer threads. These run the reverse
+ * filters, create the files and restore their metadata, each with its own
+ * archive_write_disk handle. Entry n goes to writer n % nthreads. Everything else,
+ * like directories, links and large files, is written by the extractor thread
+ * itself so their relative ordering is kept.
+ */
+struct extract_slot {
+	struct archive_entry *entry;
+	struct archive *awd;
+	pc_ctx_t *pctx;
+	uchar_t *buf;
+	int typ, rv, stop;
+	Sem_t start_sem, done_sem;
+	pthread_t thr;
+};
+
+static void *
+extract_thread_func(void *dat)
+{
+	struct extract_slot *s = (struct extract_slot *)dat;
+	const char *err;
+
+	for (;;) {
+		Sem_Wait(&(s->start_sem));
+		if (s->stop)
+			break;
+		s->rv = archive_extract_entry(NULL, s->entry, s->awd, s->typ, s->buf,
+		    s->pctx);
+		if (s->rv != ARCHIVE_OK) {
+			err = archive_error_string(s->awd);
+			log_msg(LOG_WARN, 0, "%s: %s", archive_entry_pathname(s->entry),
+			    err ? err : "Extraction failed");
+		}
+		free(s->buf);
+		s->buf = NULL;
+		Sem_Post(&(s->done_sem));
+	}
+	return (NULL);
+}
+
+/*
+ * Wait for the writer to finish the entry in this slot. Returns non-zero if the
+ * entry failed fatally.
+ */
+static int
+finish_slot(struct extract_slot *s)
+{
+	Sem_Wait(&(s->done_sem));
+	archive_entry_free(s->entry);
+	s->entry = NULL;
+	return (s->rv == ARCHIVE_FATAL);
+}
+
+/*
+ * Read all of the current entry's data into a buffer. Holes in sparse entries are
+ * left zero-filled.
+ */
+static int
+read_entry_data(struct archive *ar, struct archive_entry *entry, uchar_t **bufp)
+{
+	int64_t offset, sz;
+	const void *buff;
+	size_t size;
+	uchar_t *buf;
+	int r;
+
+	sz = archive_entry_size(entry);
+	buf = (uchar_t *)calloc(1, sz);
+	if (buf == NULL) {
+		archive_set_error(ar, ENOMEM, "Out of memory.");
+		return (ARCHIVE_FATAL);
+	}
+	for (;;) {
+		r = archive_read_data_block(ar, &buff, &size, &offset);
+		if (r == ARCHIVE_EOF)
+			break;
+		if (r != ARCHIVE_OK) {
+			free(buf);
+			return (r);
+		}
+		if (offset < 0 || offset > sz || size > sz - offset) {
+			archive_set_error(ar, EINVAL,
+			    "Entry data exceeds entry size.");
+			free(buf);
+			return (ARCHIVE_FATAL);
+		}
+		memcpy(buf + offset, buff, size);
+	}
+	*bufp = buf;
+	return (ARCHIVE_OK);
+}
+
 /*
  * Extract Thread function. Read an uncompressed archive from the decompressor stage
  * and extract members to disk.
@@ -1598,15 +2168,22 @@ archive_list_entry(struct archive *a, struct archive_entry *entry, int typ)
 static void *
 extractor_thread_func(void *dat) {
 	pc_ctx_t *pctx = (pc_ctx_t *)dat;
-	char cwd[PATH_MAX], got_cwd;
-	int flags, rv;
+	char cwd[PATH_MAX], got_cwd, *pending, *val;
+	int flags, rv, i, cur, nslots, fatal, drain;
 	uint32_t ctr;
 	struct archive_entry *entry;
 	struct archive *awd, *arc;
+	struct extract_slot *slots, *s;
 
 	/* Silence compiler. */
 	awd = NULL;
 	got_cwd = 0;
+	flags = 0;
+	slots = NULL;
+	pending = NULL;
+	nslots = 0;
+	cur = 0;
+	fatal = 0;
 
 	if (!pctx->list_mode) {
 		flags = ARCHIVE_EXTRACT_TIME;
@@ -1642,7 +2219,13 @@ extractor_thread_func(void *dat) {
 	}
 	ctr = 1;
 	arc = (struct archive *)(pctx->archive_ctx);
-	archive_read_open(arc, pctx, arc_open_callback, extract_read_callback, extract_close_callback);
+	if ((pctx->list_mode && pctx->meta_stream) || pctx->arc_selective) {
+		archive_read_open2(arc, pctx, arc_open_callback, extract_read_callback,
+		    extract_skip_callback, extract_close_callback);
+	} else {
+		archive_read_open(arc, pctx, arc_open_callback, extract_read_callback,
+		    extract_close_callback);
+	}
 
 	/*
 	 * Change directory after opening the archive, otherwise archive_read_open() can fail
@@ -1658,18 +2241,63 @@ extractor_thread_func(void *dat) {
 		 * Open list file for pathnames that had filter errors (if any).
 		 */
 		pctx->err_paths_fd = fopen("filter_failures.txt", "w");
+
+		/*
+		 * Start the writer threads. With none all entries are written by
+		 * this thread.
+		 */
+		nslots = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if ((val = getenv("PCOMPRESS_ARC_EXTRACT_THREADS")) != NULL)
+			nslots = atoi(val);
+		if (nslots < 0)
+			nslots = 0;
+		if (nslots > ARC_EXTRACT_THREADS_MAX)
+			nslots = ARC_EXTRACT_THREADS_MAX;
+		if (nslots > 0) {
+			slots = (struct extract_slot *)calloc(nslots,
+			    sizeof (struct extract_slot));
+			pending = (char *)calloc(nslots, 1);
+			if (slots == NULL || pending == NULL) {
+				log_msg(LOG_WARN, 0, "Out of memory, extracting serially.");
+				nslots = 0;
+			}
+		}
+		for (i = 0; i < nslots; i++) {
+			s = &slots[i];
+			s->pctx = pctx;
+			s->awd = archive_write_disk_new();
+			archive_write_disk_set_options(s->awd, flags);
+			archive_write_disk_set_standard_lookup(s->awd);
+			Sem_Init(&(s->start_sem), 0, 0);
+			Sem_Init(&(s->done_sem), 0, 0);
+			if (pthread_create(&(s->thr), NULL, extract_thread_func, s) != 0) {
+				log_msg(LOG_WARN, 1, "Error in thread creation: ");
+				archive_write_free(s->awd);
+				Sem_Destroy(&(s->start_sem));
+				Sem_Destroy(&(s->done_sem));
+				nslots = i;
+				break;
+			}
+		}
 	}
 
 	/*
 	 * Read archive entries and extract to disk.
 	 */
-	while ((rv = archive_read_next_header(arc, &entry)) != ARCHIVE_EOF) {
+	for (;;) {
 #ifndef	__APPLE__
 		const char *xt_name, *xt_value;
 		size_t xt_size;
 #endif
+		const char *ref_size;
+		size_t ref_len;
 		int typ;
 
+		rv = archive_read_next_header(arc, &entry);
+		if (rv == ARCHIVE_EOF) {
+			pctx->arc_eof = 1;
+			break;
+		}
 		if (rv != ARCHIVE_OK)
 			log_msg(LOG_WARN, 0, "%s", archive_error_string(arc));
 
@@ -1683,6 +2311,61 @@ extractor_thread_func(void *dat) {
 			continue;
 		}
 
+		/*
+		 * Skip members that were not asked for. Selection is on the name as
+		 * stored, which is also what the catalog has.
+		 */
+		if (pctx->nextract > 0 &&
+		    !member_selected(pctx, archive_entry_pathname(entry))) {
+			if (archive_read_data_skip(arc) == ARCHIVE_FATAL) {
+				log_msg(LOG_ERR, 0, "%s: %s", archive_entry_pathname(entry),
+				    archive_error_string(arc));
+				log_msg(LOG_ERR, 0, "Fatal error aborting extraction.");
+				break;
+			}
+			continue;
+		}
+
+		/*
+		 * Members unchanged since an earlier incremental archive are only
+		 * references. Their data comes from extracting that archive first.
+		 */
+		if (archive_entry_has_xattr(entry, MANIFEST_REF_XATTR,
+		    (const void **)&ref_size, &ref_len)) {
+			char szbuf[24];
+			struct stat sb;
+
+			if (ref_len >= sizeof (szbuf))
+				ref_len = sizeof (szbuf) - 1;
+			memcpy(szbuf, ref_size, ref_len);
+			szbuf[ref_len] = '\0';
+			if (pctx->list_mode) {
+				archive_entry_set_size(entry, strtoull(szbuf, NULL, 10));
+				archive_list_entry(arc, entry, TYPE_UNKNOWN);
+			} else if (lstat(archive_entry_pathname(entry), &sb) == -1 ||
+			    sb.st_size != strtoull(szbuf, NULL, 10)) {
+				log_msg(LOG_ERR, 0, "%s: Unchanged member is missing or "
+				    "differs, extract the earlier archives first.",
+				    archive_entry_pathname(entry));
+				pctx->extract_errored = 1;
+			}
+			continue;
+		}
+		if (archive_entry_has_xattr(entry, MANIFEST_DEL_XATTR,
+		    (const void **)&ref_size, &ref_len)) {
+			if (pctx->list_mode)
+				continue;
+			if (!deleted_member_safe(archive_entry_pathname(entry))) {
+				log_msg(LOG_WARN, 0, "%s: Not removing deleted member outside "
+				    "the target directory.", archive_entry_pathname(entry));
+			} else if (unlink(archive_entry_pathname(entry)) == -1 &&
+			    errno != ENOENT) {
+				log_msg(LOG_WARN, 1, "%s: Cannot remove deleted member: ",
+				    archive_entry_pathname(entry));
+			}
+			continue;
+		}
+
 		typ = TYPE_UNKNOWN;
 		/*
 		 * Workaround for libarchive weirdness on Non MAC OS X platforms for filenames
@@ -1708,8 +2391,59 @@ extractor_thread_func(void *dat) {
 		}
 #endif
 
-		if (!pctx->list_mode) {
-			rv = archive_extract_entry(arc, entry, awd, typ, pctx);
+		if (!pctx->list_mode && nslots > 0) {
+			const char *path = archive_entry_pathname(entry);
+
+			/*
+			 * A hardlink needs its target to be complete. Directories come
+			 * after their contents and their times must be set once those
+			 * are created. Any other entry must not be written while an
+			 * earlier one for the same path is in flight.
+			 */
+			drain = (archive_entry_hardlink(entry) != NULL ||
+			    archive_entry_filetype(entry) == AE_IFDIR);
+			for (i = 0; i < nslots; i++) {
+				if (pending[i] && (drain ||
+				    strcmp(archive_entry_pathname(slots[i].entry), path) == 0)) {
+					fatal |= finish_slot(&slots[i]);
+					pending[i] = 0;
+				}
+			}
+			if (fatal)
+				break;
+
+			if (archive_entry_filetype(entry) == AE_IFREG &&
+			    archive_entry_hardlink(entry) == NULL &&
+			    archive_entry_size_is_set(entry) &&
+			    archive_entry_size(entry) > 0 &&
+			    archive_entry_size(entry) <= ARC_EXTRACT_BUF_MAX) {
+				s = &slots[cur];
+				if (pending[cur]) {
+					fatal |= finish_slot(s);
+					pending[cur] = 0;
+					if (fatal)
+						break;
+				}
+				rv = read_entry_data(arc, entry, &(s->buf));
+				if (rv == ARCHIVE_OK) {
+					s->entry = archive_entry_clone(entry);
+					if (s->entry == NULL) {
+						archive_set_error(arc, ENOMEM, "Out of memory.");
+						free(s->buf);
+						s->buf = NULL;
+						rv = ARCHIVE_FATAL;
+					} else {
+						s->typ = typ;
+						Sem_Post(&(s->start_sem));
+						pending[cur] = 1;
+						cur = (cur + 1) % nslots;
+					}
+				}
+			} else {
+				rv = archive_extract_entry(arc, entry, awd, typ, NULL, pctx);
+			}
+		} else if (!pctx->list_mode) {
+			rv = archive_extract_entry(arc, entry, awd, typ, NULL, pctx);
 		} else {
 			rv = archive_list_entry(arc, entry, typ);
 		}
@@ -1717,6 +2451,18 @@ extractor_thread_func(void *dat) {
 			log_msg(LOG_WARN, 0, "%s: %s", archive_entry_pathname(entry),
 			    archive_error_string(arc));
 
+			/*
+			 * A selected hard link fails when its target was not selected
+			 * too. The member was asked for but not extracted, so this is
+			 * an error just like a missing member.
+			 */
+			if (pctx->nextract > 0 && archive_entry_hardlink(entry) != NULL) {
+				log_msg(LOG_ERR, 0, "%s: Hard link target %s was not "
+				    "extracted, select it as well.",
+				    archive_entry_pathname(entry),
+				    archive_entry_hardlink(entry));
+				pctx->extract_errored = 1;
+			}
 		} else {
 			log_msg(LOG_VERBOSE, 0, "%5d %8" PRIu64 " %s", ctr, archive_entry_size(entry),
 			    archive_entry_pathname(entry));
@@ -1729,6 +2475,33 @@ extractor_thread_func(void *dat) {
 		ctr++;
 	}
 
+	/*
+	 * Writers are done before the main disk writer is freed below, since that
+	 * applies the deferred directory permissions and times.
+	 */
+	for (i = 0; i < nslots; i++) {
+		s = &slots[i];
+		if (pending[i])
+			fatal |= finish_slot(s);
+		s->stop = 1;
+		Sem_Post(&(s->start_sem));
+		pthread_join(s->thr, NULL);
+		archive_write_free(s->awd);
+		Sem_Destroy(&(s->start_sem));
+		Sem_Destroy(&(s->done_sem));
+	}
+	free(slots);
+	free(pending);
+	if (fatal)
+		log_msg(LOG_ERR, 0, "Fatal error aborting extraction.");
+	for (i = 0; i < pctx->nextract; i++) {
+		if (!pctx->extract_found[i]) {
+			log_msg(LOG_ERR, 0, "%s: Not found in archive.",
+			    pctx->extract_paths[i]);
+			pctx->extract_errored = 1;
+		}
+	}
+
 	if (!pctx->list_mode) {
 		if (pctx->errored_count > 0) {
 			log_msg(LOG_WARN, 0, "WARN: %d pathnames failed filter decoding.");
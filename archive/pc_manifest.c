@@ -0,0 +1,372 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * File manifest for incremental archiving. It records the identity and the
+ * content digest of every regular file that went into an archive. The next
+ * archive made against it stores only a reference for files whose identity
+ * or content did not change.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <utils.h>
+#include <crypto/crypto_utils.h>
+#include "lzma/lzma_crc.h"
+#include "archive/pc_manifest.h"
+
+#define	MANIFEST_HSIZE_INIT	4096
+#define	MANIFEST_MAP_SIZE	(1024 * 1024)
+
+static uint64_t
+name_hash(const char *name)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*name != '\0') {
+		h ^= (uchar_t)*name++;
+		h *= 1099511628211ULL;
+	}
+	return (h);
+}
+
+manifest_t *
+manifest_create(void)
+{
+	manifest_t *mf;
+
+	mf = (manifest_t *)calloc(1, sizeof (manifest_t));
+	if (mf == NULL)
+		return (NULL);
+	mf->hsize = MANIFEST_HSIZE_INIT;
+	mf->htab = (manifest_ent_t **)calloc(mf->hsize, sizeof (manifest_ent_t *));
+	if (mf->htab == NULL) {
+		free(mf);
+		return (NULL);
+	}
+	return (mf);
+}
+
+/*
+ * Double the hash table once it holds as many entries as buckets.
+ */
+static int
+manifest_grow(manifest_t *mf)
+{
+	manifest_ent_t **htab, *ent, *next;
+	uint64_t i, hsize, h;
+
+	hsize = mf->hsize * 2;
+	htab = (manifest_ent_t **)calloc(hsize, sizeof (manifest_ent_t *));
+	if (htab == NULL)
+		return (-1);
+	for (i = 0; i < mf->hsize; i++) {
+		for (ent = mf->htab[i]; ent != NULL; ent = next) {
+			next = ent->next;
+			h = name_hash(ent->name) & (hsize - 1);
+			ent->next = htab[h];
+			htab[h] = ent;
+		}
+	}
+	free(mf->htab);
+	mf->htab = htab;
+	mf->hsize = hsize;
+	return (0);
+}
+
+manifest_ent_t *
+manifest_lookup(manifest_t *mf, const char *name)
+{
+	manifest_ent_t *ent;
+
+	ent = mf->htab[name_hash(name) & (mf->hsize - 1)];
+	while (ent != NULL) {
+		if (strcmp(ent->name, name) == 0)
+			return (ent);
+		ent = ent->next;
+	}
+	return (NULL);
+}
+
+/*
+ * Add an entry, replacing any earlier one with the same name.
+ */
+int
+manifest_add(manifest_t *mf, const char *name, uint64_t size, uint64_t mtime_sec,
+    uint32_t mtime_nsec, uint64_t dev, uint64_t ino, uchar_t *hash)
+{
+	manifest_ent_t *ent;
+	uint64_t h;
+
+	ent = manifest_lookup(mf, name);
+	if (ent == NULL) {
+		if (mf->nents == mf->hsize && manifest_grow(mf) != 0)
+			goto nomem;
+		ent = (manifest_ent_t *)malloc(sizeof (manifest_ent_t));
+		if (ent == NULL)
+			goto nomem;
+		ent->name = strdup(name);
+		if (ent->name == NULL) {
+			free(ent);
+			goto nomem;
+		}
+		h = name_hash(name) & (mf->hsize - 1);
+		ent->next = mf->htab[h];
+		mf->htab[h] = ent;
+		mf->nents++;
+	}
+	ent->size = size;
+	ent->mtime_sec = mtime_sec;
+	ent->mtime_nsec = mtime_nsec;
+	ent->dev = dev;
+	ent->ino = ino;
+	memcpy(ent->hash, hash, MANIFEST_HASH_BYTES);
+	return (0);
+nomem:
+	log_msg(LOG_ERR, 0, "Out of memory growing manifest.");
+	return (-1);
+}
+
+/*
+ * Load a manifest written by an earlier run. A missing file gives an empty
+ * manifest, so the first run archives everything.
+ */
+manifest_t *
+manifest_load(const char *file)
+{
+	manifest_t *mf;
+	struct stat sbuf;
+	uchar_t *buf, *pos, *end;
+	uint64_t i, nents;
+	uint32_t crc, nlen;
+	char *name;
+	int fd;
+
+	mf = manifest_create();
+	if (mf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (NULL);
+	}
+	fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return (mf);
+		log_msg(LOG_ERR, 1, "Cannot open manifest %s: ", file);
+		manifest_destroy(mf);
+		return (NULL);
+	}
+
+	buf = NULL;
+	if (fstat(fd, &sbuf) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot stat manifest %s: ", file);
+		goto err;
+	}
+	if (sbuf.st_size < 20) {
+		log_msg(LOG_ERR, 0, "Manifest %s is truncated.", file);
+		goto err;
+	}
+	buf = (uchar_t *)malloc(sbuf.st_size);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory reading manifest.");
+		goto err;
+	}
+	if (Read(fd, buf, sbuf.st_size) != sbuf.st_size) {
+		log_msg(LOG_ERR, 1, "Cannot read manifest %s: ", file);
+		goto err;
+	}
+	end = buf + sbuf.st_size - sizeof (crc);
+	crc = ntohl(U32_P(end));
+	if (memcmp(buf, MANIFEST_MAGIC, 8) != 0 ||
+	    lzma_crc32(buf, end - buf, 0) != crc) {
+		log_msg(LOG_ERR, 0, "Manifest %s is corrupt or not a manifest.", file);
+		goto err;
+	}
+
+	nents = ntohll(U64_P(buf + 8));
+	pos = buf + 16;
+	for (i = 0; i < nents; i++) {
+		if (end - pos < MANIFEST_ENT_HDR_SZ)
+			break;
+		nlen = ntohl(U32_P(pos + MANIFEST_ENT_HDR_SZ - 4));
+		if (nlen == 0 || nlen > end - pos - MANIFEST_ENT_HDR_SZ)
+			break;
+		name = (char *)malloc(nlen + 1);
+		if (name == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory reading manifest.");
+			goto err;
+		}
+		memcpy(name, pos + MANIFEST_ENT_HDR_SZ, nlen);
+		name[nlen] = '\0';
+		if (manifest_add(mf, name, ntohll(U64_P(pos)), ntohll(U64_P(pos + 8)),
+		    ntohl(U32_P(pos + 16)), ntohll(U64_P(pos + 20)),
+		    ntohll(U64_P(pos + 28)), pos + 36) != 0) {
+			free(name);
+			goto err;
+		}
+		free(name);
+		pos += MANIFEST_ENT_HDR_SZ + nlen;
+	}
+	if (i < nents || pos != end) {
+		log_msg(LOG_ERR, 0, "Manifest %s is corrupt.", file);
+		goto err;
+	}
+	free(buf);
+	close(fd);
+	return (mf);
+err:
+	free(buf);
+	close(fd);
+	manifest_destroy(mf);
+	return (NULL);
+}
+
+/*
+ * Write the manifest to a temporary file and rename it into place, so an
+ * interrupted run leaves the previous manifest intact.
+ */
+int
+manifest_write(manifest_t *mf, const char *file)
+{
+	char tmpfile[MAXPATHLEN];
+	uchar_t *buf, *pos;
+	manifest_ent_t *ent;
+	uint64_t i, len, nlen;
+	int fd, rv;
+
+	len = 16 + sizeof (uint32_t);
+	for (i = 0; i < mf->hsize; i++) {
+		for (ent = mf->htab[i]; ent != NULL; ent = ent->next)
+			len += MANIFEST_ENT_HDR_SZ + strlen(ent->name);
+	}
+	buf = (uchar_t *)malloc(len);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory writing manifest.");
+		return (-1);
+	}
+	memcpy(buf, MANIFEST_MAGIC, 8);
+	U64_P(buf + 8) = htonll(mf->nents);
+	pos = buf + 16;
+	for (i = 0; i < mf->hsize; i++) {
+		for (ent = mf->htab[i]; ent != NULL; ent = ent->next) {
+			nlen = strlen(ent->name);
+			U64_P(pos) = htonll(ent->size);
+			U64_P(pos + 8) = htonll(ent->mtime_sec);
+			U32_P(pos + 16) = htonl(ent->mtime_nsec);
+			U64_P(pos + 20) = htonll(ent->dev);
+			U64_P(pos + 28) = htonll(ent->ino);
+			memcpy(pos + 36, ent->hash, MANIFEST_HASH_BYTES);
+			U32_P(pos + MANIFEST_ENT_HDR_SZ - 4) = htonl((uint32_t)nlen);
+			memcpy(pos + MANIFEST_ENT_HDR_SZ, ent->name, nlen);
+			pos += MANIFEST_ENT_HDR_SZ + nlen;
+		}
+	}
+	U32_P(pos) = htonl(lzma_crc32(buf, pos - buf, 0));
+
+	rv = -1;
+	snprintf(tmpfile, sizeof (tmpfile), "%s.tmp", file);
+	fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	if (fd == -1) {
+		log_msg(LOG_ERR, 1, "Cannot create %s: ", tmpfile);
+		free(buf);
+		return (-1);
+	}
+	if (Write(fd, buf, len) != len) {
+		log_msg(LOG_ERR, 1, "Cannot write %s: ", tmpfile);
+	} else if (fsync(fd) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot sync %s: ", tmpfile);
+	} else {
+		rv = 0;
+	}
+	close(fd);
+	free(buf);
+	if (rv == 0 && rename(tmpfile, file) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot rename %s to %s: ", tmpfile, file);
+		rv = -1;
+	}
+	if (rv != 0)
+		unlink(tmpfile);
+	return (rv);
+}
+
+/*
+ * Digest the content of an open file.
+ */
+int
+manifest_hash_fd(int fd, uint64_t size, uchar_t *hash)
+{
+	cksum_ctx_t cctx;
+	uchar_t *mapbuf;
+	uint64_t off, len;
+	int rv;
+
+	if (cksum_init(&cctx, MANIFEST_HASH) != 0) {
+		log_msg(LOG_ERR, 0, "Cannot initialize manifest digest.");
+		return (-1);
+	}
+	rv = 0;
+	for (off = 0; off < size; off += len) {
+		len = size - off;
+		if (len > MANIFEST_MAP_SIZE)
+			len = MANIFEST_MAP_SIZE;
+		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+		if (mapbuf == MAP_FAILED) {
+			log_msg(LOG_ERR, 1, "Mmap failed: ");
+			rv = -1;
+			break;
+		}
+		cksum_update(&cctx, mapbuf, len);
+		munmap(mapbuf, len);
+	}
+	if (rv == 0)
+		cksum_final(&cctx, hash);
+	cksum_cleanup(&cctx);
+	return (rv);
+}
+
+void
+manifest_destroy(manifest_t *mf)
+{
+	manifest_ent_t *ent, *next;
+	uint64_t i;
+
+	if (mf == NULL)
+		return;
+	for (i = 0; i < mf->hsize; i++) {
+		for (ent = mf->htab[i]; ent != NULL; ent = next) {
+			next = ent->next;
+			free(ent->name);
+			free(ent);
+		}
+	}
+	free(mf->htab);
+	free(mf);
+}
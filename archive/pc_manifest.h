@@ -0,0 +1,97 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_MANIFEST_H
+#define	_PC_MANIFEST_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <utils.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Manifest of the regular files in an archive, used for incremental archiving.
+ * File layout, all integers in network byte order:
+ * 8 Bytes: MANIFEST_MAGIC
+ * 64-bit integer: Number of entries
+ * For each entry:
+ *     64-bit integer: Size
+ *     64-bit integer: Modification time, seconds
+ *     32-bit integer: Modification time, nanoseconds
+ *     64-bit integer: Device
+ *     64-bit integer: Inode
+ *     MANIFEST_HASH_BYTES: BLAKE2 256 digest of the content
+ *     32-bit integer: Length of the member name
+ *     Member name bytes without a terminating NUL
+ * 4 Bytes: CRC32 of all of the above
+ */
+#define	MANIFEST_MAGIC		"PCZMANI1"
+#define	MANIFEST_HASH		CKSUM_BLAKE256
+#define	MANIFEST_HASH_BYTES	32
+#define	MANIFEST_ENT_HDR_SZ	(40 + MANIFEST_HASH_BYTES)
+
+/*
+ * Marks a member that is unchanged since the archive the manifest was made
+ * for. The entry has no data and the value is the member's size.
+ */
+#define	MANIFEST_REF_XATTR	"_._pc_ref_xattr"
+
+/*
+ * Marks a file of the previous manifest that no longer exists.
+ */
+#define	MANIFEST_DEL_XATTR	"_._pc_del_xattr"
+
+typedef struct manifest_ent {
+	uint64_t size;
+	uint64_t mtime_sec;
+	uint32_t mtime_nsec;
+	uint64_t dev, ino;
+	uchar_t hash[MANIFEST_HASH_BYTES];
+	char *name;
+	struct manifest_ent *next;
+} manifest_ent_t;
+
+typedef struct {
+	manifest_ent_t **htab;
+	uint64_t hsize, nents;
+} manifest_t;
+
+manifest_t *manifest_create(void);
+manifest_t *manifest_load(const char *file);
+manifest_ent_t *manifest_lookup(manifest_t *mf, const char *name);
+int manifest_add(manifest_t *mf, const char *name, uint64_t size, uint64_t mtime_sec,
+    uint32_t mtime_nsec, uint64_t dev, uint64_t ino, uchar_t *hash);
+int manifest_write(manifest_t *mf, const char *file);
+int manifest_hash_fd(int fd, uint64_t size, uchar_t *hash);
+void manifest_destroy(manifest_t *mf);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -29,6 +29,9 @@
 #include <stdio.h>
 #include <utils.h>
 
+// Reusable working memory for bsdiff()
+typedef struct bsdiff_scratch bsdiff_scratch_t;
+
 // Simple stream I/O to buffer
 typedef struct {
 	uchar_t *buf;
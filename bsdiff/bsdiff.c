@@ -72,12 +72,91 @@ __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bsdiff/bsdiff.c,v 1.1 2005/08/06 01:59:05
 #ifdef __USE_SSE_INTRIN__
 #include <emmintrin.h>
 #endif
+#ifdef ENABLE_PC_LIBBSC
+#include <bwt/divsufsort/divsufsort.h>
+#endif
 
 #define	__IN_BSDIFF__
 #include "bscommon.h"
 
 #define BDIFF_MIN(x,y) (((x)<(y)) ? (x) : (y))
 
+/*
+ * Working memory for bsdiff(). It is sized for the largest pair of buffers
+ * seen so far, so a thread diffing many blocks allocates it only once.
+ */
+struct bsdiff_scratch {
+	bsize_t *I, *V;
+	u_char *db, *eb;
+	bsize_t oldcap, newcap;
+};
+
+bsdiff_scratch_t *
+bsdiff_scratch_create(void)
+{
+	return ((bsdiff_scratch_t *)slab_calloc(NULL, 1, sizeof (bsdiff_scratch_t)));
+}
+
+static void
+scratch_release(bsdiff_scratch_t *bs)
+{
+	if (bs->I) slab_free(NULL, bs->I);
+	if (bs->V) slab_free(NULL, bs->V);
+	if (bs->db) slab_free(NULL, bs->db);
+	if (bs->eb) slab_free(NULL, bs->eb);
+	bs->I = bs->V = NULL;
+	bs->db = bs->eb = NULL;
+	bs->oldcap = bs->newcap = 0;
+}
+
+void
+bsdiff_scratch_destroy(bsdiff_scratch_t *bs)
+{
+	if (bs) {
+		scratch_release(bs);
+		slab_free(NULL, bs);
+	}
+}
+
+static int
+scratch_reserve(bsdiff_scratch_t *bs, bsize_t oldsize, bsize_t newsize)
+{
+	if (oldsize + 1 > bs->oldcap) {
+		if (bs->I) slab_free(NULL, bs->I);
+		if (bs->V) slab_free(NULL, bs->V);
+		bs->I = (bsize_t *)slab_alloc(NULL, (oldsize+1)*sizeof (bsize_t));
+#ifndef ENABLE_PC_LIBBSC
+		bs->V = (bsize_t *)slab_alloc(NULL, (oldsize+1)*sizeof (bsize_t));
+#else
+		bs->V = NULL;
+#endif
+		bs->oldcap = oldsize + 1;
+		if (bs->I == NULL) {
+			bs->oldcap = 0;
+			return (-1);
+		}
+#ifndef ENABLE_PC_LIBBSC
+		if (bs->V == NULL) {
+			bs->oldcap = 0;
+			return (-1);
+		}
+#endif
+	}
+	if (newsize + 1 > bs->newcap) {
+		if (bs->db) slab_free(NULL, bs->db);
+		if (bs->eb) slab_free(NULL, bs->eb);
+		bs->db = (u_char *)slab_alloc(NULL, newsize+1);
+		bs->eb = (u_char *)slab_alloc(NULL, newsize+1);
+		bs->newcap = newsize + 1;
+		if (bs->db == NULL || bs->eb == NULL) {
+			bs->newcap = 0;
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+#ifndef ENABLE_PC_LIBBSC
 static void split(bsize_t *I,bsize_t *V,bsize_t start,bsize_t len,bsize_t h)
 {
 	bsize_t i,j,k,x,tmp,jj,kk;
@@ -207,6 +286,26 @@ static void qsufsort(bsize_t *I,bsize_t *V,u_char *oldbuf,bsize_t oldsize)
 
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
+#endif
+
+/*
+ * Build the suffix array of oldbuf into I. Like qsufsort() the array has
+ * oldsize+1 entries with the empty suffix first. When libbsc is available
+ * its divsufsort() is used, which is much faster than qsufsort() and needs
+ * no second array.
+ */
+static int
+build_sa(bsdiff_scratch_t *bs, u_char *oldbuf, bsize_t oldsize)
+{
+#ifdef ENABLE_PC_LIBBSC
+	bs->I[0] = oldsize;
+	if (divsufsort(oldbuf, bs->I + 1, oldsize, 0) != 0)
+		return (-1);
+#else
+	qsufsort(bs->I, bs->V, oldbuf, oldsize);
+#endif
+	return (0);
+}
 
 static bsize_t matchlen(u_char *oldbuf,bsize_t oldsize,u_char *newbuf,bsize_t newsize)
 {
@@ -252,11 +351,16 @@ valouti32(bsize_t x, u_char *buf)
 	I32_P(buf) = htonl(val);
 }
 
+/*
+ * Diff newbuf against oldbuf into diff. Working memory comes from bs if given,
+ * otherwise it is allocated for this call.
+ */
 bsize_t
 bsdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsize,
-       u_char *diff, u_char *scratch, bsize_t scratchsize)
+       u_char *diff, u_char *scratch, bsize_t scratchsize, bsdiff_scratch_t *bs)
 {
-	bsize_t *I,*V;
+	bsdiff_scratch_t tmp;
+	bsize_t *I;
 	bsize_t scan,pos,len;
 	bsize_t lastscan,lastpos,lastoffset;
 	bsize_t oldscore,scsc;
@@ -271,20 +375,22 @@ bsdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsize,
 	bufio_t pf;
 
 	sz = sizeof (bsize_t);
-	I = (bsize_t *)slab_alloc(NULL, (oldsize+1)*sz);
-	V = (bsize_t *)slab_alloc(NULL, (oldsize+1)*sz);
-	if(I == NULL || V == NULL) return (0);
-
-	qsufsort(I,V,oldbuf,oldsize);
-	slab_free(NULL, V);
-
-	if(((db=(u_char *)slab_alloc(NULL, newsize+1))==NULL) ||
-		((eb=(u_char *)slab_alloc(NULL, newsize+1))==NULL)) {
+	if (bs == NULL) {
+		memset(&tmp, 0, sizeof (tmp));
+		bs = &tmp;
+	}
+	if (scratch_reserve(bs, oldsize, newsize) == -1) {
 		log_msg(LOG_ERR, 0, "bsdiff: Memory allocation error.\n");
-		slab_free(NULL, I);
-		slab_free(NULL, V);
-		return (0);
+		rv = 0;
+		goto out;
+	}
+	if (build_sa(bs, oldbuf, oldsize) == -1) {
+		rv = 0;
+		goto out;
 	}
+	I = bs->I;
+	db = bs->db;
+	eb = bs->eb;
 	dblen=0;
 	eblen=0;
 	BUFOPEN(&pf, diff, newsize);
@@ -469,10 +575,9 @@ bsdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsize,
 	BUFWRITE(&pf, header, hdrsz);
 
 out:
-	/* Free the memory we used */
-	slab_free(NULL, db);
-	slab_free(NULL, eb);
-	slab_free(NULL, I);
+	/* Free the memory we used unless it is kept for the next call. */
+	if (bs == &tmp)
+		scratch_release(&tmp);
 
 	return (rv);
 }
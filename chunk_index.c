@@ -0,0 +1,587 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Optional index of chunk offsets appended to a compressed file. It allows
+ * locating the chunks holding any part of the original data without scanning
+ * all the chunk headers before it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utils/utils.h"
+#include "lzma/lzma_crc.h"
+#include "allocator.h"
+#include "chunk_index.h"
+
+#define	CIDX_INITIAL_ENTS	1024
+
+/*
+ * Create an empty index while compressing. If encrypting, the HMAC context
+ * is set up here since the key is cleared once the file header is written.
+ */
+chunk_index_t *
+chunk_index_create(int cksum, int mac_bytes, crypto_ctx_t *cctx)
+{
+	chunk_index_t *cidx;
+
+	cidx = (chunk_index_t *)slab_calloc(NULL, 1, sizeof (chunk_index_t));
+	if (cidx == NULL)
+		return (NULL);
+	cidx->maxents = CIDX_INITIAL_ENTS;
+	cidx->ents = (chunk_index_ent_t *)malloc(cidx->maxents * sizeof (chunk_index_ent_t));
+	if (cidx->ents == NULL) {
+		slab_release(NULL, cidx);
+		return (NULL);
+	}
+	cidx->cksum = cksum;
+	if (cctx) {
+		if (hmac_init(&cidx->mac, cksum, cctx) == -1) {
+			free(cidx->ents);
+			slab_release(NULL, cidx);
+			return (NULL);
+		}
+		cidx->encrypted = 1;
+		cidx->mac_bytes = mac_bytes;
+	} else {
+		cidx->mac_bytes = sizeof (uint32_t);
+	}
+	return (cidx);
+}
+
+/*
+ * Record the next chunk written out. Chunks must be added in file order and
+ * cmp_pos must have been set to the offset of the first chunk.
+ */
+int
+chunk_index_add(chunk_index_t *cidx, uint64_t orig_off, uint64_t cmp_len, uchar_t flags)
+{
+	chunk_index_ent_t *ent;
+
+	if (cidx->nents == cidx->maxents) {
+		chunk_index_ent_t *ents;
+
+		ents = (chunk_index_ent_t *)realloc(cidx->ents,
+		    cidx->maxents * 2 * sizeof (chunk_index_ent_t));
+		if (ents == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory growing chunk index.");
+			return (-1);
+		}
+		cidx->ents = ents;
+		cidx->maxents *= 2;
+	}
+	ent = &(cidx->ents[cidx->nents++]);
+	ent->cmp_off = cidx->cmp_pos;
+	ent->orig_off = orig_off;
+	ent->flags = flags;
+	cidx->cmp_pos += cmp_len;
+	return (0);
+}
+
+/*
+ * Compute the CRC32 or HMAC over serialized entries and the footer values.
+ */
+static void
+chunk_index_mac(chunk_index_t *cidx, uchar_t *buf, uint64_t len, uchar_t *mac)
+{
+	if (cidx->encrypted) {
+		uchar_t hash[cidx->mac_bytes];
+		unsigned int hlen;
+
+		hmac_reinit(&cidx->mac);
+		hmac_update(&cidx->mac, buf, len);
+		hmac_final(&cidx->mac, hash, &hlen);
+		serialize_checksum(hash, mac, hlen);
+	} else {
+		U32_P(mac) = htonl(lzma_crc32(buf, len, 0));
+	}
+}
+
+/*
+ * Serialize the index. The MAC covers the entries followed by the chunk count
+ * and original size, in the order they are hashed below.
+ */
+int
+chunk_index_write(chunk_index_t *cidx, int fd, uint64_t orig_size)
+{
+	uchar_t *buf, *pos;
+	uchar_t mac[CKSUM_MAX_BYTES];
+	uint64_t i, len;
+	int rv;
+
+	len = cidx->nents * CIDX_ENTRY_SZ + cidx->mac_bytes + CIDX_FOOTER_SZ;
+	buf = (uchar_t *)malloc(len);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory writing chunk index.");
+		return (-1);
+	}
+	pos = buf;
+	for (i = 0; i < cidx->nents; i++) {
+		U64_P(pos) = htonll(cidx->ents[i].cmp_off);
+		U64_P(pos + 8) = htonll(cidx->ents[i].orig_off);
+		pos[16] = cidx->ents[i].flags;
+		pos += CIDX_ENTRY_SZ;
+	}
+	U64_P(pos) = htonll(cidx->nents);
+	U64_P(pos + 8) = htonll(orig_size);
+	chunk_index_mac(cidx, buf, pos - buf + 16, mac);
+
+	memmove(pos + cidx->mac_bytes, pos, 16);
+	memcpy(pos, mac, cidx->mac_bytes);
+	memcpy(pos + cidx->mac_bytes + 16, CIDX_MAGIC, 8);
+
+	rv = 0;
+	if (Write(fd, buf, len) != len) {
+		log_msg(LOG_ERR, 1, "Write ");
+		rv = -1;
+	}
+	free(buf);
+	return (rv);
+}
+
+/*
+ * Load and verify the index from the end of a compressed file. If encrypting,
+ * this must be called while the key is still available.
+ */
+chunk_index_t *
+chunk_index_read(int fd, int cksum, int mac_bytes, crypto_ctx_t *cctx)
+{
+	chunk_index_t *cidx;
+	struct stat sbuf;
+	uchar_t footer[CIDX_FOOTER_SZ];
+	uchar_t mac[CKSUM_MAX_BYTES], mac2[CKSUM_MAX_BYTES];
+	uchar_t *buf, *pos;
+	uint64_t i, nents, len, orig_size;
+	int mbytes;
+
+	cidx = NULL;
+	buf = NULL;
+	mbytes = cctx ? mac_bytes : sizeof (uint32_t);
+	if (fstat(fd, &sbuf) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot stat compressed file ");
+		return (NULL);
+	}
+	if (sbuf.st_size < CIDX_FOOTER_SZ ||
+	    pread(fd, footer, CIDX_FOOTER_SZ, sbuf.st_size - CIDX_FOOTER_SZ) != CIDX_FOOTER_SZ ||
+	    memcmp(footer + 16, CIDX_MAGIC, 8) != 0) {
+		log_msg(LOG_ERR, 0, "Chunk index not found, file truncated ?");
+		return (NULL);
+	}
+	nents = ntohll(U64_P(footer));
+	orig_size = ntohll(U64_P(footer + 8));
+	if (nents > (sbuf.st_size - CIDX_FOOTER_SZ - mbytes) / CIDX_ENTRY_SZ) {
+		log_msg(LOG_ERR, 0, "Invalid chunk index, file corrupt ?");
+		return (NULL);
+	}
+
+	len = nents * CIDX_ENTRY_SZ + 16;
+	buf = (uchar_t *)malloc(len + mbytes);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory reading chunk index.");
+		return (NULL);
+	}
+	if (pread(fd, buf, len - 16 + mbytes, sbuf.st_size - CIDX_FOOTER_SZ - mbytes -
+	    nents * CIDX_ENTRY_SZ) != len - 16 + mbytes) {
+		log_msg(LOG_ERR, 1, "Cannot read chunk index ");
+		goto err;
+	}
+
+	/*
+	 * Move the MAC out of the way and verify it over the entries and footer.
+	 */
+	pos = buf + nents * CIDX_ENTRY_SZ;
+	memcpy(mac, pos, mbytes);
+	memcpy(pos, footer, 16);
+
+	cidx = chunk_index_create(cksum, mac_bytes, cctx);
+	if (cidx == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory reading chunk index.");
+		goto err;
+	}
+	chunk_index_mac(cidx, buf, len, mac2);
+	if (memcmp(mac, mac2, mbytes) != 0) {
+		log_msg(LOG_ERR, 0, "Chunk index verification failed! File "
+		    "tampered or corrupt.");
+		goto err;
+	}
+
+	if (nents > cidx->maxents) {
+		chunk_index_ent_t *ents;
+
+		ents = (chunk_index_ent_t *)realloc(cidx->ents, nents *
+		    sizeof (chunk_index_ent_t));
+		if (ents == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory reading chunk index.");
+			goto err;
+		}
+		cidx->ents = ents;
+		cidx->maxents = nents;
+	}
+	pos = buf;
+	for (i = 0; i < nents; i++) {
+		cidx->ents[i].cmp_off = ntohll(U64_P(pos));
+		cidx->ents[i].orig_off = ntohll(U64_P(pos + 8));
+		cidx->ents[i].flags = pos[16];
+		if ((i > 0 && (cidx->ents[i].orig_off <= cidx->ents[i - 1].orig_off ||
+		    cidx->ents[i].cmp_off <= cidx->ents[i - 1].cmp_off)) ||
+		    cidx->ents[i].orig_off >= orig_size) {
+			log_msg(LOG_ERR, 0, "Invalid chunk index, file corrupt ?");
+			goto err;
+		}
+		pos += CIDX_ENTRY_SZ;
+	}
+	cidx->nents = nents;
+	cidx->orig_size = orig_size;
+	cidx->trailer_off = sbuf.st_size - CIDX_FOOTER_SZ - mbytes - nents * CIDX_ENTRY_SZ;
+	free(buf);
+	return (cidx);
+err:
+	free(buf);
+	chunk_index_destroy(cidx);
+	return (NULL);
+}
+
+/*
+ * Return the number of the chunk holding the given original file offset or
+ * -1 if it is beyond the end.
+ */
+int64_t
+chunk_index_find(chunk_index_t *cidx, uint64_t orig_off)
+{
+	int64_t lo, hi, mid;
+
+	if (cidx->nents == 0 || orig_off >= cidx->orig_size)
+		return (-1);
+	lo = 0;
+	hi = cidx->nents - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (cidx->ents[mid].orig_off <= orig_off)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return (lo);
+}
+
+void
+chunk_index_destroy(chunk_index_t *cidx)
+{
+	if (cidx == NULL)
+		return;
+	if (cidx->encrypted)
+		hmac_cleanup(&cidx->mac);
+	free(cidx->ents);
+	slab_release(NULL, cidx);
+}
+
+/*
+ * Create an empty member catalog while archiving.
+ */
+catalog_t *
+catalog_create(void)
+{
+	catalog_t *cat;
+
+	cat = (catalog_t *)slab_calloc(NULL, 1, sizeof (catalog_t));
+	if (cat == NULL)
+		return (NULL);
+	cat->maxents = CIDX_INITIAL_ENTS;
+	cat->names_max = CIDX_INITIAL_ENTS * 64;
+	cat->ents = (catalog_ent_t *)malloc(cat->maxents * sizeof (catalog_ent_t));
+	cat->names = (char *)malloc(cat->names_max);
+	if (cat->ents == NULL || cat->names == NULL) {
+		catalog_destroy(cat);
+		return (NULL);
+	}
+	return (cat);
+}
+
+/*
+ * Make room for one more member with a pathname of nlen bytes.
+ */
+static int
+catalog_reserve(catalog_t *cat, uint64_t nlen)
+{
+	if (cat->nents == cat->maxents) {
+		catalog_ent_t *ents;
+
+		ents = (catalog_ent_t *)realloc(cat->ents,
+		    cat->maxents * 2 * sizeof (catalog_ent_t));
+		if (ents == NULL)
+			goto nomem;
+		cat->ents = ents;
+		cat->maxents *= 2;
+	}
+	while (cat->names_len + nlen > cat->names_max) {
+		char *names;
+
+		names = (char *)realloc(cat->names, cat->names_max * 2);
+		if (names == NULL)
+			goto nomem;
+		cat->names = names;
+		cat->names_max *= 2;
+	}
+	return (0);
+nomem:
+	log_msg(LOG_ERR, 0, "Out of memory growing archive catalog.");
+	return (-1);
+}
+
+/*
+ * Record a member whose data starts at the given data stream offset. Members
+ * must be added in archive order. The data length is only known once the next
+ * member starts, so it is filled in by catalog_write().
+ */
+int
+catalog_add(catalog_t *cat, const char *path, uint64_t data_off)
+{
+	catalog_ent_t *ent;
+	uint64_t len;
+
+	len = strlen(path) + 1;
+	if (catalog_reserve(cat, len) != 0)
+		return (-1);
+	ent = &(cat->ents[cat->nents++]);
+	ent->data_off = data_off;
+	ent->data_len = 0;
+	ent->name_off = cat->names_len;
+	memcpy(cat->names + cat->names_len, path, len);
+	cat->names_len += len;
+	return (0);
+}
+
+/*
+ * Serialize the catalog, dropping members without data.
+ */
+int
+catalog_write(catalog_t *cat, chunk_index_t *cidx, int fd, uint64_t data_size)
+{
+	uchar_t *buf, *pos;
+	uchar_t mac[CKSUM_MAX_BYTES];
+	uint64_t i, n, len, end, nlen;
+	int rv;
+
+	len = CATL_ENTRY_HDR_SZ * cat->nents + cat->names_len + cidx->mac_bytes +
+	    CATL_FOOTER_SZ;
+	buf = (uchar_t *)malloc(len);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory writing archive catalog.");
+		return (-1);
+	}
+	pos = buf;
+	n = 0;
+	for (i = 0; i < cat->nents; i++) {
+		end = (i + 1 < cat->nents) ? cat->ents[i + 1].data_off : data_size;
+		if (end <= cat->ents[i].data_off)
+			continue;
+		nlen = strlen(cat->names + cat->ents[i].name_off);
+		U64_P(pos) = htonll(cat->ents[i].data_off);
+		U64_P(pos + 8) = htonll(end - cat->ents[i].data_off);
+		U32_P(pos + 16) = htonl((uint32_t)nlen);
+		memcpy(pos + CATL_ENTRY_HDR_SZ, cat->names + cat->ents[i].name_off, nlen);
+		pos += CATL_ENTRY_HDR_SZ + nlen;
+		n++;
+	}
+	len = pos - buf;
+	U64_P(pos) = htonll(n);
+	U64_P(pos + 8) = htonll(len);
+	chunk_index_mac(cidx, buf, len + 16, mac);
+
+	memmove(pos + cidx->mac_bytes, pos, 16);
+	memcpy(pos, mac, cidx->mac_bytes);
+	memcpy(pos + cidx->mac_bytes + 16, CATL_MAGIC, 8);
+	len += cidx->mac_bytes + CATL_FOOTER_SZ;
+
+	rv = 0;
+	if (Write(fd, buf, len) != len) {
+		log_msg(LOG_ERR, 1, "Write ");
+		rv = -1;
+	}
+	free(buf);
+	return (rv);
+}
+
+/*
+ * Load and verify the catalog that precedes an already loaded chunk index.
+ */
+catalog_t *
+catalog_read(int fd, chunk_index_t *cidx)
+{
+	catalog_t *cat;
+	uchar_t footer[CATL_FOOTER_SZ];
+	uchar_t mac[CKSUM_MAX_BYTES], mac2[CKSUM_MAX_BYTES];
+	uchar_t *buf, *pos, *end;
+	uint64_t i, nents, len, nlen;
+
+	cat = NULL;
+	buf = NULL;
+	if (cidx->trailer_off < CATL_FOOTER_SZ + cidx->mac_bytes ||
+	    pread(fd, footer, CATL_FOOTER_SZ, cidx->trailer_off - CATL_FOOTER_SZ) !=
+	    CATL_FOOTER_SZ || memcmp(footer + 16, CATL_MAGIC, 8) != 0) {
+		log_msg(LOG_ERR, 0, "Archive catalog not found, file truncated ?");
+		return (NULL);
+	}
+	nents = ntohll(U64_P(footer));
+	len = ntohll(U64_P(footer + 8));
+	if (len > cidx->trailer_off - CATL_FOOTER_SZ - cidx->mac_bytes ||
+	    nents > len / CATL_ENTRY_HDR_SZ) {
+		log_msg(LOG_ERR, 0, "Invalid archive catalog, file corrupt ?");
+		return (NULL);
+	}
+
+	buf = (uchar_t *)malloc(len + 16 + cidx->mac_bytes);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory reading archive catalog.");
+		return (NULL);
+	}
+	if (pread(fd, buf, len + cidx->mac_bytes, cidx->trailer_off - CATL_FOOTER_SZ -
+	    cidx->mac_bytes - len) != len + cidx->mac_bytes) {
+		log_msg(LOG_ERR, 1, "Cannot read archive catalog ");
+		goto err;
+	}
+	memcpy(mac, buf + len, cidx->mac_bytes);
+	memcpy(buf + len, footer, 16);
+	chunk_index_mac(cidx, buf, len + 16, mac2);
+	if (memcmp(mac, mac2, cidx->mac_bytes) != 0) {
+		log_msg(LOG_ERR, 0, "Archive catalog verification failed! File "
+		    "tampered or corrupt.");
+		goto err;
+	}
+
+	cat = catalog_create();
+	if (cat == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory reading archive catalog.");
+		goto err;
+	}
+	pos = buf;
+	end = buf + len;
+	for (i = 0; i < nents; i++) {
+		catalog_ent_t *ent;
+
+		if (end - pos < CATL_ENTRY_HDR_SZ)
+			break;
+		nlen = ntohl(U32_P(pos + 16));
+		if (nlen > end - pos - CATL_ENTRY_HDR_SZ)
+			break;
+
+		if (catalog_reserve(cat, nlen + 1) != 0)
+			goto err;
+		ent = &(cat->ents[cat->nents++]);
+		ent->data_off = ntohll(U64_P(pos));
+		ent->data_len = ntohll(U64_P(pos + 8));
+		ent->name_off = cat->names_len;
+		memcpy(cat->names + cat->names_len, pos + CATL_ENTRY_HDR_SZ, nlen);
+		cat->names[cat->names_len + nlen] = '\0';
+		cat->names_len += nlen + 1;
+		if (ent->data_off + ent->data_len > cidx->orig_size ||
+		    ent->data_off + ent->data_len < ent->data_off)
+			break;
+		pos += CATL_ENTRY_HDR_SZ + nlen;
+	}
+	if (i < nents || pos != end) {
+		log_msg(LOG_ERR, 0, "Invalid archive catalog, file corrupt ?");
+		goto err;
+	}
+	free(buf);
+	return (cat);
+err:
+	free(buf);
+	catalog_destroy(cat);
+	return (NULL);
+}
+
+/*
+ * Check whether a member name is the given path or lies under it. Directory
+ * members are stored with a trailing '/' and members archived by a relative
+ * path may carry a leading "./".
+ */
+int
+catalog_match(const char *name, const char *path)
+{
+	size_t len;
+
+	while (name[0] == '/' || (name[0] == '.' && name[1] == '/'))
+		name += (name[0] == '/') ? 1 : 2;
+	len = strlen(path);
+	if (strncmp(name, path, len) != 0)
+		return (0);
+	return (name[len] == '\0' || name[len] == '/');
+}
+
+/*
+ * Mark the chunks holding data of the members matching any of the paths.
+ * Returns an array with a flag per chunk in the index.
+ */
+char *
+catalog_select(catalog_t *cat, chunk_index_t *cidx, char **paths, int npaths,
+    uint64_t *nsel)
+{
+	char *sel;
+	uint64_t i;
+	int64_t c, last;
+	int j;
+
+	sel = (char *)calloc(cidx->nents > 0 ? cidx->nents : 1, 1);
+	if (sel == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (NULL);
+	}
+	*nsel = 0;
+	for (i = 0; i < cat->nents; i++) {
+		for (j = 0; j < npaths; j++) {
+			if (catalog_match(cat->names + cat->ents[i].name_off, paths[j]))
+				break;
+		}
+		if (j == npaths || cat->ents[i].data_len == 0)
+			continue;
+		c = chunk_index_find(cidx, cat->ents[i].data_off);
+		last = chunk_index_find(cidx, cat->ents[i].data_off +
+		    cat->ents[i].data_len - 1);
+		if (c < 0 || last < 0)
+			continue;
+		for (; c <= last; c++) {
+			if (!sel[c]) {
+				sel[c] = 1;
+				(*nsel)++;
+			}
+		}
+	}
+	return (sel);
+}
+
+void
+catalog_destroy(catalog_t *cat)
+{
+	if (cat == NULL)
+		return;
+	free(cat->ents);
+	free(cat->names);
+	slab_release(NULL, cat);
+}
@@ -0,0 +1,121 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_CHUNK_INDEX_H
+#define	_CHUNK_INDEX_H
+
+#include <utils.h>
+#include <crypto_utils.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Chunk index trailer format, following the zero-length end of file marker:
+ * For each chunk:
+ *     64-bit integer: Offset of the chunk header in the compressed file
+ *     64-bit integer: Offset of the chunk's data in the original file
+ *     1 Byte: Chunk flags
+ * CRC32, or HMAC if encrypting, of the entries and the next two values
+ * 64-bit integer: Number of chunks
+ * 64-bit integer: Size of the original file
+ * 8 Bytes: CIDX_MAGIC
+ */
+#define	CIDX_ENTRY_SZ	17
+#define	CIDX_FOOTER_SZ	24
+#define	CIDX_MAGIC	"PCZCIDX1"
+
+typedef struct {
+	uint64_t cmp_off;
+	uint64_t orig_off;
+	uchar_t flags;
+} chunk_index_ent_t;
+
+typedef struct {
+	chunk_index_ent_t *ents;
+	uint64_t nents, maxents;
+	uint64_t cmp_pos;
+	uint64_t orig_size;
+	uint64_t trailer_off;
+	int cksum, mac_bytes;
+	int encrypted;
+	mac_ctx_t mac;
+} chunk_index_t;
+
+/*
+ * Member catalog of an archive. It is written right before the chunk index:
+ * For each member having data:
+ *     64-bit integer: Offset of the member's data in the archive data stream
+ *     64-bit integer: Length of the member's data including tar padding
+ *     32-bit integer: Length of the pathname
+ *     Pathname bytes without a terminating NUL
+ * CRC32, or HMAC if encrypting, of the entries and the next two values
+ * 64-bit integer: Number of members
+ * 64-bit integer: Length of the entries in bytes
+ * 8 Bytes: CATL_MAGIC
+ *
+ * The data stream is what the chunk index orig_off values refer to. With
+ * Metadata Streams it holds only member data, so the chunks needed for a set
+ * of members can be found from the catalog and the chunk index.
+ */
+#define	CATL_ENTRY_HDR_SZ	20
+#define	CATL_FOOTER_SZ	24
+#define	CATL_MAGIC	"PCZCATL1"
+
+typedef struct {
+	uint64_t data_off;
+	uint64_t data_len;
+	uint64_t name_off;
+} catalog_ent_t;
+
+typedef struct {
+	catalog_ent_t *ents;
+	uint64_t nents, maxents;
+	char *names;
+	uint64_t names_len, names_max;
+} catalog_t;
+
+chunk_index_t *chunk_index_create(int cksum, int mac_bytes, crypto_ctx_t *cctx);
+int chunk_index_add(chunk_index_t *cidx, uint64_t orig_off, uint64_t cmp_len, uchar_t flags);
+int chunk_index_write(chunk_index_t *cidx, int fd, uint64_t orig_size);
+chunk_index_t *chunk_index_read(int fd, int cksum, int mac_bytes, crypto_ctx_t *cctx);
+int64_t chunk_index_find(chunk_index_t *cidx, uint64_t orig_off);
+void chunk_index_destroy(chunk_index_t *cidx);
+
+catalog_t *catalog_create(void);
+int catalog_add(catalog_t *cat, const char *path, uint64_t data_off);
+int catalog_write(catalog_t *cat, chunk_index_t *cidx, int fd, uint64_t data_size);
+catalog_t *catalog_read(int fd, chunk_index_t *cidx);
+char *catalog_select(catalog_t *cat, chunk_index_t *cidx, char **paths, int npaths,
+    uint64_t *nsel);
+int catalog_match(const char *name, const char *path);
+void catalog_destroy(catalog_t *cat);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
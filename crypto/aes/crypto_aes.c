@@ -159,6 +159,8 @@ aes_init(aes_ctx_t *ctx, uchar_t *salt, int saltlen, uchar_t *pwd, int pwd_len,
 		ctx->nonce = nonce;
 		enc_setkey(key, (ctx->keylen << 3), &(ctx->key));
 	}
+	if (ctx->gcm)
+		memcpy(ctx->gcm_key, key, ctx->keylen);
 	return (0);
 }
 
@@ -216,6 +218,84 @@ aes_decrypt(aes_ctx_t *ctx, uchar_t *ciphertext, uchar_t *plaintext, uint64_t le
 	return (0);
 }
 
+/*
+ * AES-GCM encryption and authentication in a single pass via OpenSSL, which uses
+ * AES-NI and PCLMULQDQ where available. Every chunk gets a unique 96-bit IV made
+ * from the nonce and chunk id the same way as the CTR mode counter. The tag is
+ * AEAD_TAG_LEN bytes.
+ */
+static int
+aes_gcm_crypt(aes_ctx_t *ctx, uchar_t *from, uchar_t *to, uint64_t len,
+	      uchar_t *aad, int aadlen, uchar_t *tag, uint64_t id, int enc)
+{
+	EVP_CIPHER_CTX *cctx;
+	const EVP_CIPHER *cipher;
+	uchar_t IV[12];
+	uint64_t done;
+	int outl, rv;
+
+	cctx = EVP_CIPHER_CTX_new();
+	if (cctx == NULL) {
+		log_msg(LOG_ERR, 0, "Failed to allocate GCM context\n");
+		return (-1);
+	}
+	cipher = (ctx->keylen == 16 ? EVP_aes_128_gcm() : EVP_aes_256_gcm());
+	/*
+	 * The metadata id bit goes into the otherwise zero leading word so that
+	 * metadata IVs can never equal a data chunk IV.
+	 */
+	U32_P(IV) = htonl((id & AEAD_META_ID_BIT) ? 1 : 0);
+	U64_P(IV + 4) = htonll(ctx->nonce + (id & ~AEAD_META_ID_BIT));
+
+	rv = -1;
+	if (EVP_CipherInit_ex(cctx, cipher, NULL, NULL, NULL, enc) != 1 ||
+	    EVP_CIPHER_CTX_ctrl(cctx, EVP_CTRL_GCM_SET_IVLEN, sizeof (IV), NULL) != 1 ||
+	    EVP_CipherInit_ex(cctx, NULL, NULL, ctx->gcm_key, IV, enc) != 1)
+		goto out;
+	if (!enc && EVP_CIPHER_CTX_ctrl(cctx, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_LEN, tag) != 1)
+		goto out;
+	if (EVP_CipherUpdate(cctx, NULL, &outl, aad, aadlen) != 1)
+		goto out;
+
+	/*
+	 * OpenSSL takes int lengths.
+	 */
+	done = 0;
+	while (done < len) {
+		int n = (len - done > (1U << 30) ? (1U << 30) : len - done);
+
+		if (EVP_CipherUpdate(cctx, to + done, &outl, from + done, n) != 1)
+			goto out;
+		done += n;
+	}
+	if (EVP_CipherFinal_ex(cctx, to + done, &outl) != 1)
+		goto out;
+	if (enc && EVP_CIPHER_CTX_ctrl(cctx, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_LEN, tag) != 1)
+		goto out;
+	rv = 0;
+out:
+	EVP_CIPHER_CTX_free(cctx);
+	memset(IV, 0, sizeof (IV));
+	return (rv);
+}
+
+int
+aes_gcm_encrypt(aes_ctx_t *ctx, uchar_t *plaintext, uchar_t *ciphertext, uint64_t len,
+		uchar_t *aad, int aadlen, uchar_t *tag, uint64_t id)
+{
+	return (aes_gcm_crypt(ctx, plaintext, ciphertext, len, aad, aadlen, tag, id, 1));
+}
+
+/*
+ * Returns -1 if the tag does not verify.
+ */
+int
+aes_gcm_decrypt(aes_ctx_t *ctx, uchar_t *ciphertext, uchar_t *plaintext, uint64_t len,
+		uchar_t *aad, int aadlen, uchar_t *tag, uint64_t id)
+{
+	return (aes_gcm_crypt(ctx, ciphertext, plaintext, len, aad, aadlen, tag, id, 0));
+}
+
 uchar_t *
 aes_nonce(aes_ctx_t *ctx)
 {
@@ -232,6 +312,7 @@ void
 aes_cleanup(aes_ctx_t *ctx)
 {
 	memset((void *)(&ctx->key), 0, sizeof (ctx->key));
+	memset(ctx->gcm_key, 0, sizeof (ctx->gcm_key));
 	ctx->nonce = 0;
 	free(ctx);
 }
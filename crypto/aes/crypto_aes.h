@@ -38,10 +38,15 @@
 extern "C" {
 #endif
 
+/*
+ * In GCM mode the raw key is retained since OpenSSL does its own key expansion.
+ */
 typedef struct {
 	uint64_t nonce;
 	AES_KEY key;
 	int keylen;
+	int gcm;
+	uchar_t gcm_key[MAX_KEYLEN];
 	uchar_t pkey[MAX_KEYLEN];
 } aes_ctx_t;
 
@@ -49,6 +54,10 @@ int aes_init(aes_ctx_t *ctx, uchar_t *salt, int saltlen, uchar_t *pwd, int pwd_l
 	     uint64_t nonce, int enc);
 int aes_encrypt(aes_ctx_t *ctx, uchar_t *plaintext, uchar_t *ciphertext, uint64_t len, uint64_t id);
 int aes_decrypt(aes_ctx_t *ctx, uchar_t *ciphertext, uchar_t *plaintext, uint64_t len, uint64_t id);
+int aes_gcm_encrypt(aes_ctx_t *ctx, uchar_t *plaintext, uchar_t *ciphertext, uint64_t len,
+		    uchar_t *aad, int aadlen, uchar_t *tag, uint64_t id);
+int aes_gcm_decrypt(aes_ctx_t *ctx, uchar_t *ciphertext, uchar_t *plaintext, uint64_t len,
+		    uchar_t *aad, int aadlen, uchar_t *tag, uint64_t id);
 uchar_t *aes_nonce(aes_ctx_t *ctx);
 void aes_clean_pkey(aes_ctx_t *ctx);
 void aes_cleanup(aes_ctx_t *ctx);
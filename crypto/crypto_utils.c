@@ -96,6 +96,7 @@ static struct {
 static int cksum_provider = PROVIDER_OPENSSL;
 
 extern uint64_t lzma_crc64(const uint8_t *buf, uint64_t size, uint64_t crc);
+extern uint64_t lzma_crc64_par(const uint8_t *buf, uint64_t size, uint64_t crc);
 extern uint64_t lzma_crc64_8bchk(const uint8_t *buf, uint64_t size,
 	uint64_t crc, uint64_t *cnt);
 
@@ -181,7 +182,9 @@ get_crypto_alg(char *name)
 	if (name[0] == 0 || name[1] == 0 || name[2] == 0) {
 		return (0);
 	}
-	if (strncmp(name, "AES", 3) == 0) {
+	if (strcmp(name, "AES-GCM") == 0) {
+		return (CRYPTO_ALG_AES_GCM);
+	} else if (strncmp(name, "AES", 3) == 0) {
 		return (CRYPTO_ALG_AES);
 	} else {
 		if (name[3] == 0 || name[4] == 0 || name[5] == 0 || name[6] == 0) {
@@ -216,7 +219,10 @@ compute_checksum(uchar_t *cksum_buf, int cksum, uchar_t *buf, uint64_t bytes, in
 	DEBUG_STAT_EN(if (verbose) strt = get_wtime_millis());
 	if (cksum == CKSUM_CRC64) {
 		uint64_t *ck = (uint64_t *)cksum_buf;
-		*ck = lzma_crc64(buf, bytes, 0);
+		if (!mt)
+			*ck = lzma_crc64(buf, bytes, 0);
+		else
+			*ck = lzma_crc64_par(buf, bytes, 0);
 
 	} else if (cksum == CKSUM_BLAKE256) {
 		if (!mt) {
@@ -415,6 +421,197 @@ deserialize_checksum(uchar_t *checksum, uchar_t *buf, int cksum_bytes)
 	}
 }
 
+/*
+ * State for the incremental chunk digest. This must track compute_checksum()
+ * exactly, including the choice of provider for SHA2. The OpenSSL SHA2
+ * digests go through EVP as the low level interfaces are deprecated.
+ */
+#define	CKSUM_USES_EVP(cksum) (cksum_provider == PROVIDER_OPENSSL && \
+	((cksum) == CKSUM_SHA256 || (cksum) == CKSUM_SHA512))
+
+typedef union {
+	uint64_t crc;
+	blake2b_state blake;
+	Skein_512_Ctxt_t skein;
+	EVP_MD_CTX *md;
+	SHA512_Context opt_sha512;
+	hashState keccak;
+} cksum_state_t;
+
+int
+cksum_init(cksum_ctx_t *cctx, int cksum)
+{
+	cctx->state = calloc(1, sizeof (cksum_state_t));
+	if (!cctx->state)
+		return (-1);
+	cctx->cksum = cksum;
+	if (CKSUM_USES_EVP(cksum)) {
+		((cksum_state_t *)(cctx->state))->md = EVP_MD_CTX_new();
+		if (((cksum_state_t *)(cctx->state))->md == NULL) {
+			free(cctx->state);
+			cctx->state = NULL;
+			return (-1);
+		}
+	}
+	if (cksum_reinit(cctx) != 0) {
+		cksum_cleanup(cctx);
+		return (-1);
+	}
+	return (0);
+}
+
+int
+cksum_reinit(cksum_ctx_t *cctx)
+{
+	cksum_state_t *st = (cksum_state_t *)(cctx->state);
+	int cksum = cctx->cksum;
+
+	if (cksum == CKSUM_CRC64) {
+		st->crc = 0;
+
+	} else if (cksum == CKSUM_BLAKE256) {
+		if (bdsp.blake2b_init(&st->blake, 32) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_BLAKE512) {
+		if (bdsp.blake2b_init(&st->blake, 64) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_SKEIN256) {
+		Skein_512_Init(&st->skein, 256);
+
+	} else if (cksum == CKSUM_SKEIN512) {
+		Skein_512_Init(&st->skein, 512);
+
+	} else if (cksum == CKSUM_SHA256) {
+		if (cksum_provider == PROVIDER_OPENSSL) {
+			if (EVP_DigestInit_ex(st->md, EVP_sha256(), NULL) != 1)
+				return (-1);
+		} else
+			opt_SHA512t256_Init(&st->opt_sha512);
+
+	} else if (cksum == CKSUM_SHA512) {
+		if (cksum_provider == PROVIDER_OPENSSL) {
+			if (EVP_DigestInit_ex(st->md, EVP_sha512(), NULL) != 1)
+				return (-1);
+		} else
+			opt_SHA512_Init(&st->opt_sha512);
+
+	} else if (cksum == CKSUM_KECCAK256) {
+		if (Keccak_Init(&st->keccak, 256) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_KECCAK512) {
+		if (Keccak_Init(&st->keccak, 512) != 0)
+			return (-1);
+	} else {
+		return (-1);
+	}
+	return (0);
+}
+
+int
+cksum_update(cksum_ctx_t *cctx, uchar_t *data, uint64_t len)
+{
+	cksum_state_t *st = (cksum_state_t *)(cctx->state);
+	int cksum = cctx->cksum;
+
+	if (cksum == CKSUM_CRC64) {
+		st->crc = lzma_crc64(data, len, st->crc);
+
+	} else if (cksum == CKSUM_BLAKE256 || cksum == CKSUM_BLAKE512) {
+		if (bdsp.blake2b_update(&st->blake, data, len) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_SKEIN256 || cksum == CKSUM_SKEIN512) {
+		Skein_512_Update(&st->skein, data, len);
+
+	} else if (cksum == CKSUM_SHA256) {
+		if (cksum_provider == PROVIDER_OPENSSL) {
+			if (EVP_DigestUpdate(st->md, data, len) != 1)
+				return (-1);
+		} else
+			opt_SHA512t256_Update(&st->opt_sha512, data, len);
+
+	} else if (cksum == CKSUM_SHA512) {
+		if (cksum_provider == PROVIDER_OPENSSL) {
+			if (EVP_DigestUpdate(st->md, data, len) != 1)
+				return (-1);
+		} else
+			opt_SHA512_Update(&st->opt_sha512, data, len);
+
+	} else if (cksum == CKSUM_KECCAK256 || cksum == CKSUM_KECCAK512) {
+		// Keccak takes data length in bits so we have to scale
+		while (len > KECCAK_MAX_SEG) {
+			if (Keccak_Update(&st->keccak, data, KECCAK_MAX_SEG << 3) != 0)
+				return (-1);
+			data += KECCAK_MAX_SEG;
+			len -= KECCAK_MAX_SEG;
+		}
+		if (Keccak_Update(&st->keccak, data, len << 3) != 0)
+			return (-1);
+	} else {
+		return (-1);
+	}
+	return (0);
+}
+
+int
+cksum_final(cksum_ctx_t *cctx, uchar_t *cksum_buf)
+{
+	cksum_state_t *st = (cksum_state_t *)(cctx->state);
+	int cksum = cctx->cksum;
+
+	if (cksum == CKSUM_CRC64) {
+		*((uint64_t *)cksum_buf) = st->crc;
+
+	} else if (cksum == CKSUM_BLAKE256) {
+		if (bdsp.blake2b_final(&st->blake, cksum_buf, 32) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_BLAKE512) {
+		if (bdsp.blake2b_final(&st->blake, cksum_buf, 64) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_SKEIN256 || cksum == CKSUM_SKEIN512) {
+		Skein_512_Final(&st->skein, cksum_buf);
+
+	} else if (cksum == CKSUM_SHA256) {
+		if (cksum_provider == PROVIDER_OPENSSL) {
+			if (EVP_DigestFinal_ex(st->md, cksum_buf, NULL) != 1)
+				return (-1);
+		} else
+			opt_SHA512t256_Final(&st->opt_sha512, cksum_buf);
+
+	} else if (cksum == CKSUM_SHA512) {
+		if (cksum_provider == PROVIDER_OPENSSL) {
+			if (EVP_DigestFinal_ex(st->md, cksum_buf, NULL) != 1)
+				return (-1);
+		} else
+			opt_SHA512_Final(&st->opt_sha512, cksum_buf);
+
+	} else if (cksum == CKSUM_KECCAK256 || cksum == CKSUM_KECCAK512) {
+		if (Keccak_Final(&st->keccak, cksum_buf) != 0)
+			return (-1);
+	} else {
+		return (-1);
+	}
+	return (0);
+}
+
+void
+cksum_cleanup(cksum_ctx_t *cctx)
+{
+	if (cctx->state) {
+		if (CKSUM_USES_EVP(cctx->cksum))
+			EVP_MD_CTX_free(((cksum_state_t *)(cctx->state))->md);
+		memset(cctx->state, 0, sizeof (cksum_state_t));
+		free(cctx->state);
+	}
+	cctx->state = NULL;
+	cctx->cksum = 0;
+}
+
 /*
  * Perform keyed hashing. With Skein/Blake/Keccak, HMAC is not used, rather
  * their native MAC features are used which are more optimal than HMAC.
@@ -741,7 +938,7 @@ int
 init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 	    uchar_t *salt, int saltlen, int keylen, uchar_t *nonce, int enc_dec)
 {
-	if (crypto_alg == CRYPTO_ALG_AES || crypto_alg == CRYPTO_ALG_SALSA20) {
+	if (CRYPTO_ALG_IS_AES(crypto_alg) || crypto_alg == CRYPTO_ALG_SALSA20) {
 		aes_ctx_t *actx;
 		salsa20_ctx_t *sctx;
 
@@ -749,9 +946,10 @@ init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 		actx = NULL;
 		sctx = NULL;
 
-		if (crypto_alg == CRYPTO_ALG_AES) {
+		if (CRYPTO_ALG_IS_AES(crypto_alg)) {
 			actx = (aes_ctx_t *)malloc(sizeof (aes_ctx_t));
 			actx->keylen = keylen;
+			actx->gcm = (crypto_alg == CRYPTO_ALG_AES_GCM);
 			cctx->pkey = actx->pkey;
 			aes_module_init(&proc_info);
 		} else {
@@ -799,7 +997,7 @@ init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 			/*
 			 * Zero nonce (arg #6) since it will be generated.
 			 */
-			if (crypto_alg == CRYPTO_ALG_AES) {
+			if (CRYPTO_ALG_IS_AES(crypto_alg)) {
 				if (aes_init(actx, salt, 32, pwd, pwd_len, 0, enc_dec) != 0) {
 					log_msg(LOG_ERR, 0, "Failed to initialize AES context\n");
 					return (-1);
@@ -824,7 +1022,7 @@ init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 			cctx->salt = (uchar_t *)malloc(saltlen);
 			memcpy(cctx->salt, salt, saltlen);
 
-			if (crypto_alg == CRYPTO_ALG_AES) {
+			if (CRYPTO_ALG_IS_AES(crypto_alg)) {
 				if (aes_init(actx, cctx->salt, saltlen, pwd, pwd_len, U64_P(nonce),
 				    enc_dec) != 0) {
 					log_msg(LOG_ERR, 0, "Failed to initialize AES context\n");
@@ -837,7 +1035,7 @@ init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 				}
 			}
 		}
-		if (crypto_alg == CRYPTO_ALG_AES) {
+		if (CRYPTO_ALG_IS_AES(crypto_alg)) {
 			cctx->crypto_ctx = actx;
 		} else {
 			cctx->crypto_ctx = sctx;
@@ -875,10 +1073,33 @@ crypto_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes, uint6
 	return (0);
 }
 
+/*
+ * Encrypt or decrypt and authenticate a chunk in one pass with an AEAD algorithm.
+ * The aad bytes are authenticated but not encrypted. When encrypting the tag of
+ * AEAD_TAG_LEN bytes is returned in tag. When decrypting it is verified against
+ * tag and -1 is returned on a mismatch.
+ */
+int
+crypto_aead_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes,
+		uchar_t *aad, int aadlen, uchar_t *tag, uint64_t id)
+{
+	if (cctx->crypto_alg == CRYPTO_ALG_AES_GCM) {
+		if (cctx->enc_dec == ENCRYPT_FLAG) {
+			return (aes_gcm_encrypt((aes_ctx_t *)(cctx->crypto_ctx), from, to, bytes,
+			    aad, aadlen, tag, id));
+		} else {
+			return (aes_gcm_decrypt((aes_ctx_t *)(cctx->crypto_ctx), from, to, bytes,
+			    aad, aadlen, tag, id));
+		}
+	}
+	log_msg(LOG_ERR, 0, "Not an AEAD algorithm code: %d\n", cctx->crypto_alg);
+	return (-1);
+}
+
 uchar_t *
 crypto_nonce(crypto_ctx_t *cctx)
 {
-	if (cctx->crypto_alg == CRYPTO_ALG_AES) {
+	if (CRYPTO_ALG_IS_AES(cctx->crypto_alg)) {
 		return (aes_nonce((aes_ctx_t *)(cctx->crypto_ctx)));
 	}
 	return (salsa20_nonce((salsa20_ctx_t *)(cctx->crypto_ctx)));
@@ -887,7 +1108,7 @@ crypto_nonce(crypto_ctx_t *cctx)
 void
 crypto_clean_pkey(crypto_ctx_t *cctx)
 {
-	if (cctx->crypto_alg == CRYPTO_ALG_AES) {
+	if (CRYPTO_ALG_IS_AES(cctx->crypto_alg)) {
 		aes_clean_pkey((aes_ctx_t *)(cctx->crypto_ctx));
 	} else {
 		salsa20_clean_pkey((salsa20_ctx_t *)(cctx->crypto_ctx));
@@ -898,7 +1119,7 @@ crypto_clean_pkey(crypto_ctx_t *cctx)
 void
 cleanup_crypto(crypto_ctx_t *cctx)
 {
-	if (cctx->crypto_alg == CRYPTO_ALG_AES) {
+	if (CRYPTO_ALG_IS_AES(cctx->crypto_alg)) {
 		aes_cleanup((aes_ctx_t *)(cctx->crypto_ctx));
 	} else {
 		salsa20_cleanup((salsa20_ctx_t *)(cctx->crypto_ctx));
@@ -56,6 +56,17 @@ extern "C" {
 #define	DECRYPT_FLAG		0
 #define	CRYPTO_ALG_AES		0x10
 #define	CRYPTO_ALG_SALSA20	0x20
+#define	CRYPTO_ALG_AES_GCM	0x30
+#define	CRYPTO_ALG_IS_AES(a)	((a) == CRYPTO_ALG_AES || (a) == CRYPTO_ALG_AES_GCM)
+#define	CRYPTO_ALG_IS_AEAD(a)	((a) == CRYPTO_ALG_AES_GCM)
+#define	AEAD_TAG_LEN		16
+
+/*
+ * Archive metadata chunks are numbered separately from data chunks. Their
+ * AEAD ids carry this bit so that the two never share a GCM IV.
+ */
+#define	AEAD_META_ID_BIT	(1ULL << 63)
+#define	AEAD_META_ID(id)	((uint64_t)(id) | AEAD_META_ID_BIT)
 #define	MAX_SALTLEN		64
 #define	MAX_NONCE		32
 
@@ -71,6 +82,15 @@ typedef struct {
 	int keylen;
 } crypto_ctx_t;
 
+/*
+ * Incremental form of the chunk digest. Feeding the same bytes in any number
+ * of pieces yields the same value as compute_checksum() with mt == 0.
+ */
+typedef struct cksum_ctx {
+	void *state;
+	int cksum;
+} cksum_ctx_t;
+
 typedef struct {
 	void *mac_ctx;
 	void *mac_ctx_reinit;
@@ -86,6 +106,11 @@ int get_checksum_props(const char *name, int *cksum, int *cksum_bytes,
 		      int *mac_bytes, int accept_compatible);
 void serialize_checksum(uchar_t *checksum, uchar_t *buf, int cksum_bytes);
 void deserialize_checksum(uchar_t *checksum, uchar_t *buf, int cksum_bytes);
+int cksum_init(cksum_ctx_t *cctx, int cksum);
+int cksum_reinit(cksum_ctx_t *cctx);
+int cksum_update(cksum_ctx_t *cctx, uchar_t *data, uint64_t len);
+int cksum_final(cksum_ctx_t *cctx, uchar_t *cksum_buf);
+void cksum_cleanup(cksum_ctx_t *cctx);
 
 /*
  * Encryption related functions.
@@ -93,6 +118,8 @@ void deserialize_checksum(uchar_t *checksum, uchar_t *buf, int cksum_bytes);
 int init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 	       uchar_t *salt, int saltlen, int keylen, uchar_t *nonce, int enc_dec);
 int crypto_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes, uint64_t id);
+int crypto_aead_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes,
+		    uchar_t *aad, int aadlen, uchar_t *tag, uint64_t id);
 uchar_t *crypto_nonce(crypto_ctx_t *cctx);
 void crypto_clean_pkey(crypto_ctx_t *cctx);
 void cleanup_crypto(crypto_ctx_t *cctx);
@@ -22,6 +22,7 @@
  * moinakg@belenix.org, http://moinakg.wordpress.com/
  */
 
+#include <math.h>
 #include "utils.h"
 #include "analyzer.h"
 
@@ -29,6 +30,10 @@
 #define	THIRTY_PCT(x)	((((double)x)/10) * 3)
 #define	TEN_PCT(x)	(((double)x)/10)
 
+#define	PROBE_SAMPLES	8
+#define	PROBE_SAMPLE_SZ	8192
+#define	PROBE_HASH_BITS	12
+
 void
 analyze_buffer(void *src, uint64_t srclen, analyzer_ctx_t *actx)
 {
@@ -123,3 +128,81 @@ analyze_buffer_simple(void *src, uint64_t srclen)
 	return (btype);
 }
 
+
+/*
+ * Estimate the compressed size of one sample as a percentage. Bytes covered by
+ * repeats of earlier 4-byte sequences are taken out as an LZ pass would and the
+ * rest is assumed to code at the sample's order-0 entropy.
+ */
+static double
+probe_sample(uchar_t *src, uint32_t len)
+{
+	uint32_t freq[256], i, covered;
+	uint16_t htab[1 << PROBE_HASH_BITS];
+	double ent, p;
+
+	memset(freq, 0, sizeof (freq));
+	memset(htab, 0, sizeof (htab));
+	for (i = 0; i < len; i++)
+		freq[src[i]]++;
+	ent = 0;
+	for (i = 0; i < 256; i++) {
+		if (freq[i]) {
+			p = (double)freq[i] / len;
+			ent -= p * log2(p);
+		}
+	}
+
+	covered = 0;
+	i = 0;
+	while (i + 4 <= len) {
+		uint32_t h, cand;
+
+		h = (U32_P(src + i) * 2654435761U) >> (32 - PROBE_HASH_BITS);
+		cand = htab[h];
+		htab[h] = i + 1;
+		if (cand && U32_P(src + cand - 1) == U32_P(src + i)) {
+			uint32_t l = 4;
+
+			cand--;
+			while (i + l < len && src[cand + l] == src[i + l])
+				l++;
+			covered += l;
+			i += l;
+		} else {
+			i++;
+		}
+	}
+	return ((1.0 - (double)covered / len) * ent * 100.0 / 8.0);
+}
+
+/*
+ * Quick compressibility probe over a few evenly spaced samples of the buffer.
+ * Returns the lowest estimated compressed size percentage of any sample, so a
+ * single compressible region is enough to give a low value.
+ */
+int
+analyze_compressibility(void *src, uint64_t srclen)
+{
+	uchar_t *src1 = (uchar_t *)src;
+	uint64_t step, i;
+	double pct, minpct;
+
+	if (srclen == 0)
+		return (100);
+
+	if (srclen <= PROBE_SAMPLES * PROBE_SAMPLE_SZ) {
+		if (srclen > UINT16_MAX)
+			srclen = UINT16_MAX;
+		return ((int)probe_sample(src1, srclen));
+	}
+
+	minpct = 100;
+	step = srclen / PROBE_SAMPLES;
+	for (i = 0; i < PROBE_SAMPLES; i++) {
+		pct = probe_sample(src1 + i * step, PROBE_SAMPLE_SZ);
+		if (pct < minpct)
+			minpct = pct;
+	}
+	return ((int)minpct);
+}
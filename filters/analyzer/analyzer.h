@@ -41,6 +41,7 @@ typedef struct _analyzer_ctx {
 
 void analyze_buffer(void *src, uint64_t srclen, analyzer_ctx_t *actx);
 int analyze_buffer_simple(void *src, uint64_t srclen);
+int analyze_compressibility(void *src, uint64_t srclen);
 
 #ifdef  __cplusplus
 }
@@ -719,3 +719,22 @@ int LZ4_compressHC(const char* source,
 }
 
 
+int LZ4_sizeofStateHC(void)
+{
+	return sizeof(LZ4HC_Data_Structure);
+}
+
+
+int LZ4_compressHC_withStateHC(void* state,
+				 const char* source,
+				 char* dest,
+				 int isize)
+{
+	LZ4HC_Data_Structure* ctx = (LZ4HC_Data_Structure*)state;
+
+	if (((size_t)state) & (sizeof(void*)-1)) return 0;   // state must be aligned
+	LZ4HC_Init (ctx, (const BYTE*)source);
+	return LZ4_compressHCCtx(ctx, source, dest, isize);
+}
+
+
@@ -75,6 +75,19 @@ LZ4_compressHC :
 */
 
 
+int LZ4_sizeofStateHC(void);
+int LZ4_compressHC_withStateHC (void* state, const char* source, char* dest, int isize);
+
+/*
+LZ4_compressHC_withStateHC :
+	Same as LZ4_compressHC() but the working tables are provided by the caller
+	instead of being allocated on every call. 'state' must be at least
+	LZ4_sizeofStateHC() bytes and pointer aligned. It is reset on every call,
+	so one state can be reused for any number of independent blocks.
+	return : the number of bytes in compressed buffer dest, or 0 if state is misaligned
+*/
+
+
 /* Note :
 Decompression functions are provided within regular LZ4 source code (see "lz4.h") (BSD license)
 */
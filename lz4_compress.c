@@ -36,8 +36,16 @@
 
 #define	LZ4_MAX_CHUNK	2147450621L
 
+/*
+ * Per-thread compression state. The HC match tables and the level 2
+ * intermediate buffer live as long as the thread and are only reset between
+ * chunks. The fast LZ4 path keeps its small hash table on the stack.
+ */
 struct lz4_params {
 	int level;
+	void *hc_state;
+	uchar_t *dst2;
+	uint64_t dst2sz;
 };
 
 void
@@ -75,10 +83,25 @@ lz4_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		return (1);
 	}
 	lzdat = (struct lz4_params *)slab_alloc(NULL, sizeof (struct lz4_params));
+	if (!lzdat) {
+		log_msg(LOG_ERR, 0, "LZ4: Out of memory\n");
+		return (1);
+	}
 
 	lev = *level;
 	if (lev > 3) lev = 3;
 	lzdat->level = lev;
+	lzdat->hc_state = NULL;
+	lzdat->dst2 = NULL;
+	lzdat->dst2sz = 0;
+	if (op == COMPRESS && lev > 1) {
+		lzdat->hc_state = slab_alloc(NULL, LZ4_sizeofStateHC());
+		if (!lzdat->hc_state) {
+			log_msg(LOG_ERR, 0, "LZ4: Out of memory\n");
+			slab_free(NULL, lzdat);
+			return (1);
+		}
+	}
 	*data = lzdat;
 
 	if (*level > 9) *level = 9;
@@ -91,6 +114,10 @@ lz4_deinit(void **data)
 	struct lz4_params *lzdat = (struct lz4_params *)(*data);
 
 	if (lzdat) {
+		if (lzdat->hc_state)
+			slab_free(NULL, lzdat->hc_state);
+		if (lzdat->dst2)
+			slab_free(NULL, lzdat->dst2);
 		slab_free(NULL, lzdat);
 	}
 	*data = NULL;
@@ -104,7 +131,7 @@ lz4_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	int rv;
 	struct lz4_params *lzdat = (struct lz4_params *)data;
 	int _srclen = srclen;
-	uchar_t *dst2;
+	uint64_t sz;
 
 	if (lzdat->level == 1) {
 		rv = LZ4_compress((const char *)src, (char *)dst, _srclen);
@@ -114,16 +141,27 @@ lz4_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 		if (rv == 0 || rv > *dstlen) {
 			return (-1);
 		}
-		dst2 = (uchar_t *)slab_alloc(NULL, rv + sizeof (int) + LZ4_compressBound(rv));
-		*((int *)dst2) = htonl(rv);
-		rv = LZ4_compressHC((const char *)dst, (char *)(dst2 + sizeof (int)), rv);
+		sz = rv + sizeof (int) + LZ4_compressBound(rv);
+		if (sz > lzdat->dst2sz) {
+			if (lzdat->dst2)
+				slab_free(NULL, lzdat->dst2);
+			lzdat->dst2 = (uchar_t *)slab_alloc(NULL, sz);
+			if (!lzdat->dst2) {
+				lzdat->dst2sz = 0;
+				return (-1);
+			}
+			lzdat->dst2sz = sz;
+		}
+		*((int *)lzdat->dst2) = htonl(rv);
+		rv = LZ4_compressHC_withStateHC(lzdat->hc_state, (const char *)dst,
+		    (char *)(lzdat->dst2 + sizeof (int)), rv);
 		if (rv != 0) {
 			rv += sizeof (int);
-			memcpy(dst, dst2, rv);
+			memcpy(dst, lzdat->dst2, rv);
 		}
-		slab_free(NULL, dst2);
 	} else {
-		rv = LZ4_compressHC((const char *)src, (char *)dst, _srclen);
+		rv = LZ4_compressHC_withStateHC(lzdat->hc_state, (const char *)src,
+		    (char *)dst, _srclen);
 	}
 	if (rv == 0) {
 		return (-1);
@@ -48,8 +48,10 @@ extern const uint32_t lzma_crc32_table[8][256];
 // If you make any changes, do some bench marking! Seemingly unrelated
 // changes can very easily ruin the performance (and very probably is
 // very compiler dependent).
+// lzma_crc32() itself lives in crc_clmul.c and dispatches between this
+// table driven version and the carry-less multiply folding kernels.
 extern uint32_t
-lzma_crc32(const uint8_t *buf, size_t size, uint32_t crc)
+lzma_crc32_generic(const uint8_t *buf, size_t size, uint32_t crc)
 {
 	crc = ~crc;
 
@@ -50,8 +50,10 @@
 extern const uint64_t lzma_crc64_table[4][256];
 
 // See the comments in crc32_fast.c. They aren't duplicated here.
+// lzma_crc64() itself lives in crc_clmul.c and dispatches between this
+// table driven version and the carry-less multiply folding kernels.
 extern uint64_t
-lzma_crc64(const uint8_t *buf, size_t size, uint64_t crc)
+lzma_crc64_generic(const uint8_t *buf, size_t size, uint64_t crc)
 {
 	crc = ~crc;
 
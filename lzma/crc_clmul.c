@@ -0,0 +1,225 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *      
+ */
+
+/*
+ * Runtime selection of the CRC32/CRC64 kernels plus CRC64 combination which
+ * allows a buffer to be checksummed in independent slices.
+ */
+#include <stdlib.h>
+#include "crc_clmul.h"
+
+/*
+ * ECMA-182 CRC64 as used by xz and CRC32 (IEEE 802.3) in normal form. The
+ * reflected CRC64 polynomial is needed for combining.
+ */
+#define	CRC64_POLY	0x42F0E1EBA9EA3693ULL
+#define	CRC64_POLY_REFL	0xC96C5795D7870F42ULL
+#define	CRC32_POLY	0x04C11DB7ULL
+
+/*
+ * Below this size the overhead of dispatching to multiple threads outweighs
+ * the gains.
+ */
+#define	CRC64_PAR_SLICES	4
+#define	CRC64_PAR_MIN		(1024 * 1024)
+
+static crc_fold_func_t crc_fold = NULL;
+static crc_fold_consts_t crc64_consts, crc32_consts;
+static uint64_t crc64_x2n_table[64];
+
+/*
+ * Compute x^n mod P and return it bit-reversed within a 64-bit lane, ie.
+ * the coefficient of x^i lands in bit 63 - i.
+ */
+static uint64_t
+xn_mod_p(unsigned int n, uint64_t poly, int width)
+{
+	uint64_t r, top, mask, refl;
+	int i;
+
+	top = (uint64_t)1 << (width - 1);
+	mask = (width == 64) ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+	r = 1;
+	while (n--) {
+		int carry = ((r & top) != 0);
+
+		r = (r << 1) & mask;
+		if (carry)
+			r ^= poly;
+	}
+
+	refl = 0;
+	for (i = 0; i < width; i++) {
+		if (r & ((uint64_t)1 << i))
+			refl |= (uint64_t)1 << (63 - i);
+	}
+	return (refl);
+}
+
+static void
+init_fold_consts(crc_fold_consts_t *k, uint64_t poly, int width)
+{
+	k->k128[0] = xn_mod_p(128 + 63, poly, width);
+	k->k128[1] = xn_mod_p(128 - 1, poly, width);
+	k->k256[0] = xn_mod_p(256 + 63, poly, width);
+	k->k256[1] = xn_mod_p(256 - 1, poly, width);
+	k->k512[0] = xn_mod_p(512 + 63, poly, width);
+	k->k512[1] = xn_mod_p(512 - 1, poly, width);
+	k->k1024[0] = xn_mod_p(1024 + 63, poly, width);
+	k->k1024[1] = xn_mod_p(1024 - 1, poly, width);
+}
+
+/*
+ * Multiply a and b modulo the reflected CRC64 polynomial. Same approach as
+ * zlib's crc32_combine().
+ */
+static uint64_t
+multmodp64(uint64_t a, uint64_t b)
+{
+	uint64_t m, p;
+
+	m = (uint64_t)1 << 63;
+	p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC64_POLY_REFL : b >> 1;
+	}
+	return (p);
+}
+
+/*
+ * Return x^(n * 2^k) mod P.
+ */
+static uint64_t
+x2nmodp64(uint64_t n, unsigned int k)
+{
+	uint64_t p;
+
+	p = (uint64_t)1 << 63;
+	while (n) {
+		if (n & 1)
+			p = multmodp64(crc64_x2n_table[k & 63], p);
+		n >>= 1;
+		k++;
+	}
+	return (p);
+}
+
+void
+lzma_crc_module_init(void)
+{
+	uint64_t p;
+	int n;
+
+	p = (uint64_t)1 << 62;	/* x^1 */
+	crc64_x2n_table[0] = p;
+	for (n = 1; n < 64; n++)
+		crc64_x2n_table[n] = p = multmodp64(p, p);
+
+#ifdef	__x86_64__
+	if (!proc_info.pclmul_avail || proc_info.sse_level < 4)
+		return;
+
+	init_fold_consts(&crc64_consts, CRC64_POLY, 64);
+	init_fold_consts(&crc32_consts, CRC32_POLY, 32);
+	if (proc_info.vpclmul_avail && proc_info.avx_level >= 2)
+		crc_fold = crc_fold_vpclmul;
+	else
+		crc_fold = crc_fold_pclmul;
+#endif
+}
+
+/*
+ * Folding leaves a 16-byte remainder which, when run through the tables from
+ * a zero register, yields the same state as the consumed prefix. The tail is
+ * then handled by the tables as usual.
+ */
+uint64_t
+lzma_crc64(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	uint8_t rem[16];
+	size_t done;
+
+	if (crc_fold == NULL || size < CRC_FOLD_MIN)
+		return (lzma_crc64_generic(buf, size, crc));
+
+	done = crc_fold(buf, size, ~crc, &crc64_consts, rem);
+	crc = lzma_crc64_generic(rem, 16, ~(uint64_t)0);
+	return (lzma_crc64_generic(buf + done, size - done, crc));
+}
+
+uint32_t
+lzma_crc32(const uint8_t *buf, size_t size, uint32_t crc)
+{
+	uint8_t rem[16];
+	size_t done;
+
+	if (crc_fold == NULL || size < CRC_FOLD_MIN)
+		return (lzma_crc32_generic(buf, size, crc));
+
+	done = crc_fold(buf, size, (uint32_t)~crc, &crc32_consts, rem);
+	crc = lzma_crc32_generic(rem, 16, ~(uint32_t)0);
+	return (lzma_crc32_generic(buf + done, size - done, crc));
+}
+
+uint64_t
+lzma_crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2)
+{
+	return (multmodp64(x2nmodp64(len2, 3), crc1) ^ crc2);
+}
+
+uint64_t
+lzma_crc64_par(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	uint64_t part[CRC64_PAR_SLICES];
+	size_t slice;
+	int i;
+
+	if (size < CRC64_PAR_MIN)
+		return (lzma_crc64(buf, size, crc));
+
+	slice = size / CRC64_PAR_SLICES;
+#if defined(_OPENMP)
+#	pragma omp parallel for
+#endif
+	for (i = 0; i < CRC64_PAR_SLICES; i++) {
+		size_t len = (i == CRC64_PAR_SLICES - 1) ? size - slice * i : slice;
+
+		part[i] = lzma_crc64(buf + slice * i, len, i == 0 ? crc : 0);
+	}
+
+	crc = part[0];
+	for (i = 1; i < CRC64_PAR_SLICES; i++) {
+		size_t len = (i == CRC64_PAR_SLICES - 1) ? size - slice * i : slice;
+
+		crc = lzma_crc64_combine(crc, part[i], len);
+	}
+	return (crc);
+}
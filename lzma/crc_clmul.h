@@ -0,0 +1,63 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *      
+ */
+
+#ifndef __CRC_CLMUL_H__
+#define	__CRC_CLMUL_H__
+
+#include <lzma_crc.h>
+
+/*
+ * Folding constants for a reflected CRC of width <= 64 bits. Each pair holds
+ * bit-reversed { x^(D+63) mod P, x^(D-1) mod P } for a fold distance of D
+ * bits and is loaded as a single 128-bit lane.
+ */
+typedef struct {
+	uint64_t k128[2];
+	uint64_t k256[2];
+	uint64_t k512[2];
+	uint64_t k1024[2];
+} crc_fold_consts_t;
+
+/*
+ * Minimum buffer length for which folding is used. Shorter buffers are
+ * cheaper with the tables.
+ */
+#define	CRC_FOLD_MIN	128
+
+/*
+ * Fold buf into a single 16-byte remainder written to rem. The CRC register
+ * (already inverted) is XORed into the first bytes of the message. Returns
+ * the number of bytes consumed, always a multiple of 16. size must be at
+ * least 64.
+ */
+typedef size_t (*crc_fold_func_t)(const uint8_t *buf, size_t size, uint64_t reg,
+	const crc_fold_consts_t *k, uint8_t *rem);
+
+extern size_t crc_fold_pclmul(const uint8_t *buf, size_t size, uint64_t reg,
+	const crc_fold_consts_t *k, uint8_t *rem);
+extern size_t crc_fold_vpclmul(const uint8_t *buf, size_t size, uint64_t reg,
+	const crc_fold_consts_t *k, uint8_t *rem);
+
+#endif
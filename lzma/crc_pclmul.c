@@ -0,0 +1,89 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *      
+ */
+
+/*
+ * CRC folding with the PCLMULQDQ carry-less multiply instruction. This is the
+ * technique described in Intel's "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction" paper. The same kernel serves both CRC32 and
+ * CRC64 since only the folding constants depend on the polynomial. The final
+ * 16-byte remainder is reduced by the caller using the tables which avoids a
+ * per-polynomial Barrett reduction step.
+ *
+ * This file is compiled with -msse4.1 -mpclmul and must only be called when
+ * the CPU supports PCLMULQDQ.
+ */
+#ifdef	__x86_64__
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#include "crc_clmul.h"
+
+static inline __m128i
+fold128(__m128i x, __m128i k, __m128i next)
+{
+	__m128i lo, hi;
+
+	lo = _mm_clmulepi64_si128(x, k, 0x00);
+	hi = _mm_clmulepi64_si128(x, k, 0x11);
+	return (_mm_xor_si128(_mm_xor_si128(lo, hi), next));
+}
+
+size_t
+crc_fold_pclmul(const uint8_t *buf, size_t size, uint64_t reg,
+    const crc_fold_consts_t *k, uint8_t *rem)
+{
+	__m128i x0, x1, x2, x3, kf;
+	size_t done;
+
+	x0 = _mm_loadu_si128((const __m128i *)buf);
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+	x0 = _mm_xor_si128(x0, _mm_cvtsi64_si128((long long)reg));
+	done = 64;
+
+	/*
+	 * Four independent folding streams to hide the multiply latency.
+	 */
+	kf = _mm_loadu_si128((const __m128i *)k->k512);
+	while (size - done >= 64) {
+		x0 = fold128(x0, kf, _mm_loadu_si128((const __m128i *)(buf + done)));
+		x1 = fold128(x1, kf, _mm_loadu_si128((const __m128i *)(buf + done + 16)));
+		x2 = fold128(x2, kf, _mm_loadu_si128((const __m128i *)(buf + done + 32)));
+		x3 = fold128(x3, kf, _mm_loadu_si128((const __m128i *)(buf + done + 48)));
+		done += 64;
+	}
+
+	kf = _mm_loadu_si128((const __m128i *)k->k128);
+	x1 = fold128(x0, kf, x1);
+	x2 = fold128(x1, kf, x2);
+	x3 = fold128(x2, kf, x3);
+	while (size - done >= 16) {
+		x3 = fold128(x3, kf, _mm_loadu_si128((const __m128i *)(buf + done)));
+		done += 16;
+	}
+	_mm_storeu_si128((__m128i *)rem, x3);
+	return (done);
+}
+#endif
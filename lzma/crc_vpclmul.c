@@ -0,0 +1,102 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *      
+ */
+
+/*
+ * 256-bit variant of the folding in crc_pclmul.c using VPCLMULQDQ. Each ymm
+ * register carries two 128-bit folding lanes so one iteration consumes 128
+ * bytes.
+ *
+ * This file is compiled with -mavx2 -mpclmul -mvpclmulqdq and must only be
+ * called when the CPU supports both AVX2 and VPCLMULQDQ.
+ */
+#ifdef	__x86_64__
+#include <immintrin.h>
+#include "crc_clmul.h"
+
+static inline __m128i
+fold128(__m128i x, __m128i k, __m128i next)
+{
+	__m128i lo, hi;
+
+	lo = _mm_clmulepi64_si128(x, k, 0x00);
+	hi = _mm_clmulepi64_si128(x, k, 0x11);
+	return (_mm_xor_si128(_mm_xor_si128(lo, hi), next));
+}
+
+static inline __m256i
+fold256(__m256i x, __m256i k, __m256i next)
+{
+	__m256i lo, hi;
+
+	lo = _mm256_clmulepi64_epi128(x, k, 0x00);
+	hi = _mm256_clmulepi64_epi128(x, k, 0x11);
+	return (_mm256_xor_si256(_mm256_xor_si256(lo, hi), next));
+}
+
+size_t
+crc_fold_vpclmul(const uint8_t *buf, size_t size, uint64_t reg,
+    const crc_fold_consts_t *k, uint8_t *rem)
+{
+	__m256i y0, y1, y2, y3, kf;
+	__m128i x, k1;
+	size_t done;
+
+	if (size < 256)
+		return (crc_fold_pclmul(buf, size, reg, k, rem));
+
+	y0 = _mm256_loadu_si256((const __m256i *)buf);
+	y1 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+	y2 = _mm256_loadu_si256((const __m256i *)(buf + 64));
+	y3 = _mm256_loadu_si256((const __m256i *)(buf + 96));
+	y0 = _mm256_xor_si256(y0, _mm256_set_epi64x(0, 0, 0, (long long)reg));
+	done = 128;
+
+	kf = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)k->k1024));
+	while (size - done >= 128) {
+		y0 = fold256(y0, kf, _mm256_loadu_si256((const __m256i *)(buf + done)));
+		y1 = fold256(y1, kf, _mm256_loadu_si256((const __m256i *)(buf + done + 32)));
+		y2 = fold256(y2, kf, _mm256_loadu_si256((const __m256i *)(buf + done + 64)));
+		y3 = fold256(y3, kf, _mm256_loadu_si256((const __m256i *)(buf + done + 96)));
+		done += 128;
+	}
+
+	kf = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)k->k256));
+	y1 = fold256(y0, kf, y1);
+	y2 = fold256(y1, kf, y2);
+	y3 = fold256(y2, kf, y3);
+
+	/*
+	 * The low lane precedes the high lane in the message.
+	 */
+	k1 = _mm_loadu_si128((const __m128i *)k->k128);
+	x = fold128(_mm256_castsi256_si128(y3), k1, _mm256_extracti128_si256(y3, 1));
+	while (size - done >= 16) {
+		x = fold128(x, k1, _mm_loadu_si128((const __m128i *)(buf + done)));
+		done += 16;
+	}
+	_mm_storeu_si128((__m128i *)rem, x);
+	return (done);
+}
+#endif
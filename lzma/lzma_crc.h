@@ -30,6 +30,26 @@
 
 uint64_t lzma_crc64(const uint8_t *buf, size_t size, uint64_t crc);
 uint32_t lzma_crc32(const uint8_t *buf, size_t size, uint32_t crc);
+uint64_t lzma_crc64_generic(const uint8_t *buf, size_t size, uint64_t crc);
+uint32_t lzma_crc32_generic(const uint8_t *buf, size_t size, uint32_t crc);
+
+/*
+ * Select the CRC kernels based on proc_info. Until this is called the table
+ * driven versions are used.
+ */
+void lzma_crc_module_init(void);
+
+/*
+ * Given crc1 = CRC64(A) and crc2 = CRC64(B) return CRC64(A || B) where len2
+ * is the length of B in bytes.
+ */
+uint64_t lzma_crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
+
+/*
+ * Compute the CRC64 of a large buffer in parallel slices. The result is
+ * identical to lzma_crc64(buf, size, crc).
+ */
+uint64_t lzma_crc64_par(const uint8_t *buf, size_t size, uint64_t crc);
 
 
 #endif
\ No newline at end of file
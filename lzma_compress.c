@@ -34,8 +34,18 @@
 
 #define	SZ_ERROR_DESTLEN	100
 #define	LZMA_DEFAULT_DICT	(1 << 24)
+#define	LZMA_RC_INIT_SIZE	5
 
-CLzmaEncProps *p = NULL;
+/*
+ * Per-thread codec state. The encoder handle keeps its match finder, range
+ * coder and literal probability buffers across chunks and the decoder keeps
+ * its probability array. They are only reallocated if the sizes change.
+ */
+struct lzma_ctx {
+	CLzmaEncProps props;
+	CLzmaEncHandle enc;
+	CLzmaDec dec;
+};
 
 static ISzAlloc g_Alloc = {
 	slab_alloc,
@@ -73,75 +83,100 @@ lzma_props(algo_props_t *data, int level, uint64_t chunksize) {
 		data->deltac_min_distance = (EIGHTM * 32);
 }
 
-/*
- * The two functions below are not thread-safe, by design.
- */
-int
-lzma_init(void **data, int *level, int nthreads, uint64_t chunksize,
-	  int file_version, compress_op_t op)
+static void
+lzma_set_props(CLzmaEncProps *p, int *level, int nthreads)
 {
-	if (!p && op == COMPRESS) {
-		p = (CLzmaEncProps *)slab_alloc(NULL, sizeof (CLzmaEncProps));
-		LzmaEncProps_Init(p);
+	LzmaEncProps_Init(p);
+	/*
+	 * Set the dictionary size and fast bytes based on level.
+	 */
+	if (*level < 8) {
 		/*
-		 * Set the dictionary size and fast bytes based on level.
+		 * Choose a dict size with a balance between perf and
+		 * compression.
 		 */
-		if (*level < 8) {
-			/*
-			 * Choose a dict size with a balance between perf and
-			 * compression.
-			 */
-			p->dictSize = LZMA_DEFAULT_DICT;
-
-		} else {
-			/*
-			 * Let LZMA determine best dict size.
-			 */
-			p->dictSize = 0;
-		}
+		p->dictSize = LZMA_DEFAULT_DICT;
+
+	} else {
+		/*
+		 * Let LZMA determine best dict size.
+		 */
+		p->dictSize = 0;
+	}
 
-		/* Determine the fast bytes value and also adjust dict size further. */
-		if (*level < 7) {
-			p->fb = 32;
+	/* Determine the fast bytes value and also adjust dict size further. */
+	if (*level < 7) {
+		p->fb = 32;
 
-		} else if (*level < 10) {
-			p->fb = 64;
+	} else if (*level < 10) {
+		p->fb = 64;
 
-		} else if (*level == 11) {
-			p->fb = 64;
-			p->mc = 128;
+	} else if (*level == 11) {
+		p->fb = 64;
+		p->mc = 128;
 
-		} else if (*level == 12) {
-			p->fb = 128;
-			p->mc = 256;
+	} else if (*level == 12) {
+		p->fb = 128;
+		p->mc = 256;
 
-		} else if (*level == 13) {
-			p->fb = 64;
-			p->mc = 128;
-			p->dictSize = (1 << 27);
+	} else if (*level == 13) {
+		p->fb = 64;
+		p->mc = 128;
+		p->dictSize = (1 << 27);
+
+	} else if (*level == 14) {
+		p->fb = 128;
+		p->mc = 256;
+		p->dictSize = (1 << 28);
+	}
+	if (*level > 9) *level = 9;
+	p->level = *level;
+	p->numThreads = nthreads;
+	LzmaEncProps_Normalize(p);
+}
 
-		} else if (*level == 14) {
-			p->fb = 128;
-			p->mc = 256;
-			p->dictSize = (1 << 28);
+/*
+ * Called once per thread. The encoder is created here and then reused for
+ * every chunk compressed by that thread.
+ */
+int
+lzma_init(void **data, int *level, int nthreads, uint64_t chunksize,
+	  int file_version, compress_op_t op)
+{
+	struct lzma_ctx *ctx;
+
+	ctx = (struct lzma_ctx *)slab_alloc(NULL, sizeof (struct lzma_ctx));
+	if (!ctx) {
+		log_msg(LOG_ERR, 0, "LZMA: Out of memory\n");
+		return (-1);
+	}
+	ctx->enc = NULL;
+	LzmaDec_Construct(&ctx->dec);
+	if (op == COMPRESS) {
+		lzma_set_props(&ctx->props, level, nthreads);
+		slab_cache_add(ctx->props.litprob_sz);
+		ctx->enc = LzmaEnc_Create(&g_Alloc);
+		if (!ctx->enc) {
+			log_msg(LOG_ERR, 0, "LZMA: Out of memory\n");
+			slab_release(NULL, ctx);
+			return (-1);
 		}
-		if (*level > 9) *level = 9;
-		p->level = *level;
-		p->numThreads = nthreads;
-		LzmaEncProps_Normalize(p);
-		slab_cache_add(p->litprob_sz);
 	}
 	if (*level > 9) *level = 9;
-	*data = p;
+	*data = ctx;
 	return (0);
 }
 
 int
 lzma_deinit(void **data)
 {
-	if (p) {
-		slab_release(NULL, p);
-		p = NULL;
+	struct lzma_ctx *ctx = (struct lzma_ctx *)(*data);
+
+	if (ctx) {
+		if (ctx->enc)
+			LzmaEnc_Destroy(ctx->enc, &g_Alloc, &g_Alloc);
+		LzmaDec_FreeProbs(&ctx->dec, &g_Alloc);
+		slab_release(NULL, ctx);
 	}
 	*data = NULL;
 	return (0);
@@ -204,8 +239,10 @@ lzma_compress(void *src, uint64_t srclen, void *dst,
 	SizeT props_len = LZMA_PROPS_SIZE;
 	SRes res;
 	Byte *_dst;
-	CLzmaEncProps *props = (CLzmaEncProps *)data;
+	struct lzma_ctx *ctx = (struct lzma_ctx *)data;
+	CLzmaEncProps props;
 	SizeT dlen;
+	UInt32 dsz;
 
 	if (*dstlen < LZMA_PROPS_SIZE) {
 		lzerr(SZ_ERROR_DESTLEN, 1);
@@ -214,13 +251,27 @@ lzma_compress(void *src, uint64_t srclen, void *dst,
 
 	if (PC_SUBTYPE(btype) == TYPE_COMPRESSED_ZPAQ)
 		return (-1);
-	props->level = level;
+	props = ctx->props;
+	props.level = level;
+
+	/*
+	 * A dictionary larger than the chunk buys nothing but a bigger match
+	 * finder to allocate and clear, so shrink it to fit. Equal sized chunks
+	 * then keep reusing the same match finder buffers.
+	 */
+	for (dsz = (1 << 12); dsz < props.dictSize && dsz < srclen; dsz <<= 1);
+	if (dsz < props.dictSize)
+		props.dictSize = dsz;
 
 	_dst = (Byte *)dst;
 	*dstlen -= LZMA_PROPS_SIZE;
 	dlen = *dstlen;
-	res = LzmaEncode(_dst + LZMA_PROPS_SIZE, &dlen, (const uchar_t *)src, srclen,
-	    props, (uchar_t *)_dst, &props_len, 0, NULL, &g_Alloc, &g_Alloc);
+	res = LzmaEnc_SetProps(ctx->enc, &props);
+	if (res == SZ_OK)
+		res = LzmaEnc_WriteProperties(ctx->enc, (uchar_t *)_dst, &props_len);
+	if (res == SZ_OK)
+		res = LzmaEnc_MemEncode(ctx->enc, _dst + LZMA_PROPS_SIZE, &dlen,
+		    (const uchar_t *)src, srclen, 0, NULL, &g_Alloc, &g_Alloc);
 	*dstlen = dlen;
 
 	if (res != 0) {
@@ -241,19 +292,50 @@ lzma_decompress(void *src, uint64_t srclen, void *dst,
 	SRes res;
 	ELzmaStatus status;
 	SizeT dlen;
+	struct lzma_ctx *ctx = (struct lzma_ctx *)data;
+	CLzmaDec *dec;
 
 	_srclen = srclen - LZMA_PROPS_SIZE;
 	_src = (uchar_t *)src + LZMA_PROPS_SIZE;
 	dlen = *dstlen;
 
-	if ((res = LzmaDecode((uchar_t *)dst, &dlen, _src, &_srclen,
-	    (uchar_t *)src, LZMA_PROPS_SIZE, LZMA_FINISH_ANY,
-	    &status, &g_Alloc)) != SZ_OK) {
+	if (!ctx) {
+		if ((res = LzmaDecode((uchar_t *)dst, &dlen, _src, &_srclen,
+		    (uchar_t *)src, LZMA_PROPS_SIZE, LZMA_FINISH_ANY,
+		    &status, &g_Alloc)) != SZ_OK) {
+			*dstlen = dlen;
+			lzerr(res, 0);
+			return (-1);
+		}
 		*dstlen = dlen;
+		return (0);
+	}
+
+	/*
+	 * Same as LzmaDecode() but the probability array stays allocated in
+	 * the per-thread decoder.
+	 */
+	dec = &ctx->dec;
+	res = SZ_ERROR_INPUT_EOF;
+	if (_srclen >= LZMA_RC_INIT_SIZE)
+		res = LzmaDec_AllocateProbs(dec, (uchar_t *)src, LZMA_PROPS_SIZE, &g_Alloc);
+	if (res == SZ_OK) {
+		dec->dic = (uchar_t *)dst;
+		dec->dicBufSize = dlen;
+		LzmaDec_Init(dec);
+		res = LzmaDec_DecodeToDic(dec, dlen, _src, &_srclen, LZMA_FINISH_ANY, &status);
+		if (res == SZ_OK && status == LZMA_STATUS_NEEDS_MORE_INPUT)
+			res = SZ_ERROR_INPUT_EOF;
+		dlen = dec->dicPos;
+	} else {
+		dlen = 0;
+	}
+	dec->dic = NULL;
+	*dstlen = dlen;
+	if (res != SZ_OK) {
 		lzerr(res, 0);
 		return (-1);
 	}
-	*dstlen = dlen;
 	return (0);
 }
 
@@ -134,7 +134,7 @@ compress_and_write(meta_ctx_t *mctx)
 		type |= PREPROC_COMPRESSED;
 	}
 
-	if (pctx->encrypt_type) {
+	if (pctx->encrypt_type && !CRYPTO_ALG_IS_AEAD(pctx->encrypt_type)) {
 		rv = crypto_buf(&(pctx->crypto_ctx), comp_chunk, comp_chunk, dstlen, mctx->id);
 		if (rv == -1) {
 			pctx->main_cancel = 1;
@@ -154,7 +154,21 @@ compress_and_write(meta_ctx_t *mctx)
 	if (!pctx->encrypt_type)
 		serialize_checksum(mctx->checksum, tobuf + 25, pctx->cksum_bytes);
 
-	if (pctx->encrypt_type) {
+	if (CRYPTO_ALG_IS_AEAD(pctx->encrypt_type)) {
+		/*
+		 * AEAD encrypts and authenticates in one pass. The header is the
+		 * associated data and the tag is stored in place of the HMAC.
+		 */
+		memset(tobuf + 25, 0, pctx->mac_bytes + CRC32_SIZE);
+		rv = crypto_aead_buf(&(pctx->crypto_ctx), comp_chunk, comp_chunk, dstlen,
+		    tobuf, METADATA_HDR_SZ, tobuf + 25, AEAD_META_ID(mctx->id));
+		if (rv == -1) {
+			pctx->main_cancel = 1;
+			pctx->t_errored = 1;
+			log_msg(LOG_ERR, 0, "Metadata Encrypion failed");
+			return (0);
+		}
+	} else if (pctx->encrypt_type) {
 		uchar_t chash[pctx->mac_bytes];
 		unsigned int hlen;
 		uchar_t *mac_ptr;
@@ -181,6 +195,8 @@ compress_and_write(meta_ctx_t *mctx)
 	dstlen += METADATA_HDR_SZ; // The 'full' chunk now
 	pthread_mutex_lock(&pctx->write_mutex);
 	wbytes = Write(mctx->comp_fd, mctx->tobuf, dstlen);
+	if (wbytes == dstlen && pctx->cidx)
+		pctx->cidx->cmp_pos += dstlen;
 	pthread_mutex_unlock(&pctx->write_mutex);
 	if (wbytes != dstlen) {
 		log_msg(LOG_ERR, 1, "Metadata Write (expected: %" PRIu64 ", written: %" PRId64 ") : ",
@@ -298,8 +314,21 @@ decompress_data(meta_ctx_t *mctx)
 	/*
 	 * If this was encrypted:
 	 * Verify HMAC first before anything else and then decrypt compressed data.
+	 * AEAD verifies the tag while decrypting.
 	 */
-	if (pctx->encrypt_type) {
+	if (CRYPTO_ALG_IS_AEAD(pctx->encrypt_type)) {
+		uchar_t tag[AEAD_TAG_LEN];
+
+		memcpy(tag, cbuf + 25, AEAD_TAG_LEN);
+		memset(cbuf + 25, 0, pctx->mac_bytes + CRC32_SIZE);
+		rv = crypto_aead_buf(&(pctx->crypto_ctx), cseg, cseg, len_cmp,
+		    cbuf, METADATA_HDR_SZ, tag, AEAD_META_ID(mctx->id));
+		if (rv == -1) {
+			log_msg(LOG_ERR, 0, "Metadata chunk %d, AEAD verification failed",
+			    mctx->id);
+			return (0);
+		}
+	} else if (pctx->encrypt_type) {
 		unsigned int len;
 
 		len = pctx->mac_bytes;
@@ -110,6 +110,9 @@ usage(pc_ctx_t *pctx)
 "       -t <number>\n"
 "                Sets the number of compression threads. Default: core count.\n"
 "       -T       Disable separate metadata stream.\n"
+"       -u <manifest file>\n"
+"                Incremental archiving. Files unchanged since the run that wrote the\n"
+"                manifest are stored as references. The manifest is then updated.\n"
 "       -S <chunk checksum>\n"
 "                The chunk verification checksum. Default: BLAKE256. Others are: CRC64, SHA256,\n"
 "                SHA512, KECCAK256, KECCAK512, BLAKE256, BLAKE512.\n"
@@ -131,17 +134,26 @@ usage(pc_ctx_t *pctx)
 "                See above.\n"
 "                Note: In singe file compression mode with adapt2 or adapt algorithm, larger\n"
 "                      chunks may not necessarily produce better compression.\n"
-"       -p       Make Pcompress work in streaming mode. Input is stdin, output is stdout.\n\n"
+"       -p       Make Pcompress work in streaming mode. Input is stdin, output is stdout.\n"
+"       -I       Append an index of chunk offsets to the compressed file. This allows\n"
+"                decompressing a byte range with -X. With -a a member catalog is added\n"
+"                to extract selected members quickly.\n\n"
 "       <target file>\n"
-"                Pathname of the compressed file to be created or '-' for stdout.\n\n"
+"                Pathname of the compressed file to be created or '-' for stdout.\n\n",
+	    UTILITY_VERSION, LICENSE_STRING, pctx->exec_name, pctx->exec_name);
+	fprintf(stderr,
 "    Decompression, Listing and Archive extraction\n"
 "    ---------------------------------------------\n"
-"       %s <-d|-i>  [-m] [-K] <compressed file or '-'> [<target file or directory>]\n\n"
+"       %s <-d|-i>  [-m] [-K] <compressed file or '-'> [<target file or directory>]\n"
+"                 [<member> ...]\n\n"
 "       -d        Extract archive to target dir or current dir.\n"
 "       -i        Only list contents of the archive, do not extract.\n\n"
 "       -m        Enable restoring *all* permissions, ACLs, Extended Attributes etc.\n"
 "                 Equivalent to the '-p' option in tar.\n"
 "       -K        Do not overwrite newer files.\n"
+"       -X <offset>[,<length>]\n"
+"                 Only decompress the given byte range of the original file. Needs a\n"
+"                 file compressed with -I. Offset and length can have a suffix as in -s.\n"
 "       -m and -K are only meaningful if the compressed file is an archive. For single file\n"
 "       compressed mode these options are ignored.\n\n"
 "       <compressed file>\n"
@@ -152,13 +164,15 @@ usage(pc_ctx_t *pctx)
 "                 Default output name if omitted: <input filename>.out\n\n"
 "                 If Archiving was done then this should be the name of a directory into which\n"
 "                 extracted files are restored. Default if omitted: Current directory.\n\n",
-	    UTILITY_VERSION, LICENSE_STRING, pctx->exec_name, pctx->exec_name, pctx->exec_name);
+	    pctx->exec_name);
 	fprintf(stderr,
 "    Encryption\n"
 "    ----------\n"
 "       -e <ALGO> Encrypt chunks with the given encrption algorithm. The ALGO parameter\n"
-"                 can be one of AES or SALSA20. Both are used in CTR stream encryption\n"
-"                 mode. The password can be prompted from the user or read from a file.\n"
+"                 can be one of AES, AES-GCM or SALSA20. AES and SALSA20 are used in CTR\n"
+"                 stream encryption mode along with a separate HMAC. AES-GCM encrypts and\n"
+"                 authenticates each chunk in a single pass.\n"
+"                 The password can be prompted from the user or read from a file.\n"
 "                 Unique keys are generated every time pcompress is run even when giving\n"
 "                 the same password. Default key length is 256-bits (see -k below).\n"
 "       -w <pathname>\n"
@@ -190,6 +204,45 @@ show_compression_stats(pc_ctx_t *pctx)
 		    bytes_to_size(pctx->avg_chunk),
 		    (double)pctx->avg_chunk/(double)pctx->chunksize*100);
 	}
+	if (pctx->probe_pct > 0 && pctx->chunk_num > 0) {
+		int est = (pctx->probe_skipped > 0 && pctx->probe_cmp_bytes > 0 &&
+		    pctx->probe_cmp_ms > 0);
+
+		log_msg(LOG_INFO, 0, "Incompressible chunks  : %u stored as-is (%s), probe time %.2f ms%s",
+		    pctx->probe_skipped, bytes_to_size(pctx->probe_skipped_bytes), pctx->probe_ms,
+		    est ? "" : "\n");
+		if (est) {
+			log_msg(LOG_INFO, 0, "Est. compression saved : %.2f ms\n",
+			    (double)pctx->probe_skipped_bytes * pctx->probe_cmp_ms /
+			    (double)pctx->probe_cmp_bytes - pctx->probe_ms);
+		}
+	}
+	if (pctx->numa_stats) {
+		uint32_t i;
+		numa_node_stats_t *ns;
+
+		log_msg(LOG_INFO, 0, "NUMA placement         : %u node(s), I/O on node %d",
+		    pctx->numa_nnodes, pctx->numa_io_node);
+		for (i = 0; i < pctx->numa_nnodes; i++) {
+			ns = &(pctx->numa_stats[i]);
+			log_msg(LOG_INFO, 0, "  Node %-3d             : %u workers, %s in %.2f ms"
+			    ", %.2f MB/s per worker%s", ns->node, ns->workers,
+			    bytes_to_size(ns->bytes), ns->busy_ms,
+			    ns->busy_ms > 0 ? get_mb_s(ns->bytes, 0, ns->busy_ms) : 0,
+			    i == pctx->numa_nnodes - 1 ? "\n" : "");
+		}
+	}
+	if (pctx->blk_cache) {
+		block_cache_stats_t bs;
+
+		block_cache_get_stats(pctx->blk_cache, &bs);
+		log_msg(LOG_INFO, 0, "Dedupe block cache     : %" PRIu64 " hits, %" PRIu64
+		    " misses (%.2f%% hit rate)", bs.hits, bs.misses,
+		    bs.hits + bs.misses > 0 ?
+		    (double)bs.hits * 100 / (double)(bs.hits + bs.misses) : 0);
+		log_msg(LOG_INFO, 0, "                         %s read from output, %" PRIu64
+		    " evictions\n", bytes_to_size(bs.bytes_read), bs.evictions);
+	}
 }
 
 /*
@@ -205,7 +258,7 @@ show_compression_stats(pc_ctx_t *pctx)
 static int
 preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t srclen,
     void *dst, uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data,
-    algo_props_t *props, int interesting)
+    algo_props_t *props, int interesting, stage_stats_t *ss)
 {
 	uchar_t *dest = (uchar_t *)dst, type = 0;
 	int result;
@@ -213,6 +266,7 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 	uchar_t *from, *to;
 	int stype, analyzed;
 	analyzer_ctx_t actx;
+	double sstrt;
 	DEBUG_STAT_EN(double strt, en);
 
 	_dstlen = *dstlen;
@@ -225,7 +279,9 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 
 	if (btype == TYPE_UNKNOWN || stype == TYPE_ARCHIVE_TAR || stype == TYPE_PDF ||
 	    PC_TYPE(btype) & TYPE_TEXT || interesting) {
+		sstrt = stage_begin(ss);
 		analyze_buffer(src, srclen, &actx);
+		stage_end(ss, STAGE_ANALYZE, sstrt, srclen);
 		analyzed = 1;
 		if (pctx->adapt_mode)
 			adapt_set_analyzer_ctx(data, &actx);
@@ -235,6 +291,7 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 	 * Dispack is used for 32-bit EXE files via a libarchive filter routine.
 	 * For 64-bit exes or AR archives we apply an E8E9 CALL/JMP transform filter.
 	 */
+	sstrt = stage_begin(ss);
 	if (pctx->exe_preprocess) {
 		int processed = 0;
 
@@ -366,10 +423,13 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 	*dest = type;
 	U64_P(dest + 1) = htonll(srclen);
 	_dstlen = srclen;
+	stage_end(ss, STAGE_PREPROC, sstrt, fromlen);
+	sstrt = stage_begin(ss);
 	DEBUG_STAT_EN(strt = get_wtime_millis());
 	result = cmp_func(src, srclen, dest+9, &_dstlen, level, chdr,
 	    btype, data);
 	DEBUG_STAT_EN(en = get_wtime_millis());
+	stage_end(ss, STAGE_CODEC, sstrt, srclen);
 
 	if (result > -1 && _dstlen < srclen) {
 		*dest |= PREPROC_COMPRESSED;
@@ -403,11 +463,12 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 static int
 preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64_t srclen,
     void *dst, uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data,
-    algo_props_t *props)
+    algo_props_t *props, stage_stats_t *ss)
 {
 	uchar_t *sorc = (uchar_t *)src, type;
 	int result;
 	uint64_t _dstlen = *dstlen, _dstlen1 = *dstlen;
+	double sstrt;
 	DEBUG_STAT_EN(double strt, en);
 
 	type = *sorc;
@@ -417,9 +478,11 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 		*dstlen = ntohll(U64_P(sorc));
 		sorc += 8;
 		srclen -= 8;
+		sstrt = stage_begin(ss);
 		DEBUG_STAT_EN(strt = get_wtime_millis());
 		result = dec_func(sorc, srclen, dst, dstlen, level, chdr, btype, data);
 		DEBUG_STAT_EN(en = get_wtime_millis());
+		stage_end(ss, STAGE_CODEC, sstrt, *dstlen);
 
 		if (result < 0) return (result);
 		DEBUG_STAT_EN(fprintf(stderr, "Chunk decompression speed %.3f MB/s\n",
@@ -430,6 +493,7 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 		src = sorc;
 	}
 
+	sstrt = stage_begin(ss);
 	if (type & PREPROC_TYPE_DELTA2) {
 		result = delta2_decode((uchar_t *)src, srclen, (uchar_t *)dst, &_dstlen);
 		if (result != -1) {
@@ -505,47 +569,341 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 		log_msg(LOG_ERR, 0, "Invalid preprocessing flags: %d", type);
 		return (-1);
 	}
+	stage_end(ss, STAGE_PREPROC, sstrt, *dstlen);
 	return (0);
 }
 
 /*
- * This routine is called in multiple threads. Calls the decompression handler
- * as encoded in the file header. For adaptive mode the handler adapt_decompress()
- * in turns looks at the chunk header and calls the actual decompression
- * routine.
+ * Chunk scheduler. The reader thread fills chunk slots strictly in sequence and
+ * queues them. Any idle worker thread picks up the next queued slot so a slow
+ * chunk only ties up one thread while the others carry on with subsequent chunks.
+ * The ring of slots doubles as the writer's reorder window: the writer drains
+ * slots in chunk sequence irrespective of which worker finishes first.
+ *
+ * With NUMA placement there is a queue per node. A slot is queued on the node
+ * its buffers live on and is only picked up by workers running on that node.
  */
-static void *
-perform_decompress(void *dat)
+static int
+sched_init(pc_ctx_t *pctx, uint32_t nslots, uint32_t nworkers, uint32_t nqueues)
 {
-	struct cmp_data *tdat = (struct cmp_data *)dat;
-	uint64_t _chunksize;
-	uint64_t dedupe_index_sz, dedupe_data_sz, dedupe_index_sz_cmp, dedupe_data_sz_cmp;
-	int rv = 0;
-	unsigned int blknum;
-	uchar_t checksum[CKSUM_MAX_BYTES];
-	uchar_t HDR;
-	uchar_t *cseg;
-	pc_ctx_t *pctx;
+	sched_queue_t *sq;
+	uint32_t i;
 
-	pctx = tdat->pctx;
-redo:
-	Sem_Wait(&tdat->start_sem);
-	if (pctx->main_cancel)
+	pctx->ready_q = NULL;
+	pctx->ready_nq = 0;
+	if (nslots + nworkers == 0)
+		return (0);
+	pctx->ready_q = (sched_queue_t *)slab_calloc(NULL, nqueues, sizeof (sched_queue_t));
+	if (!pctx->ready_q)
+		return (-1);
+	for (i = 0; i < nqueues; i++) {
+		sq = &(pctx->ready_q[i]);
+
+		/*
+		 * Room for every slot plus one exit marker per worker.
+		 */
+		sq->len = nslots + nworkers;
+		sq->q = (struct cmp_data **)slab_calloc(NULL, sq->len,
+		    sizeof (struct cmp_data *));
+		if (!sq->q)
+			return (-1);
+		sq->head = 0;
+		sq->tail = 0;
+		pthread_mutex_init(&sq->mutex, NULL);
+		Sem_Init(&(sq->sem), 0, 0);
+		pctx->ready_nq++;
+	}
+	return (0);
+}
+
+static void
+sched_destroy(pc_ctx_t *pctx)
+{
+	sched_queue_t *sq;
+	uint32_t i;
+
+	if (!pctx->ready_q)
+		return;
+	for (i = 0; i < pctx->ready_nq; i++) {
+		sq = &(pctx->ready_q[i]);
+		slab_release(NULL, sq->q);
+		pthread_mutex_destroy(&sq->mutex);
+		Sem_Destroy(&(sq->sem));
+	}
+	slab_release(NULL, pctx->ready_q);
+	pctx->ready_q = NULL;
+	pctx->ready_nq = 0;
+}
+
+/*
+ * Queue a filled slot on the given node. A NULL slot tells the worker that
+ * picks it up to exit.
+ */
+static void
+sched_enqueue(pc_ctx_t *pctx, int node, struct cmp_data *tdat)
+{
+	sched_queue_t *sq = &(pctx->ready_q[node]);
+
+	pthread_mutex_lock(&sq->mutex);
+	sq->q[sq->tail] = tdat;
+	sq->tail = (sq->tail + 1) % sq->len;
+	pthread_mutex_unlock(&sq->mutex);
+	Sem_Post(&(sq->sem));
+}
+
+static void
+sched_put(pc_ctx_t *pctx, struct cmp_data *tdat)
+{
+	sched_enqueue(pctx, tdat->numa_node, tdat);
+}
+
+/*
+ * Wait for the next slot and bind the worker's algorithm state to it.
+ */
+static struct cmp_data *
+sched_get(struct cmp_worker *wk)
+{
+	pc_ctx_t *pctx = wk->pctx;
+	sched_queue_t *sq = &(pctx->ready_q[wk->numa_node]);
+	struct cmp_data *tdat;
+	double strt;
+
+	strt = stage_begin(wk->sstats);
+	Sem_Wait(&(sq->sem));
+	stage_end(wk->sstats, STAGE_SEM_WAIT, strt, 0);
+	pthread_mutex_lock(&sq->mutex);
+	tdat = sq->q[sq->head];
+	sq->head = (sq->head + 1) % sq->len;
+	pthread_mutex_unlock(&sq->mutex);
+	if (tdat == NULL)
 		return (NULL);
 
-	if (unlikely(tdat->cancel)) {
-		tdat->len_cmp = 0;
-		Sem_Post(&tdat->cmp_done_sem);
+	tdat->data = wk->data;
+	tdat->level = wk->level;
+	tdat->chunk_hmac = &(wk->chunk_hmac);
+	tdat->rctx = wk->rctx;
+	tdat->sstats = wk->sstats;
+	if (tdat->rctx) {
+		/*
+		 * Global dedupe index access is sequenced by chunk, not by thread.
+		 */
+		tdat->rctx->index_sem = &(tdat->index_sem);
+		tdat->rctx->index_sem_next = tdat->index_sem_next;
+		if (tdat->decompressing) {
+			tdat->rctx->id = tdat->id;
+		} else {
+			tdat->rctx->file_offset = tdat->file_offset;
+			tdat->rctx->seq = tdat->id;
+		}
+	}
+	return (tdat);
+}
+
+/*
+ * Ask all workers to exit and wait for them.
+ */
+static void
+sched_stop(pc_ctx_t *pctx, struct cmp_worker *wrk, uint32_t nworkers)
+{
+	uint32_t i;
+
+	for (i = 0; i < nworkers; i++)
+		sched_enqueue(pctx, wrk[i].numa_node, NULL);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(wrk[i].thr, NULL);
+}
+
+/*
+ * Per-stage time accounting is enabled by pointing PCOMPRESS_STAGE_STATS at
+ * the file that should receive the JSON summary, or "-" for stderr. Slot 0
+ * accounts the reader thread, slot 1 the writer and the rest the workers.
+ */
+#define	STAGE_READER(pctx) ((pctx)->stage_stats)
+#define	STAGE_WRITER(pctx) ((pctx)->stage_stats ? &((pctx)->stage_stats[1]) : NULL)
+
+static int
+stage_stats_init(pc_ctx_t *pctx, struct cmp_worker *wrk, uint32_t nworkers)
+{
+	uint32_t i;
+
+	pctx->stage_stats = NULL;
+	pctx->stage_nstats = 0;
+	if (getenv("PCOMPRESS_STAGE_STATS") == NULL)
 		return (0);
+
+	pctx->stage_stats = stage_stats_create(nworkers + 2);
+	if (pctx->stage_stats == NULL)
+		return (-1);
+	pctx->stage_nstats = nworkers + 2;
+	pctx->stage_strt = get_wtime_millis();
+	stage_stats_name(&(pctx->stage_stats[0]), "reader", -1);
+	stage_stats_name(&(pctx->stage_stats[1]), "writer", -1);
+	for (i = 0; i < nworkers; i++) {
+		wrk[i].sstats = &(pctx->stage_stats[i + 2]);
+		stage_stats_name(wrk[i].sstats, "worker", i);
+	}
+	return (0);
+}
+
+/*
+ * Emit the stage accounting once all threads are done.
+ */
+static void
+stage_stats_fini(pc_ctx_t *pctx, const char *op)
+{
+	char *path;
+
+	if (pctx->stage_stats == NULL)
+		return;
+	path = getenv("PCOMPRESS_STAGE_STATS");
+	if (path != NULL) {
+		stage_stats_write(path, op, pctx->stage_stats, pctx->stage_nstats,
+		    get_wtime_millis() - pctx->stage_strt);
+	}
+	slab_release(NULL, pctx->stage_stats);
+	pctx->stage_stats = NULL;
+}
+
+/*
+ * Number of chunk slots to use for the given number of workers. Each worker gets
+ * one slot. Additional slots upto the reorder window depth allow idle workers to
+ * proceed with later chunks while an earlier one is still in progress. The extra
+ * slots are bounded by a memory cap.
+ *
+ * The window depth defaults to the worker count and can be set via the
+ * PCOMPRESS_REORDER_DEPTH environment variable. The memory cap defaults to 1/8th
+ * of physical RAM and can be set in megabytes via PCOMPRESS_REORDER_MEM.
+ */
+static uint32_t
+sched_nslots(uint32_t nworkers, uint64_t slot_mem, uint64_t max_slots)
+{
+	uint64_t depth, mem;
+	char *val;
+
+	if (nworkers == 0)
+		return (0);
+
+	depth = nworkers;
+	if ((val = getenv("PCOMPRESS_REORDER_DEPTH")) != NULL)
+		depth = strtoull(val, NULL, 0);
+
+	mem = get_total_ram() / 8;
+	if ((val = getenv("PCOMPRESS_REORDER_MEM")) != NULL)
+		mem = strtoull(val, NULL, 0) * 1024 * 1024;
+
+	if (slot_mem > 0 && depth > mem / slot_mem)
+		depth = mem / slot_mem;
+	if (max_slots > 0) {
+		if (max_slots <= nworkers)
+			depth = 0;
+		else if (depth > max_slots - nworkers)
+			depth = max_slots - nworkers;
+	}
+	return (nworkers + depth);
+}
+
+/*
+ * NUMA placement is enabled by setting PCOMPRESS_NUMA to 1. Chunk slots and
+ * worker threads are then spread round-robin across the nodes in use, with
+ * each worker pinned to its node and each slot's buffers first touched there.
+ * The reader, writer and helper threads stay on the node nearest to the input
+ * (or else output) device. Returns the number of nodes in use.
+ */
+static uint32_t
+numa_setup(pc_ctx_t *pctx, int in_fd, int out_fd, uint32_t nslots, uint32_t nworkers)
+{
+	uint32_t nn, i;
+	char *val;
+
+	if ((val = getenv("PCOMPRESS_NUMA")) == NULL || atoi(val) <= 0 || nslots < 2)
+		return (1);
+	pctx->numa = numa_topo_create();
+	if (pctx->numa == NULL) {
+		log_msg(LOG_WARN, 0, "NUMA placement is not supported here.");
+		return (1);
 	}
 
 	/*
-	 * If the last read returned a 0 quit.
+	 * Every node in use must have at least one slot and one worker.
 	 */
-	if (tdat->rbytes == 0) {
-		tdat->len_cmp = 0;
-		goto cont;
+	nn = numa_nodes(pctx->numa);
+	if (nn > nworkers)
+		nn = nworkers;
+	if (nn > nslots)
+		nn = nslots;
+	pctx->numa_stats = (numa_node_stats_t *)slab_calloc(NULL, nn,
+	    sizeof (numa_node_stats_t));
+	if (pctx->numa_stats == NULL) {
+		numa_topo_destroy(pctx->numa);
+		pctx->numa = NULL;
+		return (1);
+	}
+	for (i = 0; i < nn; i++)
+		pctx->numa_stats[i].node = numa_node_id(pctx->numa, i);
+	pctx->numa_nnodes = nn;
+
+	pctx->numa_io_node = -1;
+	if (in_fd != -1)
+		pctx->numa_io_node = numa_fd_node(pctx->numa, in_fd);
+	if (pctx->numa_io_node < 0 && out_fd != -1)
+		pctx->numa_io_node = numa_fd_node(pctx->numa, out_fd);
+	if (pctx->numa_io_node < 0)
+		pctx->numa_io_node = 0;
+	numa_bind_self(pctx->numa, pctx->numa_io_node);
+	return (nn);
+}
+
+/*
+ * Sum up the per worker accounting by node and undo the placement of the
+ * calling thread.
+ */
+static void
+numa_finish(pc_ctx_t *pctx, struct cmp_worker *wrk, uint32_t nworkers)
+{
+	numa_node_stats_t *ns;
+	uint32_t i;
+
+	if (pctx->numa == NULL)
+		return;
+	for (i = 0; wrk != NULL && i < nworkers; i++) {
+		ns = &(pctx->numa_stats[wrk[i].numa_node]);
+		ns->workers++;
+		ns->bytes += wrk[i].numa_bytes;
+		ns->busy_ms += wrk[i].numa_ms;
 	}
+	numa_unbind_self(pctx->numa);
+	numa_topo_destroy(pctx->numa);
+	pctx->numa = NULL;
+}
+
+/*
+ * With NUMA placement the reader keeps a spare buffer per node. Having filled
+ * slot cur it switches to the spare on the node of the slot filled next, so
+ * that exchanging buffers with slots never moves memory across nodes.
+ */
+static uchar_t *
+numa_next_buf(uchar_t **bufs, uchar_t *spare, struct cmp_data *cur, struct cmp_data *next)
+{
+	bufs[cur->numa_node] = spare;
+	return (bufs[next->numa_node]);
+}
+
+/*
+ * Verify, decrypt, decompress and rebuild the chunk read into tdat. The
+ * original data is left in tdat->uncompressed_chunk with its length in
+ * tdat->len_cmp, which is set to 0 on failure.
+ */
+static int
+decompress_chunk(pc_ctx_t *pctx, struct cmp_data *tdat, stage_stats_t *ss)
+{
+	uint64_t _chunksize;
+	uint64_t dedupe_index_sz, dedupe_data_sz, dedupe_index_sz_cmp, dedupe_data_sz_cmp;
+	int rv = 0;
+	unsigned int blknum;
+	uchar_t checksum[CKSUM_MAX_BYTES];
+	uchar_t HDR;
+	uchar_t *cseg;
+	double sstrt;
 
 	cseg = tdat->compressed_chunk + pctx->cksum_bytes + pctx->mac_bytes;
 	HDR = *cseg;
@@ -563,25 +921,60 @@ redo:
 	/*
 	 * If this was encrypted:
 	 * Verify HMAC first before anything else and then decrypt compressed data.
+	 * AEAD algorithms verify the tag and decrypt in one pass, see
+	 * perform_compress().
 	 */
-	if (pctx->encrypt_type) {
+	if (CRYPTO_ALG_IS_AEAD(pctx->encrypt_type)) {
+		uchar_t aad[sizeof (tdat->len_cmp_be) + pctx->cksum_bytes + pctx->mac_bytes +
+		    CHUNK_FLAG_SZ + ORIGINAL_CHUNKSZ];
+		uchar_t tag[AEAD_TAG_LEN];
+		int aadlen;
+
+		sstrt = stage_begin(ss);
+		memcpy(tag, tdat->compressed_chunk + pctx->cksum_bytes, AEAD_TAG_LEN);
+		memset(tdat->compressed_chunk + pctx->cksum_bytes, 0, pctx->mac_bytes);
+		memcpy(aad, &tdat->len_cmp_be, sizeof (tdat->len_cmp_be));
+		aadlen = sizeof (tdat->len_cmp_be);
+		memcpy(aad + aadlen, tdat->compressed_chunk, pctx->cksum_bytes +
+		    pctx->mac_bytes + CHUNK_FLAG_SZ);
+		aadlen += pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ;
+		if (HDR & CHSIZE_MASK) {
+			memcpy(aad + aadlen, tdat->compressed_chunk + tdat->rbytes,
+			    ORIGINAL_CHUNKSZ);
+			aadlen += ORIGINAL_CHUNKSZ;
+		}
+		rv = crypto_aead_buf(&(pctx->crypto_ctx), cseg, cseg, tdat->len_cmp, aad,
+		    aadlen, tag, tdat->id);
+		if (rv == -1) {
+			/*
+			 * Tag verification failure is fatal.
+			 */
+			log_msg(LOG_ERR, 0, "Chunk %d, AEAD verification failed", tdat->id);
+			pctx->main_cancel = 1;
+			tdat->len_cmp = 0;
+			pctx->t_errored = 1;
+			return (-1);
+		}
+		stage_end(ss, STAGE_CRYPTO, sstrt, tdat->len_cmp);
+	} else if (pctx->encrypt_type) {
 		unsigned int len;
 		DEBUG_STAT_EN(double strt, en);
 
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		sstrt = stage_begin(ss);
 		len = pctx->mac_bytes;
 		deserialize_checksum(checksum, tdat->compressed_chunk + pctx->cksum_bytes,
 		    pctx->mac_bytes);
 		memset(tdat->compressed_chunk + pctx->cksum_bytes, 0, pctx->mac_bytes);
-		hmac_reinit(&tdat->chunk_hmac);
-		hmac_update(&tdat->chunk_hmac, (uchar_t *)&tdat->len_cmp_be, sizeof (tdat->len_cmp_be));
-		hmac_update(&tdat->chunk_hmac, tdat->compressed_chunk, tdat->rbytes);
+		hmac_reinit(tdat->chunk_hmac);
+		hmac_update(tdat->chunk_hmac, (uchar_t *)&tdat->len_cmp_be, sizeof (tdat->len_cmp_be));
+		hmac_update(tdat->chunk_hmac, tdat->compressed_chunk, tdat->rbytes);
 		if (HDR & CHSIZE_MASK) {
 			uchar_t *rseg;
 			rseg = tdat->compressed_chunk + tdat->rbytes;
-			hmac_update(&tdat->chunk_hmac, rseg, ORIGINAL_CHUNKSZ);
+			hmac_update(tdat->chunk_hmac, rseg, ORIGINAL_CHUNKSZ);
 		}
-		hmac_final(&tdat->chunk_hmac, tdat->checksum, &len);
+		hmac_final(tdat->chunk_hmac, tdat->checksum, &len);
 		if (memcmp(checksum, tdat->checksum, len) != 0) {
 			/*
 			 * HMAC verification failure is fatal.
@@ -590,18 +983,19 @@ redo:
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
-			Sem_Post(&tdat->cmp_done_sem);
-			return (NULL);
+			return (-1);
 		}
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "HMAC Verification speed %.3f MB/s",
 			      get_mb_s(tdat->rbytes + sizeof (tdat->len_cmp_be), strt, en)));
+		stage_end(ss, STAGE_CHECKSUM, sstrt, tdat->rbytes);
 
 		/*
 		 * Encryption algorithm should not change the size and
 		 * encryption is in-place.
 		 */
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		sstrt = stage_begin(ss);
 		rv = crypto_buf(&(pctx->crypto_ctx), cseg, cseg, tdat->len_cmp, tdat->id);
 		if (rv == -1) {
 			/*
@@ -610,18 +1004,20 @@ redo:
 			log_msg(LOG_ERR, 0, "Chunk %d, Decryption failed", tdat->id);
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
-			Sem_Post(&tdat->cmp_done_sem);
-			return (NULL);
+			pctx->t_errored = 1;
+			return (-1);
 		}
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "Decryption speed %.3f MB/s\n",
 			      get_mb_s(tdat->len_cmp, strt, en)));
+		stage_end(ss, STAGE_CRYPTO, sstrt, tdat->len_cmp);
 	} else if (pctx->mac_bytes > 0) {
 		/*
 		 * Verify header CRC32 in non-crypto mode.
 		 */
 		uint32_t crc1, crc2;
 
+		sstrt = stage_begin(ss);
 		crc1 = htonl(U32_P(tdat->compressed_chunk + pctx->cksum_bytes));
 		memset(tdat->compressed_chunk + pctx->cksum_bytes, 0, pctx->mac_bytes);
 		crc2 = lzma_crc32((uchar_t *)&tdat->len_cmp_be, sizeof (tdat->len_cmp_be), 0);
@@ -641,8 +1037,7 @@ redo:
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
-			Sem_Post(&tdat->cmp_done_sem);
-			return (NULL);
+			return (-1);
 		}
 
 		/*
@@ -650,6 +1045,8 @@ redo:
 		 * digest.
 		 */
 		deserialize_checksum(tdat->checksum, tdat->compressed_chunk, pctx->cksum_bytes);
+		stage_end(ss, STAGE_CHECKSUM, sstrt, pctx->cksum_bytes + pctx->mac_bytes +
+		    CHUNK_FLAG_SZ);
 	}
 
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) &&
@@ -673,13 +1070,15 @@ redo:
 			if (HDR & CHUNK_FLAG_PREPROC) {
 				rv = preproc_decompress(pctx, tdat->decompress, cmpbuf,
 				    dedupe_data_sz_cmp,	ubuf, &_chunksize, tdat->level,
-				    HDR, pctx->btype, tdat->data, tdat->props);
+				    HDR, pctx->btype, tdat->data, tdat->props, ss);
 			} else {
 				DEBUG_STAT_EN(double strt, en);
 
 				DEBUG_STAT_EN(strt = get_wtime_millis());
+				sstrt = stage_begin(ss);
 				rv = tdat->decompress(cmpbuf, dedupe_data_sz_cmp, ubuf, &_chunksize,
 				    tdat->level, HDR, pctx->btype, tdat->data);
+				stage_end(ss, STAGE_CODEC, sstrt, _chunksize);
 				DEBUG_STAT_EN(en = get_wtime_millis());
 				DEBUG_STAT_EN(fprintf(stderr, "Chunk %d decompression speed %.3f MB/s\n",
 						      tdat->id, get_mb_s(_chunksize, strt, en)));
@@ -688,7 +1087,7 @@ redo:
 				tdat->len_cmp = 0;
 				log_msg(LOG_ERR, 0, "ERROR: Chunk %d, decompression failed.", tdat->id);
 				pctx->t_errored = 1;
-				goto cont;
+				return (-1);
 			}
 		} else {
 			memcpy(ubuf, cmpbuf, _chunksize);
@@ -700,8 +1099,10 @@ redo:
 
 		if (dedupe_index_sz >= 90 && dedupe_index_sz > dedupe_index_sz_cmp) {
 			/* Index should be at least 90 bytes to have been compressed. */
+			sstrt = stage_begin(ss);
 			rv = lzma_decompress(cmpbuf, dedupe_index_sz_cmp, ubuf,
 			    &dedupe_index_sz, tdat->rctx->level, 0, TYPE_BINARY, tdat->rctx->lzma_data);
+			stage_end(ss, STAGE_CODEC, sstrt, dedupe_index_sz);
 		} else {
 			memcpy(ubuf, cmpbuf, dedupe_index_sz);
 		}
@@ -717,13 +1118,15 @@ redo:
 			if (HDR & CHUNK_FLAG_PREPROC) {
 				rv = preproc_decompress(pctx, tdat->decompress, cseg, tdat->len_cmp,
 				    tdat->uncompressed_chunk, &_chunksize, tdat->level, HDR, pctx->btype,
-				    tdat->data, tdat->props);
+				    tdat->data, tdat->props, ss);
 			} else {
 				DEBUG_STAT_EN(double strt, en);
 
 				DEBUG_STAT_EN(strt = get_wtime_millis());
+				sstrt = stage_begin(ss);
 				rv = tdat->decompress(cseg, tdat->len_cmp, tdat->uncompressed_chunk,
 				    &_chunksize, tdat->level, HDR, pctx->btype, tdat->data);
+				stage_end(ss, STAGE_CODEC, sstrt, _chunksize);
 				DEBUG_STAT_EN(en = get_wtime_millis());
 				DEBUG_STAT_EN(fprintf(stderr, "Chunk decompression speed %.3f MB/s\n",
 						get_mb_s(_chunksize, strt, en)));
@@ -738,23 +1141,27 @@ redo:
 		tdat->len_cmp = 0;
 		log_msg(LOG_ERR, 0, "ERROR: Chunk %d, decompression failed.", tdat->id);
 		pctx->t_errored = 1;
-		goto cont;
+		return (-1);
 	}
 	/* Rebuild chunk from dedup blocks. */
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan) && (HDR & CHUNK_FLAG_DEDUP)) {
 		dedupe_context_t *rctx;
 		uchar_t *tmp;
+		double iwait;
 
 		rctx = tdat->rctx;
 		reset_dedupe_context(tdat->rctx);
 		rctx->cbuf = tdat->compressed_chunk;
+		sstrt = stage_begin(ss);
+		iwait = stage_total(ss, STAGE_INDEX_WAIT);
 		dedupe_decompress(rctx, tdat->uncompressed_chunk, &(tdat->len_cmp));
+		stage_end_outer(ss, STAGE_DEDUPE, sstrt, tdat->len_cmp, STAGE_INDEX_WAIT, iwait);
 		if (!rctx->valid) {
 			log_msg(LOG_ERR, 0, "ERROR: Chunk %d, dedup recovery failed.", tdat->id);
 			rv = -1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
-			goto cont;
+			return (-1);
 		}
 		_chunksize = tdat->len_cmp;
 		tmp = tdat->uncompressed_chunk;
@@ -769,7 +1176,9 @@ redo:
 		 * to wait for the previous thread's dedupe recovery to complete.
 		 */
 		if (pctx->enable_rabin_global) {
+			sstrt = stage_begin(ss);
 			Sem_Wait(tdat->rctx->index_sem);
+			stage_end(ss, STAGE_INDEX_WAIT, sstrt, 0);
 		}
 	}
 
@@ -779,15 +1188,55 @@ redo:
 		 * If it does not match we set length of chunk to 0 to indicate
 		 * exit to the writer thread.
 		 */
+		sstrt = stage_begin(ss);
 		compute_checksum(checksum, pctx->cksum, tdat->uncompressed_chunk,
 		    _chunksize, tdat->cksum_mt, 1);
+		stage_end(ss, STAGE_CHECKSUM, sstrt, _chunksize);
 		if (memcmp(checksum, tdat->checksum, pctx->cksum_bytes) != 0) {
 			tdat->len_cmp = 0;
 			log_msg(LOG_ERR, 0, "ERROR: Chunk %d, checksums do not match.", tdat->id);
 			pctx->t_errored = 1;
 			pctx->main_cancel = 1;
+			return (-1);
 		}
 	}
+	return (0);
+
+}
+
+/*
+ * This routine is called in multiple threads. Calls the decompression handler
+ * as encoded in the file header. For adaptive mode the handler adapt_decompress()
+ * in turns looks at the chunk header and calls the actual decompression
+ * routine.
+ */
+static void *
+perform_decompress(void *dat)
+{
+	struct cmp_worker *wk = (struct cmp_worker *)dat;
+	struct cmp_data *tdat;
+	pc_ctx_t *pctx;
+
+	pctx = wk->pctx;
+redo:
+	tdat = sched_get(wk);
+	if (tdat == NULL || pctx->main_cancel)
+		return (NULL);
+
+	if (unlikely(tdat->cancel)) {
+		tdat->len_cmp = 0;
+		Sem_Post(&tdat->cmp_done_sem);
+		return (0);
+	}
+
+	/*
+	 * If the last read returned a 0 quit.
+	 */
+	if (tdat->rbytes == 0) {
+		tdat->len_cmp = 0;
+		goto cont;
+	}
+	decompress_chunk(pctx, tdat, wk->sstats);
 
 cont:
 	Sem_Post(&tdat->cmp_done_sem);
@@ -796,6 +1245,331 @@ cont:
 	return (NULL);
 }
 
+/*
+ * Global Dedupe references in a decompressed range can point to data before
+ * the range, which is not in the output file. The chunks holding that data
+ * are decompressed from the compressed file on demand. Those chunks can in
+ * turn reference earlier chunks, so decoding recurses with a separate decode
+ * slot per level. References always point backwards, so the depth is bounded
+ * by the chunk number. A few decoded chunks are cached since references tend
+ * to cluster.
+ */
+#define	RANGE_CACHE_CHUNKS	4
+
+struct range_dec {
+	struct cmp_data tdat;
+	Sem_t index_sem;
+};
+
+struct range_cache_ent {
+	uchar_t *buf;
+	uint64_t len;
+	int64_t id;
+	uint64_t used;
+};
+
+struct range_res {
+	pc_ctx_t *pctx;
+	int fd, store_fd, level, dedupe_flag, version;
+	uint64_t chunksize, compressed_chunksize;
+	algo_props_t *props;
+	void *data;
+	mac_ctx_t chunk_hmac;
+	struct range_dec **dec;
+	uint32_t ndec, depth;
+	struct range_cache_ent cache[RANGE_CACHE_CHUNKS];
+	uint64_t clock;
+	pthread_mutex_t mtx;
+};
+
+static int range_ref_read(void *arg, uchar_t *buf, uint64_t len, uint64_t offset);
+
+/*
+ * Must be called before the encryption key is cleared.
+ */
+static struct range_res *
+range_res_create(pc_ctx_t *pctx, int fd, int store_fd, algo_props_t *props, int level,
+    int dedupe_flag, int version, uint64_t chunksize, uint64_t compressed_chunksize)
+{
+	struct range_res *rr;
+	pthread_mutexattr_t attr;
+
+	rr = (struct range_res *)slab_calloc(NULL, 1, sizeof (struct range_res));
+	if (rr == NULL)
+		return (NULL);
+	rr->pctx = pctx;
+	rr->fd = fd;
+	rr->store_fd = store_fd;
+	rr->props = props;
+	rr->level = level;
+	rr->dedupe_flag = dedupe_flag;
+	rr->version = version;
+	rr->chunksize = chunksize;
+	rr->compressed_chunksize = compressed_chunksize;
+	if (pctx->_init_func) {
+		if (pctx->_init_func(&(rr->data), &(rr->level), props->nthreads, chunksize,
+		    version, DECOMPRESS) != 0) {
+			slab_release(NULL, rr);
+			return (NULL);
+		}
+	}
+	if (pctx->encrypt_type) {
+		if (hmac_init(&rr->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
+			log_msg(LOG_ERR, 0, "Cannot initialize chunk hmac.");
+			if (pctx->_deinit_func)
+				pctx->_deinit_func(&(rr->data));
+			slab_release(NULL, rr);
+			return (NULL);
+		}
+	}
+
+	/*
+	 * Nested decoding happens in the same thread, hence a recursive lock.
+	 */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&rr->mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return (rr);
+}
+
+static void
+range_res_destroy(struct range_res *rr)
+{
+	pc_ctx_t *pctx;
+	uint32_t i;
+
+	if (rr == NULL)
+		return;
+	pctx = rr->pctx;
+	for (i = 0; i < rr->ndec; i++) {
+		struct cmp_data *tdat = &(rr->dec[i]->tdat);
+
+		destroy_dedupe_context(tdat->rctx);
+		slab_release(NULL, tdat->compressed_chunk);
+		slab_release(NULL, tdat->uncompressed_chunk);
+		Sem_Destroy(&(rr->dec[i]->index_sem));
+		slab_release(NULL, rr->dec[i]);
+	}
+	if (rr->dec)
+		free(rr->dec);
+	for (i = 0; i < RANGE_CACHE_CHUNKS; i++) {
+		if (rr->cache[i].buf)
+			slab_release(NULL, rr->cache[i].buf);
+	}
+	if (pctx->_deinit_func)
+		pctx->_deinit_func(&(rr->data));
+	if (pctx->encrypt_type)
+		hmac_cleanup(&rr->chunk_hmac);
+	pthread_mutex_destroy(&rr->mtx);
+	slab_release(NULL, rr);
+}
+
+/*
+ * Decode slot for the current nesting depth, created on first use.
+ */
+static struct range_dec *
+range_dec_get(struct range_res *rr)
+{
+	pc_ctx_t *pctx = rr->pctx;
+	struct range_dec *dec, **decs;
+	struct cmp_data *tdat;
+
+	if (rr->depth < rr->ndec)
+		return (rr->dec[rr->depth]);
+
+	decs = (struct range_dec **)realloc(rr->dec, (rr->ndec + 1) * sizeof (*decs));
+	if (decs == NULL)
+		return (NULL);
+	rr->dec = decs;
+	dec = (struct range_dec *)slab_calloc(NULL, 1, sizeof (struct range_dec));
+	if (dec == NULL)
+		return (NULL);
+	tdat = &(dec->tdat);
+	tdat->compressed_chunk = (uchar_t *)slab_alloc(NULL, rr->compressed_chunksize);
+	tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL, rr->compressed_chunksize);
+	tdat->rctx = create_dedupe_context(rr->chunksize, rr->compressed_chunksize,
+	    pctx->rab_blk_size, pctx->algo, rr->props, pctx->enable_delta_encode,
+	    rr->dedupe_flag, rr->version, DECOMPRESS, 0, NULL, NULL, 0, 1, 0);
+	if (!tdat->compressed_chunk || !tdat->uncompressed_chunk || !tdat->rctx) {
+		if (tdat->compressed_chunk)
+			slab_release(NULL, tdat->compressed_chunk);
+		if (tdat->uncompressed_chunk)
+			slab_release(NULL, tdat->uncompressed_chunk);
+		if (tdat->rctx)
+			destroy_dedupe_context(tdat->rctx);
+		slab_release(NULL, dec);
+		return (NULL);
+	}
+	Sem_Init(&(dec->index_sem), 0, 0);
+	tdat->cmp_seg = tdat->uncompressed_chunk;
+	tdat->pctx = pctx;
+	tdat->chunksize = rr->chunksize;
+	tdat->decompress = pctx->_decompress_func;
+	tdat->level = rr->level;
+	tdat->data = rr->data;
+	tdat->chunk_hmac = &(rr->chunk_hmac);
+	tdat->props = rr->props;
+	tdat->decompressing = 1;
+	tdat->rctx->store_fd = rr->store_fd;
+	tdat->rctx->cdc_type = pctx->dedupe_cdc;
+	tdat->rctx->index_sem = &(dec->index_sem);
+	tdat->rctx->index_sem_next = &(dec->index_sem);
+	tdat->rctx->ref_read = range_ref_read;
+	tdat->rctx->ref_arg = rr;
+	rr->dec[rr->ndec++] = dec;
+	return (dec);
+}
+
+/*
+ * Decompress the given chunk number into a cache slot.
+ */
+static struct range_cache_ent *
+range_decode(struct range_res *rr, int64_t id)
+{
+	pc_ctx_t *pctx = rr->pctx;
+	struct range_cache_ent *ent;
+	struct range_dec *dec;
+	struct cmp_data *tdat;
+	uint64_t off;
+	int64_t rb;
+	uchar_t *tmp;
+	int i, rv;
+
+	dec = range_dec_get(rr);
+	if (dec == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory resolving dedupe reference.");
+		return (NULL);
+	}
+	tdat = &(dec->tdat);
+	off = pctx->cidx->ents[id].cmp_off;
+	if (pread(rr->fd, &tdat->len_cmp_be, sizeof (tdat->len_cmp_be), off) !=
+	    sizeof (tdat->len_cmp_be)) {
+		log_msg(LOG_ERR, 1, "Read: ");
+		return (NULL);
+	}
+	tdat->len_cmp = ntohll(tdat->len_cmp_be);
+	if (tdat->len_cmp == 0 || tdat->len_cmp > rr->chunksize + 256) {
+		log_msg(LOG_ERR, 0, "Invalid length for chunk %" PRId64 ", file corrupt", id);
+		return (NULL);
+	}
+	rb = tdat->len_cmp + pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ;
+	tdat->rbytes = pread(rr->fd, tdat->compressed_chunk, rb, off + sizeof (tdat->len_cmp));
+	if (tdat->rbytes != rb) {
+		log_msg(LOG_ERR, 1, "Incomplete chunk %" PRId64 ": ", id);
+		return (NULL);
+	}
+	tdat->id = id;
+	tdat->cksum_mt = 0;
+
+	/*
+	 * Decoding is not sequenced with other chunks here. The index semaphore
+	 * is just posted to let it through.
+	 */
+	Sem_Post(&(dec->index_sem));
+	rr->depth++;
+	rv = decompress_chunk(pctx, tdat, NULL);
+	rr->depth--;
+	if (rv != 0)
+		return (NULL);
+
+	ent = &(rr->cache[0]);
+	for (i = 1; i < RANGE_CACHE_CHUNKS; i++) {
+		if (rr->cache[i].used < ent->used)
+			ent = &(rr->cache[i]);
+	}
+	if (ent->buf == NULL) {
+		ent->buf = (uchar_t *)slab_alloc(NULL, rr->compressed_chunksize);
+		if (ent->buf == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory resolving dedupe reference.");
+			return (NULL);
+		}
+	}
+	tmp = ent->buf;
+	ent->buf = tdat->uncompressed_chunk;
+	tdat->uncompressed_chunk = tmp;
+	tdat->cmp_seg = tmp;
+	ent->len = tdat->len_cmp;
+	ent->id = id;
+	return (ent);
+}
+
+/*
+ * Copy len bytes at the given original file offset, decompressing the chunks
+ * that hold them as needed.
+ */
+static int
+range_ref_read(void *arg, uchar_t *buf, uint64_t len, uint64_t offset)
+{
+	struct range_res *rr = (struct range_res *)arg;
+	chunk_index_t *cidx = rr->pctx->cidx;
+	struct range_cache_ent *ent;
+	uint64_t coff, n;
+	int64_t id;
+	int i, rv;
+
+	rv = 0;
+	pthread_mutex_lock(&rr->mtx);
+	while (len > 0) {
+		id = chunk_index_find(cidx, offset);
+		if (id < 0) {
+			rv = -1;
+			break;
+		}
+		ent = NULL;
+		for (i = 0; i < RANGE_CACHE_CHUNKS; i++) {
+			if (rr->cache[i].buf && rr->cache[i].id == id) {
+				ent = &(rr->cache[i]);
+				break;
+			}
+		}
+		if (ent == NULL) {
+			ent = range_decode(rr, id);
+			if (ent == NULL) {
+				rv = -1;
+				break;
+			}
+		}
+		ent->used = ++rr->clock;
+
+		coff = offset - cidx->ents[id].orig_off;
+		if (coff >= ent->len) {
+			rv = -1;
+			break;
+		}
+		n = ent->len - coff;
+		if (n > len)
+			n = len;
+		memcpy(buf, ent->buf + coff, n);
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&rr->mtx);
+	return (rv);
+}
+
+/*
+ * Global Dedupe references are resolved by reading back earlier output. When
+ * the output is a pipe a copy of it is written to an unlinked temporary file
+ * instead, in PCOMPRESS_CACHE_DIR or else the usual temporary directory.
+ */
+static int
+spill_open(pc_ctx_t *pctx)
+{
+	char path[MAXPATHLEN], *tmp;
+
+	tmp = get_temp_dir();
+	snprintf(path, sizeof (path), "%s" PATHSEP_STR ".pcompress_spillXXXXXX", tmp);
+	free(tmp);
+	if ((pctx->spill_fd = mkstemp(path)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot create temporary output copy in %s ", path);
+		return (-1);
+	}
+	unlink(path);
+	return (0);
+}
+
 /*
  * File decompression routine.
  *
@@ -840,19 +1614,26 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	struct stat sbuf;
 	struct wdata w;
 	int compfd = -1, compfd2 = -1, p, dedupe_flag;
-	int uncompfd = -1, err, np, bail;
+	int uncompfd = -1, err, np, bail, store_fd = -1;
 	int thread = 0, level;
-	uint32_t nprocs = 1, i;
+	uint32_t nprocs = 1, nslots = 0, i;
 	unsigned short version, flags;
 	int64_t chunksize, compressed_chunksize;
+	uint64_t store_id, store_base;
 	struct cmp_data **dary, *tdat;
+	struct cmp_worker *wrk, *wk;
+	struct range_res *rres;
 	pthread_t writer_thr;
 	algo_props_t props;
+	double sstrt;
 
 	err = 0;
 	flags = 0;
 	thread = 0;
 	dary = NULL;
+	wrk = NULL;
+	rres = NULL;
+	pctx->blk_cache = NULL;
 	init_algo_props(&props);
 
 	/*
@@ -917,6 +1698,19 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	chunksize = ntohll(chunksize);
 	level = ntohl(level);
 
+	/*
+	 * Files that reference a persistent dedupe store carry the store id and
+	 * the store offset where the data of the compressing run began.
+	 */
+	store_id = store_base = 0;
+	if (flags & FLAG_DEDUP_STORE) {
+		if (Read(compfd, &store_id, sizeof (store_id)) < sizeof (store_id) ||
+		    Read(compfd, &store_base, sizeof (store_base)) < sizeof (store_base)) {
+			log_msg(LOG_ERR, 1, "Read: ");
+			UNCOMP_BAIL;
+		}
+	}
+
 	/*
 	 * Check for ridiculous values (malicious tampering or otherwise).
 	 */
@@ -936,7 +1730,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		err = 1;
 		goto uncomp_done;
 	}
-	if (version < VERSION-4) {
+	if (version < VERSION_COMPAT-4) {
 		log_msg(LOG_ERR, 0, "Unsupported version: %d", version);
 		err = 1;
 		goto uncomp_done;
@@ -1040,7 +1834,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				log_msg(LOG_WARN, 0, "Using %s for output file name.", to_filename);
 			}
 		}
-		if (!pctx->pipe_mode) {
+		if (to_filename != NULL) {
 			origf = to_filename;
 			if ((to_filename = realpath(origf, NULL)) != NULL) {
 				free((void *)(to_filename));
@@ -1067,11 +1861,13 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		pctx->enable_rabin_scan = 1;
 		dedupe_flag = RABIN_DEDUPE_SEGMENTED;
 
+		if (flags & FLAG_DEDUP_GEAR)
+			pctx->dedupe_cdc = DEDUPE_CDC_GEAR;
+
 		if (flags & FLAG_DEDUP_FIXED) {
 			if (version > 7) {
-				if (pctx->pipe_mode) {
-					log_msg(LOG_ERR, 0, "Global Deduplication is not "
-					    "supported with pipe mode.");
+				if (to_filename == NULL && !(flags & FLAG_ARCHIVE) &&
+				    spill_open(pctx) == -1) {
 					err = 1;
 					goto uncomp_done;
 				}
@@ -1087,6 +1883,37 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		pctx->enable_fixed_scan = 1;
 		dedupe_flag = RABIN_DEDUPE_FIXED;
 	}
+	if ((flags & FLAG_DEDUP_GEAR) && !(flags & FLAG_DEDUP)) {
+		log_msg(LOG_ERR, 0, "Invalid file deduplication flags.");
+		err = 1;
+		goto uncomp_done;
+	}
+
+	/*
+	 * Global Dedupe references to blocks from earlier runs are resolved from
+	 * the persistent dedupe store.
+	 */
+	if (flags & FLAG_DEDUP_STORE) {
+		char spath[MAXPATHLEN];
+
+		if (!pctx->enable_rabin_global) {
+			log_msg(LOG_ERR, 0, "Invalid file deduplication flags.");
+			err = 1;
+			goto uncomp_done;
+		}
+		if (pctx->dedupe_store == NULL) {
+			log_msg(LOG_ERR, 0, "This file references a dedupe store. Specify the "
+			    "store directory with -R.");
+			err = 1;
+			goto uncomp_done;
+		}
+		snprintf(spath, sizeof (spath), "%s/data", pctx->dedupe_store);
+		if ((store_fd = open(spath, O_RDONLY)) == -1) {
+			log_msg(LOG_ERR, 1, "Cannot open dedupe store %s ", spath);
+			err = 1;
+			goto uncomp_done;
+		}
+	}
 
 	if (flags & FLAG_SINGLE_CHUNK) {
 		props.is_single_chunk = 1;
@@ -1142,7 +1969,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		if (version < 7)
 			pctx->keylen = OLD_KEYLEN;
 
-		if (pctx->encrypt_type == CRYPTO_ALG_AES) {
+		if (CRYPTO_ALG_IS_AES(pctx->encrypt_type)) {
 			noncelen = 8;
 		} else if (pctx->encrypt_type == CRYPTO_ALG_SALSA20) {
 			noncelen = XSALSA20_CRYPTO_NONCEBYTES;
@@ -1174,7 +2001,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			UNCOMP_BAIL;
 		}
 
-		if (pctx->encrypt_type == CRYPTO_ALG_AES) {
+		if (CRYPTO_ALG_IS_AES(pctx->encrypt_type)) {
 			U64_P(nonce) = ntohll(U64_P(n1));
 
 		} else if (pctx->encrypt_type == CRYPTO_ALG_SALSA20) {
@@ -1302,6 +2129,10 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		hmac_update(&hdr_mac, (uchar_t *)&d3, sizeof (chunksize));
 		d2 = htonl(level);
 		hmac_update(&hdr_mac, (uchar_t *)&d2, sizeof (level));
+		if (flags & FLAG_DEDUP_STORE) {
+			hmac_update(&hdr_mac, (uchar_t *)&store_id, sizeof (store_id));
+			hmac_update(&hdr_mac, (uchar_t *)&store_base, sizeof (store_base));
+		}
 		if (version > 6) {
 			d2 = htonl(saltlen);
 			hmac_update(&hdr_mac, (uchar_t *)&d2, sizeof (saltlen));
@@ -1345,6 +2176,10 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		crc2 = lzma_crc32((uchar_t *)&ch, sizeof (ch), crc2);
 		d2 = htonl(level);
 		crc2 = lzma_crc32((uchar_t *)&d2, sizeof (level), crc2);
+		if (flags & FLAG_DEDUP_STORE) {
+			crc2 = lzma_crc32((uchar_t *)&store_id, sizeof (store_id), crc2);
+			crc2 = lzma_crc32((uchar_t *)&store_base, sizeof (store_base), crc2);
+		}
 		if (crc1 != crc2) {
 			log_msg(LOG_ERR, 0, "Header verification failed! File tampered "
 			    "or wrong password.");
@@ -1352,8 +2187,80 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		}
 	}
 
+	/*
+	 * A different store than the one this file was compressed against would
+	 * only show up later as checksum failures, so refuse it upfront.
+	 */
+	if (flags & FLAG_DEDUP_STORE) {
+		if (dedupe_store_check(pctx->dedupe_store, ntohll(store_id),
+		    ntohll(store_base)) == -1) {
+			UNCOMP_BAIL;
+		}
+	}
+
+	/*
+	 * When decompressing a range, load the chunk index from the end of the file
+	 * and seek straight to the first chunk needed.
+	 */
+	if (pctx->range_len > 0) {
+		int64_t first;
+
+		if (!(flags & FLAG_CHUNK_INDEX) || (flags & FLAG_ARCHIVE)) {
+			log_msg(LOG_ERR, 0, "Range decompression needs a file compressed "
+			    "with '-I'.");
+			UNCOMP_BAIL;
+		}
+		pctx->cidx = chunk_index_read(compfd, pctx->cksum, pctx->mac_bytes,
+		    pctx->encrypt_type ? &(pctx->crypto_ctx) : NULL);
+		if (pctx->cidx == NULL) {
+			UNCOMP_BAIL;
+		}
+		first = chunk_index_find(pctx->cidx, pctx->range_start);
+		if (first < 0) {
+			log_msg(LOG_ERR, 0, "Range starts beyond the end of the data.");
+			UNCOMP_BAIL;
+		}
+		if (pctx->range_len > pctx->cidx->orig_size - pctx->range_start)
+			pctx->range_len = pctx->cidx->orig_size - pctx->range_start;
+		pctx->range_last = chunk_index_find(pctx->cidx,
+		    pctx->range_start + pctx->range_len - 1);
+		if (lseek(compfd, pctx->cidx->ents[first].cmp_off, SEEK_SET) == -1) {
+			log_msg(LOG_ERR, 1, "Cannot seek to chunk %" PRId64 ": ", first);
+			UNCOMP_BAIL;
+		}
+	}
+
+	/*
+	 * Extracting some members of an indexed archive. The member catalog gives
+	 * the data stream extent of each member and only the chunks covering them
+	 * are decoded. Without a catalog the whole archive is decoded and the
+	 * extractor skips the other members.
+	 */
+	if (pctx->nextract > 0 && (flags & FLAG_ARCHIVE) && (flags & FLAG_CHUNK_INDEX) &&
+	    pctx->meta_stream && !pctx->list_mode) {
+		uint64_t nsel;
+
+		pctx->cidx = chunk_index_read(compfd, pctx->cksum, pctx->mac_bytes,
+		    pctx->encrypt_type ? &(pctx->crypto_ctx) : NULL);
+		if (pctx->cidx == NULL) {
+			UNCOMP_BAIL;
+		}
+		pctx->catalog = catalog_read(compfd, pctx->cidx);
+		if (pctx->catalog == NULL) {
+			UNCOMP_BAIL;
+		}
+		pctx->chunk_sel = catalog_select(pctx->catalog, pctx->cidx,
+		    pctx->extract_paths, pctx->nextract, &nsel);
+		if (pctx->chunk_sel == NULL) {
+			UNCOMP_BAIL;
+		}
+		pctx->arc_selective = 1;
+		log_msg(LOG_INFO, 0, "Decoding %" PRIu64 " of %" PRIu64 " chunks.",
+		    nsel, pctx->cidx->nents);
+	}
+
 	if (flags & FLAG_ARCHIVE) {
-		if (pctx->enable_rabin_global) {
+		if (pctx->enable_rabin_global && !pctx->arc_selective) {
 			char cwd[MAXPATHLEN];
 
 			if (to_filename[0] != PATHSEP_CHAR) {
@@ -1402,6 +2309,20 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			}
 		}
 
+		/*
+		 * Listing with a metadata stream never reads file data. The extractor
+		 * skips over it and is handed this dummy buffer for any leftover
+		 * partial reads. It must be in place before the extractor starts.
+		 */
+		if (pctx->list_mode && pctx->meta_stream) {
+			pctx->temp_mmap_buf = (uchar_t *)slab_alloc(NULL, chunksize);
+			if (pctx->temp_mmap_buf == NULL) {
+				log_msg(LOG_ERR, 0, "Out of memory.");
+				UNCOMP_BAIL;
+			}
+			pctx->temp_mmap_len = chunksize;
+		}
+
 		uncompfd = -1;
 		if (setup_extractor(pctx) == -1) {
 			log_msg(LOG_ERR, 0, "Setup of extraction context failed.");
@@ -1413,7 +2334,16 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			UNCOMP_BAIL;
 		}
 	} else {
-		if (!pctx->pipe_mode) {
+		if (pctx->nextract > 0) {
+			log_msg(LOG_ERR, 0, "Member names can only be given when "
+			    "extracting an archive.");
+			UNCOMP_BAIL;
+		}
+
+		/*
+		 * Input from a pipe can still be decompressed to a named file.
+		 */
+		if (to_filename != NULL) {
 			if ((uncompfd = open(to_filename, O_WRONLY|O_CREAT|O_TRUNC,
 			    S_IRUSR|S_IWUSR)) == -1) {
 				log_msg(LOG_ERR, 1, "Cannot open: %s", to_filename);
@@ -1451,23 +2381,27 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	 * metadata stream, then we do not do any data decompression. Only
 	 * metadata is decompressed.
 	 */
-	if (pctx->list_mode && pctx->meta_stream) {
+	if (pctx->list_mode && pctx->meta_stream)
 		pctx->nthreads = 0;
-		pctx->temp_mmap_buf = (uchar_t *)slab_alloc(NULL, chunksize);
-		pctx->temp_mmap_len = chunksize;
-	}
 
 	if (pctx->nthreads * props.nthreads > 1)
 		log_msg(LOG_INFO, 0, "Scaling to %d threads", pctx->nthreads * props.nthreads);
 	else
 		log_msg(LOG_INFO, 0, "Scaling to 1 thread");
 	nprocs = pctx->nthreads;
+	nslots = sched_nslots(nprocs, compressed_chunksize * 2, 0);
 	slab_cache_add(compressed_chunksize);
 	slab_cache_add(chunksize);
 	slab_cache_add(sizeof (struct cmp_data));
 
-	dary = (struct cmp_data **)slab_calloc(NULL, nprocs, sizeof (struct cmp_data *));
-	for (i = 0; i < nprocs; i++) {
+	dary = (struct cmp_data **)slab_calloc(NULL, nslots, sizeof (struct cmp_data *));
+	wrk = (struct cmp_worker *)slab_calloc(NULL, nprocs, sizeof (struct cmp_worker));
+	if ((nslots > 0 && (!dary || !wrk)) || sched_init(pctx, nslots, nprocs, 1) == -1 ||
+	    stage_stats_init(pctx, wrk, nprocs) == -1) {
+		log_msg(LOG_ERR, 0, "1: Out of memory");
+		UNCOMP_BAIL;
+	}
+	for (i = 0; i < nslots; i++) {
 		dary[i] = (struct cmp_data *)slab_alloc(NULL, sizeof (struct cmp_data));
 		if (!dary[i]) {
 			log_msg(LOG_ERR, 0, "1: Out of memory");
@@ -1482,6 +2416,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		tdat->decompress = pctx->_decompress_func;
 		tdat->cancel = 0;
 		tdat->decompressing = 1;
+		tdat->numa_node = 0;
 		if (props.is_single_chunk) {
 			tdat->cksum_mt = 1;
 			if (version == 6) {
@@ -1492,14 +2427,62 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		}
 		tdat->level = level;
 		tdat->data = NULL;
+		tdat->rctx = NULL;
+		tdat->chunk_hmac = NULL;
 		tdat->props = &props;
-		Sem_Init(&(tdat->start_sem), 0, 0);
 		Sem_Init(&(tdat->cmp_done_sem), 0, 0);
 		Sem_Init(&(tdat->write_done_sem), 0, 1);
 		Sem_Init(&(tdat->index_sem), 0, 0);
+	}
+
+	/*
+	 * Global dedupe recovery is sequenced in chunk order, hence around the ring
+	 * of chunk slots.
+	 */
+	for (i = 0; i < nslots; i++) {
+		dary[i]->index_sem_next = &(dary[(i + 1) % nslots]->index_sem);
+	}
+
+	/*
+	 * Global Dedupe references in a range are resolved from the compressed file.
+	 */
+	if (pctx->cidx && pctx->enable_rabin_global) {
+		rres = range_res_create(pctx, compfd, store_fd, &props, level, dedupe_flag,
+		    version, chunksize, compressed_chunksize);
+		if (rres == NULL) {
+			log_msg(LOG_ERR, 0, "Cannot set up dedupe reference resolution.");
+			UNCOMP_BAIL;
+		}
+	}
+
+	/*
+	 * Otherwise they are read back from the output file through a shared
+	 * block cache.
+	 */
+	if (!rres && pctx->enable_rabin_global) {
+		uint64_t cmem = DEDUPE_CACHE_MEM;
+		char *val;
+
+		if ((val = getenv("PCOMPRESS_DEDUPE_CACHE")) != NULL)
+			cmem = strtoull(val, NULL, 0) * 1024 * 1024;
+		if (cmem > 0) {
+			pctx->blk_cache = block_cache_create(cmem, DEDUPE_CACHE_BLKSZ);
+			if (pctx->blk_cache == NULL) {
+				log_msg(LOG_ERR, 0, "Cannot allocate dedupe block cache.");
+				UNCOMP_BAIL;
+			}
+		}
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		wk = &wrk[i];
+		wk->pctx = pctx;
+		wk->level = level;
+		wk->data = NULL;
+		wk->rctx = NULL;
 
 		if (pctx->_init_func) {
-			if (pctx->_init_func(&(tdat->data), &(tdat->level), props.nthreads, chunksize,
+			if (pctx->_init_func(&(wk->data), &(wk->level), props.nthreads, chunksize,
 			    version, DECOMPRESS) != 0) {
 				UNCOMP_BAIL;
 			}
@@ -1509,22 +2492,35 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		 * The last parameter is freeram. It is not needed during decompression.
 		 */
 		if (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) {
-			tdat->rctx = create_dedupe_context(chunksize, compressed_chunksize,
+			wk->rctx = create_dedupe_context(chunksize, compressed_chunksize,
 			    pctx->rab_blk_size, pctx->algo, &props, pctx->enable_delta_encode,
-			    dedupe_flag, version, DECOMPRESS, 0, NULL, pctx->pipe_mode, nprocs, 0);
-			if (tdat->rctx == NULL) {
+			    dedupe_flag, version, DECOMPRESS, 0, NULL, NULL, pctx->pipe_mode,
+			    nprocs, 0);
+			if (wk->rctx == NULL) {
 				UNCOMP_BAIL;
 			}
-			if (pctx->enable_rabin_global) {
-				if (pctx->archive_mode) {
-					if ((tdat->rctx->out_fd = open(pctx->archive_temp_file,
+			wk->rctx->store_fd = store_fd;
+			wk->rctx->cdc_type = pctx->dedupe_cdc;
+			wk->rctx->sstats = wk->sstats;
+			if (rres) {
+				wk->rctx->ref_read = range_ref_read;
+				wk->rctx->ref_arg = rres;
+			} else if (pctx->enable_rabin_global) {
+				wk->rctx->blk_cache = pctx->blk_cache;
+				if (pctx->spill_fd != -1) {
+					/*
+					 * Only pread() is done on it, so it can be shared.
+					 */
+					wk->rctx->out_fd = pctx->spill_fd;
+				} else if (pctx->archive_mode) {
+					if ((wk->rctx->out_fd = open(pctx->archive_temp_file,
 					    O_RDONLY, 0)) == -1) {
 						log_msg(LOG_ERR, 1, "Unable to get new read handle"
 						    " to output file");
 						UNCOMP_BAIL;
 					}
 				} else {
-					if ((tdat->rctx->out_fd = open(to_filename, O_RDONLY, 0))
+					if ((wk->rctx->out_fd = open(to_filename, O_RDONLY, 0))
 					    == -1) {
 						log_msg(LOG_ERR, 1, "Unable to get new read handle"
 						    " to output file");
@@ -1532,33 +2528,24 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 					}
 				}
 			}
-			tdat->rctx->index_sem = &(tdat->index_sem);
-		} else {
-			tdat->rctx = NULL;
 		}
 
 		if (pctx->encrypt_type) {
-			if (hmac_init(&tdat->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
+			if (hmac_init(&wk->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
 				log_msg(LOG_ERR, 0, "Cannot initialize chunk hmac.");
 				UNCOMP_BAIL;
 			}
 		}
-		if (pthread_create(&(tdat->thr), NULL, perform_decompress,
-		    (void *)tdat) != 0) {
+		if (pthread_create(&(wk->thr), NULL, perform_decompress,
+		    (void *)wk) != 0) {
 			log_msg(LOG_ERR, 1, "Error in thread creation: ");
 			UNCOMP_BAIL;
 		}
 	}
 	thread = 1;
 
-	if (pctx->enable_rabin_global) {
-		for (i = 0; i < nprocs; i++) {
-			tdat = dary[i];
-			tdat->rctx->index_sem_next = &(dary[(i + 1) % nprocs]->index_sem);
-		}
-	}
-	// When doing global dedupe first thread does not wait to start dedupe recovery.
-	if (nprocs > 0)
+	// When doing global dedupe first chunk does not wait to start dedupe recovery.
+	if (nslots > 0)
 		Sem_Post(&(dary[0]->index_sem));
 
 	if (pctx->encrypt_type) {
@@ -1569,7 +2556,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	if (!(pctx->list_mode && pctx->meta_stream)) {
 		w.dary = dary;
 		w.wfd = uncompfd;
-		w.nprocs = nprocs;
+		w.nprocs = nslots;
 		w.chunksize = chunksize;
 		w.pctx = pctx;
 		if (pthread_create(&writer_thr, NULL, writer_thread, (void *)(&w)) != 0) {
@@ -1582,30 +2569,63 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	/*
 	 * Now read from the compressed file in variable compressed chunk size.
 	 * First the size is read from the chunk header and then as many bytes +
-	 * checksum size are read and passed to decompression thread.
+	 * checksum size are read and queued for the next free decompression thread.
 	 * Chunk sequencing is ensured.
 	 */
 	pctx->chunk_num = 0;
+	if (pctx->cidx)
+		pctx->chunk_num = chunk_index_find(pctx->cidx, pctx->range_start);
 	np = 0;
 	bail = 0;
-	if (nprocs == 0)
+	if (nslots == 0)
 		bail = 1;
 	while (!bail) {
 		int64_t rb;
 
 		if (pctx->main_cancel) break;
-		for (p = 0; p < nprocs; p++) {
+		for (p = 0; p < nslots; p++) {
 			np = p;
 			tdat = dary[p];
+			sstrt = stage_begin(STAGE_READER(pctx));
 			Sem_Wait(&tdat->write_done_sem);
+			stage_end(STAGE_READER(pctx), STAGE_SEM_WAIT, sstrt, 0);
 			if (pctx->main_cancel) break;
 			tdat->id = pctx->chunk_num;
-			if (tdat->rctx) tdat->rctx->id = tdat->id;
+			if (pctx->chunk_sel) {
+				/*
+				 * Only chunks covering the selected members are decoded.
+				 * Seek over the rest.
+				 */
+				if (!pctx->chunk_sel[pctx->chunk_num]) {
+					while (pctx->chunk_num < pctx->cidx->nents &&
+					    !pctx->chunk_sel[pctx->chunk_num])
+						++(pctx->chunk_num);
+					if (pctx->chunk_num == pctx->cidx->nents) {
+						bail = 1;
+						break;
+					}
+					if (lseek(compfd, pctx->cidx->ents[pctx->chunk_num].cmp_off,
+					    SEEK_SET) == -1) {
+						log_msg(LOG_ERR, 1, "Cannot seek to chunk %d: ",
+						    pctx->chunk_num);
+						UNCOMP_BAIL;
+					}
+				}
+				tdat->id = pctx->chunk_num;
+				tdat->file_offset = pctx->cidx->ents[pctx->chunk_num].orig_off;
+			} else if (pctx->cidx) {
+				if (pctx->chunk_num > pctx->range_last) {
+					bail = 1;
+					break;
+				}
+				tdat->file_offset = pctx->cidx->ents[pctx->chunk_num].orig_off;
+			}
 
 redo:
 			/*
 			 * First read length of compressed chunk.
 			 */
+			sstrt = stage_begin(STAGE_READER(pctx));
 			rb = Read(compfd, &tdat->len_cmp, sizeof (tdat->len_cmp));
 			if (rb != sizeof (tdat->len_cmp)) {
 				if (rb < 0) log_msg(LOG_ERR, 1, "Read: ");
@@ -1692,6 +2712,8 @@ redo:
 				rb = tdat->len_cmp + pctx->cksum_bytes + pctx->mac_bytes +
 				    CHUNK_FLAG_SZ;
 				tdat->rbytes = Read(compfd, tdat->compressed_chunk, rb);
+				stage_end(STAGE_READER(pctx), STAGE_READ, sstrt,
+				    tdat->rbytes > 0 ? tdat->rbytes : 0);
 			} else {
 				off_t cpos = lseek(compfd, 0, SEEK_CUR);
 
@@ -1719,13 +2741,13 @@ redo:
 			if (tdat->len_cmp == METADATA_INDICATOR) {
 				goto redo;
 			}
-			Sem_Post(&tdat->start_sem);
+			sched_put(pctx, tdat);
 			++(pctx->chunk_num);
 		}
 	}
 
 	if (!pctx->main_cancel) {
-		for (p = 0; p < nprocs; p++) {
+		for (p = 0; p < nslots; p++) {
 			if (p == np) continue;
 			tdat = dary[p];
 			Sem_Wait(&tdat->write_done_sem);
@@ -1737,17 +2759,27 @@ redo:
 uncomp_done:
 	if (pctx->t_errored) err = pctx->t_errored;
 	if (thread) {
-		for (i = 0; i < nprocs; i++) {
+		for (i = 0; i < nslots; i++) {
 			tdat = dary[i];
 			tdat->cancel = 1;
 			tdat->len_cmp = 0;
-			Sem_Post(&tdat->start_sem);
 			Sem_Post(&tdat->cmp_done_sem);
-			pthread_join(tdat->thr, NULL);
 		}
+		if (pctx->main_cancel || pctx->t_errored)
+			dedupe_abort(wrk[0].rctx);
+		sched_stop(pctx, wrk, nprocs);
 		if (thread == 2)
 			pthread_join(writer_thr, NULL);
 	}
+	range_res_destroy(rres);
+	chunk_index_destroy(pctx->cidx);
+	pctx->cidx = NULL;
+	catalog_destroy(pctx->catalog);
+	pctx->catalog = NULL;
+	free(pctx->chunk_sel);
+	pctx->chunk_sel = NULL;
+	if (store_fd != -1)
+		close(store_fd);
 
 	/*
 	 * Ownership and mode of target should be same as original.
@@ -1757,19 +2789,23 @@ uncomp_done:
 		if (fchown(uncompfd, sbuf.st_uid, sbuf.st_gid) == -1)
 			log_msg(LOG_ERR, 1, "Chown ");
 	}
-	if (dary != NULL) {
+	if (wrk != NULL) {
 		for (i = 0; i < nprocs; i++) {
+			if (pctx->_deinit_func)
+				pctx->_deinit_func(&(wrk[i].data));
+			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
+				destroy_dedupe_context(wrk[i].rctx);
+			}
+		}
+		slab_release(NULL, wrk);
+	}
+	if (dary != NULL) {
+		for (i = 0; i < nslots; i++) {
 			if (!dary[i]) continue;
 			if (dary[i]->uncompressed_chunk)
 				slab_release(NULL, dary[i]->uncompressed_chunk);
 			if (dary[i]->compressed_chunk)
 				slab_release(NULL, dary[i]->compressed_chunk);
-			if (pctx->_deinit_func)
-				pctx->_deinit_func(&(dary[i]->data));
-			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
-				destroy_dedupe_context(dary[i]->rctx);
-			}
-			Sem_Destroy(&(dary[i]->start_sem));
 			Sem_Destroy(&(dary[i]->cmp_done_sem));
 			Sem_Destroy(&(dary[i]->write_done_sem));
 			Sem_Destroy(&(dary[i]->index_sem));
@@ -1778,12 +2814,17 @@ uncomp_done:
 		}
 		slab_release(NULL, dary);
 	}
+	sched_destroy(pctx);
 	if (!pctx->pipe_mode) {
 		if (filename && compfd != -1) close(compfd);
 		if (uncompfd != -1) close(uncompfd);
+	} else if (to_filename != NULL && uncompfd != -1) {
+		close(uncompfd);
 	}
 	if (pctx->archive_mode) {
 		pthread_join(pctx->archive_thread, NULL);
+		if (pctx->extract_errored)
+			err = 1;
 		if (pctx->meta_stream) {
 			meta_ctx_done(pctx->meta_ctx);
 			if (pctx->list_mode) {
@@ -1798,38 +2839,86 @@ uncomp_done:
 		Sem_Destroy(&(pctx->write_sem));
 	}
 
+	stage_stats_fini(pctx, "decompress");
 	if (!pctx->hide_cmp_stats) show_compression_stats(pctx);
+	block_cache_destroy(pctx->blk_cache);
+	pctx->blk_cache = NULL;
+	if (pctx->spill_fd != -1) {
+		close(pctx->spill_fd);
+		pctx->spill_fd = -1;
+	}
 
 	return (err);
 }
 
+/*
+ * Sample the chunk data about to be compressed and predict whether compressing
+ * it is worthwhile. Returns 1 if the chunk should be stored as-is.
+ */
+static int
+probe_chunk(pc_ctx_t *pctx, struct cmp_data *tdat, uchar_t *buf, uint64_t len)
+{
+	double strt;
+	int pct;
+
+	if (pctx->probe_pct <= 0)
+		return (0);
+
+	strt = get_wtime_millis();
+	pct = analyze_compressibility(buf, len);
+	tdat->probe_ms = get_wtime_millis() - strt;
+	if (tdat->sstats)
+		stage_add(tdat->sstats, STAGE_ANALYZE, tdat->probe_ms, len);
+	if (pct >= pctx->probe_pct) {
+		tdat->probe_skipped = 1;
+		return (1);
+	}
+	return (0);
+}
+
 static void *
 perform_compress(void *dat) {
-	struct cmp_data *tdat = (struct cmp_data *)dat;
+	struct cmp_worker *wk = (struct cmp_worker *)dat;
+	struct cmp_data *tdat;
 	typeof (tdat->chunksize) _chunksize, len_cmp, dedupe_index_sz, index_size_cmp;
 	int type, rv;
 	uchar_t *compressed_chunk;
 	int64_t rbytes;
+	double cstrt, sstrt, wstrt;
 	pc_ctx_t *pctx;
+	stage_stats_t *ss;
 
-	pctx = tdat->pctx;
+	pctx = wk->pctx;
+	ss = wk->sstats;
+	wstrt = 0;
 redo:
-	Sem_Wait(&tdat->start_sem);
+	tdat = sched_get(wk);
+	if (tdat == NULL)
+		return (0);
 	if (unlikely(tdat->cancel)) {
 		tdat->len_cmp = 0;
 		Sem_Post(&tdat->cmp_done_sem);
 		return (0);
 	}
+	if (pctx->numa) {
+		wstrt = get_wtime_millis();
+		wk->numa_bytes += tdat->rbytes;
+	}
 
 	compressed_chunk = tdat->compressed_chunk + CHUNK_FLAG_SZ;
 	rbytes = tdat->rbytes;
 	dedupe_index_sz = 0;
 	type = COMPRESSED;
+	tdat->probe_skipped = 0;
+	tdat->probe_ms = 0;
+	tdat->cmp_ms = 0;
+	tdat->cmp_bytes = 0;
 
 	/* Perform Dedup if enabled. */
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
 		dedupe_context_t *rctx;
 		uint64_t rb = tdat->rbytes;
+		double iwait;
 
 		/*
 		 * Compute checksum of original uncompressed chunk. When doing dedup
@@ -1837,15 +2926,21 @@ redo:
 		 * into uncompressed_chunk so that compress transforms uncompressed_chunk
 		 * back into cmp_seg. Avoids an extra memcpy().
 		 */
-		if (!pctx->encrypt_type)
+		if (!pctx->encrypt_type && !tdat->cksum_fused) {
+			sstrt = stage_begin(ss);
 			compute_checksum(tdat->checksum, pctx->cksum, tdat->cmp_seg, tdat->rbytes,
 					 tdat->cksum_mt, 1);
+			stage_end(ss, STAGE_CHECKSUM, sstrt, tdat->rbytes);
+		}
 
 		rctx = tdat->rctx;
 		reset_dedupe_context(tdat->rctx);
 		rctx->cbuf = tdat->uncompressed_chunk;
+		sstrt = stage_begin(ss);
+		iwait = stage_total(ss, STAGE_INDEX_WAIT);
 		dedupe_index_sz = dedupe_compress(tdat->rctx, tdat->cmp_seg, &rb, 0,
 						  NULL, tdat->cksum_mt);
+		stage_end_outer(ss, STAGE_DEDUPE, sstrt, rbytes, STAGE_INDEX_WAIT, iwait);
 		tdat->rbytes = rb;
 		if (!rctx->valid) {
 			memcpy(tdat->uncompressed_chunk, tdat->cmp_seg, rbytes);
@@ -1855,9 +2950,12 @@ redo:
 		/*
 		 * Compute checksum of original uncompressed chunk.
 		 */
-		if (!pctx->encrypt_type)
+		if (!pctx->encrypt_type && !tdat->cksum_fused) {
+			sstrt = stage_begin(ss);
 			compute_checksum(tdat->checksum, pctx->cksum, tdat->uncompressed_chunk,
 					 tdat->rbytes, tdat->cksum_mt, 1);
+			stage_end(ss, STAGE_CHECKSUM, sstrt, tdat->rbytes);
+		}
 	}
 
 	/*
@@ -1883,10 +2981,12 @@ redo:
 
 		if (dedupe_index_sz >= 90) {
 			/* Compress index if it is at least 90 bytes. */
+			sstrt = stage_begin(ss);
 			rv = lzma_compress(tdat->uncompressed_chunk + RABIN_HDR_SIZE,
 			    dedupe_index_sz, compressed_chunk + RABIN_HDR_SIZE,
 			    &index_size_cmp, tdat->rctx->level, 255, TYPE_BINARY,
 			    tdat->rctx->lzma_data);
+			stage_end(ss, STAGE_CODEC, sstrt, dedupe_index_sz);
 
 			/* 
 			 * If index compression fails or does not produce a smaller result
@@ -1909,24 +3009,34 @@ plain_index:
 		o_chunksize = _chunksize;
 
 		/* Compress data chunk. */
+		cstrt = get_wtime_millis();
 		if (_chunksize == 0) {
 			rv = -1;
+		} else if (probe_chunk(pctx, tdat, tdat->uncompressed_chunk + dedupe_index_sz,
+		    _chunksize)) {
+			rv = -1;
 		} else if (pctx->preprocess_mode) {
 			rv = preproc_compress(pctx, tdat->compress,
 			    tdat->uncompressed_chunk + dedupe_index_sz, _chunksize,
 			    compressed_chunk + index_size_cmp, &_chunksize, tdat->level, 0,
-			    tdat->btype, tdat->data, tdat->props, tdat->interesting);
+			    tdat->btype, tdat->data, tdat->props, tdat->interesting, ss);
 		} else {
 			DEBUG_STAT_EN(double strt, en);
 
 			DEBUG_STAT_EN(strt = get_wtime_millis());
+			sstrt = stage_begin(ss);
 			rv = tdat->compress(tdat->uncompressed_chunk + dedupe_index_sz,
 			    _chunksize, compressed_chunk + index_size_cmp, &_chunksize,
 			    tdat->level, 0, tdat->btype, tdat->data);
+			stage_end(ss, STAGE_CODEC, sstrt, o_chunksize);
 			DEBUG_STAT_EN(en = get_wtime_millis());
 			DEBUG_STAT_EN(fprintf(stderr, "Chunk compression speed %.3f MB/s\n",
 					      get_mb_s(_chunksize, strt, en)));
 		}
+		if (!tdat->probe_skipped && o_chunksize > 0) {
+			tdat->cmp_ms = get_wtime_millis() - cstrt;
+			tdat->cmp_bytes = o_chunksize;
+		}
 
 		/* Can't compress data just retain as-is. */
 		if (rv < 0 || _chunksize >= o_chunksize) {
@@ -1940,21 +3050,30 @@ plain_index:
 		_chunksize += index_size_cmp;
 	} else {
 		_chunksize = tdat->rbytes;
-		if (pctx->preprocess_mode) {
+		cstrt = get_wtime_millis();
+		if (probe_chunk(pctx, tdat, tdat->uncompressed_chunk, tdat->rbytes)) {
+			rv = -1;
+		} else if (pctx->preprocess_mode) {
 			rv = preproc_compress(pctx, tdat->compress, tdat->uncompressed_chunk,
 			    tdat->rbytes, compressed_chunk, &_chunksize, tdat->level, 0,
-			    tdat->btype, tdat->data, tdat->props, tdat->interesting);
+			    tdat->btype, tdat->data, tdat->props, tdat->interesting, ss);
 		} else {
 			DEBUG_STAT_EN(double strt, en);
 
 			DEBUG_STAT_EN(strt = get_wtime_millis());
+			sstrt = stage_begin(ss);
 			rv = tdat->compress(tdat->uncompressed_chunk, tdat->rbytes,
 			    compressed_chunk, &_chunksize, tdat->level, 0, tdat->btype,
 			    tdat->data);
+			stage_end(ss, STAGE_CODEC, sstrt, tdat->rbytes);
 			DEBUG_STAT_EN(en = get_wtime_millis());
 			DEBUG_STAT_EN(fprintf(stderr, "Chunk compression speed %.3f MB/s\n",
 					      get_mb_s(_chunksize, strt, en)));
 		}
+		if (!tdat->probe_skipped) {
+			tdat->cmp_ms = get_wtime_millis() - cstrt;
+			tdat->cmp_bytes = tdat->rbytes;
+		}
 	}
 
 	/*
@@ -1979,9 +3098,11 @@ plain_index:
 	}
 
 	/*
-	 * Now perform encryption on the compressed data, if requested.
+	 * Now perform encryption on the compressed data, if requested. AEAD
+	 * algorithms encrypt further below, together with authenticating the
+	 * chunk header.
 	 */
-	if (pctx->encrypt_type) {
+	if (pctx->encrypt_type && !CRYPTO_ALG_IS_AEAD(pctx->encrypt_type)) {
 		int ret;
 		DEBUG_STAT_EN(double strt, en);
 
@@ -1990,6 +3111,7 @@ plain_index:
 		 * encryption is in-place.
 		 */
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		sstrt = stage_begin(ss);
 		ret = crypto_buf(&(pctx->crypto_ctx), compressed_chunk, compressed_chunk,
 			tdat->len_cmp, tdat->id);
 		if (ret == -1) {
@@ -2005,6 +3127,7 @@ plain_index:
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "Encryption speed %.3f MB/s\n",
 			      get_mb_s(tdat->len_cmp, strt, en)));
+		stage_end(ss, STAGE_CRYPTO, sstrt, tdat->len_cmp);
 	}
 
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan) && tdat->rctx->valid) {
@@ -2050,9 +3173,39 @@ plain_index:
 	*(tdat->compressed_chunk) = type;
 
 	/*
-	 * If encrypting, compute HMAC for full chunk including header.
+	 * If encrypting, compute HMAC for full chunk including header. With an AEAD
+	 * algorithm the data is encrypted and authenticated in one pass. The header
+	 * and the original chunk size, if present, are the additional data and the
+	 * tag goes into the MAC field.
 	 */
-	if (pctx->encrypt_type) {
+	sstrt = stage_begin(ss);
+	if (CRYPTO_ALG_IS_AEAD(pctx->encrypt_type)) {
+		uchar_t *mac_ptr;
+		uchar_t aad[rbytes + ORIGINAL_CHUNKSZ];
+		int aadlen;
+
+		mac_ptr = tdat->cmp_seg + sizeof (tdat->len_cmp) + pctx->cksum_bytes;
+		memset(mac_ptr, 0, pctx->mac_bytes);
+		memcpy(aad, tdat->cmp_seg, rbytes);
+		aadlen = rbytes;
+		if (type & CHSIZE_MASK) {
+			memcpy(aad + aadlen, tdat->cmp_seg + tdat->len_cmp - ORIGINAL_CHUNKSZ,
+			    ORIGINAL_CHUNKSZ);
+			aadlen += ORIGINAL_CHUNKSZ;
+		}
+		if (crypto_aead_buf(&(pctx->crypto_ctx), compressed_chunk, compressed_chunk,
+		    tdat->len_cmp - aadlen, aad, aadlen, mac_ptr, tdat->id) == -1) {
+			/*
+			 * Encryption failure is fatal.
+			 */
+			pctx->main_cancel = 1;
+			tdat->len_cmp = 0;
+			pctx->t_errored = 1;
+			Sem_Post(&tdat->cmp_done_sem);
+			return (0);
+		}
+		stage_end(ss, STAGE_CRYPTO, sstrt, tdat->len_cmp);
+	} else if (pctx->encrypt_type) {
 		uchar_t *mac_ptr;
 		unsigned int hlen;
 		uchar_t chash[pctx->mac_bytes];
@@ -2062,9 +3215,9 @@ plain_index:
 		DEBUG_STAT_EN(strt = get_wtime_millis());
 		mac_ptr = tdat->cmp_seg + sizeof (tdat->len_cmp) + pctx->cksum_bytes;
 		memset(mac_ptr, 0, pctx->mac_bytes);
-		hmac_reinit(&tdat->chunk_hmac);
-		hmac_update(&tdat->chunk_hmac, tdat->cmp_seg, tdat->len_cmp);
-		hmac_final(&tdat->chunk_hmac, chash, &hlen);
+		hmac_reinit(tdat->chunk_hmac);
+		hmac_update(tdat->chunk_hmac, tdat->cmp_seg, tdat->len_cmp);
+		hmac_final(tdat->chunk_hmac, chash, &hlen);
 		serialize_checksum(chash, mac_ptr, hlen);
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "HMAC Computation speed %.3f MB/s\n",
@@ -2085,24 +3238,41 @@ plain_index:
 			    ORIGINAL_CHUNKSZ, crc);
 		U32_P(mac_ptr) = htonl(crc);
 	}
+	if (!CRYPTO_ALG_IS_AEAD(pctx->encrypt_type))
+		stage_end(ss, STAGE_CHECKSUM, sstrt, pctx->encrypt_type ? tdat->len_cmp : rbytes);
+	if (pctx->numa)
+		wk->numa_ms += get_wtime_millis() - wstrt;
 
 	Sem_Post(&tdat->cmp_done_sem);
 	goto redo;
 }
 
+/*
+ * Chunks can complete out of order since any worker may pick up any chunk.
+ * The writer drains the slots in chunk sequence, holding back completed
+ * chunks till all preceding ones have been written out.
+ */
 static void *
 writer_thread(void *dat) {
 	int p;
 	struct wdata *w = (struct wdata *)dat;
 	struct cmp_data *tdat;
 	int64_t wbytes;
+	uchar_t *wbuf;
+	uint64_t wlen;
+	int cidx_err;
 	pc_ctx_t *pctx;
+	stage_stats_t *ss;
+	double sstrt;
 
 	pctx = w->pctx;
+	ss = STAGE_WRITER(pctx);
 repeat:
 	for (p = 0; p < w->nprocs; p++) {
 		tdat = w->dary[p];
+		sstrt = stage_begin(ss);
 		Sem_Wait(&tdat->cmp_done_sem);
+		stage_end(ss, STAGE_SEM_WAIT, sstrt, 0);
 		if (tdat->len_cmp == 0) {
 			goto do_cancel;
 		}
@@ -2113,33 +3283,84 @@ repeat:
 			if (tdat->len_cmp < pctx->smallest_chunk)
 				pctx->smallest_chunk = tdat->len_cmp;
 			pctx->avg_chunk += tdat->len_cmp;
+			if (tdat->probe_skipped) {
+				pctx->probe_skipped++;
+				pctx->probe_skipped_bytes += tdat->rbytes;
+			}
+			pctx->probe_ms += tdat->probe_ms;
+			pctx->probe_cmp_ms += tdat->cmp_ms;
+			pctx->probe_cmp_bytes += tdat->cmp_bytes;
+		}
+
+		/*
+		 * When decompressing a range only the part of the chunk within the
+		 * range is written.
+		 */
+		wbuf = tdat->cmp_seg;
+		wlen = tdat->len_cmp;
+		if (tdat->decompressing && pctx->range_len > 0) {
+			uint64_t cstart, cend, rend;
+
+			cstart = tdat->file_offset;
+			cend = cstart + tdat->len_cmp;
+			rend = pctx->range_start + pctx->range_len;
+			if (cstart < pctx->range_start) {
+				wbuf += pctx->range_start - cstart;
+				cstart = pctx->range_start;
+			}
+			if (cend > rend)
+				cend = rend;
+			wlen = cend > cstart ? cend - cstart : 0;
 		}
 
+		sstrt = stage_begin(ss);
+		cidx_err = 0;
 		if (pctx->archive_mode && tdat->decompressing) {
-			wbytes = archiver_write(pctx, tdat->cmp_seg, tdat->len_cmp);
+			pctx->arc_buf_off = tdat->file_offset;
+			wbytes = archiver_write(pctx, wbuf, wlen);
 		} else {
+			/*
+			 * Metadata chunks are written under the same lock, so the
+			 * index entry is added here to get this chunk's offset.
+			 */
 			pthread_mutex_lock(&pctx->write_mutex);
-			wbytes = Write(w->wfd, tdat->cmp_seg, tdat->len_cmp);
+			wbytes = Write(w->wfd, wbuf, wlen);
+			if (wbytes == wlen && pctx->do_compress && pctx->cidx) {
+				cidx_err = chunk_index_add(pctx->cidx, tdat->file_offset,
+				    tdat->len_cmp, *(tdat->compressed_chunk));
+			}
 			pthread_mutex_unlock(&pctx->write_mutex);
 		}
-		if (pctx->archive_temp_fd != -1 && wbytes == tdat->len_cmp) {
-			wbytes = Write(pctx->archive_temp_fd, tdat->cmp_seg, tdat->len_cmp);
+		if (pctx->archive_temp_fd != -1 && wbytes == wlen) {
+			wbytes = Write(pctx->archive_temp_fd, wbuf, wlen);
 		}
-		if (unlikely(wbytes != tdat->len_cmp)) {
+		if (pctx->spill_fd != -1 && wbytes == wlen) {
+			wbytes = Write(pctx->spill_fd, wbuf, wlen);
+		}
+		stage_end(ss, STAGE_WRITE, sstrt, wlen);
+		if (unlikely(wbytes != wlen)) {
 			log_msg(LOG_ERR, 1, "Chunk Write (expected: %" PRIu64
-			    ", written: %" PRId64 ") : ", tdat->len_cmp, wbytes);
+			    ", written: %" PRId64 ") : ", wlen, wbytes);
+			pctx->t_errored = 1;
 do_cancel:
 			pctx->main_cancel = 1;
 			tdat->cancel = 1;
-			Sem_Post(&tdat->start_sem);
-			if (tdat->rctx && pctx->enable_rabin_global)
-				Sem_Post(tdat->rctx->index_sem_next);
-			Sem_Post(&tdat->write_done_sem);
+			if (pctx->enable_rabin_global)
+				Sem_Post(tdat->index_sem_next);
+
+			/*
+			 * No more chunks are written, release the main thread whichever
+			 * slot it is waiting on.
+			 */
+			for (p = 0; p < w->nprocs; p++)
+				Sem_Post(&(w->dary[p]->write_done_sem));
 			return (0);
 		}
-		if (tdat->decompressing && tdat->rctx && pctx->enable_rabin_global) {
-			Sem_Post(tdat->rctx->index_sem_next);
+		if (tdat->decompressing && pctx->enable_rabin_global) {
+			Sem_Post(tdat->index_sem_next);
 		}
+		if (cidx_err != 0)
+			goto do_cancel;
 		Sem_Post(&tdat->write_done_sem);
 	}
 	goto repeat;
@@ -2158,24 +3379,38 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	struct wdata w;
 	char tmpfile1[MAXPATHLEN], tmpdir[MAXPATHLEN];
 	char to_filename[MAXPATHLEN];
-	uint64_t compressed_chunksize, n_chunksize, file_offset;
+	uint64_t compressed_chunksize, n_chunksize, file_offset = 0;
 	int64_t rbytes, rabin_count;
 	unsigned short version, flags;
 	struct stat sbuf;
 	int compfd = -1, uncompfd = -1, err;
 	int thread, bail, single_chunk;
-	uint32_t i, nprocs, np, p, dedupe_flag;
+	uint32_t i, nprocs, nslots, np, p, dedupe_flag, scan_threads, nn = 1;
 	struct cmp_data **dary = NULL, *tdat;
+	struct cmp_worker *wrk = NULL, *wk;
 	pthread_t writer_thr;
-	uchar_t *cread_buf, *pos;
+	uchar_t *cread_buf, **cread_bufs, *pos;
+	char *val;
+	double sstrt;
 	dedupe_context_t *rctx;
+	read_ahead_t *ra;
 	algo_props_t props;
 	my_sysinfo msys_info;
+	cksum_ctx_t rd_cctx;
+	uchar_t cread_cksum[CKSUM_MAX_BYTES];
+	int cksum_on_read;
 
 	init_algo_props(&props);
 	props.cksum = pctx->cksum;
 	props.buf_extra = 0;
 	cread_buf = NULL;
+	cread_bufs = NULL;
+	ra = NULL;
+	pctx->numa = NULL;
+	pctx->numa_stats = NULL;
+	pctx->numa_nnodes = 0;
+	rd_cctx.state = NULL;
+	cksum_on_read = 0;
 	pctx->btype = TYPE_UNKNOWN;
 	flags = 0;
 	sbuf.st_size = 0;
@@ -2250,6 +3485,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	}
 
 	single_chunk = 0;
+	nslots = 0;
 	rctx = NULL;
 
 	/*
@@ -2455,6 +3691,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	if (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) {
 		if (pctx->enable_rabin_global) {
 			flags |= (FLAG_DEDUP | FLAG_DEDUP_FIXED);
+			if (pctx->dedupe_store)
+				flags |= FLAG_DEDUP_STORE;
 			dedupe_flag = RABIN_DEDUPE_FILE_GLOBAL;
 		} else if (pctx->enable_rabin_scan) {
 			flags |= FLAG_DEDUP;
@@ -2463,6 +3701,9 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			flags |= FLAG_DEDUP_FIXED;
 			dedupe_flag = RABIN_DEDUPE_FIXED;
 		}
+		if (pctx->enable_rabin_scan && pctx->dedupe_cdc == DEDUPE_CDC_GEAR)
+			flags |= FLAG_DEDUP_GEAR;
+
 		/* Additional scratch space for dedup arrays. */
 		if (chunksize + dedupe_buf_extra(chunksize, 0, pctx->algo, pctx->enable_delta_encode)
 		    > compressed_chunksize) {
@@ -2485,14 +3726,51 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	else
 		log_msg(LOG_INFO, 0, "Scaling to 1 thread");
 	nprocs = pctx->nthreads;
-	dary = (struct cmp_data **)slab_calloc(NULL, nprocs, sizeof (struct cmp_data *));
+
+	/*
+	 * There is no point in having more chunk slots than chunks in the file.
+	 */
+	if (single_chunk) {
+		nslots = 1;
+	} else if (!pctx->pipe_mode && !pctx->archive_mode) {
+		nslots = sched_nslots(nprocs, compressed_chunksize * 2,
+		    (sbuf.st_size + chunksize - 1) / chunksize);
+	} else {
+		nslots = sched_nslots(nprocs, compressed_chunksize * 2, 0);
+	}
+	nn = numa_setup(pctx, uncompfd, compfd, nslots, nprocs);
+	dary = (struct cmp_data **)slab_calloc(NULL, nslots, sizeof (struct cmp_data *));
+	wrk = (struct cmp_worker *)slab_calloc(NULL, nprocs, sizeof (struct cmp_worker));
 	cread_buf = (uchar_t *)slab_alloc(NULL, compressed_chunksize);
-	if (!cread_buf) {
+	if (pctx->numa)
+		cread_bufs = (uchar_t **)slab_calloc(NULL, nn, sizeof (uchar_t *));
+	if (!cread_buf || !dary || !wrk || (pctx->numa && !cread_bufs) ||
+	    sched_init(pctx, nslots, nprocs, nn) == -1 ||
+	    stage_stats_init(pctx, wrk, nprocs) == -1) {
 		log_msg(LOG_ERR, 0, "3: Out of memory");
 		COMP_BAIL;
 	}
 
-	for (i = 0; i < nprocs; i++) {
+	for (i = 0; i < nslots; i++) {
+		/*
+		 * Slot buffers are allocated and first touched from the node that
+		 * processes them. So is the reader's spare buffer for each node.
+		 */
+		if (pctx->numa) {
+			numa_bind_self(pctx->numa, i % nn);
+			if (i < nn) {
+				if (i == 0)
+					cread_bufs[i] = cread_buf;
+				else
+					cread_bufs[i] = (uchar_t *)slab_alloc(NULL,
+					    compressed_chunksize);
+				if (!cread_bufs[i]) {
+					log_msg(LOG_ERR, 0, "4: Out of memory");
+					COMP_BAIL;
+				}
+				numa_touch(cread_bufs[i], compressed_chunksize);
+			}
+		}
 		dary[i] = (struct cmp_data *)slab_alloc(NULL, sizeof (struct cmp_data));
 		if (!dary[i]) {
 			log_msg(LOG_ERR, 0, "4: Out of memory");
@@ -2526,40 +3804,63 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			log_msg(LOG_ERR, 0, "5: Out of memory");
 			COMP_BAIL;
 		}
+		tdat->numa_node = i % nn;
+		if (pctx->numa) {
+			numa_touch(tdat->cmp_seg, compressed_chunksize);
+			numa_touch(tdat->uncompressed_chunk, compressed_chunksize);
+		}
 		tdat->cancel = 0;
 		tdat->decompressing = 0;
 		if (single_chunk)
 			tdat->cksum_mt = 1;
 		else
 			tdat->cksum_mt = 0;
+		tdat->cksum_fused = 0;
 		tdat->level = level;
 		tdat->data = NULL;
 		tdat->rctx = NULL;
+		tdat->chunk_hmac = NULL;
 		tdat->props = &props;
-		Sem_Init(&(tdat->start_sem), 0, 0);
 		Sem_Init(&(tdat->cmp_done_sem), 0, 0);
 		Sem_Init(&(tdat->write_done_sem), 0, 1);
 		Sem_Init(&(tdat->index_sem), 0, 0);
+	}
 
+	for (i = 0; i < nprocs; i++) {
+		wk = &wrk[i];
+		wk->pctx = pctx;
+		wk->level = level;
+		wk->data = NULL;
+		wk->rctx = NULL;
+
+		/*
+		 * The worker inherits the node binding and its algorithm state is
+		 * allocated on that node.
+		 */
+		wk->numa_node = i % nn;
+		if (pctx->numa)
+			numa_bind_self(pctx->numa, wk->numa_node);
 		if (pctx->_init_func) {
-			if (pctx->_init_func(&(tdat->data), &(tdat->level), props.nthreads,
+			if (pctx->_init_func(&(wk->data), &(wk->level), props.nthreads,
 			    chunksize, VERSION, COMPRESS) != 0) {
 				COMP_BAIL;
 			}
 		}
 
 		if (pctx->encrypt_type) {
-			if (hmac_init(&tdat->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
+			if (hmac_init(&wk->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
 				log_msg(LOG_ERR, 0, "Cannot initialize chunk hmac.");
 				COMP_BAIL;
 			}
 		}
-		if (pthread_create(&(tdat->thr), NULL, perform_compress,
-		    (void *)tdat) != 0) {
+		if (pthread_create(&(wk->thr), NULL, perform_compress,
+		    (void *)wk) != 0) {
 			log_msg(LOG_ERR, 1, "Error in thread creation: ");
 			COMP_BAIL;
 		}
 	}
+	if (pctx->numa)
+		numa_bind_self(pctx->numa, pctx->numa_io_node);
 
 	/*
 	 * Now create the metadata handler context. This is relevant in archive mode where
@@ -2592,33 +3893,50 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	}
 
 	if (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) {
+		/*
+		 * CPUs not occupied by a worker thread are shared out for splitting
+		 * the block boundary scan of large chunks.
+		 */
+		scan_threads = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN) / nprocs;
+		if (scan_threads < 1)
+			scan_threads = 1;
 		for (i = 0; i < nprocs; i++) {
-			tdat = dary[i];
-			tdat->rctx = create_dedupe_context(chunksize, compressed_chunksize,
+			wk = &wrk[i];
+			if (pctx->numa)
+				numa_bind_self(pctx->numa, wk->numa_node);
+			wk->rctx = create_dedupe_context(chunksize, compressed_chunksize,
 			    pctx->rab_blk_size, pctx->algo, &props, pctx->enable_delta_encode,
 			    dedupe_flag, VERSION, COMPRESS, sbuf.st_size, tmpdir,
-			    pctx->pipe_mode, nprocs, msys_info.freeram);
-			if (tdat->rctx == NULL) {
+			    pctx->dedupe_store, pctx->pipe_mode, nprocs, msys_info.freeram);
+			if (wk->rctx == NULL) {
 				COMP_BAIL;
 			}
 
-			tdat->rctx->show_chunks = pctx->show_chunks;
-			tdat->rctx->index_sem = &(tdat->index_sem);
-			tdat->rctx->id = i;
+			wk->rctx->show_chunks = pctx->show_chunks;
+			wk->rctx->cdc_type = pctx->dedupe_cdc;
+			wk->rctx->scan_threads = scan_threads;
+			wk->rctx->sstats = wk->sstats;
+			wk->rctx->id = i;
 		}
+		if (pctx->numa)
+			numa_bind_self(pctx->numa, pctx->numa_io_node);
+	}
+
+	/*
+	 * Global dedupe index access is sequenced in chunk order, hence around the
+	 * ring of chunk slots.
+	 */
+	for (i = 0; i < nslots; i++) {
+		dary[i]->index_sem_next = &(dary[(i + 1) % nslots]->index_sem);
 	}
 	if (pctx->enable_rabin_global) {
-		for (i = 0; i < nprocs; i++) {
-			tdat = dary[i];
-			tdat->rctx->index_sem_next = &(dary[(i + 1) % nprocs]->index_sem);
-		}
-		// When doing global dedupe first thread does not wait to access the index.
+		// When doing global dedupe first chunk does not wait to access the index.
 		Sem_Post(&(dary[0]->index_sem));
 	}
 
 	w.dary = dary;
 	w.wfd = compfd;
-	w.nprocs = nprocs;
+	w.nprocs = nslots;
 	w.pctx = pctx;
 	if (pthread_create(&writer_thr, NULL, writer_thread, (void *)(&w)) != 0) {
 		log_msg(LOG_ERR, 1, "Error in thread creation: ");
@@ -2630,6 +3948,32 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	 * Start the archiver thread if needed.
 	 */
 	if (pctx->archive_mode) {
+		/*
+		 * The member catalog is filled in by the archiver thread.
+		 */
+		if (pctx->chunk_index) {
+			pctx->catalog = catalog_create();
+			if (pctx->catalog == NULL) {
+				log_msg(LOG_ERR, 0, "Cannot create archive catalog.");
+				COMP_BAIL;
+			}
+		}
+
+		/*
+		 * Incremental archiving compares against the manifest of the
+		 * previous run and builds the one for this run.
+		 */
+		if (pctx->manifest_file) {
+			pctx->manifest_prev = manifest_load(pctx->manifest_file);
+			if (pctx->manifest_prev == NULL) {
+				COMP_BAIL;
+			}
+			pctx->manifest = manifest_create();
+			if (pctx->manifest == NULL) {
+				log_msg(LOG_ERR, 0, "Out of memory.");
+				COMP_BAIL;
+			}
+		}
 		if (start_archiver(pctx) != 0) {
 			COMP_BAIL;
 		}
@@ -2643,9 +3987,26 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	 * then write out the full hdr in one shot.
 	 */
 	flags |= pctx->cksum;
+	if (pctx->chunk_index) {
+		flags |= FLAG_CHUNK_INDEX;
+
+		/*
+		 * The index HMAC context needs the key, which is cleared after
+		 * the header HMAC below.
+		 */
+		pctx->cidx = chunk_index_create(pctx->cksum, pctx->mac_bytes,
+		    pctx->encrypt_type ? &(pctx->crypto_ctx) : NULL);
+		if (pctx->cidx == NULL) {
+			log_msg(LOG_ERR, 0, "Cannot create chunk index.");
+			COMP_BAIL;
+		}
+	}
 	memset(cread_buf, 0, ALGO_SZ);
 	strncpy((char *)cread_buf, pctx->algo, ALGO_SZ);
-	version = htons(VERSION);
+	if (flags & FLAG_DEDUP_STORE)
+		version = htons(VERSION);
+	else
+		version = htons(VERSION_COMPAT);
 	flags = htons(flags);
 	n_chunksize = htonll(chunksize);
 	level = htonl(level);
@@ -2659,6 +4020,20 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	memcpy(pos, &level, sizeof (level));
 	pos += sizeof (level);
 
+	/*
+	 * Record which dedupe store this file references, so that decompression
+	 * can refuse a different one.
+	 */
+	if (pctx->enable_rabin_global && pctx->dedupe_store) {
+		uint64_t store_id, store_base;
+
+		dedupe_store_info(wrk[0].rctx, &store_id, &store_base);
+		U64_P(pos) = htonll(store_id);
+		pos += sizeof (store_id);
+		U64_P(pos) = htonll(store_base);
+		pos += sizeof (store_base);
+	}
+
 	/*
 	 * If encryption is enabled, include salt, nonce and keylen in the header
 	 * to be HMAC-ed (archive version 7 and greater).
@@ -2668,7 +4043,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		pos += sizeof (int);
 		serialize_checksum(pctx->crypto_ctx.salt, pos, pctx->crypto_ctx.saltlen);
 		pos += pctx->crypto_ctx.saltlen;
-		if (pctx->encrypt_type == CRYPTO_ALG_AES) {
+		if (CRYPTO_ALG_IS_AES(pctx->encrypt_type)) {
 			U64_P(pos) = htonll(U64_P(crypto_nonce(&(pctx->crypto_ctx))));
 			pos += 8;
 
@@ -2684,6 +4059,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		log_msg(LOG_ERR, 1, "Write ");
 		COMP_BAIL;
 	}
+	if (pctx->cidx)
+		pctx->cidx->cmp_pos = pos - cread_buf;
 
 	/*
 	 * If encryption is enabled, compute header HMAC and write it.
@@ -2711,6 +4088,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			log_msg(LOG_ERR, 1, "Write ");
 			COMP_BAIL;
 		}
+		if (pctx->cidx)
+			pctx->cidx->cmp_pos += pos - cread_buf;
 	} else {
 		/*
 		 * Compute header CRC32 and store that. Only archive version 5 and above.
@@ -2721,6 +4100,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			log_msg(LOG_ERR, 1, "Write ");
 			COMP_BAIL;
 		}
+		if (pctx->cidx)
+			pctx->cidx->cmp_pos += sizeof (uint32_t);
 	}
 
 	/*
@@ -2733,38 +4114,97 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	pctx->largest_chunk = 0;
 	pctx->smallest_chunk = chunksize;
 	pctx->avg_chunk = 0;
+	pctx->probe_skipped = 0;
+	pctx->probe_skipped_bytes = 0;
+	pctx->probe_cmp_bytes = 0;
+	pctx->probe_ms = 0;
+	pctx->probe_cmp_ms = 0;
+	pctx->probe_pct = PROBE_PCT_DEFAULT;
+	if ((val = getenv("PCOMPRESS_PROBE_PCT")) != NULL)
+		pctx->probe_pct = atoi(val);
 	rabin_count = 0;
 
+	/*
+	 * Optionally compute the chunk checksum on the reader side, a block at a
+	 * time as the data comes in, rather than in a separate pass over the whole
+	 * chunk in the compression thread. This trades reader thread time for one
+	 * less sweep through memory per chunk. Only whole chunks as read from a
+	 * plain file or pipe qualify, rabin split chunks are trimmed after reading.
+	 */
+	if ((val = getenv("PCOMPRESS_CKSUM_ON_READ")) != NULL && atoi(val) > 0 &&
+	    !pctx->encrypt_type && !pctx->archive_mode && !single_chunk &&
+	    !pctx->enable_rabin_split && !pctx->numa) {
+		cksum_on_read = 1;
+	}
+
+	/*
+	 * Plain file or pipe input is read ahead by a helper thread, so that reads
+	 * overlap with chunking and queueing instead of one chunk at a time.
+	 * Archive mode already has its own producer thread feeding us.
+	 */
+	if (!pctx->archive_mode && !single_chunk) {
+		uint32_t depth = READAHEAD_DEFAULT;
+
+		if ((val = getenv("PCOMPRESS_READAHEAD")) != NULL)
+			depth = atoi(val);
+		if (depth > 0) {
+			ra = ra_create(uncompfd, depth, chunksize, compressed_chunksize,
+			    cksum_on_read ? pctx->cksum : 0);
+			if (ra == NULL) {
+				log_msg(LOG_ERR, 0, "Cannot start read-ahead.");
+				COMP_BAIL;
+			}
+		}
+	}
+	if (cksum_on_read && ra == NULL) {
+		if (cksum_init(&rd_cctx, pctx->cksum) != 0) {
+			log_msg(LOG_ERR, 0, "Cannot initialize checksum.");
+			COMP_BAIL;
+		}
+	}
+
 	/*
 	 * Read the first chunk into a spare buffer (a simple double-buffering).
 	 */
-	file_offset = 0;
 	pctx->interesting = 0;
+	sstrt = stage_begin(STAGE_READER(pctx));
 	if (pctx->enable_rabin_split) {
 		rctx = create_dedupe_context(chunksize, 0, pctx->rab_blk_size, pctx->algo, &props,
 		    pctx->enable_delta_encode, pctx->enable_fixed_scan, VERSION, COMPRESS, 0, NULL,
-		    pctx->pipe_mode, nprocs, msys_info.freeram);
+		    NULL, pctx->pipe_mode, nprocs, msys_info.freeram);
+		rctx->cdc_type = pctx->dedupe_cdc;
 		if (pctx->archive_mode)
-			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx, pctx);
+			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx,
+			    pctx, NULL);
 		else
-			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx, NULL);
+			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx,
+			    NULL, ra);
 	} else {
 		if (pctx->archive_mode)
 			rbytes = archiver_read(pctx, cread_buf, chunksize);
+		else if (ra && pctx->numa)
+			rbytes = ra_read(ra, cread_buf, chunksize);
+		else if (ra)
+			rbytes = ra_swap(ra, &cread_buf, cread_cksum);
+		else if (cksum_on_read)
+			rbytes = Read_Cksum(uncompfd, cread_buf, chunksize, &rd_cctx, cread_cksum);
 		else
 			rbytes = Read(uncompfd, cread_buf, chunksize);
 	}
+	stage_end(STAGE_READER(pctx), STAGE_READ, sstrt, rbytes > 0 ? rbytes : 0);
 
 	while (!bail) {
 		uchar_t *tmp;
 
 		if (pctx->main_cancel) break;
-		for (p = 0; p < nprocs; p++) {
+		for (p = 0; p < nslots; p++) {
 			np = p;
 			tdat = dary[p];
 			if (pctx->main_cancel) break;
-			/* Wait for previous chunk compression to complete. */
+			/* Wait for previous chunk in this slot to be written out. */
+			sstrt = stage_begin(STAGE_READER(pctx));
 			Sem_Wait(&tdat->write_done_sem);
+			stage_end(STAGE_READER(pctx), STAGE_SEM_WAIT, sstrt, 0);
 			if (pctx->main_cancel) break;
 
 			if (rbytes == 0) { /* EOF */
@@ -2785,13 +4225,19 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			tdat->rbytes = rbytes;
 			tdat->interesting = pctx->interesting;
 			tdat->btype = pctx->btype; // Have to copy btype for this buffer as pctx->btype will change
+			tdat->cksum_fused = cksum_on_read;
+			if (cksum_on_read)
+				memcpy(tdat->checksum, cread_cksum, CKSUM_MAX_BYTES);
 			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global)) {
 				tmp = tdat->cmp_seg;
 				tdat->cmp_seg = cread_buf;
 				cread_buf = tmp;
+				if (pctx->numa)
+					cread_buf = numa_next_buf(cread_bufs, cread_buf, tdat,
+					    dary[(p + 1) % nslots]);
 				tdat->compressed_chunk = tdat->cmp_seg + COMPRESSED_CHUNKSZ +
 				    pctx->cksum_bytes + pctx->mac_bytes;
-				if (tdat->rctx) tdat->rctx->file_offset = file_offset;
+				tdat->file_offset = file_offset;
 
 				/*
 				 * If there is data after the last rabin boundary in the chunk, then
@@ -2808,6 +4254,10 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				tmp = tdat->uncompressed_chunk;
 				tdat->uncompressed_chunk = cread_buf;
 				cread_buf = tmp;
+				if (pctx->numa)
+					cread_buf = numa_next_buf(cread_bufs, cread_buf, tdat,
+					    dary[(p + 1) % nslots]);
+				tdat->file_offset = file_offset;
 			}
 			file_offset += tdat->rbytes;
 
@@ -2819,8 +4269,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				}
 			}
 
-			/* Signal the compression thread to start */
-			Sem_Post(&tdat->start_sem);
+			/* Queue the chunk for the next free compression thread */
+			sched_put(pctx, tdat);
 			++(pctx->chunk_num);
 
 			if (single_chunk) {
@@ -2833,25 +4283,34 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			 * buffer is in progress.
 			 */
 			pctx->interesting = 0;
+			sstrt = stage_begin(STAGE_READER(pctx));
 			if (pctx->enable_rabin_split) {
 				if (pctx->archive_mode)
 					rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize,
-					    &rabin_count, rctx, pctx);
+					    &rabin_count, rctx, pctx, NULL);
 				else
 					rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize,
-					    &rabin_count, rctx, NULL);
+					    &rabin_count, rctx, NULL, ra);
 			} else {
 				if (pctx->archive_mode)
 					rbytes = archiver_read(pctx, cread_buf, chunksize);
+				else if (ra && pctx->numa)
+					rbytes = ra_read(ra, cread_buf, chunksize);
+				else if (ra)
+					rbytes = ra_swap(ra, &cread_buf, cread_cksum);
+				else if (cksum_on_read)
+					rbytes = Read_Cksum(uncompfd, cread_buf, chunksize,
+					    &rd_cctx, cread_cksum);
 				else
 					rbytes = Read(uncompfd, cread_buf, chunksize);
 			}
+			stage_end(STAGE_READER(pctx), STAGE_READ, sstrt, rbytes > 0 ? rbytes : 0);
 		}
 	}
 
 	if (!pctx->main_cancel) {
 		/* Wait for all remaining chunks to finish. */
-		for (p = 0; p < nprocs; p++) {
+		for (p = 0; p < nslots; p++) {
 			if (p == np) continue;
 			tdat = dary[p];
 			Sem_Wait(&tdat->write_done_sem);
@@ -2861,6 +4320,10 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	}
 
 comp_done:
+	ra_destroy(ra);
+	if (rd_cctx.state)
+		cksum_cleanup(&rd_cctx);
+
 	/*
 	 * First close the input fd of uncompressed data. If archiving this will cause
 	 * the archive thread to exit and cleanup.
@@ -2875,19 +4338,23 @@ comp_done:
 
 	if (pctx->t_errored) err = pctx->t_errored;
 	if (thread) {
-		for (i = 0; i < nprocs; i++) {
+		for (i = 0; i < nslots; i++) {
 			tdat = dary[i];
 			tdat->cancel = 1;
 			tdat->len_cmp = 0;
-			Sem_Post(&tdat->start_sem);
 			Sem_Post(&tdat->cmp_done_sem);
-			pthread_join(tdat->thr, NULL);
-			if (pctx->encrypt_type)
-				hmac_cleanup(&tdat->chunk_hmac);
+		}
+		if (pctx->main_cancel || pctx->t_errored)
+			dedupe_abort(wrk[0].rctx);
+		sched_stop(pctx, wrk, nprocs);
+		if (pctx->encrypt_type) {
+			for (i = 0; i < nprocs; i++)
+				hmac_cleanup(&wrk[i].chunk_hmac);
 		}
 		if (thread == 2)
 			pthread_join(writer_thr, NULL);
 	}
+	numa_finish(pctx, wrk, thread ? nprocs : 0);
 
 	if (err) {
 		if (compfd != -1 && !pctx->pipe_mode && !pctx->pipe_out) {
@@ -2909,6 +4376,28 @@ comp_done:
 			err = 1;
 		}
 
+		/*
+		 * The chunk index, if requested, follows the trailer. Archives
+		 * have their member catalog just before it.
+		 */
+		if (!err && pctx->catalog) {
+			if (catalog_write(pctx->catalog, pctx->cidx, compfd, file_offset) != 0)
+				err = 1;
+		}
+		if (!err && pctx->cidx) {
+			if (chunk_index_write(pctx->cidx, compfd, file_offset) != 0)
+				err = 1;
+		}
+
+		/*
+		 * Record this run's blocks in the dedupe store. The output file does
+		 * not depend on this so a failure here only costs future dedupe.
+		 */
+		if (!err && pctx->enable_rabin_global && pctx->dedupe_store) {
+			if (dedupe_store_commit(wrk[0].rctx, file_offset) != 0)
+				log_msg(LOG_WARN, 0, "Dedupe store was not updated.");
+		}
+
 		/*
 		 * Rename the temporary file to the actual compressed file
 		 * unless we are in a pipe.
@@ -2933,19 +4422,23 @@ comp_done:
 			}
 		}
 	}
-	if (dary != NULL) {
+	if (wrk != NULL) {
 		for (i = 0; i < nprocs; i++) {
+			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
+				destroy_dedupe_context(wrk[i].rctx);
+			}
+			if (pctx->_deinit_func)
+				pctx->_deinit_func(&(wrk[i].data));
+		}
+		slab_release(NULL, wrk);
+	}
+	if (dary != NULL) {
+		for (i = 0; i < nslots; i++) {
 			if (!dary[i]) continue;
 			if (dary[i]->uncompressed_chunk != (uchar_t *)1)
 				slab_release(NULL, dary[i]->uncompressed_chunk);
 			if (dary[i]->cmp_seg != (uchar_t *)1)
 				slab_release(NULL, dary[i]->cmp_seg);
-			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
-				destroy_dedupe_context(dary[i]->rctx);
-			}
-			if (pctx->_deinit_func)
-				pctx->_deinit_func(&(dary[i]->data));
-			Sem_Destroy(&(dary[i]->start_sem));
 			Sem_Destroy(&(dary[i]->cmp_done_sem));
 			Sem_Destroy(&(dary[i]->write_done_sem));
 			Sem_Destroy(&(dary[i]->index_sem));
@@ -2954,9 +4447,19 @@ comp_done:
 		}
 		slab_release(NULL, dary);
 	}
+	sched_destroy(pctx);
 	if (pctx->enable_rabin_split) destroy_dedupe_context(rctx);
+	if (cread_bufs != NULL) {
+		for (i = 0; i < nn; i++) {
+			if (cread_bufs[i] && cread_bufs[i] != cread_buf)
+				slab_release(NULL, cread_bufs[i]);
+		}
+		slab_release(NULL, cread_bufs);
+	}
 	if (cread_buf != (uchar_t *)1)
 		slab_release(NULL, cread_buf);
+	chunk_index_destroy(pctx->cidx);
+	pctx->cidx = NULL;
 	if (!pctx->pipe_mode) {
 		if (compfd != -1) close(compfd);
 	}
@@ -2965,6 +4468,25 @@ comp_done:
 		struct fn_list *fn, *fn1;
 
 		pthread_join(pctx->archive_thread, NULL);
+		catalog_destroy(pctx->catalog);
+		pctx->catalog = NULL;
+
+		/*
+		 * The manifest is only replaced once the archive is complete.
+		 */
+		if (!err && pctx->manifest) {
+			if (manifest_write(pctx->manifest, pctx->manifest_file) != 0) {
+				err = 1;
+			} else {
+				log_msg(LOG_INFO, 0, "%" PRIu64 " unchanged files (%" PRIu64
+				    " bytes) stored as references.", pctx->manifest_refs,
+				    pctx->manifest_ref_bytes);
+			}
+		}
+		manifest_destroy(pctx->manifest_prev);
+		manifest_destroy(pctx->manifest);
+		pctx->manifest_prev = NULL;
+		pctx->manifest = NULL;
 		fn = pctx->fn;
 		while (fn) {
 			fn1 = fn;
@@ -2974,8 +4496,13 @@ comp_done:
 		Sem_Destroy(&(pctx->read_sem));
 		Sem_Destroy(&(pctx->write_sem));
 	}
+	stage_stats_fini(pctx, "compress");
 	if (!pctx->hide_cmp_stats) show_compression_stats(pctx);
 	pctx->_stats_func(!pctx->hide_cmp_stats);
+	if (pctx->numa_stats) {
+		slab_release(NULL, pctx->numa_stats);
+		pctx->numa_stats = NULL;
+	}
 
 	return (err);
 }
@@ -3120,10 +4647,12 @@ create_pc_context(void)
 	ctx->enable_rabin_split = 1;
 	ctx->rab_blk_size = -1;
 	ctx->archive_temp_fd = -1;
+	ctx->spill_fd = -1;
 	ctx->pagesize = sysconf(_SC_PAGE_SIZE);
 	ctx->btype = TYPE_UNKNOWN;
 	ctx->delta2_nstrides = NSTRIDES_STANDARD;
 	pthread_mutex_init(&ctx->write_mutex, NULL);
+	pthread_mutex_init(&ctx->arc_mutex, NULL);
 
 	return (ctx);
 }
@@ -3135,6 +4664,18 @@ destroy_pc_context(pc_ctx_t *pctx)
 		free((void *)(pctx->filename));
 	if (pctx->pwd_file)
 		free(pctx->pwd_file);
+	if (pctx->manifest_file)
+		free(pctx->manifest_file);
+	if (pctx->dedupe_store)
+		free(pctx->dedupe_store);
+	if (pctx->extract_paths) {
+		int i;
+
+		for (i = 0; i < pctx->nextract; i++)
+			free(pctx->extract_paths[i]);
+		free(pctx->extract_paths);
+		free(pctx->extract_found);
+	}
 	free((void *)(pctx->exec_name));
 	slab_cleanup(pctx->hide_mem_stats);
 	free(pctx);
@@ -3159,14 +4700,81 @@ init_pc_context_argstr(pc_ctx_t *pctx, char *args)
 	return (0);
 }
 
+/*
+ * Parse a decompression range given as <offset>,<length>. The length may be
+ * omitted to decompress till the end.
+ */
+static int
+parse_range(pc_ctx_t *pctx, const char *arg)
+{
+	char str[64], *sep;
+	int64_t off, len;
+
+	snprintf(str, sizeof (str), "%s", arg);
+	len = INT64_MAX;
+	sep = strchr(str, ',');
+	if (sep != NULL) {
+		*sep = '\0';
+		if (parse_numeric(&len, sep + 1) != 0 || len <= 0) {
+			log_msg(LOG_ERR, 0, "Invalid range length %s", sep + 1);
+			return (1);
+		}
+	}
+	if (parse_numeric(&off, str) != 0 || off < 0) {
+		log_msg(LOG_ERR, 0, "Invalid range offset %s", str);
+		return (1);
+	}
+	pctx->range_start = off;
+	pctx->range_len = len;
+	return (0);
+}
+
+/*
+ * Keep the archive member names to extract or list. They are matched against
+ * the stored names, which have no leading '/' and no trailing '/'.
+ */
+static int
+parse_member_paths(pc_ctx_t *pctx, char **paths, int n)
+{
+	char *path;
+	size_t len;
+	int i;
+
+	pctx->extract_paths = (char **)calloc(n, sizeof (char *));
+	pctx->extract_found = (char *)calloc(n, 1);
+	if (pctx->extract_paths == NULL || pctx->extract_found == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (1);
+	}
+	for (i = 0; i < n; i++) {
+		path = paths[i];
+		while (path[0] == '/' || (path[0] == '.' && path[1] == '/'))
+			path += (path[0] == '/') ? 1 : 2;
+		if ((pctx->extract_paths[i] = strdup(path)) == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory.");
+			return (1);
+		}
+		pctx->nextract++;
+		len = strlen(pctx->extract_paths[i]);
+		while (len > 0 && pctx->extract_paths[i][len - 1] == '/')
+			pctx->extract_paths[i][--len] = '\0';
+		if (len == 0) {
+			log_msg(LOG_ERR, 0, "Invalid member name: %s", paths[i]);
+			return (1);
+		}
+	}
+	return (0);
+}
+
 int DLL_EXPORT
 init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 {
-	int opt, num_rem, err, my_optind;
+	int opt, num_rem, err, my_optind, d_opts;
 	char *pos;
 	struct filter_flags ff;
 
 	pctx->level = -1;
+	d_opts = 0;
 	err = 0;
 	pctx->keylen = DEFAULT_KEYLEN;
 	pctx->chunksize = 0;
@@ -3180,7 +4788,7 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 	ff.exe_preprocess = 0;
 
 	pthread_mutex_lock(&opt_parse);
-	while ((opt = getopt(argc, argv, "dc:s:l:pt:MCDGEe:w:LPS:B:Fk:avmKjxiTn")) != -1) {
+	while ((opt = getopt(argc, argv, "dc:s:l:pt:MCDGEe:w:LPS:B:Fk:avmKjxiTnR:IX:u:")) != -1) {
 		int ovr;
 		int64_t chunksize;
 
@@ -3263,6 +4871,8 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 
 		    case 'D':
 			pctx->advanced_opts = 1;
+			if (d_opts++)
+				pctx->dedupe_cdc = DEDUPE_CDC_GEAR;
 			pctx->enable_rabin_scan = 1;
 			break;
 
@@ -3284,7 +4894,7 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->encrypt_type = get_crypto_alg(optarg);
 			if (pctx->encrypt_type == 0) {
 				log_msg(LOG_ERR, 0, "Invalid encryption algorithm. "
-				    "Should be AES or SALSA20.", optarg);
+				    "Should be AES, AES-GCM or SALSA20.", optarg);
 				return (1);
 			}
 			break;
@@ -3293,6 +4903,14 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->pwd_file = strdup(optarg);
 			break;
 
+		    case 'u':
+			pctx->manifest_file = strdup(optarg);
+			break;
+
+		    case 'R':
+			pctx->dedupe_store = strdup(optarg);
+			break;
+
 		    case 'F':
 			pctx->advanced_opts = 1;
 			pctx->enable_fixed_scan = 1;
@@ -3364,6 +4982,15 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->enable_archive_sort = -1;
 			break;
 
+		    case 'I':
+			pctx->chunk_index = 1;
+			break;
+
+		    case 'X':
+			if (parse_range(pctx, optarg) != 0)
+				return (1);
+			break;
+
 		    case '?':
 		    default:
 			return (2);
@@ -3388,6 +5015,28 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		return (1);
 	}
 
+	if (pctx->chunk_index && !pctx->do_compress) {
+		log_msg(LOG_ERR, 0, "'-I' is only for compression.");
+		return (1);
+	}
+
+	if (pctx->manifest_file && !(pctx->archive_mode && pctx->do_compress)) {
+		log_msg(LOG_ERR, 0, "'-u' is only for archive creation.");
+		return (1);
+	}
+
+	if (pctx->chunk_index && pctx->archive_mode && pctx->meta_stream == -1) {
+		log_msg(LOG_ERR, 0, "'-I' when archiving needs Metadata Streams, "
+		    "it cannot be used with '-T'.");
+		return (1);
+	}
+
+	if (pctx->range_len > 0 && (!pctx->do_uncompress || pctx->list_mode ||
+	    pctx->pipe_mode)) {
+		log_msg(LOG_ERR, 0, "'-X' is only for decompressing a file, not a pipe.");
+		return (1);
+	}
+
 	/*
 	 * Default compression algorithm during archiving is Adaptive2.
 	 */
@@ -3474,6 +5123,17 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		return (1);
 	}
 
+	if (pctx->dedupe_store) {
+		if (pctx->do_compress && !pctx->enable_rabin_global) {
+			log_msg(LOG_ERR, 0, "Dedupe store (-R) requires Global Deduplication (-G).");
+			return (1);
+		}
+		if (pctx->pipe_mode) {
+			log_msg(LOG_ERR, 0, "Dedupe store (-R) is not supported in pipe mode.");
+			return (1);
+		}
+	}
+
 	/*
 	 * EXE, PackJPG and WavPack are only valid when archiving files.
 	 */
@@ -3488,7 +5148,8 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		log_msg(LOG_ERR, 0, "Expected at least one filename.");
 		return (1);
 
-	} else if (num_rem == 1 || num_rem == 2 || (num_rem > 0 && pctx->archive_mode)) {
+	} else if (num_rem == 1 || num_rem == 2 || (num_rem > 0 && pctx->archive_mode) ||
+	    (num_rem > 2 && pctx->do_uncompress)) {
 		if (pctx->do_compress) {
 			char apath[MAXPATHLEN];
 
@@ -3587,12 +5248,22 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 					return (1);
 				}
 			}
-			if (num_rem == 2) {
-				my_optind++;
+			my_optind++;
+			num_rem--;
+
+			/*
+			 * Any names after the target directory, or after the archive when
+			 * listing, are archive members to extract or list.
+			 */
+			if (num_rem > 0 && !pctx->list_mode) {
 				pctx->to_filename = argv[my_optind];
+				my_optind++;
+				num_rem--;
 			} else {
 				pctx->to_filename = NULL;
 			}
+			if (num_rem > 0 && parse_member_paths(pctx, &argv[my_optind], num_rem) != 0)
+				return (1);
 		} else {
 			return (1);
 		}
@@ -38,20 +38,50 @@ extern "C" {
 #include <crypto_utils.h>
 #include <filters/analyzer/analyzer.h>
 #include <meta_stream.h>
+#include <chunk_index.h>
+#include <pc_manifest.h>
+#include <numa.h>
 
 #define	CHUNK_FLAG_SZ	1
 #define	ALGO_SZ		8
 #define	MIN_CHUNK	2048
-#define	VERSION		10
+#define	VERSION		11
+/*
+ * Files that need no newer format features are written with this version so
+ * that older releases can still read them.
+ */
+#define	VERSION_COMPAT	10
 #define	FLAG_DEDUP	1
 #define	FLAG_DEDUP_FIXED	2
 #define	FLAG_SINGLE_CHUNK	4
+#define	FLAG_DEDUP_STORE	8
+#define	FLAG_DEDUP_GEAR	64
+#define	FLAG_CHUNK_INDEX	128
 #define FLAG_META_STREAM	4096
 #define	FLAG_ARCHIVE	2048
 #define	UTILITY_VERSION	"3.1"
 #define	MASK_CRYPTO_ALG	0x30
 #define	MAX_LEVEL	14
 
+/*
+ * Chunks whose sampled compressibility estimate is at or above this percentage
+ * of the original size are stored without running the compressor. The probe is
+ * off by default and is enabled by setting PCOMPRESS_PROBE_PCT.
+ */
+#define	PROBE_PCT_DEFAULT	0
+
+/*
+ * Number of chunks read ahead of the compression pipeline by a helper thread.
+ */
+#define	READAHEAD_DEFAULT	2
+
+/*
+ * Size of the output block cache used to resolve global dedupe references
+ * during decompression and the granularity in which it reads the output.
+ */
+#define	DEDUPE_CACHE_MEM	(64ULL * 1024 * 1024)
+#define	DEDUPE_CACHE_BLKSZ	(128 * 1024)
+
 #ifndef _MPLV2_LICENSE_
 #define	LICENSE_STRING "LGPLv3"
 #else
@@ -195,6 +225,18 @@ extern int libbsc_deinit(void **data);
 extern void libbsc_stats(int show);
 #endif
 
+struct cmp_data;
+
+/*
+ * Queue of filled chunk slots waiting for a worker thread.
+ */
+typedef struct {
+	struct cmp_data **q;
+	uint32_t len, head, tail;
+	pthread_mutex_t mutex;
+	Sem_t sem;
+} sched_queue_t;
+
 typedef struct pc_ctx {
 	compress_func_ptr _compress_func;
 	compress_func_ptr _decompress_func;
@@ -212,6 +254,7 @@ typedef struct pc_ctx {
 	int hide_cmp_stats;
 	int show_chunks;
 	int enable_rabin_scan;
+	int dedupe_cdc;
 	int enable_rabin_global;
 	int enable_delta_encode;
 	int enable_delta2_encode;
@@ -248,9 +291,10 @@ typedef struct pc_ctx {
 	struct fn_list *fn;
 	Sem_t read_sem, write_sem;
 	pthread_mutex_t write_mutex;
+	pthread_mutex_t arc_mutex;
 	uchar_t *arc_buf;
 	uint64_t arc_buf_size, arc_buf_pos;
-	int arc_closed, arc_writing;
+	int arc_closed, arc_writing, arc_eof;
 	int btype, ctype;
 	int interesting;
 	int min_chunk;
@@ -262,6 +306,13 @@ typedef struct pc_ctx {
 
 	unsigned int chunk_num;
 	uint64_t largest_chunk, smallest_chunk, avg_chunk;
+	int probe_pct;
+	uint32_t probe_skipped;
+	uint64_t probe_skipped_bytes, probe_cmp_bytes;
+	double probe_ms, probe_cmp_ms;
+	stage_stats_t *stage_stats;
+	int stage_nstats;
+	double stage_strt;
 	uint64_t chunksize;
 	const char *algo, *filename;
 	char *to_filename;
@@ -275,38 +326,117 @@ typedef struct pc_ctx {
 	unsigned char *user_pw;
 	int user_pw_len;
 	char *pwd_file, *f_name;
+	char *dedupe_store;
 	meta_ctx_t *meta_ctx;
+
+	/*
+	 * Chunk index trailer and range decompression. range_len is 0 when
+	 * decompressing the whole file.
+	 */
+	int chunk_index;
+	chunk_index_t *cidx;
+	uint64_t range_start, range_len;
+	int64_t range_last;
+
+	/*
+	 * Archive member catalog and selective extraction. When only some members
+	 * are extracted from an archive with a catalog, chunk_sel flags the chunks
+	 * to decompress and the extractor tracks its position in the data stream.
+	 */
+	catalog_t *catalog;
+	char **extract_paths;
+	char *extract_found;
+	int nextract, extract_errored;
+	char *chunk_sel;
+	int arc_selective;
+	uint64_t arc_data_pos, arc_buf_off;
+
+	/*
+	 * Incremental archiving. Files unchanged since the previous manifest are
+	 * stored as references and a new manifest is written on success.
+	 */
+	char *manifest_file;
+	manifest_t *manifest_prev, *manifest;
+	uint64_t manifest_refs, manifest_ref_bytes;
+
+	/*
+	 * Chunk scheduling. Filled chunk slots are queued here for any idle
+	 * worker thread to pick up. There is one queue per NUMA node in use,
+	 * otherwise just one.
+	 */
+	sched_queue_t *ready_q;
+	uint32_t ready_nq;
+
+	/*
+	 * NUMA placement of workers and their buffers, when enabled.
+	 */
+	numa_topo_t *numa;
+	uint32_t numa_nnodes;
+	int numa_io_node;
+	numa_node_stats_t *numa_stats;
+
+	/*
+	 * Output blocks cached for global dedupe decompression.
+	 */
+	block_cache_t *blk_cache;
+	int spill_fd; // Copy of pipe output for global dedupe references, -1 if unused
 } pc_ctx_t;
 
 /*
- * Per-thread data structure for compression and decompression threads.
+ * Per-chunk slot for compression and decompression. Slots are filled in
+ * chunk sequence and the writer drains them in the same sequence. There
+ * can be more slots than worker threads.
  */
 struct cmp_data {
 	uchar_t *cmp_seg;
 	uchar_t *compressed_chunk;
 	uchar_t *uncompressed_chunk;
 	dedupe_context_t *rctx;
+	stage_stats_t *sstats;
 	int64_t rbytes;
 	uint64_t chunksize;
 	uint64_t len_cmp, len_cmp_be;
 	uchar_t checksum[CKSUM_MAX_BYTES];
 	int level, cksum_mt, out_fd;
+	int cksum_fused;	/* checksum already computed by the reader */
+	int numa_node;		/* node the slot buffers live on */
 	unsigned int id;
 	compress_func_ptr compress;
 	compress_func_ptr decompress;
 	int cancel;
 	int interesting;
-	Sem_t start_sem;
 	Sem_t cmp_done_sem;
 	Sem_t write_done_sem;
 	Sem_t index_sem;
+	Sem_t *index_sem_next;
+	uint64_t file_offset;
 	void *data;
-	pthread_t thr;
-	mac_ctx_t chunk_hmac;
+	mac_ctx_t *chunk_hmac;
 	algo_props_t *props;
 	int decompressing;
 	int btype;
+	int probe_skipped;
+	uint64_t cmp_bytes;
+	double probe_ms, cmp_ms;
+	pc_ctx_t *pctx;
+};
+
+/*
+ * Per-thread data structure for compression and decompression threads. The
+ * algorithm state lives here and is bound to whichever chunk slot the thread
+ * picks up next.
+ */
+struct cmp_worker {
+	void *data;
+	int level;
+	dedupe_context_t *rctx;
+	mac_ctx_t chunk_hmac;
+	pthread_t thr;
+	stage_stats_t *sstats;
 	pc_ctx_t *pctx;
+	int numa_node;
+	uint64_t numa_bytes;
+	double numa_ms;
 };
 
 void usage(pc_ctx_t *pctx);
@@ -67,6 +67,9 @@ ppmd_alloc(void *data)
 {
 	CPpmd8 *_ppmd = (CPpmd8 *)data;
 
+	/* Already set up by an earlier call on this thread. */
+	if (_ppmd->Base != 0 && _ppmd->Size == ppmd8_mem_sz[_ppmd->Order])
+		return (0);
 	if (!Ppmd8_Alloc(_ppmd, ppmd8_mem_sz[_ppmd->Order], &g_Alloc)) {
 		log_msg(LOG_ERR, 0, "PPMD: Out of memory.\n");
 		return (-1);
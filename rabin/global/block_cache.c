@@ -0,0 +1,301 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * Global dedupe references point backwards into output that has already been
+ * written. Rather than mapping the output file for every referenced block the
+ * referenced region is read in larger aligned blocks which are kept in a small
+ * LRU cache shared by all the decompression threads. Duplicate blocks tend to
+ * come in runs that reference neighbouring offsets, so most references after
+ * the first in a run are served from memory.
+ *
+ * Only data below the start of the segment being restored is ever requested
+ * and that part of the output never changes once written. A block may however
+ * have been filled while the output was shorter, so each block records how
+ * much of it is valid and is refilled when a reference goes past that.
+ *
+ * The cache lock is not held while a block is read from the file. The entry
+ * is marked as filling and taken off the LRU list, so that it cannot be
+ * evicted, and other threads wanting the same block wait for the fill to
+ * finish. If every entry is being filled the data is read directly.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "utils/utils.h"
+#include "allocator.h"
+#include "block_cache.h"
+
+struct bc_entry {
+	uint64_t blk;
+	uint32_t valid;
+	int filling;
+	uchar_t *data;
+	struct bc_entry *hnext;
+	struct bc_entry *prev, *next;
+};
+
+struct block_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t fill_cv;
+	uint32_t blksz;
+	uint32_t nents, used;
+	uint32_t hmask;
+	struct bc_entry **htab;
+	struct bc_entry *ents;
+	struct bc_entry lru; // Head is most recently used, tail is evicted first
+	block_cache_stats_t st;
+};
+
+block_cache_t *
+block_cache_create(uint64_t memlimit, uint32_t blksz)
+{
+	block_cache_t *bc;
+	uint64_t nents, hsz;
+
+	nents = memlimit / blksz;
+	if (nents < 2)
+		return (NULL);
+	if (nents > UINT32_MAX / 2)
+		nents = UINT32_MAX / 2;
+	for (hsz = 1; hsz < nents; hsz <<= 1);
+
+	bc = (block_cache_t *)slab_calloc(NULL, 1, sizeof (block_cache_t));
+	if (!bc)
+		return (NULL);
+	pthread_mutex_init(&bc->lock, NULL);
+	pthread_cond_init(&bc->fill_cv, NULL);
+	bc->htab = (struct bc_entry **)slab_calloc(NULL, hsz, sizeof (struct bc_entry *));
+	bc->ents = (struct bc_entry *)slab_calloc(NULL, nents, sizeof (struct bc_entry));
+	if (!bc->htab || !bc->ents) {
+		block_cache_destroy(bc);
+		return (NULL);
+	}
+	bc->blksz = blksz;
+	bc->nents = nents;
+	bc->hmask = hsz - 1;
+	bc->lru.next = &bc->lru;
+	bc->lru.prev = &bc->lru;
+	return (bc);
+}
+
+void
+block_cache_destroy(block_cache_t *bc)
+{
+	uint32_t i;
+
+	if (!bc)
+		return;
+	if (bc->ents) {
+		for (i = 0; i < bc->used; i++)
+			slab_free(NULL, bc->ents[i].data);
+		slab_free(NULL, bc->ents);
+	}
+	if (bc->htab)
+		slab_free(NULL, bc->htab);
+	pthread_mutex_destroy(&bc->lock);
+	pthread_cond_destroy(&bc->fill_cv);
+	slab_free(NULL, bc);
+}
+
+static void
+lru_unlink(struct bc_entry *ent)
+{
+	ent->prev->next = ent->next;
+	ent->next->prev = ent->prev;
+}
+
+static void
+lru_push(block_cache_t *bc, struct bc_entry *ent)
+{
+	ent->next = bc->lru.next;
+	ent->prev = &bc->lru;
+	bc->lru.next->prev = ent;
+	bc->lru.next = ent;
+}
+
+static struct bc_entry *
+bc_lookup(block_cache_t *bc, uint64_t blk)
+{
+	struct bc_entry *ent;
+
+	for (ent = bc->htab[blk & bc->hmask]; ent; ent = ent->hnext) {
+		if (ent->blk == blk)
+			return (ent);
+	}
+	return (NULL);
+}
+
+/*
+ * Get an entry to hold a new block, either unused or the least recently used
+ * one. The entry is removed from the hashtable and the LRU list. Entries being
+ * filled are not on the LRU list, so NULL is returned if all of them are.
+ */
+static struct bc_entry *
+bc_alloc(block_cache_t *bc)
+{
+	struct bc_entry *ent, **pp;
+
+	if (bc->used < bc->nents) {
+		ent = &bc->ents[bc->used];
+		ent->data = (uchar_t *)slab_alloc(NULL, bc->blksz);
+		if (!ent->data)
+			return (NULL);
+		bc->used++;
+		return (ent);
+	}
+
+	ent = bc->lru.prev;
+	if (ent == &bc->lru)
+		return (NULL);
+	lru_unlink(ent);
+	for (pp = &bc->htab[ent->blk & bc->hmask]; *pp != ent; pp = &((*pp)->hnext));
+	*pp = ent->hnext;
+	bc->st.evictions++;
+	return (ent);
+}
+
+static int64_t
+read_full(int fd, uchar_t *buf, uint64_t len, uint64_t offset)
+{
+	uint64_t done;
+	ssize_t rv;
+
+	done = 0;
+	while (done < len) {
+		rv = pread(fd, buf + done, len - done, offset + done);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (rv == 0)
+			break;
+		done += rv;
+	}
+	return (done);
+}
+
+/*
+ * Copy len bytes at offset in the output file into buf. Data in the file is
+ * only trusted below valid_end. Returns 0 on success and -1 on a read error or
+ * if the range is not available.
+ */
+int
+block_cache_read(block_cache_t *bc, int fd, uchar_t *buf, uint64_t len,
+		uint64_t offset, uint64_t valid_end)
+{
+	struct bc_entry *ent;
+	uint64_t blk, boff, clen, want;
+	int64_t rv;
+
+	if (offset + len > valid_end)
+		return (-1);
+
+	pthread_mutex_lock(&bc->lock);
+	while (len > 0) {
+		blk = offset / bc->blksz;
+		boff = offset % bc->blksz;
+		clen = bc->blksz - boff;
+		if (clen > len)
+			clen = len;
+
+		ent = bc_lookup(bc, blk);
+		if (ent && ent->filling) {
+			/*
+			 * The entry may be refilled or evicted by the time we wake
+			 * up, so look it up again.
+			 */
+			pthread_cond_wait(&bc->fill_cv, &bc->lock);
+			continue;
+		}
+		if (ent && ent->valid >= boff + clen) {
+			bc->st.hits++;
+			lru_unlink(ent);
+		} else {
+			bc->st.misses++;
+			if (ent) {
+				lru_unlink(ent);
+			} else {
+				ent = bc_alloc(bc);
+				if (!ent) {
+					pthread_mutex_unlock(&bc->lock);
+					rv = read_full(fd, buf, clen, offset);
+					if (rv != (int64_t)clen)
+						return (-1);
+					pthread_mutex_lock(&bc->lock);
+					bc->st.bytes_read += rv;
+					buf += clen;
+					offset += clen;
+					len -= clen;
+					continue;
+				}
+				ent->blk = blk;
+				ent->hnext = bc->htab[blk & bc->hmask];
+				bc->htab[blk & bc->hmask] = ent;
+			}
+
+			/*
+			 * Read the whole block, or as much of it as has been written.
+			 */
+			want = valid_end - blk * bc->blksz;
+			if (want > bc->blksz)
+				want = bc->blksz;
+			ent->filling = 1;
+			pthread_mutex_unlock(&bc->lock);
+			rv = read_full(fd, ent->data, want, blk * bc->blksz);
+			pthread_mutex_lock(&bc->lock);
+			ent->filling = 0;
+			pthread_cond_broadcast(&bc->fill_cv);
+			ent->valid = (rv > 0 ? rv : 0);
+			if (rv > 0)
+				bc->st.bytes_read += rv;
+			if (ent->valid < boff + clen) {
+				lru_push(bc, ent);
+				pthread_mutex_unlock(&bc->lock);
+				return (-1);
+			}
+		}
+		lru_push(bc, ent);
+		memcpy(buf, ent->data + boff, clen);
+		buf += clen;
+		offset += clen;
+		len -= clen;
+	}
+	pthread_mutex_unlock(&bc->lock);
+	return (0);
+}
+
+void
+block_cache_get_stats(block_cache_t *bc, block_cache_stats_t *st)
+{
+	pthread_mutex_lock(&bc->lock);
+	*st = bc->st;
+	pthread_mutex_unlock(&bc->lock);
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+#ifndef	_BLOCK_CACHE_H
+#define	_BLOCK_CACHE_H
+
+#include <stdint.h>
+#include "utils/utils.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounded LRU cache of fixed size blocks of already written output, used to
+ * resolve backward global dedupe references during decompression.
+ */
+typedef struct block_cache block_cache_t;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t bytes_read;
+	uint64_t evictions;
+} block_cache_stats_t;
+
+block_cache_t *block_cache_create(uint64_t memlimit, uint32_t blksz);
+void block_cache_destroy(block_cache_t *bc);
+int block_cache_read(block_cache_t *bc, int fd, uchar_t *buf, uint64_t len,
+		uint64_t offset, uint64_t valid_end);
+void block_cache_get_stats(block_cache_t *bc, block_cache_stats_t *st);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
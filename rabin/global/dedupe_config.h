@@ -89,6 +89,10 @@ typedef struct {
 		       // segment metadata cache.
 	int valid;
 	void *db_index;
+	int store_fd; // Data file of persistent dedupe store, -1 if none
+	uint64_t store_base; // Store offset where data from this run begins
+	uint64_t store_id; // Random identity of the persistent dedupe store
+	int store_failed; // Set if writing to the store failed
 } archive_config_t;
 
 #pragma pack(1)
@@ -33,6 +33,8 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
 
 #include "utils/utils.h"
 #include "allocator.h"
@@ -46,14 +48,88 @@ typedef struct {
 	hash_entry_t **tab;
 } htab_t;
 
+/*
+ * Entry in the open-addressing simple index. Entries are fixed width and live
+ * inline in one contiguous arena. An item_size of zero marks an empty slot. The
+ * full key hash is kept to recompute the home slot and to filter compares.
+ */
+typedef struct {
+	uint64_t item_offset;
+	uint32_t item_size;
+	uint32_t hash;
+	uchar_t cksum[1];
+} oa_entry_t;
+
+#define	OA_ENTRY_SZ(cksum_sz)	(offsetof(oa_entry_t, cksum) + (cksum_sz))
+#define	OA_ENTRY_MAX		OA_ENTRY_SZ(CKSUM_MAX_BYTES)
+
+/*
+ * The simple index is split into shards by hash slot. Each shard has its own
+ * lock and memory budget. Chunks pass through every shard in chunk sequence
+ * order (next_seq) so that different chunks can work on different shards at
+ * the same time while each key still sees its inserts in stream order.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t turn;
+	uint32_t next_seq;
+	uint64_t memlimit;
+	uint64_t memused;
+	uchar_t *tab;
+	uint32_t cap, count, max_entries;
+} index_shard_t;
+
 typedef struct {
 	htab_t *list;
 	uint64_t memlimit;
 	uint64_t memused;
 	int hash_entry_size, intervals, hash_slots;
+	index_shard_t *shards;
+	uint32_t nshards;
+	int aborted;
+	int open_addr;
+	uchar_t *arena;
+	size_t arena_sz;
 	char *index_file;
+	int index_fd;
+	struct store_hdr *store_hdr;
 } index_t;
 
+/*
+ * A persistent dedupe store is a directory holding two files:
+ *
+ * index - A header followed by the open-addressing tables of all shards. It is
+ *         mapped privately at startup and replaced atomically once a run
+ *         completes successfully, so a failed run never leaves it inconsistent.
+ * data  - Sparse log of block data. Each run writes its unique blocks at
+ *         store_base + file offset. Index entries hold store offsets, so later
+ *         runs can reference blocks from earlier runs.
+ *
+ * The store is host-endian and meant to stay local to one machine.
+ */
+#define	STORE_MAGIC	"PCDSTOR1"
+#define	STORE_VERSION	1
+#define	STORE_HDR_SZ	65536
+#define	STORE_ALIGN	4096
+
+/*
+ * Room for the longest file name in the store directory, "/.index.tmp".
+ */
+#define	STORE_NAME_MAX	16
+
+typedef struct store_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t cksum_type;
+	uint32_t entry_sz;
+	uint32_t nshards;
+	uint32_t cap;
+	uint32_t pad;
+	uint64_t store_id;
+	uint64_t data_end;
+	uint32_t count[INDEX_SHARDS];
+} store_hdr_t;
+
 archive_config_t *
 init_global_db(char *configfile)
 {
@@ -73,17 +149,6 @@ init_global_db(char *configfile)
 	return (cfg);
 }
 
-int
-init_on_disk_index(archive_config_t *cfg)
-{
-#if 0
-        if (file_exists()) {
-
-        }
-#endif
-	return (0);
-}
-
 void
 static cleanup_indx(index_t *indx)
 {
@@ -107,6 +172,19 @@ static cleanup_indx(index_t *indx)
 			}
 			free(indx->list);
 		}
+		if (indx->shards) {
+			for (i = 0; i < indx->nshards; i++) {
+				pthread_mutex_destroy(&(indx->shards[i].lock));
+				pthread_cond_destroy(&(indx->shards[i].turn));
+			}
+			free(indx->shards);
+		}
+		if (indx->arena)
+			munmap(indx->arena, indx->arena_sz);
+		if (indx->index_fd != -1)
+			close(indx->index_fd);
+		if (indx->store_hdr)
+			free(indx->store_hdr);
 		free(indx);
 	}
 }
@@ -116,6 +194,30 @@ static cleanup_indx(index_t *indx)
 #define	MEM_REQD(hslots, ent_sz) (hslots * MEM_PER_UNIT(ent_sz))
 #define	SLOTS_FOR_MEM(memlimit, ent_sz) (memlimit / MEM_PER_UNIT(ent_sz) - 5)
 
+/*
+ * The open-addressing table is sized for 1.5x the expected number of entries
+ * at a maximum load factor of 7/8.
+ */
+#define	OA_MEM_PER_UNIT(ent_sz) (((ent_sz) * 12) / 7 + 1)
+#define	OA_MAX_LOAD(cap) ((cap) - ((cap) >> 3))
+#define	HUGEPAGE_SZ	(2UL * 1024 * 1024)
+
+/*
+ * The simple index uses an open-addressing table by default. Setting
+ * PCOMPRESS_GLOBAL_INDEX=chain selects the older chained hashtable.
+ */
+static int
+use_open_addr(archive_config_t *cfg, int pct_interval)
+{
+	char *val;
+
+	if (cfg->dedupe_mode != MODE_SIMPLE || pct_interval != 0)
+		return (0);
+	if ((val = getenv("PCOMPRESS_GLOBAL_INDEX")) != NULL && strcmp(val, "chain") == 0)
+		return (0);
+	return (1);
+}
+
 int
 setup_db_config_s(archive_config_t *cfg, uint32_t chunksize, uint64_t *user_chunk_sz,
 		 int *pct_interval, const char *algo, cksum_t ck, cksum_t ck_sim,
@@ -200,6 +302,10 @@ set_cfg:
 	 * occupancy.
 	 */
 	*memreqd = MEM_REQD(*hash_slots, *hash_entry_size);
+	if (use_open_addr(cfg, *pct_interval)) {
+		*hash_entry_size = OA_ENTRY_SZ(cfg->chunk_cksum_sz);
+		*memreqd = (uint64_t)(*hash_slots) * OA_MEM_PER_UNIT(*hash_entry_size);
+	}
 
 	/*
 	 * If memory required is more than the indicated memory limit then
@@ -214,6 +320,287 @@ set_cfg:
 	return (rv);
 }
 
+/*
+ * Allocate the open-addressing arena and carve it into per-shard tables. The
+ * arena is one anonymous mapping so that it can be backed by huge pages. Huge
+ * pages are requested when PCOMPRESS_INDEX_HUGEPAGES is set. If explicit huge
+ * pages are not available transparent huge pages are requested instead.
+ */
+static int
+init_open_addr(index_t *indx)
+{
+	uint64_t cap, sz;
+	uint32_t i;
+	uchar_t *arena;
+	int hugepages;
+
+	cap = ((uint64_t)indx->hash_slots * 12 / 7) / indx->nshards + 2;
+	if (cap > UINT32_MAX - 1)
+		cap = UINT32_MAX - 1;
+	if (indx->index_fd != -1)
+		cap = indx->store_hdr->cap;
+	sz = cap * indx->hash_entry_size * indx->nshards;
+	hugepages = (getenv("PCOMPRESS_INDEX_HUGEPAGES") != NULL);
+	arena = MAP_FAILED;
+	if (indx->index_fd != -1) {
+		/*
+		 * Existing persistent index. Changes stay private till committed.
+		 */
+		arena = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE, indx->index_fd,
+		    STORE_HDR_SZ);
+		if (arena == MAP_FAILED) {
+			log_msg(LOG_ERR, 1, "Cannot map dedupe store index ");
+			return (-1);
+		}
+#ifdef MADV_HUGEPAGE
+		if (hugepages)
+			madvise(arena, sz, MADV_HUGEPAGE);
+#endif
+	} else if (hugepages) {
+		sz = (sz + HUGEPAGE_SZ - 1) & ~(HUGEPAGE_SZ - 1);
+#ifdef MAP_HUGETLB
+		arena = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	}
+	if (arena == MAP_FAILED) {
+		arena = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (arena == MAP_FAILED) {
+			log_msg(LOG_ERR, 1, "Cannot allocate Global Dedupe index ");
+			return (-1);
+		}
+#ifdef MADV_HUGEPAGE
+		if (hugepages)
+			madvise(arena, sz, MADV_HUGEPAGE);
+#endif
+	}
+	indx->arena = arena;
+	indx->arena_sz = sz;
+	for (i = 0; i < indx->nshards; i++) {
+		indx->shards[i].tab = arena + i * cap * indx->hash_entry_size;
+		indx->shards[i].cap = cap;
+		indx->shards[i].count = 0;
+		if (indx->index_fd != -1)
+			indx->shards[i].count = indx->store_hdr->count[i];
+		indx->shards[i].max_entries = OA_MAX_LOAD(cap);
+	}
+	return (0);
+}
+
+/*
+ * Open or create the persistent dedupe store in directory path. An existing
+ * index determines the shard layout, otherwise the index is sized for four
+ * times the current dataset within the memory limit, to leave room for
+ * future runs. The data file is locked so that only one run can add to
+ * the store at a time.
+ */
+static int
+init_on_disk_index(archive_config_t *cfg, index_t *indx, char *path, size_t memlimit)
+{
+	char fpath[sizeof (cfg->rootdir) + STORE_NAME_MAX];
+	struct flock lk;
+	store_hdr_t *hdr;
+	uint64_t slots;
+
+	if (strlen(path) >= sizeof (cfg->rootdir)) {
+		log_msg(LOG_ERR, 0, "Dedupe store path too long: %s", path);
+		return (-1);
+	}
+	strcpy(cfg->rootdir, path);
+	if (mkdir(path, S_IRWXU) == -1 && errno != EEXIST) {
+		log_msg(LOG_ERR, 1, "Cannot create dedupe store %s ", path);
+		return (-1);
+	}
+	snprintf(fpath, sizeof (fpath), "%s/data", path);
+	cfg->store_fd = open(fpath, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (cfg->store_fd == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open %s ", fpath);
+		return (-1);
+	}
+	memset(&lk, 0, sizeof (lk));
+	lk.l_type = F_WRLCK;
+	lk.l_whence = SEEK_SET;
+	if (fcntl(cfg->store_fd, F_SETLK, &lk) == -1) {
+		log_msg(LOG_ERR, 0, "Dedupe store %s is in use by another process.", path);
+		return (-1);
+	}
+
+	hdr = (store_hdr_t *)calloc(1, sizeof (store_hdr_t));
+	if (!hdr) {
+		log_msg(LOG_ERR, 0, "Memory allocation failure\n");
+		return (-1);
+	}
+	indx->store_hdr = hdr;
+	snprintf(fpath, sizeof (fpath), "%s/index", path);
+	indx->index_fd = open(fpath, O_RDONLY);
+	if (indx->index_fd == -1) {
+		if (errno != ENOENT) {
+			log_msg(LOG_ERR, 1, "Cannot open %s ", fpath);
+			return (-1);
+		}
+
+		/*
+		 * New store.
+		 */
+		memcpy(hdr->magic, STORE_MAGIC, sizeof (hdr->magic));
+		hdr->version = STORE_VERSION;
+		hdr->cksum_type = cfg->chunk_cksum_type;
+		hdr->entry_sz = indx->hash_entry_size;
+		hdr->store_id = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^
+		    (uint64_t)(uintptr_t)hdr;
+		slots = (uint64_t)indx->hash_slots * 4;
+		if (slots > memlimit / OA_MEM_PER_UNIT(indx->hash_entry_size))
+			slots = memlimit / OA_MEM_PER_UNIT(indx->hash_entry_size);
+		if (slots > UINT32_MAX)
+			slots = UINT32_MAX;
+		if (slots > indx->hash_slots)
+			indx->hash_slots = slots;
+		indx->nshards = INDEX_SHARDS;
+		if (indx->nshards > indx->hash_slots)
+			indx->nshards = indx->hash_slots;
+		cfg->store_base = 0;
+		cfg->store_id = hdr->store_id;
+		return (0);
+	}
+
+	if (Read(indx->index_fd, hdr, sizeof (store_hdr_t)) < sizeof (store_hdr_t) ||
+	    memcmp(hdr->magic, STORE_MAGIC, sizeof (hdr->magic)) != 0 ||
+	    hdr->version != STORE_VERSION || hdr->nshards == 0 ||
+	    hdr->nshards > INDEX_SHARDS || hdr->cap < 2) {
+		log_msg(LOG_ERR, 0, "%s is not a valid dedupe store index.", fpath);
+		return (-1);
+	}
+	if (hdr->cksum_type != cfg->chunk_cksum_type || hdr->entry_sz != indx->hash_entry_size) {
+		log_msg(LOG_ERR, 0, "Dedupe store %s uses a different block hash.", path);
+		return (-1);
+	}
+	indx->nshards = hdr->nshards;
+	cfg->store_base = hdr->data_end;
+	cfg->store_id = hdr->store_id;
+	return (0);
+}
+
+/*
+ * Check that the dedupe store at path is the one a compressed file was created
+ * against. store_id and store_base are recorded in the file header. The store
+ * must have the same id and must hold at least the data that was present when
+ * the file was created.
+ */
+int
+db_store_check(char *path, uint64_t store_id, uint64_t store_base)
+{
+	char fpath[MAXPATHLEN];
+	store_hdr_t hdr;
+	int fd;
+
+	snprintf(fpath, sizeof (fpath), "%s/index", path);
+	fd = open(fpath, O_RDONLY);
+	if (fd == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open dedupe store index %s ", fpath);
+		return (-1);
+	}
+	if (Read(fd, &hdr, sizeof (hdr)) < sizeof (hdr) ||
+	    memcmp(hdr.magic, STORE_MAGIC, sizeof (hdr.magic)) != 0 ||
+	    hdr.version != STORE_VERSION) {
+		log_msg(LOG_ERR, 0, "%s is not a valid dedupe store index.", fpath);
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+	if (hdr.store_id != store_id) {
+		log_msg(LOG_ERR, 0, "Dedupe store %s is not the store this file was "
+		    "compressed against.", path);
+		return (-1);
+	}
+	if (hdr.data_end < store_base) {
+		log_msg(LOG_ERR, 0, "Dedupe store %s is older than this file.", path);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Write out the updated index once a run has completed. data_len is the number
+ * of bytes of input processed by this run. The new index is written to a
+ * temporary file and renamed over the old one after the data file is synced.
+ */
+int
+db_store_commit(archive_config_t *cfg, uint64_t data_len)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	store_hdr_t *hdr = indx->store_hdr;
+	char fpath[sizeof (cfg->rootdir) + STORE_NAME_MAX];
+	char tpath[sizeof (cfg->rootdir) + STORE_NAME_MAX];
+	uint64_t tabsz;
+	uint32_t i;
+	int fd;
+
+	if (cfg->store_fd == -1)
+		return (0);
+	if (cfg->store_failed) {
+		log_msg(LOG_ERR, 0, "Not updating dedupe store %s due to earlier errors.",
+		    cfg->rootdir);
+		return (-1);
+	}
+	hdr->nshards = indx->nshards;
+	hdr->cap = indx->shards[0].cap;
+	for (i = 0; i < indx->nshards; i++)
+		hdr->count[i] = indx->shards[i].count;
+	hdr->data_end = (cfg->store_base + data_len + STORE_ALIGN - 1) & ~((uint64_t)STORE_ALIGN - 1);
+	tabsz = (uint64_t)hdr->cap * indx->hash_entry_size * indx->nshards;
+
+	snprintf(fpath, sizeof (fpath), "%s/index", cfg->rootdir);
+	snprintf(tpath, sizeof (tpath), "%s/.index.tmp", cfg->rootdir);
+	if (fsync(cfg->store_fd) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot sync dedupe store data ");
+		return (-1);
+	}
+	fd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		log_msg(LOG_ERR, 1, "Cannot create %s ", tpath);
+		return (-1);
+	}
+	if (Write(fd, hdr, sizeof (store_hdr_t)) < sizeof (store_hdr_t) ||
+	    lseek(fd, STORE_HDR_SZ, SEEK_SET) != STORE_HDR_SZ ||
+	    Write(fd, indx->arena, tabsz) < tabsz || fsync(fd) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot write %s ", tpath);
+		close(fd);
+		unlink(tpath);
+		return (-1);
+	}
+	close(fd);
+	if (rename(tpath, fpath) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot rename %s ", tpath);
+		unlink(tpath);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Save block data at the given store offset. Can be called concurrently.
+ */
+int
+db_store_write(archive_config_t *cfg, uchar_t *buf, uint64_t len, uint64_t offset)
+{
+	int64_t w;
+
+	while (len > 0) {
+		w = pwrite(cfg->store_fd, buf, len, offset);
+		if (w <= 0) {
+			if (w == -1 && errno == EINTR)
+				continue;
+			log_msg(LOG_ERR, 1, "Dedupe store write failed ");
+			cfg->store_failed = 1;
+			return (-1);
+		}
+		buf += w;
+		len -= w;
+		offset += w;
+	}
+	return (0);
+}
+
 archive_config_t *
 init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_chunk_sz,
 		 int pct_interval, const char *algo, cksum_t ck, cksum_t ck_sim,
@@ -226,22 +613,16 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 	int hash_entry_size;
 	index_t *indx;
 
-	if (path != NULL) {
-		log_msg(LOG_WARN, 0, "Disk based index not yet implemented.\n");
-		return (NULL);
-	}
 	cfg = calloc(1, sizeof (archive_config_t));
-
-	rv = setup_db_config_s(cfg, chunksize, &user_chunk_sz, &pct_interval, algo, ck, ck_sim,
-		 file_sz, &hash_slots, &hash_entry_size, &memreqd, memlimit, tmppath);
+	cfg->store_fd = -1;
 
 	/*
-	 * Reduce hash_slots to remain within memlimit
+	 * A persistent store always uses the simple index. Passing a NULL tmppath
+	 * prevents switching to segmented mode when memory is short.
 	 */
-	while (memreqd > memlimit) {
-		hash_slots--;
-		memreqd = hash_slots * MEM_PER_UNIT(hash_entry_size);
-	}
+	rv = setup_db_config_s(cfg, chunksize, &user_chunk_sz, &pct_interval, algo, ck, ck_sim,
+		 file_sz, &hash_slots, &hash_entry_size, &memreqd, memlimit,
+		 path != NULL ? NULL : tmppath);
 
 	/*
 	 * Now initialize the hashtable[s] to setup the index. 
@@ -251,6 +632,27 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 		free(cfg);
 		return (NULL);
 	}
+	indx->index_fd = -1;
+	indx->open_addr = use_open_addr(cfg, pct_interval);
+	if (path != NULL && !indx->open_addr) {
+		log_msg(LOG_ERR, 0, "Dedupe store needs the simple open-addressing index.");
+		free(indx);
+		free(cfg);
+		return (NULL);
+	}
+
+	/*
+	 * Reduce hash_slots to remain within memlimit
+	 */
+	if (indx->open_addr) {
+		if (memreqd > memlimit)
+			hash_slots = memlimit / OA_MEM_PER_UNIT(hash_entry_size);
+	} else {
+		while (memreqd > memlimit) {
+			hash_slots--;
+			memreqd = hash_slots * MEM_PER_UNIT(hash_entry_size);
+		}
+	}
 
 	cfg->nthreads = nthreads;
 	if (cfg->dedupe_mode == MODE_SIMILARITY)
@@ -263,7 +665,7 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 	indx->intervals = intervals;
 	indx->hash_slots = hash_slots / intervals;
 
-	for (i = 0; i < intervals; i++) {
+	for (i = 0; i < intervals && !indx->open_addr; i++) {
 		indx->list[i].tab = (hash_entry_t **)calloc(indx->hash_slots, sizeof (hash_entry_t *));
 		if (!(indx->list[i].tab)) {
 			cleanup_indx(indx);
@@ -273,6 +675,46 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 		indx->memused += ((indx->hash_slots) * (sizeof (hash_entry_t *)));
 	}
 
+	/*
+	 * Only the simple index is accessed concurrently. Segmented dedupe keeps
+	 * a single shard since the caller serializes index access along with the
+	 * segment cache. The shard count is fixed so that output does not depend
+	 * on the number of threads.
+	 */
+	indx->nshards = 1;
+	if (cfg->dedupe_mode == MODE_SIMPLE && pct_interval == 0) {
+		indx->nshards = INDEX_SHARDS;
+		if (indx->nshards > indx->hash_slots)
+			indx->nshards = indx->hash_slots;
+	}
+	if (path != NULL && init_on_disk_index(cfg, indx, path, memlimit) != 0) {
+		if (cfg->store_fd != -1)
+			close(cfg->store_fd);
+		cleanup_indx(indx);
+		free(cfg);
+		return (NULL);
+	}
+	indx->shards = (index_shard_t *)calloc(indx->nshards, sizeof (index_shard_t));
+	if (!(indx->shards)) {
+		cleanup_indx(indx);
+		free(cfg);
+		return (NULL);
+	}
+	for (i = 0; i < indx->nshards; i++) {
+		pthread_mutex_init(&(indx->shards[i].lock), NULL);
+		pthread_cond_init(&(indx->shards[i].turn), NULL);
+		indx->shards[i].next_seq = 0;
+		indx->shards[i].memlimit = indx->memlimit / indx->nshards;
+		indx->shards[i].memused = indx->memused / indx->nshards;
+	}
+	if (indx->open_addr && init_open_addr(indx) != 0) {
+		if (cfg->store_fd != -1)
+			close(cfg->store_fd);
+		cleanup_indx(indx);
+		free(cfg);
+		return (NULL);
+	}
+
 	/*
 	 * If Segmented Deduplication is required intervals will be set and a temporary
 	 * file is created to hold rabin block hash lists for each segment.
@@ -479,18 +921,21 @@ mycmp(uchar_t *a, uchar_t *b, int sz)
 }
 
 /*
- * Lookup and insert item if indicated. Not thread-safe by design. Caller needs to
- * ensure thread-safety.
+ * Compute the hash slot for a key. This can be called without any locking.
  */
-hash_entry_t *
-db_lookup_insert_s(archive_config_t *cfg, uchar_t *sim_cksum, int interval,
-		   uint64_t item_offset, uint32_t item_size, int do_insert)
+uint32_t
+db_hash_slot(archive_config_t *cfg, uchar_t *sim_cksum)
 {
 	uint32_t htab_entry;
 	index_t *indx = (index_t *)(cfg->db_index);
-	hash_entry_t **htab, *ent, **pent;
 
-	assert((cfg->similarity_cksum_sz & (sizeof (size_t) - 1)) == 0);
+	/*
+	 * The open-addressing index takes the raw 32-bit hash of the key and
+	 * derives the shard and home slot from it. Simple index keys are
+	 * cryptographic hashes so their leading bytes are used directly.
+	 */
+	if (indx->open_addr)
+		return (U32_P(sim_cksum));
 
 	/*
 	 * If doing similarity based dedupe, keys will be 64-bit and are portions of
@@ -503,7 +948,83 @@ db_lookup_insert_s(archive_config_t *cfg, uchar_t *sim_cksum, int interval,
 		htab_entry = XXH32(sim_cksum, cfg->similarity_cksum_sz, 0);
 	}
 	htab_entry ^= (htab_entry / cfg->similarity_cksum_sz);
-	htab_entry = htab_entry % indx->hash_slots;
+	return (htab_entry % indx->hash_slots);
+}
+
+/*
+ * Number of independently lockable index shards and the shard a hash slot
+ * belongs to.
+ */
+uint32_t
+db_nshards(archive_config_t *cfg)
+{
+	return (((index_t *)(cfg->db_index))->nshards);
+}
+
+uint32_t
+db_slot_shard(archive_config_t *cfg, uint32_t slot)
+{
+	return (slot % ((index_t *)(cfg->db_index))->nshards);
+}
+
+/*
+ * Wait till chunk number seq is the next in sequence for the given shard and
+ * take ownership of the shard. Every chunk must enter and leave every shard
+ * exactly once, in chunk order, even if it has no keys in that shard.
+ */
+void
+db_shard_enter(archive_config_t *cfg, uint32_t shard, uint32_t seq)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	index_shard_t *sh = &(indx->shards[shard]);
+
+	pthread_mutex_lock(&(sh->lock));
+	while (sh->next_seq != seq && !indx->aborted)
+		pthread_cond_wait(&(sh->turn), &(sh->lock));
+}
+
+void
+db_shard_leave(archive_config_t *cfg, uint32_t shard)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	index_shard_t *sh = &(indx->shards[shard]);
+
+	sh->next_seq++;
+	pthread_cond_broadcast(&(sh->turn));
+	pthread_mutex_unlock(&(sh->lock));
+}
+
+/*
+ * Release all threads waiting for their turn on a shard. Used when processing
+ * is cancelled and some chunks in the sequence will never arrive. Waiters
+ * still hold the shard lock so the index is not corrupted.
+ */
+void
+db_index_abort(archive_config_t *cfg)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	uint32_t i;
+
+	for (i = 0; i < indx->nshards; i++) {
+		pthread_mutex_lock(&(indx->shards[i].lock));
+		indx->aborted = 1;
+		pthread_cond_broadcast(&(indx->shards[i].turn));
+		pthread_mutex_unlock(&(indx->shards[i].lock));
+	}
+}
+
+/*
+ * Lookup and insert item in the chained hashtable if indicated.
+ */
+static hash_entry_t *
+chain_lookup_insert(archive_config_t *cfg, uint32_t htab_entry, uchar_t *sim_cksum,
+		   int interval, uint64_t item_offset, uint32_t item_size, int do_insert)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	index_shard_t *sh;
+	hash_entry_t **htab, *ent, **pent;
+
+	assert((cfg->similarity_cksum_sz & (sizeof (size_t) - 1)) == 0);
 	htab = indx->list[interval].tab;
 
 	pent = &(htab[htab_entry]);
@@ -537,7 +1058,8 @@ db_lookup_insert_s(archive_config_t *cfg, uchar_t *sim_cksum, int interval,
 		}
 	}
 	if (do_insert) {
-		if (indx->memused + indx->hash_entry_size >= indx->memlimit && htab[htab_entry] != NULL) {
+		sh = &(indx->shards[htab_entry % indx->nshards]);
+		if (sh->memused + indx->hash_entry_size >= sh->memlimit && htab[htab_entry] != NULL) {
 			/*
 			 * If the index is close to full capacity, steal the oldest hash bucket
 			 * in this slot to hold the new data.
@@ -546,7 +1068,7 @@ db_lookup_insert_s(archive_config_t *cfg, uchar_t *sim_cksum, int interval,
 			htab[htab_entry] = htab[htab_entry]->next;
 		} else {
 			ent = (hash_entry_t *)malloc(indx->hash_entry_size);
-			indx->memused += indx->hash_entry_size;
+			sh->memused += indx->hash_entry_size;
 		}
 		ent->item_offset = item_offset;
 		ent->item_size = item_size;
@@ -557,6 +1079,184 @@ db_lookup_insert_s(archive_config_t *cfg, uchar_t *sim_cksum, int interval,
 	return (NULL);
 }
 
+#define	OA_ENT(sh, ent_sz, pos) ((oa_entry_t *)((sh)->tab + (uint64_t)(pos) * (ent_sz)))
+
+static inline uint32_t
+oa_home(uint32_t hash, uint32_t cap)
+{
+	return ((uint32_t)(((uint64_t)hash * cap) >> 32));
+}
+
+/*
+ * Distance of an entry at pos from its home slot.
+ */
+static inline uint32_t
+oa_dist(uint32_t pos, uint32_t hash, uint32_t cap)
+{
+	uint32_t home = oa_home(hash, cap);
+
+	return (pos >= home ? pos - home : pos + cap - home);
+}
+
+/*
+ * Remove the entry at pos using backward shift deletion. This keeps entries
+ * with the same home slot contiguous and in insertion order.
+ */
+static void
+oa_delete(index_shard_t *sh, int ent_sz, uint32_t pos)
+{
+	oa_entry_t *ent, *nent;
+	uint32_t nxt;
+
+	ent = OA_ENT(sh, ent_sz, pos);
+	for (;;) {
+		nxt = pos + 1;
+		if (nxt == sh->cap)
+			nxt = 0;
+		nent = OA_ENT(sh, ent_sz, nxt);
+		if (nent->item_size == 0 || oa_dist(nxt, nent->hash, sh->cap) == 0)
+			break;
+		memcpy(ent, nent, ent_sz);
+		ent = nent;
+		pos = nxt;
+	}
+	ent->item_size = 0;
+	sh->count--;
+}
+
+/*
+ * Robin Hood insertion starting at pos, dist along the probe sequence. An entry
+ * only displaces residents that are closer to their home slot, so a new entry
+ * lands after all existing entries with the same home slot.
+ */
+static void
+oa_insert(index_shard_t *sh, int ent_sz, uint32_t pos, uint32_t dist, uchar_t *carry,
+	  uchar_t *spare)
+{
+	oa_entry_t *ent;
+	uchar_t *tmp;
+	uint32_t d;
+
+	for (;;) {
+		ent = OA_ENT(sh, ent_sz, pos);
+		if (ent->item_size == 0) {
+			memcpy(ent, carry, ent_sz);
+			break;
+		}
+		d = oa_dist(pos, ent->hash, sh->cap);
+		if (d < dist) {
+			memcpy(spare, ent, ent_sz);
+			memcpy(ent, carry, ent_sz);
+			tmp = carry;
+			carry = spare;
+			spare = tmp;
+			dist = d;
+		}
+		if (++pos == sh->cap)
+			pos = 0;
+		dist++;
+	}
+	sh->count++;
+}
+
+/*
+ * Lookup and insert item in the open-addressing table. Eviction mirrors the
+ * chained hashtable: once the shard is full the oldest entry with the same home
+ * slot is replaced.
+ */
+static int
+oa_lookup_insert(archive_config_t *cfg, index_t *indx, uint32_t hash, uchar_t *sim_cksum,
+		 uint64_t item_offset, uint32_t item_size, uint64_t *m_offset, uint32_t *m_size)
+{
+	index_shard_t *sh = &(indx->shards[hash % indx->nshards]);
+	int ent_sz = indx->hash_entry_size;
+	uint64_t buf[2][OA_ENTRY_MAX / sizeof (uint64_t) + 1];
+	uint32_t pos, dist, d, run;
+	oa_entry_t *ent;
+
+	pos = oa_home(hash, sh->cap);
+	dist = 0;
+	run = UINT32_MAX;
+	for (;;) {
+		ent = OA_ENT(sh, ent_sz, pos);
+		if (ent->item_size == 0)
+			break;
+		d = oa_dist(pos, ent->hash, sh->cap);
+		if (d < dist)
+			break;
+		if (d == dist) {
+			if (run == UINT32_MAX)
+				run = pos;
+			if (ent->hash == hash && ent->item_size == item_size &&
+			    mycmp(sim_cksum, ent->cksum, cfg->similarity_cksum_sz) == 0) {
+				*m_offset = ent->item_offset;
+				*m_size = ent->item_size;
+				return (1);
+			}
+		}
+		if (++pos == sh->cap)
+			pos = 0;
+		dist++;
+	}
+
+	if (sh->count >= sh->max_entries) {
+		if (run != UINT32_MAX) {
+			oa_delete(sh, ent_sz, run);
+			pos = oa_home(hash, sh->cap);
+			dist = 0;
+		} else if (sh->count >= sh->cap - 1) {
+			return (0);
+		}
+	}
+	ent = (oa_entry_t *)buf[0];
+	ent->item_offset = item_offset;
+	ent->item_size = item_size;
+	ent->hash = hash;
+	memcpy(ent->cksum, sim_cksum, cfg->similarity_cksum_sz);
+	oa_insert(sh, ent_sz, pos, dist, (uchar_t *)buf[0], (uchar_t *)buf[1]);
+	return (0);
+}
+
+/*
+ * Lookup an item in the simple index given its slot from db_hash_slot() and
+ * insert it if not found. Returns 1 and the matching item's offset and size if
+ * found. Not thread-safe by design. Caller needs to own the slot's shard via
+ * db_shard_enter().
+ */
+int
+db_lookup_insert_slot_s(archive_config_t *cfg, uint32_t slot, uchar_t *sim_cksum,
+		   uint64_t item_offset, uint32_t item_size, uint64_t *m_offset,
+		   uint32_t *m_size)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	hash_entry_t *he;
+
+	if (indx->open_addr) {
+		return (oa_lookup_insert(cfg, indx, slot, sim_cksum, item_offset, item_size,
+		    m_offset, m_size));
+	}
+	he = chain_lookup_insert(cfg, slot, sim_cksum, 0, item_offset, item_size, 1);
+	if (he) {
+		*m_offset = he->item_offset;
+		*m_size = he->item_size;
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Lookup and insert item if indicated. Not thread-safe by design. Caller needs to
+ * ensure thread-safety. Only valid for the chained hashtable which is always used
+ * for segmented dedupe.
+ */
+hash_entry_t *
+db_lookup_insert_s(archive_config_t *cfg, uchar_t *sim_cksum, int interval,
+		   uint64_t item_offset, uint32_t item_size, int do_insert)
+{
+	return (chain_lookup_insert(cfg, db_hash_slot(cfg, sim_cksum), sim_cksum,
+	    interval, item_offset, item_size, do_insert));
+}
+
 void
 destroy_global_db_s(archive_config_t *cfg)
 {
@@ -564,6 +1264,8 @@ destroy_global_db_s(archive_config_t *cfg)
 	index_t *indx = (index_t *)(cfg->db_index);
 
 	cleanup_indx(indx);
+	if (cfg->store_fd != -1)
+		close(cfg->store_fd);
 	if (cfg->pct_interval > 0) {
 		for (i = 0; i < cfg->nthreads; i++) {
 			close(cfg->seg_fd_r[i].fd);
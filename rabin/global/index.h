@@ -31,6 +31,11 @@
 extern "C" {
 #endif
 
+/*
+ * Number of independently locked shards in the simple in-memory index.
+ */
+#define	INDEX_SHARDS	64
+
 /*
  * Publically visible In-memory hashtable entry.
  */
@@ -53,6 +58,18 @@ archive_config_t *init_global_db_s(char *path, char *tmppath, uint32_t chunksize
 			int nthreads);
 hash_entry_t *db_lookup_insert_s(archive_config_t *cfg, uchar_t *sim_cksum, int interval,
 		   uint64_t item_offset, uint32_t item_size, int do_insert);
+int db_lookup_insert_slot_s(archive_config_t *cfg, uint32_t slot, uchar_t *sim_cksum,
+		   uint64_t item_offset, uint32_t item_size, uint64_t *m_offset,
+		   uint32_t *m_size);
+uint32_t db_hash_slot(archive_config_t *cfg, uchar_t *sim_cksum);
+uint32_t db_nshards(archive_config_t *cfg);
+uint32_t db_slot_shard(archive_config_t *cfg, uint32_t slot);
+void db_shard_enter(archive_config_t *cfg, uint32_t shard, uint32_t seq);
+void db_shard_leave(archive_config_t *cfg, uint32_t shard);
+void db_index_abort(archive_config_t *cfg);
+int db_store_commit(archive_config_t *cfg, uint64_t data_len);
+int db_store_check(char *path, uint64_t store_id, uint64_t store_base);
+int db_store_write(archive_config_t *cfg, uchar_t *buf, uint64_t len, uint64_t offset);
 void destroy_global_db_s(archive_config_t *cfg);
 
 int db_segcache_write(archive_config_t *cfg, int tid, uchar_t *buf, uint32_t len, uint32_t blknum, uint64_t file_offset);
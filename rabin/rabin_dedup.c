@@ -90,6 +90,11 @@
 #	include <emmintrin.h>
 #endif
 
+#if defined(__USE_SSE_INTRIN__) && defined(__AVX2__)
+#	include <immintrin.h>
+#	define	GEAR_AVX2		1
+#endif
+
 #if defined(_OPENMP)
 #include <omp.h>
 #endif
@@ -106,13 +111,16 @@ extern int lzma_decompress(void *src, uint64_t srclen, void *dst,
 	uint64_t *dstlen, int level, uchar_t chdr, void *data);
 extern int lzma_deinit(void **data);
 extern int bsdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsize,
-       u_char *diff, u_char *scratch, bsize_t scratchsize);
+       u_char *diff, u_char *scratch, bsize_t scratchsize, struct bsdiff_scratch *bs);
+extern struct bsdiff_scratch *bsdiff_scratch_create(void);
+extern void bsdiff_scratch_destroy(struct bsdiff_scratch *bs);
 extern bsize_t get_bsdiff_sz(u_char *pbuf);
 extern int bspatch(u_char *pbuf, u_char *oldbuf, bsize_t oldsize, u_char *newbuf,
 	bsize_t *_newsize);
 
 static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
 uint64_t ir[256], out[256];
+static uint32_t gear[256];
 static int inited = 0;
 archive_config_t *arc = NULL;
 
@@ -165,7 +173,7 @@ dedupe_context_t *
 create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_sz,
     const char *algo, const algo_props_t *props, int delta_flag, int dedupe_flag,
     int file_version, compress_op_t op, uint64_t file_size, char *tmppath,
-    int pipe_mode, int nthreads, size_t freeram) {
+    char *store_path, int pipe_mode, int nthreads, size_t freeram) {
 	dedupe_context_t *ctx;
 	uint32_t i;
 
@@ -207,6 +215,21 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 			ir[j] = val;
 		}
 
+		/*
+		 * Gear table: fixed pseudo-random values from a SplitMix64 sequence so
+		 * that chunk boundaries are identical across runs and builds.
+		 */
+		val = 0x9E3779B97F4A7C15ULL;
+		for (j = 0; j < 256; j++) {
+			uint64_t z;
+
+			val += 0x9E3779B97F4A7C15ULL;
+			z = val;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			gear[j] = (uint32_t)((z ^ (z >> 31)) >> 32);
+		}
+
 		/*
 		 * If Global Deduplication is enabled initialize the in-memory index.
 		 * It is essentially a hashtable that is used for crypto-hash based
@@ -238,7 +261,7 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 					return (NULL);
 				}
 			}
-			arc = init_global_db_s(NULL, tmppath, rab_blk_sz, chunksize, pct_interval,
+			arc = init_global_db_s(store_path, tmppath, rab_blk_sz, chunksize, pct_interval,
 					      algo, chunk_cksum, GLOBAL_SIM_CKSUM, file_size,
 					      freeram, nthreads);
 			if (arc == NULL) {
@@ -291,7 +314,16 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 	ctx->deltac_min_distance = props->deltac_min_distance;
 	ctx->pagesize = sysconf(_SC_PAGE_SIZE);
 	ctx->similarity_cksums = NULL;
+	ctx->bs_scratch = NULL;
 	ctx->show_chunks = 0;
+	ctx->cdc_type = DEDUPE_CDC_RABIN;
+	ctx->scan_threads = 1;
+	ctx->out_fd = -1;
+	ctx->blk_cache = NULL;
+	ctx->store_fd = -1;
+	ctx->sstats = NULL;
+	ctx->ref_read = NULL;
+	ctx->ref_arg = NULL;
 	if (arc) {
 		arc->pagesize = ctx->pagesize;
 		if (rab_blk_sz < 3)
@@ -345,6 +377,8 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 		return (NULL);
 	}
 
+	ctx->g_lookup = NULL;
+	ctx->g_shard_head = NULL;
 	if (arc && dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL) {
 		ctx->similarity_cksums = (uchar_t *)slab_calloc(NULL,
 					arc->sub_intervals,
@@ -355,6 +389,22 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 			destroy_dedupe_context(ctx);
 			return (NULL);
 		}
+
+		/*
+		 * Scratch space to group index lookups by shard in simple mode.
+		 */
+		if (arc->dedupe_mode == MODE_SIMPLE && real_chunksize > 0) {
+			ctx->g_lookup = (global_lookup_t *)slab_alloc(NULL,
+			    (ctx->blknum + 1) * sizeof (global_lookup_t));
+			ctx->g_shard_head = (uint32_t *)slab_alloc(NULL,
+			    db_nshards(arc) * sizeof (uint32_t));
+			if (!ctx->g_lookup || !ctx->g_shard_head) {
+				log_msg(LOG_ERR, 0,
+				    "Could not allocate dedupe context, out of memory\n");
+				destroy_dedupe_context(ctx);
+				return (NULL);
+			}
+		}
 	}
 
 	ctx->lzma_data = NULL;
@@ -371,6 +421,19 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 		}
 	}
 
+	/*
+	 * Delta encoding working memory, kept across blocks and chunks.
+	 */
+	if (ctx->delta_flag && op == COMPRESS && real_chunksize > 0) {
+		ctx->bs_scratch = bsdiff_scratch_create();
+		if (!ctx->bs_scratch) {
+			log_msg(LOG_ERR, 0,
+			    "Could not allocate dedupe context, out of memory\n");
+			destroy_dedupe_context(ctx);
+			return (NULL);
+		}
+	}
+
 	slab_cache_add(sizeof (rabin_blockentry_t));
 	ctx->real_chunksize = real_chunksize;
 	reset_dedupe_context(ctx);
@@ -409,11 +472,58 @@ destroy_dedupe_context(dedupe_context_t *ctx)
 			slab_free(NULL, ctx->blocks);
 		}
 		if (ctx->similarity_cksums) slab_free(NULL, ctx->similarity_cksums);
+		if (ctx->bs_scratch) bsdiff_scratch_destroy(ctx->bs_scratch);
+		if (ctx->g_lookup) slab_free(NULL, ctx->g_lookup);
+		if (ctx->g_shard_head) slab_free(NULL, ctx->g_shard_head);
 		if (ctx->lzma_data) lzma_deinit(&(ctx->lzma_data));
 		slab_free(NULL, ctx);
 	}
 }
 
+/*
+ * Update the persistent dedupe store, if any, after a successful run.
+ */
+int
+dedupe_store_commit(dedupe_context_t *ctx, uint64_t data_len)
+{
+	if (ctx == NULL || ctx->arc == NULL)
+		return (0);
+	return (db_store_commit(ctx->arc, data_len));
+}
+
+/*
+ * Identity of the persistent dedupe store and the offset where data from this
+ * run begins. These are recorded in the file header.
+ */
+void
+dedupe_store_info(dedupe_context_t *ctx, uint64_t *store_id, uint64_t *store_base)
+{
+	*store_id = ctx->arc->store_id;
+	*store_base = ctx->arc->store_base;
+}
+
+/*
+ * Verify that the store at path is the one a file was compressed against.
+ */
+int
+dedupe_store_check(char *path, uint64_t store_id, uint64_t store_base)
+{
+	return (db_store_check(path, store_id, store_base));
+}
+
+/*
+ * Release workers waiting for their turn on the global index after the run
+ * was cancelled, since chunks earlier in the sequence may never get there.
+ */
+void
+dedupe_abort(dedupe_context_t *ctx)
+{
+	if (ctx == NULL || ctx->arc == NULL || ctx->arc->db_index == NULL ||
+	    ctx->arc->dedupe_mode != MODE_SIMPLE)
+		return;
+	db_index_abort(ctx->arc);
+}
+
 /*
  * Simple insertion sort of integers. Used for sorting a small number of items to
  * avoid overheads of qsort() with callback function.
@@ -469,11 +579,301 @@ ckcmp(uchar_t *a, uchar_t *b, int sz)
 	return (0);
 }
 
+/*
+ * Let the next chunk in sequence proceed with global index access when this
+ * chunk does not need the index.
+ */
+static void
+global_index_skip(dedupe_context_t *ctx)
+{
+	uint32_t k, nshards;
+	double strt;
+
+	strt = stage_begin(ctx->sstats);
+	if (ctx->arc->dedupe_mode == MODE_SIMPLE) {
+		nshards = db_nshards(ctx->arc);
+		for (k = 0; k < nshards; k++) {
+			db_shard_enter(ctx->arc, k, ctx->seq);
+			db_shard_leave(ctx->arc, k);
+		}
+	} else {
+		Sem_Wait(ctx->index_sem);
+		Sem_Post(ctx->index_sem_next);
+	}
+	stage_end(ctx->sstats, STAGE_INDEX_WAIT, strt, 0);
+}
+
+/*
+ * Find the next Gear chunk boundary. The hash is (h << 1) + gear[byte], so
+ * with a 32-bit hash every bit depends on at most the last GEAR_WIN_SIZE
+ * bytes. Hashing starts at strt, positions from cmin onwards are tested
+ * against the break mask and cmax is always a boundary. Returns the position
+ * of the last byte of the block, or end if there is no boundary before end.
+ */
+static inline uint64_t
+gear_scan(const uchar_t *buf, uint64_t strt, uint64_t cmin, uint64_t cmax, uint64_t end)
+{
+	uint64_t i, lim;
+	uint32_t h;
+
+	h = 0;
+	for (i = strt; i < cmin; i++)
+		h = (h << 1) + gear[buf[i]];
+
+	lim = end;
+	if (cmax < lim)
+		lim = cmax;
+#ifdef	GEAR_AVX2
+	{
+		/*
+		 * Test 8 positions per iteration. For gear values g[0..7] of the next
+		 * 8 bytes the hashes are h[j] = (h << (j + 1)) + sum(g[j - k] << k)
+		 * for k = 0..j. The sum is a prefix scan done with three lane shifts.
+		 */
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i bmask = _mm256_set1_epi32(GEAR_BLK_MASK);
+		const __m256i cnt = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8);
+		const __m256i last = _mm256_set1_epi32(7);
+		const __m256i sh1 = _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6);
+		const __m256i sh2 = _mm256_setr_epi32(0, 0, 0, 1, 2, 3, 4, 5);
+		const __m256i sh4 = _mm256_setr_epi32(0, 0, 0, 0, 0, 1, 2, 3);
+		__m256i hv = _mm256_set1_epi32(h);
+
+		for (; i + 8 <= lim; i += 8) {
+			__m256i g, t;
+			int m;
+
+			g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(buf + i)));
+			g = _mm256_i32gather_epi32((const int *)gear, g, 4);
+			t = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(g, sh1), zero, 0x01);
+			g = _mm256_add_epi32(g, _mm256_slli_epi32(t, 1));
+			t = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(g, sh2), zero, 0x03);
+			g = _mm256_add_epi32(g, _mm256_slli_epi32(t, 2));
+			t = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(g, sh4), zero, 0x0f);
+			g = _mm256_add_epi32(g, _mm256_slli_epi32(t, 4));
+
+			hv = _mm256_permutevar8x32_epi32(hv, last);
+			hv = _mm256_add_epi32(_mm256_sllv_epi32(hv, cnt), g);
+			t = _mm256_cmpeq_epi32(_mm256_and_si256(hv, bmask), zero);
+			m = _mm256_movemask_ps(_mm256_castsi256_ps(t));
+			if (m)
+				return (i + __builtin_ctz(m));
+		}
+		h = _mm256_extract_epi32(hv, 7);
+	}
+#endif
+	for (; i < lim; i++) {
+		h = (h << 1) + gear[buf[i]];
+		if (!(h & GEAR_BLK_MASK))
+			return (i);
+	}
+	if (cmax < end)
+		return (cmax);
+	return (end);
+}
+
+/*
+ * Record a content-defined block and compute its similarity sketch if Delta
+ * Compression is enabled.
+ */
+static inline void
+dedupe_add_block(dedupe_context_t *ctx, uchar_t *buf1, uint32_t blknum, uint64_t last_offset,
+    uint32_t length, MinHeap *heap, uint32_t *ctx_heap)
+{
+	uint64_t pc[4];
+
+	if (!(ctx->arc)) {
+		if (ctx->blocks[blknum] == 0)
+			ctx->blocks[blknum] = (rabin_blockentry_t *)slab_alloc(NULL,
+			    sizeof (rabin_blockentry_t));
+		ctx->blocks[blknum]->offset = last_offset;
+		ctx->blocks[blknum]->index = blknum; // Need to store for sorting
+		ctx->blocks[blknum]->length = length;
+	} else {
+		ctx->g_blocks[blknum].length = length;
+		ctx->g_blocks[blknum].offset = last_offset;
+	}
+	if (ctx->show_chunks) {
+		fprintf(stderr, "Block offset: %" PRIu64 ", length: %u\n", last_offset, length);
+	}
+
+	/*
+	 * Reset the heap structure and find the K min values if Delta Compression
+	 * is enabled. We use a min heap mechanism taken from the heap based priority
+	 * queue implementation in Python.
+	 * Here K = similarity extent = 87% or 62% or 50%.
+	 * 
+	 * Once block contents are arranged in a min heap we compute the K min values
+	 * sketch by hashing over the heap till K%. We interpret the raw bytes as a
+	 * sequence of 64-bit integers.
+	 * This is variant of minhashing which is used widely, for example in various
+	 * search engines to detect similar documents.
+	 */
+	if (ctx->delta_flag) {
+		length /= 8;
+		pc[1] = DELTA_NORMAL_PCT(length);
+		pc[2] = DELTA_EXTRA_PCT(length);
+		pc[3] = DELTA_EXTRA2_PCT(length);
+
+		heap_nsmallest(heap, (int64_t *)(buf1+last_offset),
+			       (int64_t *)ctx_heap, pc[ctx->delta_flag], length);
+		ctx->blocks[blknum]->similarity_hash =
+			XXH32((const uchar_t *)ctx_heap, heap_size(heap)*8, 0);
+	}
+}
+
+/*
+ * Find the end of the Rabin block starting at last. This is the same scan as the
+ * main loop in dedupe_compress() but starts from a fresh window. The boundary
+ * test at a position only depends on the RAB_POLYNOMIAL_WIN_SIZE bytes before
+ * it and hashing starts RAB_WINDOW_SLIDE_OFFSET bytes before the first tested
+ * position, so the result is identical to the main loop.
+ */
+static uint64_t
+rabin_scan_next(dedupe_context_t *ctx, uchar_t *buf1, uint64_t last, uint64_t end)
+{
+	uchar_t window[RAB_POLYNOMIAL_WIN_SIZE];
+	uint64_t i, cmin, cmax, cur_roll_checksum, cur_pos_checksum;
+	uint32_t window_pos;
+
+	memset(window, 0, RAB_POLYNOMIAL_WIN_SIZE);
+	window_pos = 0;
+	cur_roll_checksum = 0;
+	cmin = last + ctx->rabin_poly_min_block_size - 1;
+	cmax = last + ctx->rabin_poly_max_block_size - 1;
+	for (i = last + ctx->rabin_poly_min_block_size - RAB_WINDOW_SLIDE_OFFSET; i < end; i++) {
+		uint32_t cur_byte = buf1[i];
+		uint32_t pushed_out = window[window_pos];
+
+		window[window_pos] = cur_byte;
+		cur_roll_checksum = (cur_roll_checksum * RAB_POLYNOMIAL_CONST) & POLY_MASK;
+		cur_roll_checksum += cur_byte;
+		cur_roll_checksum -= out[pushed_out];
+		window_pos = (window_pos + 1) & (RAB_POLYNOMIAL_WIN_SIZE-1);
+		if (i < cmin) continue;
+
+		cur_pos_checksum = cur_roll_checksum ^ ir[pushed_out];
+		if ((cur_pos_checksum & ctx->rabin_avg_block_mask) == ctx->rabin_break_patt ||
+		    i >= cmax)
+			return (i);
+	}
+	return (end);
+}
+
+static inline uint64_t
+dedupe_scan_next(dedupe_context_t *ctx, uchar_t *buf1, uint64_t last, uint64_t end)
+{
+	if (ctx->cdc_type == DEDUPE_CDC_GEAR) {
+		return (gear_scan(buf1, last + ctx->rabin_poly_min_block_size -
+		    RAB_WINDOW_SLIDE_OFFSET, last + ctx->rabin_poly_min_block_size - 1,
+		    last + ctx->rabin_poly_max_block_size - 1, end));
+	}
+	return (rabin_scan_next(ctx, buf1, last, end));
+}
+
+/*
+ * Split the block boundary scan of a large chunk across scan_threads threads.
+ * Each thread walks the block chain from the start of its sub-range as if a
+ * block started there and records the block starts up to the first one past
+ * the sub-range. The chain from the actual start of the chunk is then merged
+ * serially. It is followed into each sub-range until it reaches a block start
+ * recorded by that thread, after which the two chains are identical. This
+ * usually happens within a few blocks, so the boundaries are the same as a
+ * serial scan at a fraction of the cost. Sets the number of blocks added in
+ * nblocks and the start of the trailing block in last_offset. Returns -1 without
+ * adding any block if the scratch space cannot be allocated, so that the caller
+ * can do a serial scan instead.
+ */
+static int
+dedupe_scan_parallel(dedupe_context_t *ctx, uchar_t *buf1, uint64_t size, uint64_t end,
+    int nthreads, uint32_t *nblocks, uint64_t *last_offset, MinHeap *heap,
+    uint32_t *ctx_heap)
+{
+	uint64_t *starts, range, cap, cur, c, rend;
+	uint32_t *cnt, blknum, min_blk;
+	int k;
+
+	min_blk = ctx->rabin_poly_min_block_size;
+	range = size / nthreads;
+	cap = range / min_blk + 3;
+	starts = (uint64_t *)slab_alloc(NULL, nthreads * cap * sizeof (uint64_t) +
+	    nthreads * sizeof (uint32_t));
+	if (starts == NULL)
+		return (-1);
+	cnt = (uint32_t *)(starts + nthreads * cap);
+
+#if defined(_OPENMP)
+#	pragma omp parallel for num_threads(nthreads)
+#endif
+	for (k = 0; k < nthreads; k++) {
+		uint64_t b, e, *st;
+		uint32_t n;
+
+		b = k * range;
+		e = (k == nthreads - 1) ? size : b + range;
+		st = starts + k * cap;
+		n = 0;
+		st[n++] = b;
+		while (b < e && size - b > min_blk) {
+			uint64_t cut = dedupe_scan_next(ctx, buf1, b, end);
+
+			if (cut >= end) break;
+			b = cut + 1;
+			st[n++] = b;
+		}
+		cnt[k] = n;
+	}
+
+	blknum = 0;
+	cur = 0;
+	for (k = 0; k < nthreads; k++) {
+		uint64_t *st = starts + k * cap;
+		uint32_t n = cnt[k], lo, hi, x;
+
+		rend = (k == nthreads - 1) ? size : (k + 1) * range;
+		while (cur < rend) {
+			/*
+			 * Block starts recorded by a thread are in ascending order.
+			 */
+			lo = 0;
+			hi = n;
+			while (lo < hi) {
+				x = (lo + hi) / 2;
+				if (st[x] < cur)
+					lo = x + 1;
+				else
+					hi = x;
+			}
+			if (lo < n && st[lo] == cur) {
+				for (x = lo + 1; x < n; x++) {
+					dedupe_add_block(ctx, buf1, blknum, cur, st[x] - cur,
+					    heap, ctx_heap);
+					++blknum;
+					cur = st[x];
+				}
+				break;
+			}
+
+			if (size - cur <= min_blk) goto done;
+			c = dedupe_scan_next(ctx, buf1, cur, end);
+			if (c >= end) goto done;
+			dedupe_add_block(ctx, buf1, blknum, cur, c + 1 - cur, heap, ctx_heap);
+			++blknum;
+			cur = c + 1;
+		}
+	}
+done:
+	slab_free(NULL, starts);
+	*nblocks = blknum;
+	*last_offset = cur;
+	return (0);
+}
+
 /**
  * Perform Deduplication.
  * Both Semi-Rabin fingerprinting based and Fixed Block Deduplication are supported.
  * A 16-byte window is used for the rolling checksum and dedup blocks can vary in size
- * from 4K-128K.
+ * from 4K-128K. Gear based chunking can be selected instead of Rabin via cdc_type.
  */
 uint32_t
 dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t offset,
@@ -487,6 +887,7 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 	uint32_t *ctx_heap;
 	rabin_blockentry_t **htab;
 	MinHeap heap;
+	double sstrt;
 	DEBUG_STAT_EN(uint32_t max_count);
 	DEBUG_STAT_EN(max_count = 0);
 	DEBUG_STAT_EN(double strt, en_1, en);
@@ -502,10 +903,8 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 		 * Must ensure that we are signaling the index semaphores before skipping
 		 * in order to maintain proper sequencing and avoid deadlocks.
 		 */
-		if (ctx->arc) {
-			Sem_Wait(ctx->index_sem);
-			Sem_Post(ctx->index_sem_next);
-		}
+		if (ctx->arc)
+			global_index_skip(ctx);
 		return (0);
 	}
 	DEBUG_STAT_EN(strt = get_wtime_millis());
@@ -563,6 +962,52 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 #endif
 	j = *size - RAB_POLYNOMIAL_WIN_SIZE;
 
+	if (rabin_pos == NULL && ctx->scan_threads > 1 && *size / RAB_PAR_SCAN_MIN > 1) {
+		int nthreads = ctx->scan_threads;
+
+		if (nthreads > *size / RAB_PAR_SCAN_MIN)
+			nthreads = *size / RAB_PAR_SCAN_MIN;
+		if (dedupe_scan_parallel(ctx, buf1, *size, j, nthreads, &blknum, &last_offset,
+		    &heap, ctx_heap) == 0)
+			goto last_block;
+	}
+
+	if (ctx->cdc_type == DEDUPE_CDC_GEAR) {
+		/*
+		 * Gear hashing restarts RAB_WINDOW_SLIDE_OFFSET bytes before the
+		 * minimum block size, like the Rabin window below. Block size limits
+		 * are the same as for Rabin.
+		 */
+		if (rabin_pos) {
+			offset = *size - ctx->rabin_poly_max_block_size;
+			while (1) {
+				i = gear_scan(buf1, offset + ctx->rabin_poly_min_block_size -
+				    RAB_WINDOW_SLIDE_OFFSET, offset + ctx->rabin_poly_min_block_size - 1,
+				    j, j);
+				if (i >= j) break;
+				last_offset = i + 1;
+				offset = last_offset;
+			}
+			if (last_offset < *size) {
+				*rabin_pos = last_offset;
+			}
+			return (0);
+		}
+
+		while (*size - last_offset > ctx->rabin_poly_min_block_size) {
+			i = gear_scan(buf1, last_offset + ctx->rabin_poly_min_block_size -
+			    RAB_WINDOW_SLIDE_OFFSET, last_offset + ctx->rabin_poly_min_block_size - 1,
+			    last_offset + ctx->rabin_poly_max_block_size - 1, j);
+			if (i >= j) break;
+			length = i + 1 - last_offset;
+			DEBUG_STAT_EN(if (length >= ctx->rabin_poly_max_block_size) ++max_count);
+			dedupe_add_block(ctx, buf1, blknum, last_offset, length, &heap, ctx_heap);
+			++blknum;
+			last_offset = i + 1;
+		}
+		goto last_block;
+	}
+
 	/* 
 	 * If rabin_pos is non-zero then we are being asked to scan for the last rabin boundary
 	 * in the chunk. We start scanning at chunk end - max rabin block size. We avoid doing
@@ -620,7 +1065,6 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 	offset = ctx->rabin_poly_min_block_size - RAB_WINDOW_SLIDE_OFFSET;
 	length = offset;
 	for (i=offset; i<j; i++) {
-		uint64_t pc[4];
 		uint32_t cur_byte = buf1[i];
 
 #ifdef	SSE_MODE
@@ -665,45 +1109,8 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 		if ((cur_pos_checksum & ctx->rabin_avg_block_mask) == ctx->rabin_break_patt ||
 		    length >= ctx->rabin_poly_max_block_size) {
 
-			if (!(ctx->arc)) {
-				if (ctx->blocks[blknum] == 0)
-					ctx->blocks[blknum] = (rabin_blockentry_t *)slab_alloc(NULL,
-					    sizeof (rabin_blockentry_t));
-				ctx->blocks[blknum]->offset = last_offset;
-				ctx->blocks[blknum]->index = blknum; // Need to store for sorting
-				ctx->blocks[blknum]->length = length;
-			} else {
-				ctx->g_blocks[blknum].length = length;
-				ctx->g_blocks[blknum].offset = last_offset;
-			}
 			DEBUG_STAT_EN(if (length >= ctx->rabin_poly_max_block_size) ++max_count);
-			if (ctx->show_chunks) {
-				fprintf(stderr, "Block offset: %" PRIu64 ", length: %u\n", last_offset, length);
-			}
-
-			/*
-			 * Reset the heap structure and find the K min values if Delta Compression
-			 * is enabled. We use a min heap mechanism taken from the heap based priority
-			 * queue implementation in Python.
-			 * Here K = similarity extent = 87% or 62% or 50%.
-			 * 
-			 * Once block contents are arranged in a min heap we compute the K min values
-			 * sketch by hashing over the heap till K%. We interpret the raw bytes as a
-			 * sequence of 64-bit integers.
-			 * This is variant of minhashing which is used widely, for example in various
-			 * search engines to detect similar documents.
-			 */
-			if (ctx->delta_flag) {
-				length /= 8;
-				pc[1] = DELTA_NORMAL_PCT(length);
-				pc[2] = DELTA_EXTRA_PCT(length);
-				pc[3] = DELTA_EXTRA2_PCT(length);
-
-				heap_nsmallest(&heap, (int64_t *)(buf1+last_offset),
-					       (int64_t *)ctx_heap, pc[ctx->delta_flag], length);
-				ctx->blocks[blknum]->similarity_hash =
-					XXH32((const uchar_t *)ctx_heap, heap_size(&heap)*8, 0);
-			}
+			dedupe_add_block(ctx, buf1, blknum, last_offset, length, &heap, ctx_heap);
 			++blknum;
 			last_offset = i+1;
 			length = 0;
@@ -713,6 +1120,7 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 		}
 	}
 
+last_block:
 	// Insert the last left-over trailing bytes, if any, into a block.
 	if (last_offset < *size) {
 		length = *size - last_offset;
@@ -761,10 +1169,8 @@ process_blocks:
 	DEBUG_STAT_EN(en_1 = get_wtime_millis());
 	DEBUG_STAT_EN(fprintf(stderr, "Original size: %" PRId64 ", blknum: %u\n", *size, blknum));
 	DEBUG_STAT_EN(fprintf(stderr, "Number of maxlen blocks: %u\n", max_count));
-	if (blknum <=2 && ctx->arc) {
-		Sem_Wait(ctx->index_sem);
-		Sem_Post(ctx->index_sem_next);
-	}
+	if (blknum <=2 && ctx->arc)
+		global_index_skip(ctx);
 	if (blknum > 2) {
 		uint64_t pos, matchlen, pos1 = 0;
 		int valid = 1;
@@ -817,23 +1223,81 @@ process_blocks:
 				 *======================================================================
 				 */
 				/*
-				 * Now lookup blocks in index. First wait for our semaphore to be
-				 * signaled. If the previous thread in sequence is using the index
-				 * it will finish and then signal our semaphore. So we can have
-				 * predictable serialization of index access in a sequence of
-				 * threads without locking.
+				 * Now lookup blocks in index. Compute hash slots and group the
+				 * blocks by index shard without holding any lock. Each shard list
+				 * is kept in block order.
 				 */
+				global_lookup_t *gl;
+				uint32_t k, nshards, *shard_head;
+
 				length = 0;
-				DEBUG_STAT_EN(w1 = get_wtime_millis());
-				Sem_Wait(ctx->index_sem);
-				DEBUG_STAT_EN(w2 = get_wtime_millis());
+				nshards = db_nshards(ctx->arc);
+				shard_head = ctx->g_shard_head;
+				for (k = 0; k < nshards; k++)
+					shard_head[k] = UINT32_MAX;
+				for (i = blknum; i > 0; i--) {
+					gl = &(ctx->g_lookup[i-1]);
+					gl->slot = db_hash_slot(ctx->arc, ctx->g_blocks[i-1].cksum);
+					k = db_slot_shard(ctx->arc, gl->slot);
+					gl->next = shard_head[k];
+					shard_head[k] = i-1;
+				}
+
+				/*
+				 * Visit the shards in order. A shard is handed from chunk to chunk
+				 * in chunk sequence so the first writer of any block always wins,
+				 * exactly as with fully serialized access, while other threads
+				 * work on other shards. Match results are copied out since the
+				 * entry may be evicted once we leave the shard.
+				 */
+				for (k = 0; k < nshards; k++) {
+					DEBUG_STAT_EN(w1 = get_wtime_millis());
+					sstrt = stage_begin(ctx->sstats);
+					db_shard_enter(ctx->arc, k, ctx->seq);
+					stage_end(ctx->sstats, STAGE_INDEX_WAIT, sstrt, 0);
+					DEBUG_STAT_EN(w2 += get_wtime_millis() - w1);
+					for (j = shard_head[k]; j != UINT32_MAX; j = gl->next) {
+						gl = &(ctx->g_lookup[j]);
+						if (!db_lookup_insert_slot_s(ctx->arc, gl->slot,
+						    ctx->g_blocks[j].cksum,
+						    ctx->arc->store_base + ctx->file_offset +
+						    ctx->g_blocks[j].offset,
+						    ctx->g_blocks[j].length, &(gl->item_offset),
+						    &(gl->item_size)))
+							gl->item_size = 0;
+					}
+					db_shard_leave(ctx->arc, k);
+				}
+				DEBUG_STAT_EN(w1 = 0);
+
+				/*
+				 * With a persistent dedupe store new blocks are saved into the
+				 * store at their index offsets. Adjacent blocks are written
+				 * together.
+				 */
+				if (ctx->arc->store_fd != -1) {
+					uint64_t soff = 0, slen = 0;
+
+					for (i=0; i<=blknum; i++) {
+						if (i < blknum && ctx->g_lookup[i].item_size == 0) {
+							if (slen == 0)
+								soff = ctx->g_blocks[i].offset;
+							slen += ctx->g_blocks[i].length;
+							continue;
+						}
+						if (slen > 0) {
+							db_store_write(ctx->arc, buf1 + soff, slen,
+							    ctx->arc->store_base + ctx->file_offset + soff);
+							slen = 0;
+						}
+					}
+				}
+
 				for (i=0; i<blknum; i++) {
-					hash_entry_t *he;
+					uint64_t ref;
 
-					he = db_lookup_insert_s(ctx->arc, ctx->g_blocks[i].cksum, 0,
-						ctx->file_offset + ctx->g_blocks[i].offset,
-						ctx->g_blocks[i].length, 1);
-					if (!he) {
+					gl = &(ctx->g_lookup[i]);
+					if (gl->item_size == 0) {
 						/*
 						 * Block match in index not found.
 						 * Block was added to index. Merge this block.
@@ -862,21 +1326,20 @@ process_blocks:
 						/*
 						 * Add a reference entry to the dedupe array.
 						 */
-						U32_P(g_dedupe_idx) = LE32((he->item_size | RABIN_INDEX_FLAG) &
+						if (gl->item_offset >= ctx->arc->store_base)
+							ref = gl->item_offset - ctx->arc->store_base;
+						else
+							ref = gl->item_offset | GLOBAL_STORE_REF;
+						U32_P(g_dedupe_idx) = LE32((gl->item_size | RABIN_INDEX_FLAG) &
 							CLEAR_SIMILARITY_FLAG);
 						g_dedupe_idx += RABIN_ENTRY_SIZE;
-						U64_P(g_dedupe_idx) = LE64(he->item_offset);
+						U64_P(g_dedupe_idx) = LE64(ref);
 						g_dedupe_idx += (RABIN_ENTRY_SIZE * 2);
-						matchlen += he->item_size;
+						matchlen += gl->item_size;
 						dedupe_index_sz += 3;
 					}
 				}
 
-				/*
-				 * Signal the next thread in sequence to access the index.
-				 */
-				Sem_Post(ctx->index_sem_next);
-
 				/*
 				 * Write final pending block length value (if any).
 				 */
@@ -999,7 +1462,9 @@ process_blocks:
 					 */
 					if (i == 0) {
 						DEBUG_STAT_EN(w1 = get_wtime_millis());
+						sstrt = stage_begin(ctx->sstats);
 						Sem_Wait(ctx->index_sem);
+						stage_end(ctx->sstats, STAGE_INDEX_WAIT, sstrt, 0);
 						DEBUG_STAT_EN(w2 = get_wtime_millis());
 					}
 
@@ -1476,7 +1941,7 @@ next_ent:
 					DEBUG_STAT_EN(++delta_calls);
 
 					bsz = bsdiff(oldbuf, be->other->length, newbuf, be->length,
-					    ctx->cbuf + pos1, buf1 + *size, matchlen);
+					    ctx->cbuf + pos1, buf1 + *size, matchlen, ctx->bs_scratch);
 					if (bsz == 0) {
 						DEBUG_STAT_EN(++delta_fails);
 						memcpy(ctx->cbuf + pos1, newbuf, be->length);
@@ -1557,6 +2022,7 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 	uint64_t data_sz, sz, indx_cmp, data_sz_cmp, deduped_sz;
 	uint64_t dedupe_index_sz, pos1;
 	uchar_t *pos2;
+	double sstrt;
 
 	parse_dedupe_hdr(buf, &blknum, &dedupe_index_sz, &data_sz, &indx_cmp, &data_sz_cmp, &deduped_sz);
 	dedupe_index = (uint32_t *)(buf + RABIN_HDR_SIZE);
@@ -1570,7 +2036,7 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 	 */
 	if (blknum & GLOBAL_FLAG) {
 		uchar_t *g_dedupe_idx, *src1, *src2;
-		uint64_t adj, offset;
+		uint64_t offset;
 		uint32_t flag;
 
 		blknum &= CLEAR_GLOBAL_FLAG;
@@ -1580,7 +2046,9 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 		blknum -= 2;
 		src1 = buf + RABIN_HDR_SIZE + dedupe_index_sz;
 
+		sstrt = stage_begin(ctx->sstats);
 		Sem_Wait(ctx->index_sem);
+		stage_end(ctx->sstats, STAGE_INDEX_WAIT, sstrt, 0);
 		for (blk=0; blk<blknum;) {
 			len = LE32(U32_P(g_dedupe_idx));
 			g_dedupe_idx += RABIN_ENTRY_SIZE;
@@ -1609,26 +2077,48 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 				 * If required data offset is greater than the current segment's starting
 				 * offset then the referenced chunk is already in the current segment in
 				 * RAM. Just mem-copy it.
-				 * Otherwise it will be in the current output file. We mmap() the relevant
-				 * region and copy it. The way deduplication is done it is guaranteed that
-				 * all duplicate references will be backward references so this approach works.
+				 * Otherwise it will be in the current output file. It is read from there,
+				 * through the shared block cache if one is set up. The way deduplication
+				 * is done it is guaranteed that all duplicate references will be backward
+				 * references so this approach works.
 				 * 
 				 * However this approach precludes pipe-mode streamed decompression since
 				 * it requires random access to the output file.
 				 */
-				if (pos1 >= offset) {
+				if (pos1 & GLOBAL_STORE_REF) {
+					/*
+					 * Block from an earlier run kept in the dedupe store.
+					 */
+					pos1 &= ~GLOBAL_STORE_REF;
+					if (ctx->store_fd == -1 ||
+					    pread(ctx->store_fd, pos2, len, pos1) != len) {
+						log_msg(LOG_ERR, 1, "Dedupe store read failed ");
+						ctx->valid = 0;
+						break;
+					}
+				} else if (pos1 >= offset) {
 					src2 = ctx->cbuf + (pos1 - offset);
 					memcpy(pos2, src2, len);
-				} else {
-					adj = pos1 % ctx->pagesize;
-					src2 = mmap(NULL, len + adj, PROT_READ, MAP_SHARED, ctx->out_fd, pos1 - adj);
-					if (src2 == NULL) {
-						log_msg(LOG_ERR, 1, "MMAP failed ");
+				} else if (ctx->ref_read) {
+					if (ctx->ref_read(ctx->ref_arg, pos2, len, pos1) != 0) {
+						log_msg(LOG_ERR, 0, "Dedupe reference at %" PRIu64
+						    " could not be resolved.", pos1);
+						ctx->valid = 0;
+						break;
+					}
+				} else if (ctx->blk_cache) {
+					if (block_cache_read(ctx->blk_cache, ctx->out_fd, pos2, len,
+					    pos1, offset) != 0) {
+						log_msg(LOG_ERR, 1, "Dedupe reference at %" PRIu64
+						    " could not be read ", pos1);
 						ctx->valid = 0;
 						break;
 					}
-					memcpy(pos2, src2 + adj, len);
-					munmap(src2, len + adj);
+				} else if (pread(ctx->out_fd, pos2, len, pos1) != len) {
+					log_msg(LOG_ERR, 1, "Dedupe reference at %" PRIu64
+					    " could not be read ", pos1);
+					ctx->valid = 0;
+					break;
 				}
 				pos2 += len;
 				sz += len;
@@ -64,7 +64,9 @@
 #define _RABIN_POLY_H_
 
 #include <utils.h>
+#include <stage_stats.h>
 #include <index.h>
+#include <block_cache.h>
 #include <crypto_utils.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -89,6 +91,18 @@
 // to slide the window over every byte in the chunk.
 #define	RAB_WINDOW_SLIDE_OFFSET	(64)
 
+// Content-defined chunking engines. Gear is a shift-and-add rolling hash over
+// a 32-byte window. Its break mask has as many bits as RAB_BLK_MASK, taken
+// from the top of the hash where every window byte contributes.
+#define	DEDUPE_CDC_RABIN	0
+#define	DEDUPE_CDC_GEAR		1
+#define	GEAR_WIN_SIZE		32
+#define	GEAR_BLK_MASK		(0xffc00000U)
+
+// Minimum sub-range per thread when the boundary scan of one chunk is split
+// across threads.
+#define	RAB_PAR_SCAN_MIN	(1048576L)
+
 // Minimum practical chunk sizes when doing dedup
 #define	RAB_MIN_CHUNK_SIZE (1048576L)
 #define	RAB_MIN_CHUNK_SIZE_GLOBAL (2097152L)
@@ -126,6 +140,10 @@
 #define	GLOBAL_FLAG RABIN_INDEX_FLAG
 #define	CLEAR_GLOBAL_FLAG (0x7fffffffUL)
 
+// Global dedupe reference offset that points into a persistent dedupe store
+// rather than into the current output file.
+#define	GLOBAL_STORE_REF (0x8000000000000000ULL)
+
 #define	RABIN_DEDUPE_SEGMENTED	0
 #define	RABIN_DEDUPE_FIXED	1
 #define	RABIN_DEDUPE_FILE_GLOBAL	2
@@ -165,6 +183,19 @@ typedef struct rab_blockentry {
 	struct rab_blockentry *next;
 } rabin_blockentry_t;
 
+/*
+ * Per-block result of a Global Dedupe simple index lookup. Blocks are linked
+ * into per-shard lists in block order via next.
+ */
+typedef struct {
+	uint64_t item_offset;
+	uint32_t item_size;
+	uint32_t slot;
+	uint32_t next;
+} global_lookup_t;
+
+struct bsdiff_scratch;
+
 typedef struct {
 	unsigned char *current_window_data;
 	rabin_blockentry_t **blocks;
@@ -181,20 +212,35 @@ typedef struct {
 	void *lzma_data;
 	int level, delta_flag, dedupe_flag, deltac_min_distance;
 	uint64_t file_offset; // For global dedupe
+	uint32_t seq; // Chunk sequence number for global dedupe index access
 	archive_config_t *arc;
 	Sem_t *index_sem;
 	Sem_t *index_sem_next;
+	global_lookup_t *g_lookup;
+	uint32_t *g_shard_head;
 	uchar_t *similarity_cksums;
+	struct bsdiff_scratch *bs_scratch; // Delta encoding working memory
 	uint32_t pagesize;
 	int out_fd;
+	block_cache_t *blk_cache; // Shared cache of output blocks read via out_fd, may be NULL
+	int store_fd; // Dedupe store data file for decompression, -1 if none
+	/*
+	 * Reads earlier data of the original file when it is not in out_fd, like
+	 * when decompressing a range. Returns 0 on success.
+	 */
+	int (*ref_read)(void *arg, uchar_t *buf, uint64_t len, uint64_t offset);
+	void *ref_arg;
 	int id;
 	int show_chunks; // Debug display of chunks (offset, length)
+	int cdc_type; // Chunking engine, DEDUPE_CDC_RABIN or DEDUPE_CDC_GEAR
+	int scan_threads; // Threads available for the boundary scan of one chunk
+	stage_stats_t *sstats; // Stage accounting of the owning thread, NULL if disabled
 } dedupe_context_t;
 
 extern dedupe_context_t *create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, 
 	int rab_blk_sz, const char *algo, const algo_props_t *props, int delta_flag, int dedupe_flag,
-	int file_version, compress_op_t op, uint64_t file_size, char *tmppath, int pipe_mode,
-	int nthreads, size_t freeram);
+	int file_version, compress_op_t op, uint64_t file_size, char *tmppath, char *store_path,
+	int pipe_mode, int nthreads, size_t freeram);
 extern void destroy_dedupe_context(dedupe_context_t *ctx);
 extern unsigned int dedupe_compress(dedupe_context_t *ctx, unsigned char *buf, 
 	uint64_t *size, uint64_t offset, uint64_t *rabin_pos, int mt);
@@ -207,6 +253,11 @@ extern void update_dedupe_hdr(uchar_t *buf, uint64_t dedupe_index_sz_cmp,
 extern void reset_dedupe_context(dedupe_context_t *ctx);
 extern uint32_t dedupe_buf_extra(uint64_t chunksize, int rab_blk_sz, const char *algo,
 	int delta_flag);
+extern int dedupe_store_commit(dedupe_context_t *ctx, uint64_t data_len);
+extern void dedupe_store_info(dedupe_context_t *ctx, uint64_t *store_id,
+	uint64_t *store_base);
+extern int dedupe_store_check(char *path, uint64_t store_id, uint64_t store_base);
+extern void dedupe_abort(dedupe_context_t *ctx);
 extern int global_dedupe_bufadjust(uint32_t rab_blk_sz, uint64_t *user_chunk_sz, int pct_interval,
 		 const char *algo, cksum_t ck, cksum_t ck_sim, size_t file_sz,
 		 size_t memlimit, int nthreads, int pipe_mode);
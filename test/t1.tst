@@ -47,6 +47,333 @@ do
 	done
 done
 
+#
+# Round trips with optional features. Each set is the environment followed by
+# the options, separated by a ':'. The environment applies to both compression
+# and decompression, and a per-stage summary is checked when one is written.
+#
+for feat in \
+	"PCOMPRESS_ADAPT_TRIAL=0:-c adapt -l 6 -s 2m" \
+	"PCOMPRESS_ADAPT_TRIAL=50:-c adapt -l 6 -s 2m" \
+	"PCOMPRESS_ADAPT_TRIAL=0:-c adapt2 -l 6 -s 2m" \
+	"PCOMPRESS_ADAPT_TRIAL=50:-c adapt2 -l 6 -s 2m" \
+	"PCOMPRESS_STAGE_STATS=stages.json:-c lz4 -l 3 -s 2m -G" \
+	"PCOMPRESS_READAHEAD=0:-c lz4 -l 3 -s 1m" \
+	"PCOMPRESS_READAHEAD=0:-c lz4 -l 3 -s 1m -D" \
+	"PCOMPRESS_READAHEAD=5:-c lz4 -l 3 -s 1m" \
+	"PCOMPRESS_READAHEAD=5:-c lz4 -l 3 -s 1m -D" \
+	"PCOMPRESS_CKSUM_ON_READ=1 PCOMPRESS_READAHEAD=0:-c lz4 -l 3 -s 1m -S CRC64" \
+	"PCOMPRESS_CKSUM_ON_READ=1 PCOMPRESS_READAHEAD=0:-c lz4 -l 3 -s 1m -S SHA256" \
+	"PCOMPRESS_CKSUM_ON_READ=1 PCOMPRESS_READAHEAD=0:-c lz4 -l 3 -s 1m -S BLAKE512" \
+	"PCOMPRESS_CKSUM_ON_READ=1 PCOMPRESS_READAHEAD=0:-c lz4 -l 3 -s 1m -S KECCAK256" \
+	"PCOMPRESS_CKSUM_ON_READ=1 PCOMPRESS_READAHEAD=2:-c lz4 -l 3 -s 1m -S CRC64" \
+	"PCOMPRESS_CKSUM_ON_READ=1 PCOMPRESS_READAHEAD=2:-c lz4 -l 3 -s 1m -S SHA256" \
+	"PCOMPRESS_CKSUM_ON_READ=1 PCOMPRESS_READAHEAD=2:-c lz4 -l 3 -s 1m -S BLAKE512" \
+	"PCOMPRESS_CKSUM_ON_READ=1 PCOMPRESS_READAHEAD=2:-c lz4 -l 3 -s 1m -S KECCAK256" \
+	"PCOMPRESS_NUMA=1:-c lz4 -l 3 -s 1m" \
+	"PCOMPRESS_NUMA=1:-c lz4 -l 3 -s 1m -D" \
+	"PCOMPRESS_NUMA=1:-c lz4 -l 3 -s 1m -D -E"
+do
+	envs="${feat%%:*}"
+	opts="${feat#*:}"
+	for tf in `cat files.lst`
+	do
+		for op in c d
+		do
+			rm -f stages.json
+			if [ "$op" = "c" ]
+			then
+				cmd="${envs} ../../pcompress ${opts} ${tf}"
+			else
+				cmd="${envs} ../../pcompress -d ${tf}.pz ${tf}.1"
+			fi
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Command failed."
+				break
+			fi
+			[ -f stages.json ] || continue
+			for stage in '"aggregate"' '"read"' '"codec"' '"write"' '"worker-0"'
+			do
+				grep "$stage" stages.json > /dev/null
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Stage summary does not have ${stage}"
+				fi
+			done
+		done
+		diff ${tf} ${tf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression was not correct"
+		fi
+		rm -f ${tf}.pz ${tf}.1 stages.json
+	done
+done
+
+#
+# Archive listing, full extraction and selected member extraction, with member
+# filtering and extraction done inline and by thread pools and with a catalog
+#
+for feat in \
+	"PCOMPRESS_ARC_FILTER_THREADS=0 PCOMPRESS_ARC_EXTRACT_THREADS=0:" \
+	"PCOMPRESS_ARC_FILTER_THREADS=4 PCOMPRESS_ARC_EXTRACT_THREADS=4:" \
+	":-I"
+do
+	envs="${feat%%:*}"
+	opts="${feat#*:}"
+	rm -rf arc.pz arcdir
+	cmd="${envs} ../../pcompress -a -c lz4 -l 3 -s 1m ${opts} `cat files.lst` arc.pz"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Archiving failed."
+		rm -f arc.pz
+		continue
+	fi
+	cmd="../../pcompress -i arc.pz > arc.lst"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Listing failed."
+	fi
+	for tf in `cat files.lst`
+	do
+		awk '{ print $NF }' arc.lst | grep -x -F "${tf#/}" > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: ${tf} missing from archive listing"
+		fi
+	done
+	rm -f arc.lst
+	cmd="${envs} ../../pcompress -d arc.pz arcdir"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Extraction failed."
+	fi
+	for tf in `cat files.lst`
+	do
+		diff ${tf} arcdir/${tf} > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extracted ${tf} was not correct"
+		fi
+	done
+	for tf in `cat files.lst`
+	do
+		rm -rf arcdir
+		cmd="${envs} ../../pcompress -d arc.pz arcdir ${tf}"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extraction failed."
+			continue
+		fi
+		diff ${tf} arcdir/${tf} > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extracted ${tf} was not correct"
+		fi
+		if [ `find arcdir -type f | wc -l` -ne 1 ]
+		then
+			echo "FATAL: Members other than ${tf} were extracted"
+		fi
+	done
+	rm -rf arcdir
+	cmd="../../pcompress -d arc.pz arcdir no/such/member"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -eq 0 ]
+	then
+		echo "FATAL: Extracting a missing member did not fail."
+	fi
+	rm -rf arc.pz arcdir
+done
+
+#
+# A selected hard link cannot be extracted without its target.
+#
+rm -rf lnkdir lnk.pz arcdir
+mkdir lnkdir
+cp `head -1 files.lst` lnkdir/a.dat
+ln lnkdir/a.dat lnkdir/b.dat
+cmd="../../pcompress -a -c lz4 -l 3 -s 1m lnkdir lnk.pz"
+echo "Running $cmd"
+eval $cmd
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Archiving failed."
+fi
+for tf in a.dat b.dat
+do
+	rm -rf arcdir
+	cmd="../../pcompress -d lnk.pz arcdir lnkdir/${tf}"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 -a ! -f arcdir/lnkdir/${tf} ]
+	then
+		continue
+	fi
+	diff lnkdir/${tf} arcdir/lnkdir/${tf} > /dev/null
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Selected hard link member was not correct"
+	fi
+done
+rm -rf lnkdir lnk.pz arcdir
+
+#
+# Incremental archiving against a manifest and restore from base plus increments.
+# The last increment has no changes and so no member data.
+#
+rm -rf incdir inc.man base.pz inc.pz nochg.pz arcdir
+mkdir incdir
+for tf in `cat files.lst`
+do
+	cp ${tf} incdir/
+done
+cmd="../../pcompress -a -u inc.man -c lz4 -l 3 -s 1m incdir base.pz"
+echo "Running $cmd"
+eval $cmd
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Archiving failed."
+fi
+rmf=`ls incdir | head -1`
+rm -f incdir/${rmf}
+echo "changed" >> incdir/`ls incdir | head -1`
+echo "new" > incdir/new.dat
+for arc in inc.pz nochg.pz
+do
+	cmd="../../pcompress -a -u inc.man -c lz4 -l 3 -s 1m incdir ${arc}"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Incremental archiving failed."
+	fi
+done
+for arc in base.pz inc.pz nochg.pz
+do
+	cmd="../../pcompress -d ${arc} arcdir"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Extraction failed."
+	fi
+done
+diff -r incdir arcdir/incdir > /dev/null
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Restore from incremental archives was not correct"
+fi
+rm -rf arcdir
+cmd="../../pcompress -d inc.pz arcdir"
+echo "Running $cmd"
+eval $cmd
+if [ $? -eq 0 ]
+then
+	echo "FATAL: Extraction without the earlier archives DID NOT ERROR where expected"
+fi
+rm -rf incdir inc.man base.pz inc.pz nochg.pz arcdir
+
+#
+# Deletion markers must not remove anything outside the extraction directory,
+# either through ".." in a crafted manifest or through a symlinked parent.
+#
+rm -rf qq inc.man base.pz inc.pz arcdir outside victim.dat
+mkdir -p qq/sub outside
+echo "keep" > qq/sub/keep.dat
+echo "victim" > qq/victim.dat
+echo "keep" > outside/keep.dat
+echo "keep" > victim.dat
+cmd="../../pcompress -a -u inc.man -c lz4 -l 3 -s 1m qq base.pz"
+echo "Running $cmd"
+eval $cmd
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Archiving failed."
+fi
+LC_ALL=C sed 's#qq/victim\.dat#../victim.dat#' inc.man > inc.man.1
+head -c `expr \`wc -c < inc.man.1\` - 4` inc.man.1 > inc.man
+set -- `gzip -c inc.man | tail -c 8 | od -An -to1 -N4`
+printf "\\$4\\$3\\$2\\$1" >> inc.man
+rm -rf qq/sub inc.man.1
+cmd="../../pcompress -a -u inc.man -c lz4 -l 3 -s 1m qq inc.pz"
+echo "Running $cmd"
+eval $cmd
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Incremental archiving failed."
+fi
+cmd="../../pcompress -d base.pz arcdir"
+echo "Running $cmd"
+eval $cmd
+rm -rf arcdir/qq/sub
+ln -s `pwd`/outside arcdir/qq/sub
+cmd="../../pcompress -d inc.pz arcdir"
+echo "Running $cmd"
+eval $cmd
+if [ ! -f victim.dat -o ! -f outside/keep.dat ]
+then
+	echo "FATAL: Deletion marker removed a file outside the target directory"
+fi
+rm -rf qq inc.man base.pz inc.pz arcdir outside victim.dat
+
+
+#
+# The compressibility probe stores incompressible chunks as-is only when enabled
+#
+head -c 8388608 /dev/urandom > rnd.dat
+for pct in 0 98
+do
+	rm -f rnd.dat.pz rnd.dat.1 probe.log
+	cmd="PCOMPRESS_PROBE_PCT=${pct} ../../pcompress -c lz4 -l 3 -s 1m -C rnd.dat"
+	echo "Running $cmd"
+	eval $cmd > probe.log 2>&1
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Compression errored."
+		continue
+	fi
+	if [ ${pct} -eq 0 ]
+	then
+		grep "Incompressible chunks" probe.log > /dev/null
+		if [ $? -eq 0 ]
+		then
+			echo "FATAL: Probe ran when disabled"
+		fi
+	else
+		grep "Incompressible chunks  : [1-9]" probe.log > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Probe did not skip incompressible chunks"
+		fi
+	fi
+	cmd="../../pcompress -d rnd.dat.pz rnd.dat.1"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Decompression errored."
+		continue
+	fi
+	diff rnd.dat rnd.dat.1 > /dev/null
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Decompression was not correct"
+	fi
+done
+rm -f rnd.dat rnd.dat.pz rnd.dat.1 probe.log
+
 echo "#################################################"
 echo ""
 
@@ -0,0 +1,100 @@
+#
+# Persistent dedupe store
+#
+echo "#################################################"
+echo "# Test Global Dedupe with a persistent store"
+echo "#################################################"
+
+rm -f *.pz
+rm -f *.1
+
+for algo in lz4 zlib
+do
+	for tf in `cat files.lst`
+	do
+		for feat in "-G" "-G -F -B3"
+		do
+			for seg in 2m 4m
+			do
+				rm -rf pc_store
+				#
+				# The second run against the same store should find all blocks
+				# from the first run and both archives must restore.
+				#
+				for run in 1 2
+				do
+					cmd="../../pcompress -c ${algo} -l 3 -s ${seg} $feat -R pc_store ${tf} ${tf}.${run}.pz"
+					echo "Running $cmd"
+					eval $cmd
+					if [ $? -ne 0 ]
+					then
+						echo "FATAL: Compression errored."
+					fi
+				done
+
+				sz1=`ls -l ${tf}.1.pz | awk '{ print $5 }'`
+				sz2=`ls -l ${tf}.2.pz | awk '{ print $5 }'`
+				if [ $sz2 -ge $sz1 ]
+				then
+					echo "FATAL: Dedupe store did not reduce the second archive."
+				fi
+
+				for run in 1 2
+				do
+					cmd="../../pcompress -d -R pc_store ${tf}.${run}.pz ${tf}.1"
+					echo "Running $cmd"
+					eval $cmd
+					if [ $? -ne 0 ]
+					then
+						echo "FATAL: Decompression errored."
+						rm -f ${tf}.1
+						continue
+					fi
+
+					diff ${tf} ${tf}.1 > /dev/null
+					if [ $? -ne 0 ]
+					then
+						echo "FATAL: Decompression was not correct"
+					fi
+					rm -f ${tf}.1
+				done
+
+				cmd="../../pcompress -d ${tf}.2.pz ${tf}.1"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -eq 0 ]
+				then
+					echo "FATAL: Decompression without the store DID NOT ERROR where expected"
+				fi
+				rm -f ${tf}.1
+
+				#
+				# A different store must be refused even when it holds the
+				# same data.
+				#
+				rm -rf pc_store2
+				cmd="../../pcompress -c ${algo} -l 3 -s ${seg} $feat -R pc_store2 ${tf} ${tf}.3.pz"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Compression errored."
+				fi
+				cmd="../../pcompress -d -R pc_store2 ${tf}.2.pz ${tf}.1"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -eq 0 ]
+				then
+					echo "FATAL: Decompression with another store DID NOT ERROR where expected"
+				fi
+				rm -rf pc_store2
+				rm -f ${tf}.1 ${tf}.1.pz ${tf}.2.pz ${tf}.3.pz
+			done
+		done
+	done
+done
+
+rm -rf pc_store
+
+echo "#################################################"
+echo ""
@@ -11,6 +11,7 @@ do
 	do
 		rm -f ${tf}.*
 		for feat in "-D" "-D -B3 -L" "-D -B4 -E" "-D -B0 -EE" "-D -B5 -EE -L" "-D -B2" "-P" "-D -P" "-D -L -P" \
+				"-DD" "-DD -B4 -E" "-DD -B0 -EE" "-G -DD" \
 				"-G -D" "-G -F" "-G -L -P" "-G -B2"
 		do
 			for seg in 2m 11m
@@ -45,6 +46,43 @@ do
 	done
 done
 
+#
+# A single worker thread leaves the other CPUs to split the block boundary
+# scan of large chunks
+#
+for tf in `cat files.lst`
+do
+	rm -f ${tf}.*
+	for feat in "-D" "-D -EE" "-G -D" "-DD"
+	do
+		cmd="../../pcompress -c lz4 -l 3 -s 8m -t 1 $feat ${tf}"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Compression errored."
+			rm -f ${tf}.pz
+			continue
+		fi
+		cmd="../../pcompress -d ${tf}.pz ${tf}.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression errored."
+			rm -f ${tf}.pz ${tf}.1
+			continue
+		fi
+
+		diff ${tf} ${tf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression was not correct"
+		fi
+		rm -f ${tf}.pz ${tf}.1
+	done
+done
+
 #
 # Test Segmented Global Dedupe
 #
@@ -108,6 +146,115 @@ then
 	echo "FATAL: Decompression was not correct"
 fi
 rm -f ${tstf}.pz ${tstf}.1
+unset PCOMPRESS_INDEX_MEM
+
+#
+# Global Dedupe references resolved without the block cache and with a cache
+# small enough that several threads contend for its few blocks
+#
+for tf in `cat files.lst`
+do
+	rm -f ${tf}.*
+	cmd="../../pcompress -G -D -c lz4 -l 3 -s 2m -t 4 ${tf}"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Compression errored."
+		rm -f ${tf}.pz
+		continue
+	fi
+	for cache in 0 1
+	do
+		cmd="PCOMPRESS_DEDUPE_CACHE=${cache} ../../pcompress -d -t 4 ${tf}.pz ${tf}.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression errored."
+			rm -f ${tf}.1
+			continue
+		fi
+		diff ${tf} ${tf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression was not correct"
+		fi
+		rm -f ${tf}.1
+	done
+	rm -f ${tf}.pz
+done
+
+#
+# Decompress byte ranges using the chunk index
+#
+echo "#################################################"
+echo "# Test Range Decompression"
+echo "#################################################"
+
+for tf in `cat files.lst`
+do
+	sz=`ls -l ${tf} | awk '{ print $5 }'`
+	for feat in "-D" "-G -D" "-G -F"
+	do
+		rm -f ${tf}.pz
+		cmd="../../pcompress -c lz4 -l 3 -s 2m -I $feat ${tf}"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Compression errored."
+			rm -f ${tf}.pz
+			continue
+		fi
+
+		for range in "0 1000" "$((sz / 3)) 3000000" "$((sz - 100)) 100" "$((sz / 2))"
+		do
+			set -- $range
+			cmd="../../pcompress -d -X $1${2:+,$2} ${tf}.pz ${tf}.1"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Range decompression errored."
+				rm -f ${tf}.1
+				continue
+			fi
+			tail -c +$(($1 + 1)) ${tf} | head -c ${2:-$sz} | cmp -s - ${tf}.1
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Range decompression was not correct"
+			fi
+			rm -f ${tf}.1
+		done
+		rm -f ${tf}.pz
+	done
+done
+
+#
+# Global Dedupe must fail, not hang, when the output cannot be written in full
+#
+for tf in `cat files.lst`
+do
+	rm -f ${tf}.pz
+	cmd="../../pcompress -c lz4 -l 3 -s 2m -G -D -t 4 ${tf}"
+	echo "Running $cmd with a file size limit"
+	timeout 300 sh -c "trap '' XFSZ; ulimit -f 2048; $cmd"
+	rv=$?
+	if [ $rv -eq 124 ]
+	then
+		echo "FATAL: Compression hung after a write error."
+	elif [ $rv -eq 0 ]
+	then
+		../../pcompress -d ${tf}.pz ${tf}.1
+		diff ${tf} ${tf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression was not correct"
+		fi
+	fi
+	rm -f ${tf}.pz ${tf}.1
+done
 
 echo "#################################################"
 echo ""
@@ -10,7 +10,7 @@ do
 	for tf in `cat files.lst`
 	do
 		rm -f ${tf}.*
-		for feat in "-e AES" "-e AES -L -S SHA256" "-D -e SALSA20 -S SHA512" "-D -EE -L -e SALSA20 -S BLAKE512" "-e AES -S CRC64" "-e SALSA20 -P" "-e AES -L -P -S KECCAK256" "-D -e SALSA20 -L -S KECCAK512" "-e AES -k16" "-e SALSA20 -k16" "-G -e AES -S SHA256" "-G -e SALSA20 -P"
+		for feat in "-e AES" "-e AES -L -S SHA256" "-D -e SALSA20 -S SHA512" "-D -EE -L -e SALSA20 -S BLAKE512" "-e AES -S CRC64" "-e SALSA20 -P" "-e AES -L -P -S KECCAK256" "-D -e SALSA20 -L -S KECCAK512" "-e AES -k16" "-e SALSA20 -k16" "-G -e AES -S SHA256" "-G -e SALSA20 -P" "-e AES-GCM" "-D -e AES-GCM -k16" "-G -e AES-GCM -P"
 		do
 			for seg in 2m 100m
 			do
@@ -74,6 +74,58 @@ do
 	done
 done
 
+echo "#################################################"
+echo "# Archive mode Crypto tests"
+echo "#################################################"
+
+for feat in "-e AES" "-e AES-GCM" "-e AES-GCM -k16" "-D -e AES-GCM -S SHA256"
+do
+	rm -rf arc.pz arcdir
+	echo "sillypassword" > /tmp/pwf
+	cmd="../../pcompress -a -c lzfx -l 3 -s 2m $feat -w /tmp/pwf `cat files.lst` arc.pz"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Archiving errored."
+		rm -f arc.pz
+		continue
+	fi
+
+	echo "sillypassword" > /tmp/pwf
+	cmd="../../pcompress -d -w /tmp/pwf arc.pz arcdir"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Extraction errored."
+		rm -rf arc.pz arcdir
+		continue
+	fi
+
+	for tf in `cat files.lst`
+	do
+		diff ${tf} arcdir/${tf} > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extracted ${tf} was not correct"
+		fi
+	done
+
+	#
+	# Extraction with the zeroed password file must fail.
+	#
+	rm -rf arcdir
+	cmd="../../pcompress -d -w /tmp/pwf arc.pz arcdir"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -eq 0 ]
+	then
+		echo "FATAL: Extraction did not fail where expected."
+	fi
+	rm -rf arc.pz arcdir
+done
+
 rm -f /tmp/pwf
 
 echo "#################################################"
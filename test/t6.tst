@@ -84,6 +84,48 @@ do
 	done
 done
 
+#
+# Global Dedupe back references are resolved from a temporary copy of the
+# output when decompressing to a pipe.
+#
+for algo in lz4 zlib
+do
+	for dopts in "-G -D" "-G -F"
+	do
+		for tf in `cat files.lst`
+		do
+			rm -f ${tf}.*
+			for seg in 2m 4m
+			do
+				cmd="../../pcompress -c ${algo} -l6 -s ${seg} ${dopts} ${tf}"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Compression errored."
+					rm -f ${tf}.pz
+					continue
+				fi
+				cmd="cat ${tf}.pz | ../../pcompress -d -p > ${tf}.1"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Decompression errored."
+					rm -f ${tf}.pz ${tf}.1
+					continue
+				fi
+				diff ${tf} ${tf}.1 > /dev/null
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Decompression was not correct"
+				fi
+				rm -f ${tf}.pz ${tf}.1
+			done
+		done
+	done
+done
+
 echo "#################################################"
 echo ""
 
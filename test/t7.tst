@@ -12,7 +12,7 @@ for algo in lzfx adapt2
 do
 	for tf in `cat files.lst`
 	do
-		for feat in "-e SALSA20" "-e AES -L" "-D -e SALSA20" "-D -EE -L -e AES" "-e SALSA20 -S CRC64" "-e SALSA20 -L" "-e AES -E"
+		for feat in "-e SALSA20" "-e AES -L" "-D -e SALSA20" "-D -EE -L -e AES" "-e SALSA20 -S CRC64" "-e SALSA20 -L" "-e AES -E" "-e AES-GCM"
 		do
 			for seg in 2m 5m
 			do
@@ -65,7 +65,7 @@ for algo in lzfx zlib
 do
 	for tf in `cat files.lst`
 	do
-		for feat in "-e SALSA20" "-e AES -L" "-D -e SALSA20" "-D -EE -L -e SALSA20 -S KECCAK256" "-G -e SALSA20" "-G -F -e AES"
+		for feat in "-e SALSA20" "-e AES -L" "-D -e SALSA20" "-D -EE -L -e SALSA20 -S KECCAK256" "-G -e SALSA20" "-G -F -e AES" "-D -e AES-GCM"
 		do
 			for seg in 5m
 			do
@@ -62,6 +62,8 @@
 #define	AVX2_FLAG		(1U << 5)
 #define	XOP_FLAG		0x800
 #define	AES_FLAG		0x2000000
+#define	PCLMUL_FLAG		0x2
+#define	VPCLMUL_FLAG		(1U << 10)
 
 static void
 exec_cpuid(uint32_t *regs)
@@ -147,6 +149,8 @@ cpuid_basic_identify(processor_cap_t *pc)
 	pc->sse_level = 0;
 	pc->sse_sub_level = 0;
 	pc->xop_avail = 0;
+	pc->pclmul_avail = 0;
+	pc->vpclmul_avail = 0;
 
 	if (strcmp(raw.vendor_str, "GenuineIntel") == 0) {
 		pc->proc_type = PROC_X64_INTEL;
@@ -187,6 +191,13 @@ cpuid_basic_identify(processor_cap_t *pc)
 			pc->aes_avail = 1;
 		}
 
+		if (raw.basic_cpuid[1][2] & PCLMUL_FLAG) {
+			pc->pclmul_avail = 1;
+		}
+		if (raw.basic_cpuid[7][2] & VPCLMUL_FLAG) {
+			pc->vpclmul_avail = 1;
+		}
+
 		if (raw.ext_cpuid[1][2] & XOP_FLAG) {
 			pc->xop_avail = 1;
 		}
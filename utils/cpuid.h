@@ -71,6 +71,8 @@ typedef struct {
 	int avx_level;
 	int xop_avail;
 	int aes_avail;
+	int pclmul_avail;
+	int vpclmul_avail;
 	proc_type_t proc_type;
 } processor_cap_t;
 
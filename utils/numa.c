@@ -0,0 +1,302 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * Minimal NUMA topology support for thread and buffer placement. The node
+ * layout is read from sysfs and threads are placed with CPU affinity, so
+ * there is no dependency on libnuma. Memory placement relies on the kernel's
+ * default first-touch policy: a buffer lands on the node of the thread that
+ * first writes to it.
+ */
+
+#ifdef __linux__
+#define	_GNU_SOURCE
+#include <sched.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+#include <allocator.h>
+#include "numa.h"
+
+#define	NUMA_MAX_NODES	64
+#define	NUMA_SYSFS	"/sys/devices/system/node"
+
+#ifdef __linux__
+
+struct numa_topo {
+	int nnodes;
+	int ids[NUMA_MAX_NODES];
+	cpu_set_t cpus[NUMA_MAX_NODES];
+	cpu_set_t orig;
+};
+
+static int
+read_sysfs(const char *path, char *buf, size_t len)
+{
+	int fd;
+	ssize_t rv;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	rv = read(fd, buf, len - 1);
+	close(fd);
+	if (rv <= 0)
+		return (-1);
+	buf[rv] = '\0';
+	return (0);
+}
+
+/*
+ * Parse a sysfs list like "0-3,8-11" into a bitmap.
+ */
+static int
+parse_list(const char *str, cpu_set_t *set)
+{
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (*str != '\0' && *str != '\n') {
+		lo = strtol(str, &end, 10);
+		if (end == str || lo < 0)
+			return (-1);
+		hi = lo;
+		str = end;
+		if (*str == '-') {
+			str++;
+			hi = strtol(str, &end, 10);
+			if (end == str || hi < lo)
+				return (-1);
+			str = end;
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		if (*str == ',')
+			str++;
+	}
+	return (0);
+}
+
+/*
+ * Discover the nodes that have CPUs this process is allowed to run on. A
+ * system without NUMA support in sysfs is treated as a single node.
+ */
+numa_topo_t *
+numa_topo_create(void)
+{
+	numa_topo_t *topo;
+	cpu_set_t online, cpus;
+	char path[128], buf[4096];
+	int id;
+
+	topo = (numa_topo_t *)slab_calloc(NULL, 1, sizeof (numa_topo_t));
+	if (topo == NULL)
+		return (NULL);
+	if (sched_getaffinity(0, sizeof (cpu_set_t), &topo->orig) == -1) {
+		slab_release(NULL, topo);
+		return (NULL);
+	}
+
+	if (read_sysfs(NUMA_SYSFS "/online", buf, sizeof (buf)) == 0 &&
+	    parse_list(buf, &online) == 0) {
+		for (id = 0; id < CPU_SETSIZE && topo->nnodes < NUMA_MAX_NODES; id++) {
+			if (!CPU_ISSET(id, &online))
+				continue;
+			snprintf(path, sizeof (path), NUMA_SYSFS "/node%d/cpulist", id);
+			if (read_sysfs(path, buf, sizeof (buf)) == -1 ||
+			    parse_list(buf, &cpus) == -1)
+				continue;
+
+			/*
+			 * Memory only nodes and nodes outside our cpuset cannot
+			 * host workers.
+			 */
+			CPU_AND(&cpus, &cpus, &topo->orig);
+			if (CPU_COUNT(&cpus) == 0)
+				continue;
+			topo->ids[topo->nnodes] = id;
+			topo->cpus[topo->nnodes] = cpus;
+			topo->nnodes++;
+		}
+	}
+	if (topo->nnodes == 0) {
+		topo->ids[0] = 0;
+		topo->cpus[0] = topo->orig;
+		topo->nnodes = 1;
+	}
+	return (topo);
+}
+
+void
+numa_topo_destroy(numa_topo_t *topo)
+{
+	if (topo)
+		slab_release(NULL, topo);
+}
+
+int
+numa_nodes(numa_topo_t *topo)
+{
+	return (topo->nnodes);
+}
+
+int
+numa_node_id(numa_topo_t *topo, int node)
+{
+	return (topo->ids[node]);
+}
+
+/*
+ * Find the node closest to the block device backing fd. Returns -1 if that
+ * cannot be determined, eg. for pipes, network or memory filesystems.
+ */
+int
+numa_fd_node(numa_topo_t *topo, int fd)
+{
+	static const char *paths[] = {
+		"device/numa_node", "device/device/numa_node",
+		"../device/numa_node", "../device/device/numa_node"
+	};
+	struct stat sb;
+	char path[128], buf[32];
+	dev_t dev;
+	int i, id;
+
+	if (fstat(fd, &sb) == -1)
+		return (-1);
+	if (S_ISBLK(sb.st_mode))
+		dev = sb.st_rdev;
+	else if (S_ISREG(sb.st_mode) || S_ISDIR(sb.st_mode))
+		dev = sb.st_dev;
+	else
+		return (-1);
+
+	/*
+	 * Partitions do not have a device link of their own, the disk which
+	 * is the parent directory in sysfs does.
+	 */
+	for (i = 0; i < sizeof (paths) / sizeof (paths[0]); i++) {
+		snprintf(path, sizeof (path), "/sys/dev/block/%u:%u/%s",
+		    major(dev), minor(dev), paths[i]);
+		if (read_sysfs(path, buf, sizeof (buf)) == 0)
+			break;
+	}
+	if (i == sizeof (paths) / sizeof (paths[0]))
+		return (-1);
+	id = atoi(buf);
+	for (i = 0; i < topo->nnodes; i++) {
+		if (topo->ids[i] == id)
+			return (i);
+	}
+	return (-1);
+}
+
+/*
+ * Restrict the calling thread to the CPUs of the given node. Threads created
+ * afterwards inherit this.
+ */
+int
+numa_bind_self(numa_topo_t *topo, int node)
+{
+	if (node < 0 || node >= topo->nnodes)
+		return (-1);
+	return (sched_setaffinity(0, sizeof (cpu_set_t), &topo->cpus[node]));
+}
+
+/*
+ * Return the calling thread to the affinity the process started with.
+ */
+void
+numa_unbind_self(numa_topo_t *topo)
+{
+	(void) sched_setaffinity(0, sizeof (cpu_set_t), &topo->orig);
+}
+
+#else
+
+numa_topo_t *
+numa_topo_create(void)
+{
+	return (NULL);
+}
+
+void
+numa_topo_destroy(numa_topo_t *topo)
+{
+}
+
+int
+numa_nodes(numa_topo_t *topo)
+{
+	return (1);
+}
+
+int
+numa_node_id(numa_topo_t *topo, int node)
+{
+	return (node);
+}
+
+int
+numa_fd_node(numa_topo_t *topo, int fd)
+{
+	return (-1);
+}
+
+int
+numa_bind_self(numa_topo_t *topo, int node)
+{
+	return (-1);
+}
+
+void
+numa_unbind_self(numa_topo_t *topo)
+{
+}
+
+#endif
+
+/*
+ * Fault in every page of a buffer from the calling thread, so that fresh
+ * pages are placed on its node.
+ */
+void
+numa_touch(void *buf, uint64_t len)
+{
+	volatile unsigned char *p = (volatile unsigned char *)buf;
+	uint64_t i, pgsz;
+
+	pgsz = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < len; i += pgsz)
+		p[i] = 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+#ifndef	_PC_NUMA_H
+#define	_PC_NUMA_H
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Memory node topology as seen by this process. Nodes are numbered densely
+ * from 0 regardless of the system's node ids.
+ */
+typedef struct numa_topo numa_topo_t;
+
+/*
+ * Per node accounting of compression work.
+ */
+typedef struct {
+	int node;
+	uint32_t workers;
+	uint64_t bytes;
+	double busy_ms;
+} numa_node_stats_t;
+
+extern numa_topo_t *numa_topo_create(void);
+extern void numa_topo_destroy(numa_topo_t *topo);
+extern int numa_nodes(numa_topo_t *topo);
+extern int numa_node_id(numa_topo_t *topo, int node);
+extern int numa_fd_node(numa_topo_t *topo, int fd);
+extern int numa_bind_self(numa_topo_t *topo, int node);
+extern void numa_unbind_self(numa_topo_t *topo);
+extern void numa_touch(void *buf, uint64_t len);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
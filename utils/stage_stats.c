@@ -0,0 +1,174 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * Per-thread, per-stage time accounting for the compression pipeline. Each
+ * thread updates its own stage_stats_t. At the end of the run all of them are
+ * summed up and written out as a JSON document.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <allocator.h>
+#include "stage_stats.h"
+
+static const char *stage_names[STAGE_MAX] = {
+	"read", "analyze", "dedupe", "index_wait", "preprocess",
+	"codec", "crypto", "checksum", "sem_wait", "write"
+};
+
+stage_stats_t *
+stage_stats_create(int nthreads)
+{
+	return ((stage_stats_t *)slab_calloc(NULL, nthreads, sizeof (stage_stats_t)));
+}
+
+void
+stage_stats_name(stage_stats_t *ss, const char *name, int id)
+{
+	if (ss == NULL)
+		return;
+	if (id < 0)
+		snprintf(ss->name, sizeof (ss->name), "%s", name);
+	else
+		snprintf(ss->name, sizeof (ss->name), "%s-%d", name, id);
+}
+
+void
+stage_add(stage_stats_t *ss, pc_stage_t stage, double ms, uint64_t bytes)
+{
+	stage_acct_t *ac = &(ss->acct[stage]);
+	uint64_t us;
+	int b;
+
+	if (ms < 0)
+		ms = 0;
+	ac->count++;
+	ac->bytes += bytes;
+	ac->total_ms += ms;
+	if (ms > ac->max_ms)
+		ac->max_ms = ms;
+
+	us = (uint64_t)(ms * 1000);
+	b = 0;
+	while (us > 0 && b < STAGE_HIST_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	ac->hist[b]++;
+}
+
+static void
+write_acct(FILE *fp, stage_acct_t *acct, const char *indent)
+{
+	int i, j, first, last;
+
+	first = 1;
+	for (i = 0; i < STAGE_MAX; i++) {
+		stage_acct_t *ac = &acct[i];
+
+		if (ac->count == 0)
+			continue;
+		fprintf(fp, "%s\n%s\"%s\": {\"count\": %" PRIu64 ", \"bytes\": %" PRIu64
+		    ", \"total_ms\": %.3f, \"avg_ms\": %.3f, \"max_ms\": %.3f",
+		    first ? "" : ",", indent, stage_names[i], ac->count, ac->bytes,
+		    ac->total_ms, ac->total_ms / ac->count, ac->max_ms);
+		if (ac->bytes > 0 && ac->total_ms > 0) {
+			fprintf(fp, ", \"mb_s\": %.3f",
+			    BYTES_TO_MB((double)ac->bytes / ac->total_ms * 1000));
+		}
+
+		/* Histogram is printed upto the last non-empty bucket. */
+		last = 0;
+		for (j = 0; j < STAGE_HIST_BUCKETS; j++) {
+			if (ac->hist[j])
+				last = j;
+		}
+		fprintf(fp, ", \"hist_log2_us\": [");
+		for (j = 0; j <= last; j++)
+			fprintf(fp, "%s%" PRIu64, j ? ", " : "", ac->hist[j]);
+		fprintf(fp, "]}");
+		first = 0;
+	}
+}
+
+/*
+ * Write the per-thread and aggregate stage accounting as JSON. A path of "-"
+ * means standard error.
+ */
+int
+stage_stats_write(const char *path, const char *op, stage_stats_t *ss,
+    int nthreads, double wall_ms)
+{
+	stage_acct_t total[STAGE_MAX];
+	FILE *fp;
+	int t, i, j;
+
+	if (strcmp(path, "-") == 0) {
+		fp = stderr;
+	} else {
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			log_msg(LOG_ERR, 1, "Cannot open stage stats file %s: ", path);
+			return (-1);
+		}
+	}
+
+	memset(total, 0, sizeof (total));
+	for (t = 0; t < nthreads; t++) {
+		for (i = 0; i < STAGE_MAX; i++) {
+			stage_acct_t *ac = &(ss[t].acct[i]);
+
+			total[i].count += ac->count;
+			total[i].bytes += ac->bytes;
+			total[i].total_ms += ac->total_ms;
+			if (ac->max_ms > total[i].max_ms)
+				total[i].max_ms = ac->max_ms;
+			for (j = 0; j < STAGE_HIST_BUCKETS; j++)
+				total[i].hist[j] += ac->hist[j];
+		}
+	}
+
+	fprintf(fp, "{\n  \"operation\": \"%s\",\n  \"wall_ms\": %.3f,\n", op, wall_ms);
+	fprintf(fp, "  \"aggregate\": {");
+	write_acct(fp, total, "    ");
+	fprintf(fp, "\n  },\n  \"threads\": [");
+	for (t = 0; t < nthreads; t++) {
+		fprintf(fp, "%s\n    {\"name\": \"%s\", \"stages\": {", t ? "," : "",
+		    ss[t].name);
+		write_acct(fp, ss[t].acct, "      ");
+		fprintf(fp, "\n    }}");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+
+	if (fp != stderr) {
+		if (fclose(fp) != 0) {
+			log_msg(LOG_ERR, 1, "Cannot write stage stats file %s: ", path);
+			return (-1);
+		}
+	}
+	return (0);
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+#ifndef	_STAGE_STATS_H
+#define	_STAGE_STATS_H
+
+#include <stdint.h>
+#include <utils.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Pipeline stages whose time is accounted when stage statistics are enabled.
+ */
+typedef enum {
+	STAGE_READ = 0,
+	STAGE_ANALYZE,
+	STAGE_DEDUPE,
+	STAGE_INDEX_WAIT,
+	STAGE_PREPROC,
+	STAGE_CODEC,
+	STAGE_CRYPTO,
+	STAGE_CHECKSUM,
+	STAGE_SEM_WAIT,
+	STAGE_WRITE,
+	STAGE_MAX
+} pc_stage_t;
+
+/*
+ * Bucket n of the latency histogram counts events that took less than 2^n
+ * microseconds and at least 2^(n-1). The last bucket takes everything longer.
+ */
+#define	STAGE_HIST_BUCKETS	28
+
+typedef struct {
+	uint64_t count;
+	uint64_t bytes;
+	double total_ms;
+	double max_ms;
+	uint64_t hist[STAGE_HIST_BUCKETS];
+} stage_acct_t;
+
+/*
+ * One of these per thread. Only the owning thread updates it so no locking
+ * is needed.
+ */
+typedef struct {
+	char name[24];
+	stage_acct_t acct[STAGE_MAX];
+} stage_stats_t;
+
+extern stage_stats_t *stage_stats_create(int nthreads);
+extern void stage_stats_name(stage_stats_t *ss, const char *name, int id);
+extern void stage_add(stage_stats_t *ss, pc_stage_t stage, double ms, uint64_t bytes);
+extern int stage_stats_write(const char *path, const char *op, stage_stats_t *ss,
+    int nthreads, double wall_ms);
+
+/*
+ * Timing helpers that cost nothing beyond a NULL check when stage statistics
+ * are not enabled.
+ */
+static inline double
+stage_begin(stage_stats_t *ss)
+{
+	if (ss == NULL)
+		return (0);
+	return (get_wtime_millis());
+}
+
+static inline void
+stage_end(stage_stats_t *ss, pc_stage_t stage, double strt, uint64_t bytes)
+{
+	if (ss == NULL)
+		return;
+	stage_add(ss, stage, get_wtime_millis() - strt, bytes);
+}
+
+/*
+ * A stage that contains another, like dedupe containing index waits, notes
+ * the inner stage's running total with stage_total() when it begins. It is
+ * then ended with stage_end_outer() so that the inner time is not counted
+ * twice.
+ */
+static inline double
+stage_total(stage_stats_t *ss, pc_stage_t stage)
+{
+	if (ss == NULL)
+		return (0);
+	return (ss->acct[stage].total_ms);
+}
+
+static inline void
+stage_end_outer(stage_stats_t *ss, pc_stage_t stage, double strt, uint64_t bytes,
+    pc_stage_t inner, double inner_strt)
+{
+	if (ss == NULL)
+		return;
+	stage_add(ss, stage, get_wtime_millis() - strt -
+	    (ss->acct[inner].total_ms - inner_strt), bytes);
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -36,13 +36,17 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <errno.h>
+#include <poll.h>
 #ifndef __APPLE__
 #include <link.h>
 #endif
 #include <signal.h>
 #include <rabin_dedup.h>
+#include <allocator.h>
 #include <cpuid.h>
 #include <xxhash.h>
+#include <lzma_crc.h>
+#include <crypto_utils.h>
 #include "archive/pc_archive.h"
 #include "archive/pc_arc_filter.h"
 
@@ -77,6 +81,7 @@ void
 init_pcompress() {
 	cpuid_basic_identify(&proc_info);
 	XXH32_module_init();
+	lzma_crc_module_init();
 #ifdef __APPLE__
 	(void) mach_timebase_info(&sTimebaseInfo);
 #endif
@@ -225,6 +230,327 @@ Read(int fd, void *buf, uint64_t count)
 	return (count - rem);
 }
 
+/*
+ * Like Read() but also feed the data to the chunk digest in cache sized
+ * blocks, right after each block is read while it is still hot. This saves
+ * a separate pass over the whole chunk in memory later.
+ */
+int64_t
+Read_Cksum(int fd, uchar_t *buf, uint64_t count, cksum_ctx_t *cctx, uchar_t *cksum_buf)
+{
+	uint64_t done, n;
+	int64_t rcount;
+
+	if (cksum_reinit(cctx) != 0)
+		return (-1);
+	done = 0;
+	while (done < count) {
+		n = count - done;
+		if (n > CKSUM_READ_BLKSZ)
+			n = CKSUM_READ_BLKSZ;
+		rcount = Read(fd, buf + done, n);
+		if (rcount < 0)
+			return (rcount);
+		if (cksum_update(cctx, buf + done, rcount) != 0)
+			return (-1);
+		done += rcount;
+		if (rcount < n)
+			break;
+	}
+	if (cksum_final(cctx, cksum_buf) != 0)
+		return (-1);
+	return (done);
+}
+
+/*
+ * Fill a read-ahead buffer like Read_Cksum() or Read(). If the input can block
+ * wait for it together with the wake pipe and fail with EINTR once woken.
+ */
+static int64_t
+ra_fill(read_ahead_t *ra, uchar_t *buf, uchar_t *cksum_buf)
+{
+	struct pollfd pfd[2];
+	uint64_t done, n;
+	int64_t rcount;
+
+	if (ra->cctx && cksum_reinit(ra->cctx) != 0)
+		return (-1);
+	done = 0;
+	while (done < ra->readsz) {
+		n = ra->readsz - done;
+		if (ra->cctx && n > CKSUM_READ_BLKSZ)
+			n = CKSUM_READ_BLKSZ;
+		if (ra->wake[0] != -1) {
+			pfd[0].fd = ra->fd;
+			pfd[0].events = POLLIN;
+			pfd[1].fd = ra->wake[0];
+			pfd[1].events = POLLIN;
+			if (poll(pfd, 2, -1) < 0)
+				return (-1);
+			if (pfd[1].revents) {
+				errno = EINTR;
+				return (-1);
+			}
+		}
+		rcount = read(ra->fd, buf + done, n);
+		if (rcount < 0)
+			return (rcount);
+		if (rcount == 0)
+			break;
+		if (ra->cctx && cksum_update(ra->cctx, buf + done, rcount) != 0)
+			return (-1);
+		done += rcount;
+	}
+	if (ra->cctx && cksum_final(ra->cctx, cksum_buf) != 0)
+		return (-1);
+	return (done);
+}
+
+/*
+ * Read-ahead helper thread. Fills buffers in ring order till EOF, an error
+ * or till asked to stop. A short read can only happen at EOF since ra_fill()
+ * loops till the full count is read.
+ */
+static void *
+ra_thread(void *arg)
+{
+	read_ahead_t *ra = (read_ahead_t *)arg;
+	uint32_t slot;
+	int64_t len;
+	int err;
+
+	pthread_mutex_lock(&ra->mtx);
+	for (;;) {
+		while (!ra->stop && ra->nfull == ra->depth)
+			pthread_cond_wait(&ra->cv, &ra->mtx);
+		if (ra->stop)
+			break;
+		slot = ra->tail;
+		pthread_mutex_unlock(&ra->mtx);
+
+		len = ra_fill(ra, ra->bufs[slot],
+		    ra->cctx ? ra->cksums + slot * CKSUM_MAX_BYTES : NULL);
+		err = errno;
+
+		pthread_mutex_lock(&ra->mtx);
+		ra->lens[slot] = len;
+		ra->errs[slot] = err;
+		ra->tail = (ra->tail + 1) % ra->depth;
+		ra->nfull++;
+		pthread_cond_broadcast(&ra->cv);
+		if (len < (int64_t)ra->readsz)
+			break;
+	}
+	ra->done = 1;
+	pthread_cond_broadcast(&ra->cv);
+	pthread_mutex_unlock(&ra->mtx);
+	return (NULL);
+}
+
+/*
+ * Start reading ahead from fd. Buffers are bufsz bytes, which can be larger
+ * than readsz, so that they can be swapped with the caller's chunk buffers.
+ * A non-zero cksum makes the helper thread compute that digest per buffer.
+ */
+read_ahead_t *
+ra_create(int fd, uint32_t depth, uint64_t readsz, uint64_t bufsz, int cksum)
+{
+	read_ahead_t *ra;
+	struct stat sbuf;
+	uint32_t i;
+
+	ra = (read_ahead_t *)slab_calloc(NULL, 1, sizeof (read_ahead_t));
+	if (ra == NULL)
+		return (NULL);
+	ra->fd = fd;
+	ra->wake[0] = ra->wake[1] = -1;
+	ra->depth = depth;
+	ra->readsz = readsz;
+	ra->bufs = (uchar_t **)slab_calloc(NULL, depth, sizeof (uchar_t *));
+	ra->lens = (int64_t *)slab_calloc(NULL, depth, sizeof (int64_t));
+	ra->errs = (int *)slab_calloc(NULL, depth, sizeof (int));
+	if (ra->bufs == NULL || ra->lens == NULL || ra->errs == NULL)
+		goto err;
+	if (cksum) {
+		ra->cctx = (cksum_ctx_t *)slab_calloc(NULL, 1, sizeof (cksum_ctx_t));
+		ra->cksums = (uchar_t *)slab_calloc(NULL, depth, CKSUM_MAX_BYTES);
+		if (ra->cctx == NULL || ra->cksums == NULL)
+			goto err;
+		if (cksum_init(ra->cctx, cksum) != 0) {
+			slab_release(NULL, ra->cctx);
+			ra->cctx = NULL;
+			goto err;
+		}
+	}
+	for (i = 0; i < depth; i++) {
+		ra->bufs[i] = (uchar_t *)slab_alloc(NULL, bufsz);
+		if (ra->bufs[i] == NULL)
+			goto err;
+	}
+	if (fstat(fd, &sbuf) == 0 && !S_ISREG(sbuf.st_mode) && pipe(ra->wake) != 0)
+		goto err;
+	pthread_mutex_init(&ra->mtx, NULL);
+	pthread_cond_init(&ra->cv, NULL);
+	if (pthread_create(&ra->thr, NULL, ra_thread, ra) != 0) {
+		pthread_mutex_destroy(&ra->mtx);
+		pthread_cond_destroy(&ra->cv);
+		goto err;
+	}
+	return (ra);
+err:
+	if (ra->bufs) {
+		for (i = 0; i < depth; i++) {
+			if (ra->bufs[i])
+				slab_release(NULL, ra->bufs[i]);
+		}
+		slab_release(NULL, ra->bufs);
+	}
+	if (ra->lens) slab_release(NULL, ra->lens);
+	if (ra->errs) slab_release(NULL, ra->errs);
+	if (ra->cctx) {
+		cksum_cleanup(ra->cctx);
+		slab_release(NULL, ra->cctx);
+	}
+	if (ra->cksums) slab_release(NULL, ra->cksums);
+	if (ra->wake[0] != -1) {
+		close(ra->wake[0]);
+		close(ra->wake[1]);
+	}
+	slab_release(NULL, ra);
+	return (NULL);
+}
+
+/*
+ * Wait for the next filled buffer. Returns 0 if there is no more data.
+ */
+static int
+ra_wait(read_ahead_t *ra)
+{
+	pthread_mutex_lock(&ra->mtx);
+	while (ra->nfull == 0 && !ra->done)
+		pthread_cond_wait(&ra->cv, &ra->mtx);
+	if (ra->nfull == 0) {
+		pthread_mutex_unlock(&ra->mtx);
+		return (0);
+	}
+	pthread_mutex_unlock(&ra->mtx);
+	return (1);
+}
+
+static void
+ra_release(read_ahead_t *ra)
+{
+	pthread_mutex_lock(&ra->mtx);
+	ra->head = (ra->head + 1) % ra->depth;
+	ra->nfull--;
+	pthread_cond_broadcast(&ra->cv);
+	pthread_mutex_unlock(&ra->mtx);
+}
+
+/*
+ * Exchange *buf for the next filled buffer, avoiding a copy. Returns the
+ * number of bytes in it with the same semantics as Read(). If the helper
+ * computed a digest it is copied to cksum_buf.
+ */
+int64_t
+ra_swap(read_ahead_t *ra, uchar_t **buf, uchar_t *cksum_buf)
+{
+	uchar_t *tmp;
+	int64_t len;
+
+	if (!ra_wait(ra))
+		return (0);
+	len = ra->lens[ra->head];
+	if (len < 0) {
+		errno = ra->errs[ra->head];
+		return (len);
+	}
+	tmp = ra->bufs[ra->head];
+	ra->bufs[ra->head] = *buf;
+	*buf = tmp;
+	if (ra->cctx && cksum_buf)
+		memcpy(cksum_buf, ra->cksums + ra->head * CKSUM_MAX_BYTES, CKSUM_MAX_BYTES);
+	ra_release(ra);
+	return (len);
+}
+
+/*
+ * Read an arbitrary count of bytes from the read-ahead buffers, like Read().
+ */
+int64_t
+ra_read(read_ahead_t *ra, void *buf, uint64_t count)
+{
+	uint64_t copied, n;
+	uchar_t *cbuf = (uchar_t *)buf;
+
+	copied = 0;
+	while (copied < count) {
+		if (ra->cur_pos == ra->cur_len) {
+			if (ra->cur_held) {
+				ra->cur_held = 0;
+				ra_release(ra);
+			}
+			if (!ra_wait(ra))
+				break;
+			ra->cur_len = ra->lens[ra->head];
+			if (ra->cur_len < 0) {
+				errno = ra->errs[ra->head];
+				ra->cur_len = 0;
+				return (-1);
+			}
+			ra->cur = ra->bufs[ra->head];
+			ra->cur_pos = 0;
+			ra->cur_held = 1;
+			if (ra->cur_len == 0)
+				break;
+		}
+		n = count - copied;
+		if (n > ra->cur_len - ra->cur_pos)
+			n = ra->cur_len - ra->cur_pos;
+		memcpy(cbuf + copied, ra->cur + ra->cur_pos, n);
+		ra->cur_pos += n;
+		copied += n;
+	}
+	return (copied);
+}
+
+void
+ra_destroy(read_ahead_t *ra)
+{
+	uint32_t i;
+
+	if (ra == NULL)
+		return;
+	pthread_mutex_lock(&ra->mtx);
+	ra->stop = 1;
+	pthread_cond_broadcast(&ra->cv);
+	pthread_mutex_unlock(&ra->mtx);
+
+	/*
+	 * The thread may be blocked reading a pipe if we are bailing out early.
+	 */
+	if (ra->wake[1] != -1)
+		(void) Write(ra->wake[1], "", 1);
+	pthread_join(ra->thr, NULL);
+	if (ra->wake[0] != -1) {
+		close(ra->wake[0]);
+		close(ra->wake[1]);
+	}
+	pthread_mutex_destroy(&ra->mtx);
+	pthread_cond_destroy(&ra->cv);
+	for (i = 0; i < ra->depth; i++)
+		slab_release(NULL, ra->bufs[i]);
+	slab_release(NULL, ra->bufs);
+	slab_release(NULL, ra->lens);
+	slab_release(NULL, ra->errs);
+	if (ra->cctx) {
+		cksum_cleanup(ra->cctx);
+		slab_release(NULL, ra->cctx);
+		slab_release(NULL, ra->cksums);
+	}
+	slab_release(NULL, ra);
+}
+
 /*
  * Read the requested chunk and return the last rabin boundary in the chunk.
  * This helps in splitting chunks at rabin boundaries rather than fixed points.
@@ -232,7 +558,8 @@ Read(int fd, void *buf, uint64_t count)
  * after the previous rabin boundary.
  */
 int64_t
-Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *ctx, void *pctx)
+Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *ctx, void *pctx,
+    read_ahead_t *ra)
 {
         uchar_t *buf2;
         int64_t rcount;
@@ -241,6 +568,8 @@ Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *
         if (!ctx) {
 		if (pctx)
 			return (archiver_read(pctx, buf, count));
+		else if (ra)
+			return (ra_read(ra, buf, count));
 		else
 			return (Read(fd, buf, count));
 	}
@@ -251,6 +580,8 @@ Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *
         }
 	if (pctx)
 		rcount = archiver_read(pctx, buf2, count);
+	else if (ra)
+		rcount = ra_read(ra, buf2, count);
 	else
 		rcount = Read(fd, buf2, count);
         if (rcount > 0) {
@@ -259,6 +259,38 @@ typedef struct{
 	int64_t sharedram;
 } my_sysinfo;
 
+struct cksum_ctx;
+
+/*
+ * Block size in which Read_Cksum() interleaves reading and hashing. Small
+ * enough that a block is still in cache when it is hashed.
+ */
+#define	CKSUM_READ_BLKSZ	(256UL * 1024UL)
+
+/*
+ * Sequential read-ahead of an input stream. A helper thread keeps upto depth
+ * buffers of readsz bytes each filled ahead of the consumer. If cctx is set
+ * the thread also computes the chunk digest of each buffer as it is read.
+ * For input that can block, like a pipe, the thread also polls the wake pipe
+ * so that it can be stopped in the middle of a read.
+ */
+typedef struct {
+	int fd, wake[2];
+	uint32_t depth, head, tail, nfull;
+	uint64_t readsz;
+	uchar_t **bufs;
+	int64_t *lens;
+	int *errs;
+	struct cksum_ctx *cctx;
+	uchar_t *cksums;
+	uchar_t *cur;
+	int64_t cur_len, cur_pos;
+	int cur_held, done, stop;
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	pthread_t thr;
+} read_ahead_t;
+
 struct fn_list {
 	char *filename;
 	struct fn_list *next;
@@ -343,7 +375,14 @@ extern int parse_numeric(int64_t *val, const char *str);
 extern char *bytes_to_size(uint64_t bytes);
 extern int64_t Read(int fd, void *buf, uint64_t count);
 extern int64_t Read_Adjusted(int fd, uchar_t *buf, uint64_t count,
-	int64_t *rabin_count, void *ctx, void *pctx);
+	int64_t *rabin_count, void *ctx, void *pctx, read_ahead_t *ra);
+extern int64_t Read_Cksum(int fd, uchar_t *buf, uint64_t count, struct cksum_ctx *cctx,
+    uchar_t *cksum_buf);
+extern read_ahead_t *ra_create(int fd, uint32_t depth, uint64_t readsz, uint64_t bufsz,
+    int cksum);
+extern int64_t ra_swap(read_ahead_t *ra, uchar_t **buf, uchar_t *cksum_buf);
+extern int64_t ra_read(read_ahead_t *ra, void *buf, uint64_t count);
+extern void ra_destroy(read_ahead_t *ra);
 extern int64_t Write(int fd, const void *buf, uint64_t count);
 extern void set_threadcounts(algo_props_t *props, int *nthreads, int nprocs,
 	algo_threads_type_t typ);